@@ -0,0 +1,1235 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+#include "libcorsaro_log.h"
+#include "libcorsaro_avro.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Tool that converts avro files written by corsaro (flowtuple, report,
+ *  dos, or anything else with a flat record schema) into text.
+ *
+ *  Flowtuple files are written in the same format as
+ *  tools/corsavro_ft2ascii.py, which mimics the old corsaro2 cors2ascii
+ *  tool. Other files are written as one line per record, with the fields
+ *  in schema order separated by '|'.
+ *
+ *  The blocks in each file are decoded and formatted by a set of worker
+ *  threads, and the main thread writes the formatted blocks out in order.
+ */
+
+/** Maximum number of fields in a record that we can convert */
+#define CONV_MAX_FIELDS 64
+
+/** Number of jobs per worker thread that can be decoded ahead of the
+ *  writer.
+ */
+#define CONV_JOBS_PER_THREAD 8
+
+/** Size of the output buffer */
+#define CONV_OUTPUT_BUFSIZE (4 * 1024 * 1024)
+
+/** Once this many bytes of flowtuples have been saved for an interval,
+ *  the rest of the interval is saved to a temporary file instead.
+ */
+#define CONV_SPILL_THRESHOLD (256 * 1024 * 1024)
+
+enum {
+    CONV_FIELD_INT,
+    CONV_FIELD_LONG,
+    CONV_FIELD_STRING,
+    CONV_FIELD_BYTES,
+    CONV_FIELD_BOOLEAN,
+    CONV_FIELD_FLOAT,
+    CONV_FIELD_DOUBLE,
+    CONV_FIELD_NULL,
+};
+
+/** Fields that are used by the flowtuple text format, in the order that
+ *  they are written.
+ */
+enum {
+    FT_FIELD_TIME,
+    FT_FIELD_SRC_IP,
+    FT_FIELD_DST_IP,
+    FT_FIELD_SRC_PORT,
+    FT_FIELD_DST_PORT,
+    FT_FIELD_PROTOCOL,
+    FT_FIELD_TTL,
+    FT_FIELD_TCP_FLAGS,
+    FT_FIELD_IP_LEN,
+    FT_FIELD_PACKET_CNT,
+    FT_FIELD_COUNT
+};
+
+static const char *ft_field_names[FT_FIELD_COUNT] = {
+    "time", "src_ip", "dst_ip", "src_port", "dst_port", "protocol", "ttl",
+    "tcp_flags", "ip_len", "packet_cnt"
+};
+
+/** The layout of the records in an input file */
+typedef struct conv_schema {
+    int field_c;
+    uint8_t types[CONV_MAX_FIELDS];
+    /** Set for integer fields that hold an IPv4 address, which are written
+     *  in dotted quad form */
+    uint8_t isaddr[CONV_MAX_FIELDS];
+
+    /** Set if the records are flowtuples, to be written in the flowtuple
+     *  text format */
+    uint8_t flowtuple;
+    /** Position of each field used by the flowtuple text format */
+    int ftfields[FT_FIELD_COUNT];
+} conv_schema_t;
+
+/** A decoded field value */
+typedef struct conv_value {
+    int64_t num;
+    double dbl;
+    const uint8_t *str;
+    int64_t len;
+} conv_value_t;
+
+/** A run of consecutive flowtuples in a block that share an interval */
+typedef struct conv_run {
+    uint32_t interval;
+    uint64_t lines;
+    uint64_t bytes;
+} conv_run_t;
+
+/** A single block to be converted by a worker thread */
+typedef struct conv_job {
+    /** The index of the input file that the block is in */
+    int fileid;
+    /** Where the block starts in the file */
+    uint64_t offset;
+    /** Number of records in the block */
+    uint64_t records;
+
+    /** The formatted records */
+    char *text;
+    size_t textlen;
+    size_t textalloc;
+    /** For flowtuple files, the intervals that the formatted records
+     *  belong to */
+    conv_run_t *runs;
+    int run_c;
+    int runalloc;
+
+    /** Set once the worker has finished with the job */
+    uint8_t done;
+    /** Set if the block could not be decoded */
+    uint8_t failed;
+} conv_job_t;
+
+/** State that is shared between the worker threads and the writer */
+typedef struct conv_state {
+    pthread_mutex_t mutex;
+    /** Signalled when a worker finishes a job */
+    pthread_cond_t jobdone;
+    /** Signalled when the writer moves on to the next job */
+    pthread_cond_t jobwritten;
+
+    corsaro_logger_t *logger;
+    char **sources;
+    conv_schema_t *schemas;
+
+    conv_job_t *jobs;
+    uint64_t job_c;
+    /** The next job to be given to a worker */
+    uint64_t nextjob;
+    /** The job that the writer is currently waiting for */
+    uint64_t writejob;
+    /** How far ahead of the writer the workers may get */
+    uint64_t window;
+} conv_state_t;
+
+/** State for writing flowtuples in the flowtuple text format. As with
+ *  corsavro_ft2ascii.py, this carries on from one input file to the next.
+ */
+typedef struct conv_ftoutput {
+    uint8_t noflowcounts;
+    uint32_t last_time;
+    uint32_t interval_count;
+
+    /** Number of flowtuples in the current interval */
+    uint64_t flow_count;
+    /** Flowtuples for the current interval, held back until we know how
+     *  many there are */
+    char *saved;
+    size_t savedlen;
+    size_t savedalloc;
+    /** Temporary file for intervals that are too large to hold in memory */
+    FILE *spill;
+} conv_ftoutput_t;
+
+volatile int halted = 0;
+
+/** Signal handler for when we get a haltable signal (SIGINT, SIGTERM)
+ */
+static void cleanup_signal(int sig) {
+    (void)sig;
+    halted = 1;
+}
+
+/** Works out the layout of the records in a file from its writer schema.
+ *
+ *  @return 0 if the schema is a record that we can convert, -1 otherwise.
+ */
+static int parse_conv_schema(corsaro_logger_t *logger, const char *fname,
+        const char *json, conv_schema_t *sch) {
+
+    avro_schema_t schema = NULL, field;
+    avro_schema_error_t error;
+    const char *name;
+    size_t namelen;
+    int i, j, ret = -1;
+
+    memset(sch, 0, sizeof(conv_schema_t));
+    for (j = 0; j < FT_FIELD_COUNT; j++) {
+        sch->ftfields[j] = -1;
+    }
+
+    if (avro_schema_from_json(json, strlen(json), &schema, &error) != 0) {
+        corsaro_log(logger, "unable to parse Avro schema in %s: %s", fname,
+                avro_strerror());
+        return -1;
+    }
+
+    if (!is_avro_record(schema)) {
+        corsaro_log(logger, "%s does not contain Avro records", fname);
+        goto endparse;
+    }
+
+    sch->field_c = avro_schema_record_size(schema);
+    if (sch->field_c > CONV_MAX_FIELDS) {
+        corsaro_log(logger, "records in %s have too many fields (max %d)",
+                fname, CONV_MAX_FIELDS);
+        goto endparse;
+    }
+
+    for (i = 0; i < sch->field_c; i++) {
+        field = avro_schema_record_field_get_by_index(schema, i);
+        name = avro_schema_record_field_name(schema, i);
+
+        switch(avro_typeof(field)) {
+            case AVRO_INT32:
+                sch->types[i] = CONV_FIELD_INT;
+                break;
+            case AVRO_INT64:
+                sch->types[i] = CONV_FIELD_LONG;
+                break;
+            case AVRO_STRING:
+                sch->types[i] = CONV_FIELD_STRING;
+                break;
+            case AVRO_BYTES:
+                sch->types[i] = CONV_FIELD_BYTES;
+                break;
+            case AVRO_BOOLEAN:
+                sch->types[i] = CONV_FIELD_BOOLEAN;
+                break;
+            case AVRO_FLOAT:
+                sch->types[i] = CONV_FIELD_FLOAT;
+                break;
+            case AVRO_DOUBLE:
+                sch->types[i] = CONV_FIELD_DOUBLE;
+                break;
+            case AVRO_NULL:
+                sch->types[i] = CONV_FIELD_NULL;
+                break;
+            default:
+                corsaro_log(logger,
+                        "field '%s' in %s has a type that cannot be converted to text",
+                        name, fname);
+                goto endparse;
+        }
+
+        /* Corsaro stores IPv4 addresses as plain integers, in fields
+         * such as 'src_ip' and 'target_ip' */
+        namelen = strlen(name);
+        if ((sch->types[i] == CONV_FIELD_INT ||
+                    sch->types[i] == CONV_FIELD_LONG) && namelen >= 3 &&
+                strcmp(name + namelen - 3, "_ip") == 0) {
+            sch->isaddr[i] = 1;
+        }
+
+        for (j = 0; j < FT_FIELD_COUNT; j++) {
+            if (strcmp(name, ft_field_names[j]) == 0 &&
+                    (sch->types[i] == CONV_FIELD_INT ||
+                     sch->types[i] == CONV_FIELD_LONG)) {
+                sch->ftfields[j] = i;
+            }
+        }
+    }
+
+    /* Other tools may have written the schema with a full name, e.g.
+     * org.caida.corsaro.flowtuple */
+    name = avro_schema_name(schema);
+    if (strrchr(name, '.')) {
+        name = strrchr(name, '.') + 1;
+    }
+    if (strcmp(name, "flowtuple") == 0) {
+        sch->flowtuple = 1;
+        for (j = 0; j < FT_FIELD_COUNT; j++) {
+            if (sch->ftfields[j] < 0) {
+                sch->flowtuple = 0;
+                break;
+            }
+        }
+    }
+    ret = 0;
+
+endparse:
+    avro_schema_decref(schema);
+    return ret;
+}
+
+/** Decodes the fields of a single binary avro record */
+static int decode_record(conv_schema_t *sch, const uint8_t **ptr,
+        const uint8_t *end, conv_value_t *vals) {
+
+    int i;
+    union {
+        float f;
+        uint32_t u;
+    } f32;
+    union {
+        double d;
+        uint64_t u;
+    } f64;
+    int k;
+
+    for (i = 0; i < sch->field_c; i++) {
+        switch(sch->types[i]) {
+            case CONV_FIELD_INT:
+            case CONV_FIELD_LONG:
+                if (corsaro_get_avro_long(ptr, end, &(vals[i].num)) < 0) {
+                    return -1;
+                }
+                break;
+            case CONV_FIELD_STRING:
+            case CONV_FIELD_BYTES:
+                if (corsaro_get_avro_long(ptr, end, &(vals[i].len)) < 0 ||
+                        vals[i].len < 0 || vals[i].len > end - *ptr) {
+                    return -1;
+                }
+                vals[i].str = *ptr;
+                (*ptr) += vals[i].len;
+                break;
+            case CONV_FIELD_BOOLEAN:
+                if (*ptr >= end) {
+                    return -1;
+                }
+                vals[i].num = **ptr;
+                (*ptr) ++;
+                break;
+            case CONV_FIELD_FLOAT:
+                if (end - *ptr < 4) {
+                    return -1;
+                }
+                f32.u = 0;
+                for (k = 3; k >= 0; k--) {
+                    f32.u = (f32.u << 8) | (*ptr)[k];
+                }
+                vals[i].dbl = f32.f;
+                (*ptr) += 4;
+                break;
+            case CONV_FIELD_DOUBLE:
+                if (end - *ptr < 8) {
+                    return -1;
+                }
+                f64.u = 0;
+                for (k = 7; k >= 0; k--) {
+                    f64.u = (f64.u << 8) | (*ptr)[k];
+                }
+                vals[i].dbl = f64.d;
+                (*ptr) += 8;
+                break;
+            case CONV_FIELD_NULL:
+                break;
+        }
+    }
+    return 0;
+}
+
+/* Appends the decimal form of an unsigned integer to a buffer */
+static inline char *put_uint(char *ptr, uint64_t val) {
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    while (n > 0) {
+        *ptr++ = tmp[--n];
+    }
+    return ptr;
+}
+
+/* Appends the decimal form of a signed integer to a buffer */
+static inline char *put_int(char *ptr, int64_t val) {
+    if (val < 0) {
+        *ptr++ = '-';
+        return put_uint(ptr, -((uint64_t)val));
+    }
+    return put_uint(ptr, (uint64_t)val);
+}
+
+/* Appends an IPv4 address, in dotted quad form, to a buffer */
+static inline char *put_ipv4(char *ptr, uint32_t addr) {
+    ptr = put_uint(ptr, (addr >> 24) & 0xff);
+    *ptr++ = '.';
+    ptr = put_uint(ptr, (addr >> 16) & 0xff);
+    *ptr++ = '.';
+    ptr = put_uint(ptr, (addr >> 8) & 0xff);
+    *ptr++ = '.';
+    return put_uint(ptr, addr & 0xff);
+}
+
+/** Makes sure a job's text buffer has room for at least 'extra' more
+ *  bytes.
+ */
+static int reserve_text(conv_job_t *job, size_t extra) {
+    char *tmp;
+    size_t newalloc;
+
+    if (job->textlen + extra <= job->textalloc) {
+        return 0;
+    }
+    newalloc = job->textalloc ? job->textalloc * 2 : 65536;
+    while (newalloc < job->textlen + extra) {
+        newalloc *= 2;
+    }
+    tmp = (char *)realloc(job->text, newalloc);
+    if (tmp == NULL) {
+        return -1;
+    }
+    job->text = tmp;
+    job->textalloc = newalloc;
+    return 0;
+}
+
+/** Formats a flowtuple in the same way as corsavro_ft2ascii.py, i.e.
+ *  src_ip|dst_ip|src_port|dst_port|protocol|ttl|tcp_flags|ip_len,packet_cnt
+ */
+static int format_flowtuple(conv_job_t *job, conv_schema_t *sch,
+        conv_value_t *vals) {
+
+    static const char hex[] = "0123456789abcdef";
+    uint64_t flags = (uint64_t)vals[sch->ftfields[FT_FIELD_TCP_FLAGS]].num;
+    char *ptr, *start;
+    conv_run_t *run;
+    uint32_t interval;
+
+    /* Most of the fields will be small, but make sure there is room
+     * for them to be as large as an avro long can be */
+    if (reserve_text(job, 256) < 0) {
+        return -1;
+    }
+    start = ptr = job->text + job->textlen;
+
+    ptr = put_ipv4(ptr, vals[sch->ftfields[FT_FIELD_SRC_IP]].num);
+    *ptr++ = '|';
+    ptr = put_ipv4(ptr, vals[sch->ftfields[FT_FIELD_DST_IP]].num);
+    *ptr++ = '|';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_SRC_PORT]].num);
+    *ptr++ = '|';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_DST_PORT]].num);
+    *ptr++ = '|';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_PROTOCOL]].num);
+    *ptr++ = '|';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_TTL]].num);
+    *ptr++ = '|';
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    if (flags > 0xff) {
+        /* Python's %02x doesn't truncate, so neither do we */
+        ptr += sprintf(ptr, "%lx", flags);
+    } else {
+        *ptr++ = hex[flags >> 4];
+        *ptr++ = hex[flags & 0x0f];
+    }
+    *ptr++ = '|';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_IP_LEN]].num);
+    *ptr++ = ',';
+    ptr = put_uint(ptr, vals[sch->ftfields[FT_FIELD_PACKET_CNT]].num);
+    *ptr++ = '\n';
+    job->textlen += (ptr - start);
+
+    /* Keep track of where each interval starts and ends, so the writer
+     * can add the interval headers */
+    interval = (uint32_t)vals[sch->ftfields[FT_FIELD_TIME]].num;
+    if (job->run_c == 0 || job->runs[job->run_c - 1].interval != interval) {
+        if (job->run_c == job->runalloc) {
+            conv_run_t *tmp;
+            int newalloc = job->runalloc ? job->runalloc * 2 : 8;
+
+            tmp = (conv_run_t *)realloc(job->runs,
+                    newalloc * sizeof(conv_run_t));
+            if (tmp == NULL) {
+                return -1;
+            }
+            job->runs = tmp;
+            job->runalloc = newalloc;
+        }
+        run = &(job->runs[job->run_c]);
+        run->interval = interval;
+        run->lines = 0;
+        run->bytes = 0;
+        job->run_c ++;
+    }
+    run = &(job->runs[job->run_c - 1]);
+    run->lines ++;
+    run->bytes += (ptr - start);
+    return 0;
+}
+
+/** Formats a record as the value of each field in schema order, separated
+ *  by '|'.
+ */
+static int format_generic(conv_job_t *job, conv_schema_t *sch,
+        conv_value_t *vals) {
+
+    static const char hex[] = "0123456789abcdef";
+    size_t needed = 0;
+    char *ptr, *start;
+    int64_t j;
+    int i;
+
+    for (i = 0; i < sch->field_c; i++) {
+        if (sch->types[i] == CONV_FIELD_STRING) {
+            needed += vals[i].len + 1;
+        } else if (sch->types[i] == CONV_FIELD_BYTES) {
+            needed += vals[i].len * 2 + 1;
+        } else {
+            needed += 32;
+        }
+    }
+    if (reserve_text(job, needed + 1) < 0) {
+        return -1;
+    }
+    start = ptr = job->text + job->textlen;
+
+    for (i = 0; i < sch->field_c; i++) {
+        if (i > 0) {
+            *ptr++ = '|';
+        }
+        switch(sch->types[i]) {
+            case CONV_FIELD_INT:
+            case CONV_FIELD_LONG:
+                if (sch->isaddr[i]) {
+                    ptr = put_ipv4(ptr, (uint32_t)vals[i].num);
+                } else {
+                    ptr = put_int(ptr, vals[i].num);
+                }
+                break;
+            case CONV_FIELD_STRING:
+                memcpy(ptr, vals[i].str, vals[i].len);
+                ptr += vals[i].len;
+                break;
+            case CONV_FIELD_BYTES:
+                for (j = 0; j < vals[i].len; j++) {
+                    *ptr++ = hex[vals[i].str[j] >> 4];
+                    *ptr++ = hex[vals[i].str[j] & 0x0f];
+                }
+                break;
+            case CONV_FIELD_BOOLEAN:
+                *ptr++ = vals[i].num ? '1' : '0';
+                break;
+            case CONV_FIELD_FLOAT:
+            case CONV_FIELD_DOUBLE:
+                ptr += snprintf(ptr, 32, "%g", vals[i].dbl);
+                break;
+            case CONV_FIELD_NULL:
+                break;
+        }
+    }
+    *ptr++ = '\n';
+    job->textlen += (ptr - start);
+    return 0;
+}
+
+/** Decodes and formats every record in a block.
+ *
+ *  @return 0 if successful, -1 if the block could not be decoded.
+ */
+static int convert_block(conv_state_t *state, conv_job_t *job,
+        corsaro_avro_block_reader_t *rdr, uint8_t generic) {
+
+    conv_schema_t *sch = &(state->schemas[job->fileid]);
+    conv_value_t vals[CONV_MAX_FIELDS];
+    const uint8_t *ptr, *end;
+    uint64_t records, i;
+    uint32_t len;
+
+    if (corsaro_seek_avro_block_reader(rdr, job->offset) < 0 ||
+            corsaro_read_next_avro_block(rdr, &ptr, &len, &records) <= 0) {
+        return -1;
+    }
+    end = ptr + len;
+
+    /* Guess at ~64 bytes per line to begin with */
+    if (reserve_text(job, records * 64) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < records; i++) {
+        if (decode_record(sch, &ptr, end, vals) < 0) {
+            corsaro_log(state->logger, "truncated record in block at %lu in %s",
+                    job->offset, state->sources[job->fileid]);
+            return -1;
+        }
+        if (sch->flowtuple && !generic) {
+            if (format_flowtuple(job, sch, vals) < 0) {
+                return -1;
+            }
+        } else if (format_generic(job, sch, vals) < 0) {
+            return -1;
+        }
+    }
+
+    if (ptr != end) {
+        corsaro_log(state->logger,
+                "unexpected data at the end of the block at %lu in %s",
+                job->offset, state->sources[job->fileid]);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct conv_worker {
+    pthread_t threadid;
+    conv_state_t *state;
+    uint8_t generic;
+} conv_worker_t;
+
+/** Function that operates a worker thread, which takes jobs in order and
+ *  converts each block to text.
+ */
+static void *start_worker(void *arg) {
+    conv_worker_t *worker = (conv_worker_t *)arg;
+    conv_state_t *state = worker->state;
+    corsaro_avro_block_reader_t *rdr = NULL;
+    int openfile = -1;
+    uint64_t jobid;
+    conv_job_t *job;
+    int ret;
+
+    while (!halted) {
+        pthread_mutex_lock(&(state->mutex));
+        while (state->nextjob < state->job_c && !halted &&
+                state->nextjob >= state->writejob + state->window) {
+            pthread_cond_wait(&(state->jobwritten), &(state->mutex));
+        }
+        jobid = state->nextjob;
+        if (jobid < state->job_c) {
+            state->nextjob ++;
+        }
+        pthread_mutex_unlock(&(state->mutex));
+
+        if (jobid >= state->job_c || halted) {
+            break;
+        }
+        job = &(state->jobs[jobid]);
+
+        /* Jobs are in file order, so we can usually keep using the
+         * reader from the previous job */
+        if (job->fileid != openfile) {
+            if (rdr) {
+                corsaro_destroy_avro_block_reader(rdr);
+            }
+            rdr = corsaro_create_avro_block_reader(state->logger,
+                    state->sources[job->fileid]);
+            openfile = job->fileid;
+        }
+
+        if (rdr == NULL) {
+            ret = -1;
+        } else {
+            ret = convert_block(state, job, rdr, worker->generic);
+        }
+
+        pthread_mutex_lock(&(state->mutex));
+        job->done = 1;
+        if (ret < 0) {
+            job->failed = 1;
+        }
+        pthread_cond_broadcast(&(state->jobdone));
+        pthread_mutex_unlock(&(state->mutex));
+    }
+
+    if (rdr) {
+        corsaro_destroy_avro_block_reader(rdr);
+    }
+
+    /* Make sure the writer isn't left waiting on a job that we never got
+     * around to because we were halted */
+    pthread_mutex_lock(&(state->mutex));
+    pthread_cond_broadcast(&(state->jobdone));
+    pthread_mutex_unlock(&(state->mutex));
+    pthread_exit(NULL);
+}
+
+/** Saves some flowtuple lines for the current interval, moving them into
+ *  a temporary file if the interval is getting too large to hold in
+ *  memory.
+ */
+static int save_ft_lines(corsaro_logger_t *logger, conv_ftoutput_t *fto,
+        const char *text, size_t len) {
+
+    if (fto->spill == NULL && fto->savedlen + len > CONV_SPILL_THRESHOLD) {
+        fto->spill = tmpfile();
+        if (fto->spill == NULL) {
+            corsaro_log(logger,
+                    "unable to create temporary file for a large interval: %s",
+                    strerror(errno));
+            return -1;
+        }
+        if (fwrite(fto->saved, 1, fto->savedlen, fto->spill) !=
+                fto->savedlen) {
+            goto spillfail;
+        }
+        fto->savedlen = 0;
+    }
+
+    if (fto->spill) {
+        if (fwrite(text, 1, len, fto->spill) != len) {
+            goto spillfail;
+        }
+        return 0;
+    }
+
+    if (fto->savedlen + len > fto->savedalloc) {
+        char *tmp;
+        size_t newalloc = fto->savedalloc ? fto->savedalloc * 2 : 1048576;
+
+        while (newalloc < fto->savedlen + len) {
+            newalloc *= 2;
+        }
+        tmp = (char *)realloc(fto->saved, newalloc);
+        if (tmp == NULL) {
+            corsaro_log(logger, "unable to allocate memory for interval");
+            return -1;
+        }
+        fto->saved = tmp;
+        fto->savedalloc = newalloc;
+    }
+    memcpy(fto->saved + fto->savedlen, text, len);
+    fto->savedlen += len;
+    return 0;
+
+spillfail:
+    corsaro_log(logger, "error while writing to temporary file: %s",
+            strerror(errno));
+    return -1;
+}
+
+/** Writes the end of the current flowtuple interval, including all of the
+ *  saved flowtuples if we are including flow counts.
+ */
+static int end_ft_interval(corsaro_logger_t *logger, FILE *out,
+        conv_ftoutput_t *fto) {
+
+    char buf[65536];
+    size_t got;
+
+    if (!fto->noflowcounts) {
+        /* Try to replicate the old category headers as best we can, but
+         * we're not going to bother trying to put flows in the "right"
+         * category -- they all go in 'other' */
+        fprintf(out, "START flowtuple_backscatter 0\n");
+        fprintf(out, "END flowtuple_backscatter\n");
+        fprintf(out, "START flowtuple_icmpreq 0\n");
+        fprintf(out, "END flowtuple_icmpreq\n");
+        fprintf(out, "START flowtuple_other %lu\n", fto->flow_count);
+
+        if (fto->spill) {
+            rewind(fto->spill);
+            while ((got = fread(buf, 1, sizeof(buf), fto->spill)) > 0) {
+                fwrite(buf, 1, got, out);
+            }
+            if (ferror(fto->spill)) {
+                corsaro_log(logger,
+                        "error while reading from temporary file: %s",
+                        strerror(errno));
+                return -1;
+            }
+            fclose(fto->spill);
+            fto->spill = NULL;
+        } else {
+            fwrite(fto->saved, 1, fto->savedlen, out);
+        }
+        fto->savedlen = 0;
+    }
+
+    fprintf(out, "END flowtuple_other\n");
+    fprintf(out, "# CORSARO_INTERVAL_END %u %u\n", fto->interval_count - 1,
+            fto->last_time);
+
+    corsaro_log(logger, "completed %u intervals", fto->interval_count);
+    return 0;
+}
+
+/** Writes the start of a new flowtuple interval, ending the previous one
+ *  first if there was one.
+ */
+static int start_ft_interval(corsaro_logger_t *logger, FILE *out,
+        conv_ftoutput_t *fto, uint32_t interval) {
+
+    if (fto->last_time != 0 && end_ft_interval(logger, out, fto) < 0) {
+        return -1;
+    }
+
+    fprintf(out, "# CORSARO_INTERVAL_START %u %u\n", fto->interval_count,
+            interval);
+    fto->interval_count ++;
+    fto->last_time = interval;
+    fto->flow_count = 0;
+
+    if (fto->noflowcounts) {
+        fprintf(out, "START flowtuple_backscatter 0\n");
+        fprintf(out, "END flowtuple_backscatter\n");
+        fprintf(out, "START flowtuple_icmpreq 0\n");
+        fprintf(out, "END flowtuple_icmpreq\n");
+        fprintf(out, "START flowtuple_other 0\n");
+    }
+    return 0;
+}
+
+/** Writes a converted block of flowtuples, adding interval headers
+ *  wherever a flowtuple has a later interval than the one before it.
+ */
+static int write_ft_job(corsaro_logger_t *logger, FILE *out,
+        conv_ftoutput_t *fto, conv_job_t *job) {
+
+    const char *text = job->text;
+    int i;
+
+    for (i = 0; i < job->run_c; i++) {
+        conv_run_t *run = &(job->runs[i]);
+
+        if (run->interval > fto->last_time && start_ft_interval(logger, out,
+                    fto, run->interval) < 0) {
+            return -1;
+        }
+
+        if (fto->noflowcounts) {
+            fwrite(text, 1, run->bytes, out);
+        } else if (save_ft_lines(logger, fto, text, run->bytes) < 0) {
+            return -1;
+        }
+        fto->flow_count += run->lines;
+        text += run->bytes;
+    }
+    return 0;
+}
+
+/** Writes the converted blocks to the output, in order.
+ *
+ *  @return 0 if every block was converted and written successfully, -1
+ *          otherwise.
+ */
+static int write_results(conv_state_t *state, FILE *out,
+        conv_ftoutput_t *fto, uint8_t generic) {
+
+    conv_job_t *job;
+    uint64_t w;
+    int failed = 0;
+
+    for (w = 0; w < state->job_c && !halted && !failed; w++) {
+        job = &(state->jobs[w]);
+
+        pthread_mutex_lock(&(state->mutex));
+        state->writejob = w;
+        pthread_cond_broadcast(&(state->jobwritten));
+        while (!job->done && !halted) {
+            pthread_cond_wait(&(state->jobdone), &(state->mutex));
+        }
+        pthread_mutex_unlock(&(state->mutex));
+
+        if (halted) {
+            break;
+        }
+        if (job->failed) {
+            corsaro_log(state->logger,
+                    "unable to convert the block at offset %lu in %s",
+                    job->offset, state->sources[job->fileid]);
+            failed = 1;
+        } else if (state->schemas[job->fileid].flowtuple && !generic) {
+            if (write_ft_job(state->logger, out, fto, job) < 0) {
+                failed = 1;
+            }
+        } else {
+            /* Don't let a flowtuple interval run on into a file with
+             * some other kind of record */
+            if (fto->last_time != 0) {
+                if (end_ft_interval(state->logger, out, fto) < 0) {
+                    failed = 1;
+                }
+                fto->last_time = 0;
+            }
+            fwrite(job->text, 1, job->textlen, out);
+        }
+
+        free(job->text);
+        free(job->runs);
+        job->text = NULL;
+        job->runs = NULL;
+    }
+
+    /* Finish off the last interval -- corsavro_ft2ascii.py never did
+     * this, but there's no good reason to leave it unfinished */
+    if (!failed && !halted && fto->last_time != 0) {
+        if (end_ft_interval(state->logger, out, fto) < 0) {
+            failed = 1;
+        }
+    }
+
+    /* Make sure no worker is left waiting for us */
+    pthread_mutex_lock(&(state->mutex));
+    if (failed) {
+        halted = 1;
+    }
+    state->writejob = state->job_c;
+    pthread_cond_broadcast(&(state->jobwritten));
+    pthread_mutex_unlock(&(state->mutex));
+
+    if (halted) {
+        return -1;
+    }
+    return 0;
+}
+
+/** Finds where each block starts in an input file, and adds a job for
+ *  each block.
+ *
+ *  @return 0 on success, -1 if an error occurs.
+ */
+static int add_file_jobs(conv_state_t *state, int fileid,
+        uint64_t *jobsalloc) {
+
+    corsaro_avro_block_reader_t *rdr;
+    uint64_t offset, records;
+    conv_job_t *job;
+    int ret;
+
+    rdr = corsaro_create_avro_block_reader(state->logger,
+            state->sources[fileid]);
+    if (rdr == NULL) {
+        return -1;
+    }
+
+    if (parse_conv_schema(state->logger, state->sources[fileid],
+                corsaro_get_avro_block_reader_schema(rdr),
+                &(state->schemas[fileid])) < 0) {
+        corsaro_destroy_avro_block_reader(rdr);
+        return -1;
+    }
+
+    while ((ret = corsaro_skip_next_avro_block(rdr, &offset,
+                    &records)) > 0) {
+        if (state->job_c == *jobsalloc) {
+            conv_job_t *tmp;
+            uint64_t newalloc = *jobsalloc ? *jobsalloc * 2 : 1024;
+
+            tmp = (conv_job_t *)realloc(state->jobs,
+                    newalloc * sizeof(conv_job_t));
+            if (tmp == NULL) {
+                corsaro_log(state->logger,
+                        "Unable to allocate memory for conversion jobs");
+                ret = -1;
+                break;
+            }
+            state->jobs = tmp;
+            *jobsalloc = newalloc;
+        }
+
+        job = &(state->jobs[state->job_c]);
+        memset(job, 0, sizeof(conv_job_t));
+        job->fileid = fileid;
+        job->offset = offset;
+        job->records = records;
+        state->job_c ++;
+    }
+
+    corsaro_destroy_avro_block_reader(rdr);
+    return ret;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr,
+"Usage: %s [options] <input file 1> ... <input file N>\n\n"
+"  -o, --outputfile <file>    write output to <file> instead of stdout\n"
+"  -F, --noflowcounts         do not include per-interval flow counts in the\n"
+"                             flowtuple category headers\n"
+"  -g, --generic              write flowtuples as plain records, like any\n"
+"                             other avro file\n"
+"  -t, --threads <count>      number of worker threads (default 4)\n"
+"  -l, --log <mode>           'stderr' (default), 'syslog' or 'disabled'\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    char *outputpath = NULL;
+    int logmode = GLOBAL_LOGMODE_STDERR;
+    char *logmodestr = NULL;
+    struct sigaction sigact;
+    sigset_t sig_before, sig_block_all;
+    corsaro_logger_t *logger;
+    conv_worker_t *workers;
+    conv_ftoutput_t fto;
+    conv_state_t state;
+    FILE *out = stdout;
+    uint8_t generic = 0;
+    int threads = 4;
+    int input_c, i;
+    int failed = 0;
+    uint64_t jobsalloc = 0, records = 0;
+    struct timespec starttime, endtime;
+    double elapsed;
+
+    sigact.sa_handler = cleanup_signal;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = SA_RESTART;
+
+    sigaction(SIGINT, &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&fto, 0, sizeof(fto));
+
+    while (1) {
+        int optind;
+        struct option long_options[] = {
+            { "outputfile", 1, 0, 'o'},
+            { "log", 1, 0, 'l'},
+            { "noflowcounts", 0, 0, 'F'},
+            { "generic", 0, 0, 'g'},
+            { "threads", 1, 0, 't'},
+            { "help", 0, 0, 'h'},
+            { NULL, 0, 0, 0 }
+        };
+
+        int c  = getopt_long(argc, argv, "o:l:Fgt:h", long_options, &optind);
+        if (c == -1) {
+            break;
+        }
+
+        switch(c) {
+            case 'o':
+                outputpath = optarg;
+                break;
+            case 'l':
+                logmodestr = optarg;
+                break;
+            case 'F':
+                fto.noflowcounts = 1;
+                break;
+            case 'g':
+                generic = 1;
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    /* Configure our logging */
+    if (logmodestr != NULL) {
+        if (strcmp(logmodestr, "stderr") == 0 ||
+                    strcmp(logmodestr, "terminal") == 0) {
+            logmode = GLOBAL_LOGMODE_STDERR;
+        } else if (strcmp(logmodestr, "syslog") == 0) {
+            logmode = GLOBAL_LOGMODE_SYSLOG;
+        } else if (strcmp(logmodestr, "disabled") == 0 ||
+                strcmp(logmodestr, "off") == 0 ||
+                strcmp(logmodestr, "none") == 0) {
+            logmode = GLOBAL_LOGMODE_DISABLED;
+        } else {
+            fprintf(stderr, "corsaroavro2ascii: unexpected logmode: %s\n",
+                    logmodestr);
+            return 1;
+        }
+    }
+
+    if (logmode == GLOBAL_LOGMODE_STDERR) {
+        logger = init_corsaro_logger("corsaroavro2ascii", "");
+    } else if (logmode == GLOBAL_LOGMODE_SYSLOG) {
+        logger = init_corsaro_logger("corsaroavro2ascii", NULL);
+    } else {
+        logger = NULL;
+    }
+
+    if (threads < 1 || threads > 256) {
+        corsaro_log(logger, "Number of threads must be between 1 and 256");
+        return 1;
+    }
+
+    if (optind >= argc) {
+        corsaro_log(logger, "No inputs specified -- exiting");
+        return 0;
+    }
+    input_c = argc - optind;
+
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&(state.mutex), NULL);
+    pthread_cond_init(&(state.jobdone), NULL);
+    pthread_cond_init(&(state.jobwritten), NULL);
+    state.logger = logger;
+    state.sources = argv + optind;
+    state.schemas = calloc(input_c, sizeof(conv_schema_t));
+    state.window = threads * CONV_JOBS_PER_THREAD;
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    /* Find all of the blocks up front, so they can be shared out between
+     * the workers. This only needs to look at the block headers, so is
+     * quick compared with decoding the blocks.
+     */
+    for (i = 0; i < input_c; i++) {
+        if (add_file_jobs(&state, i, &jobsalloc) < 0) {
+            return 1;
+        }
+    }
+
+    if (outputpath) {
+        out = fopen(outputpath, "w");
+        if (out == NULL) {
+            corsaro_log(logger, "Unable to open output file %s: %s",
+                    outputpath, strerror(errno));
+            return 1;
+        }
+    }
+    setvbuf(out, NULL, _IOFBF, CONV_OUTPUT_BUFSIZE);
+
+    sigemptyset(&sig_block_all);
+    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
+        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
+        return 1;
+    }
+
+    workers = calloc(threads, sizeof(conv_worker_t));
+    for (i = 0; i < threads; i++) {
+        workers[i].state = &state;
+        workers[i].generic = generic;
+        pthread_create(&(workers[i].threadid), NULL, start_worker,
+                &(workers[i]));
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
+        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
+        return 1;
+    }
+
+    if (write_results(&state, out, &fto, generic) < 0) {
+        failed = 1;
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].threadid, NULL);
+    }
+    free(workers);
+
+    if (fflush(out) != 0) {
+        corsaro_log(logger, "Error while writing output: %s",
+                strerror(errno));
+        failed = 1;
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endtime);
+    elapsed = (endtime.tv_sec - starttime.tv_sec) +
+            (endtime.tv_nsec - starttime.tv_nsec) / 1000000000.0;
+    for (i = 0; i < state.job_c; i++) {
+        records += state.jobs[i].records;
+        free(state.jobs[i].text);
+        free(state.jobs[i].runs);
+    }
+    if (!failed) {
+        corsaro_log(logger,
+                "Converted %lu records in %.2f seconds (%.0f records/sec)",
+                records, elapsed, elapsed > 0 ? records / elapsed : 0.0);
+    }
+
+    if (fto.spill) {
+        fclose(fto.spill);
+    }
+    free(fto.saved);
+    free(state.jobs);
+    free(state.schemas);
+    pthread_cond_destroy(&(state.jobdone));
+    pthread_cond_destroy(&(state.jobwritten));
+    pthread_mutex_destroy(&(state.mutex));
+
+    if (logger) {
+        destroy_corsaro_logger(logger);
+    }
+    return failed;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
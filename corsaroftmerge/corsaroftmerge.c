@@ -50,15 +50,19 @@
 #include "libcorsaro_log.h"
 #include "libcorsaro_avro.h"
 #include "plugins/corsaro_flowtuple.h"
-#include "pqueue.h"
 
 #include <assert.h>
+#include <dirent.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
 #include <Judy.h>
 #include <zmq.h>
 
@@ -69,21 +73,96 @@
 
 #define BASE_SOCKETNAME "inproc://ftmerger"
 
+/** Number of flowtuple records that a reader thread passes to the merger
+ *  in a single message.
+ */
+#define MERGER_BATCH_SIZE 4096
+
+/** Number of merge keys sampled from each input file when choosing the
+ *  key ranges for a partitioned merge.
+ */
+#define MERGER_SAMPLE_SIZE 4096
+
+/** Default for the most input files that are merged at once. Any more than
+ *  this and the inputs are merged in several passes.
+ */
+#define MERGER_DEFAULT_FANIN 64
+
+/** Default amount of memory (in MB) used to sort an unsorted input */
+#define MERGER_DEFAULT_SORT_MEMORY 512
+
 /** Describes a flowtuple record that is ready to be merged */
 struct merger_ft {
     /** The flowtuple record itself, decoded from avro into a native struct */
     struct corsaro_flowtuple_data ft;
+    /** The leading fields of the record's sort order, packed into a
+     *  128-bit key (see calc_merge_key()) */
+    uint64_t keyhi;
+    uint64_t keylo;
     /** The identifier of the reader thread that sent us this record */
     int source;
-    /** The flowtuple's position in the priority queue */
-    size_t pqueue_pos;
 };
 
+/** Tournament tree used to select the next record to write out from the
+ *  records at the head of each reader's current batch.
+ */
+typedef struct merger_losertree {
+    /** The number of readers (leaves) */
+    int k;
+    /** The reader that lost the match at each internal node, with the
+     *  overall winner stored in losers[0] */
+    int *losers;
+    /** The record at the head of each reader's batch, NULL if the reader
+     *  has no more records */
+    struct merger_ft **heads;
+} merger_losertree_t;
+
+/** A batch of decoded flowtuple records, sent from a reader thread to the
+ *  merger as a single message.
+ */
+typedef struct merger_batch {
+    struct merger_ft recs[MERGER_BATCH_SIZE];
+    /** The number of records in the batch */
+    uint32_t count;
+    /** The index of the next record for the merger to use */
+    uint32_t next;
+    /** Next batch in the pool's free list */
+    struct merger_batch *nextfree;
+} merger_batch_t;
+
+/** Batches that have been used up by the merger, ready to be filled again
+ *  by any of the reader threads.
+ */
+typedef struct merger_batch_pool {
+    pthread_mutex_t mutex;
+    merger_batch_t *freelist;
+} merger_batch_pool_t;
+
+/** Used by the main thread to hand each set of input files to the reader
+ *  and merger threads, which stay running between merges so that they
+ *  (and their sockets and record batches) can be reused.
+ */
+typedef struct merge_control {
+    pthread_mutex_t mutex;
+    /** Signalled when there is a new set of files to merge, or when the
+     *  threads should exit */
+    pthread_cond_t start;
+    /** Signalled when a merger thread finishes its part of a merge */
+    pthread_cond_t finish;
+    /** Incremented each time a new set of files is handed out */
+    uint64_t generation;
+    /** Number of merger threads that have finished the current merge */
+    int finished;
+    /** Set when the threads should exit */
+    uint8_t shutdown;
+} merge_control_t;
+
 /** Thread-local data for a reader thread */
 typedef struct avromerge_reader {
     pthread_t threadid;
 
-    /** Name of the file that this thread is reading from */
+    /** Name of the file that this thread is reading from, or NULL if
+     *  there is no file for this reader in the current merge */
     char *source;
     /** The name of the zeromq socket being used by this thread for output */
     char *sockname;
@@ -94,19 +173,192 @@ typedef struct avromerge_reader {
     int readerid;
     /** A corsaro logger instance, used to write log messages */
     corsaro_logger_t *logger;
+    /** The pool to take empty record batches from */
+    merger_batch_pool_t *pool;
+    /** Tells the thread when there is a new file to read */
+    merge_control_t *control;
+
+    /** If set, records with a merge key below 'low' are skipped */
+    uint8_t haslow;
+    /** If set, the reader stops at the first record with a merge key at or
+     *  above 'high' */
+    uint8_t hashigh;
+    uint64_t lowhi, lowlo;
+    uint64_t highhi, highlo;
+
+    /** Number of records in the current file that were out of order */
+    uint64_t violations;
+    /** Set if the current file could not be read in full */
+    uint8_t error;
 
 } avromerge_reader_t;
 
-/** Getter function for the pqueue position of a merger_ft instance */
-static size_t ft_get_pos(void *a) {
-    struct merger_ft *ft = (struct merger_ft *)a;
-    return ft->pqueue_pos;
+/** Thread-local data for a thread that samples merge keys from an input */
+typedef struct avromerge_sampler {
+    pthread_t threadid;
+
+    /** Name of the file that this thread is reading from */
+    char *source;
+    /** A corsaro logger instance, used to write log messages */
+    corsaro_logger_t *logger;
+
+    /** Total number of records in the file */
+    uint64_t records;
+    /** Reservoir of sampled merge keys, stored as (high, low) pairs */
+    uint64_t samples[MERGER_SAMPLE_SIZE * 2];
+    /** Number of keys in the reservoir */
+    uint32_t samplecount;
+
+} avromerge_sampler_t;
+
+/** A merge key that has been sampled from an input file, weighted by the
+ *  number of records in the file that each sample represents.
+ */
+typedef struct merger_sample {
+    uint64_t keyhi;
+    uint64_t keylo;
+    double weight;
+} merger_sample_t;
+
+/** State for one of the key ranges in a partitioned merge. Each range has
+ *  its own reader for every input and its own merger thread, which writes
+ *  the range's records to a separate avro file.
+ */
+typedef struct merge_partition {
+    pthread_t threadid;
+
+    /** The index of this range, or -1 if the merge is not partitioned */
+    int partid;
+    /** Name of the file that this range is written to */
+    char *outname;
+    corsaro_avro_writer_t *avwrt;
+
+    /** One reader thread per input file */
+    avromerge_reader_t *readers;
+    int input_c;
+
+    corsaro_logger_t *logger;
+    void *zmq_ctxt;
+    merger_batch_pool_t *pool;
+    /** Tells the merger thread when there is a new set of files to merge */
+    merge_control_t *control;
+
+    /** Set if the merger for this range failed during the current merge */
+    int error;
+} merge_partition_t;
+
+/** Everything needed to merge a set of interim files, with one set of
+ *  reader threads and a merger thread for each key range.
+ */
+typedef struct merge_context {
+    corsaro_logger_t *logger;
+    void *zmq_ctxt;
+    merger_batch_pool_t pool;
+    merge_control_t control;
+
+    /** The key ranges, each with its own readers and merger thread */
+    merge_partition_t *parts;
+    int partitions;
+    /** Number of readers per key range, i.e. the most input files that
+     *  can be merged at once */
+    int input_c;
+    /** Directory to write the intermediate runs of a multi-pass merge to,
+     *  or NULL to write them alongside the output file */
+    char *tempdir;
+    /** Number of out of order records found in each input during the
+     *  most recent merge */
+    uint64_t *violations;
+    /** If set, inputs that turn out to be unsorted are sorted and then
+     *  merged again */
+    uint8_t repair;
+    /** Most records to sort in memory at once when repairing an input */
+    uint64_t sortrecs;
+    /** The key at which each range begins, as (high, low) pairs */
+    uint64_t *bounds;
+    /** The output file name for each range */
+    char **partnames;
+
+    uint8_t splitoutput;
+    uint8_t writeindex;
+    /** Set once the reader and merger threads have been started */
+    uint8_t running;
+} merge_context_t;
+
+/** Options for running as a daemon that merges each interval's interim
+ *  files as soon as they are complete.
+ */
+typedef struct watch_config {
+    /** Directory that the interim files are written to */
+    char *watchdir;
+    /** Directory to write the merged files to */
+    char *outdir;
+    /** Number of interim files written for each interval */
+    int inputs;
+    /** Seconds to wait for all of an interval's files to arrive */
+    int timeout;
+    /** If set, an interim file is complete as soon as it appears, rather
+     *  than once its .done file has been created */
+    uint8_t renamed;
+    /** If set, interim files are removed once they have been merged */
+    uint8_t removeinputs;
+} watch_config_t;
+
+/** An interval that we have seen interim files for, but not merged yet */
+typedef struct pending_interval {
+    /** Path of the interval's interim files, without the "--N" suffix */
+    char *base;
+    /** When we first saw a file for this interval */
+    time_t firstseen;
+    /** Set if any of the interval's files were present in the latest scan */
+    uint8_t present;
+    struct pending_interval *next;
+} pending_interval_t;
+
+/** An input to one pass of a multi-pass merge */
+typedef struct merge_input {
+    char *name;
+    /** Size of the file, used to merge the smallest inputs first */
+    off_t size;
+    /** Set if the file is an intermediate run that we wrote ourselves */
+    uint8_t isrun;
+} merge_input_t;
+
+/** Takes an empty batch from the pool, allocating a new one if there are
+ *  no spare batches.
+ */
+static merger_batch_t *get_batch(merger_batch_pool_t *pool) {
+
+    merger_batch_t *batch = NULL;
+
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->freelist) {
+        batch = pool->freelist;
+        pool->freelist = batch->nextfree;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (batch == NULL) {
+        batch = malloc(sizeof(merger_batch_t));
+        if (batch == NULL) {
+            return NULL;
+        }
+    }
+    batch->count = 0;
+    batch->next = 0;
+    batch->nextfree = NULL;
+    return batch;
 }
 
-/** Setter function for the pqueue position of a merger_ft instance */
-static void ft_set_pos(void *a, size_t pos) {
-    struct merger_ft *ft = (struct merger_ft *)a;
-    ft->pqueue_pos = pos;
+/** Returns a batch to the pool so it can be reused */
+static void put_batch(merger_batch_pool_t *pool, merger_batch_t *batch) {
+
+    if (batch == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&(pool->mutex));
+    batch->nextfree = pool->freelist;
+    pool->freelist = batch;
+    pthread_mutex_unlock(&(pool->mutex));
 }
 
 /** Tests if two flowtuple records are the same.
@@ -166,65 +418,200 @@ static int ft_same(struct merger_ft *a, struct merger_ft *b) {
     return 1;
 }
 
-/** Function that determines a flowtuple record's relative sort order
- *  within a priority queue.
+/** Calculates the merge key for a flowtuple record.
  *
- *  This is basically a replica of the flowtuple sort key used by the
- *  flowtuple plugin, except I've also added the SYN length and initial
- *  TCP window size to ensure a more deterministic result.
+ *  The sort order is basically a replica of the flowtuple sort key used by
+ *  the flowtuple plugin, except that the interval comes first and I've
+ *  also added the SYN length and initial TCP window size to ensure a more
+ *  deterministic result. That doesn't fit in 128 bits, so the key (see
+ *  corsaro_flowtuple_sort_key()) covers everything up to the top byte of
+ *  the source port and ft_cmp_tail() breaks any ties.
  */
-static int ft_cmp_pri(void *next, void *curr) {
+static inline void calc_merge_key(struct merger_ft *rec) {
+    corsaro_flowtuple_sort_key(&(rec->ft), &(rec->keyhi), &(rec->keylo));
+}
 
-    struct merger_ft *nextft = (struct merger_ft *)next;
-	struct merger_ft *currft = (struct merger_ft *)curr;
+/** Compares two merge keys.
+ *
+ *  Returns: a negative value if key a is lower, a positive value if key b
+ *           is lower, or 0 if they are equal.
+ */
+static inline int merge_key_cmp(uint64_t ahi, uint64_t alo, uint64_t bhi,
+        uint64_t blo) {
 
-	if (currft->ft.interval_ts != nextft->ft.interval_ts) {
-		return (currft->ft.interval_ts < nextft->ft.interval_ts);
-	}
+    if (ahi != bhi) {
+        return (ahi < bhi) ? -1 : 1;
+    }
+    if (alo != blo) {
+        return (alo < blo) ? -1 : 1;
+    }
+    return 0;
+}
 
-	if (currft->ft.protocol != nextft->ft.protocol) {
-		return (currft->ft.protocol < nextft->ft.protocol);
-	}
+/** Compares the fields of two flowtuple records that are not fully
+ *  covered by their merge keys.
+ *
+ *  Returns: a negative value if a sorts before b, a positive value if b
+ *           sorts before a, or 0 if they are equal.
+ */
+static int ft_cmp_tail(struct merger_ft *a, struct merger_ft *b) {
 
-	if (currft->ft.ttl != nextft->ft.ttl) {
-		return (currft->ft.ttl < nextft->ft.ttl);
-	}
+    if (a->ft.src_port != b->ft.src_port) {
+        return (a->ft.src_port < b->ft.src_port) ? -1 : 1;
+    }
+    if (a->ft.dst_port != b->ft.dst_port) {
+        return (a->ft.dst_port < b->ft.dst_port) ? -1 : 1;
+    }
+    if (a->ft.ip_len != b->ft.ip_len) {
+        return (a->ft.ip_len < b->ft.ip_len) ? -1 : 1;
+    }
+    if (a->ft.tcp_synlen != b->ft.tcp_synlen) {
+        return (a->ft.tcp_synlen < b->ft.tcp_synlen) ? -1 : 1;
+    }
+    if (a->ft.tcp_synwinlen != b->ft.tcp_synwinlen) {
+        return (a->ft.tcp_synwinlen < b->ft.tcp_synwinlen) ? -1 : 1;
+    }
+    return 0;
+}
 
-	if (currft->ft.tcp_flags != nextft->ft.tcp_flags) {
-		return (currft->ft.tcp_flags < nextft->ft.tcp_flags);
-	}
+/** Compares two flowtuple records using the full sort order.
+ *
+ *  Returns: a negative value if a sorts before b, a positive value if b
+ *           sorts before a, or 0 if they are equal.
+ */
+static inline int ft_cmp(struct merger_ft *a, struct merger_ft *b) {
+    int cmp = merge_key_cmp(a->keyhi, a->keylo, b->keyhi, b->keylo);
 
-	if (currft->ft.src_ip != nextft->ft.src_ip) {
-		return (currft->ft.src_ip < nextft->ft.src_ip);
-	}
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ft_cmp_tail(a, b);
+}
 
-	if (currft->ft.dst_ip != nextft->ft.dst_ip) {
-		return (currft->ft.dst_ip < nextft->ft.dst_ip);
-	}
+/** Tests whether the head record of reader 'a' should be written before
+ *  the head record of reader 'b'. Readers with no more records always
+ *  lose, and ties are won by the reader with the lower identifier.
+ */
+static inline int lt_before(merger_losertree_t *lt, int a, int b) {
 
-	if (currft->ft.src_port != nextft->ft.src_port) {
-		return (currft->ft.src_port < nextft->ft.src_port);
-	}
+    struct merger_ft *fa = lt->heads[a];
+    struct merger_ft *fb = lt->heads[b];
+    int cmp;
 
-	if (currft->ft.dst_port != nextft->ft.dst_port) {
-		return (currft->ft.dst_port < nextft->ft.dst_port);
-	}
+    if (fa == NULL) {
+        return 0;
+    }
+    if (fb == NULL) {
+        return 1;
+    }
+    if (fa->keyhi != fb->keyhi) {
+        return fa->keyhi < fb->keyhi;
+    }
+    if (fa->keylo != fb->keylo) {
+        return fa->keylo < fb->keylo;
+    }
+    cmp = ft_cmp_tail(fa, fb);
+    if (cmp != 0) {
+        return cmp < 0;
+    }
+    return a < b;
+}
 
-	if (currft->ft.ip_len != nextft->ft.ip_len) {
-		return (currft->ft.ip_len < nextft->ft.ip_len);
-	}
+/** Creates a tournament tree for merging records from 'k' readers. The
+ *  heads of each reader must be filled in before calling lt_build().
+ */
+static merger_losertree_t *lt_create(int k) {
 
-	if (currft->ft.tcp_synlen != nextft->ft.tcp_synlen) {
-		return (currft->ft.tcp_synlen < nextft->ft.tcp_synlen);
-	}
+    merger_losertree_t *lt = calloc(1, sizeof(merger_losertree_t));
 
-	if (currft->ft.tcp_synwinlen != nextft->ft.tcp_synwinlen) {
-		return (currft->ft.tcp_synwinlen < nextft->ft.tcp_synwinlen);
-	}
+    if (lt == NULL) {
+        return NULL;
+    }
+    lt->k = k;
+    lt->losers = calloc(k, sizeof(int));
+    lt->heads = calloc(k, sizeof(struct merger_ft *));
+    if (lt->losers == NULL || lt->heads == NULL) {
+        free(lt->losers);
+        free(lt->heads);
+        free(lt);
+        return NULL;
+    }
+    return lt;
+}
+
+static void lt_free(merger_losertree_t *lt) {
+    if (lt == NULL) {
+        return;
+    }
+    free(lt->losers);
+    free(lt->heads);
+    free(lt);
+}
+
+/** Plays every match in the tree, using the current head of each reader.
+ *
+ *  Leaf i (reader i) is treated as node k + i, so the parent of any node
+ *  n is n / 2 and the root match is at node 1.
+ */
+static int lt_build(merger_losertree_t *lt) {
+
+    int *winners;
+    int n, a, b;
+
+    if (lt->k == 1) {
+        lt->losers[0] = 0;
+        return 0;
+    }
+
+    winners = malloc(sizeof(int) * 2 * lt->k);
+    if (winners == NULL) {
+        return -1;
+    }
+    for (n = 0; n < lt->k; n++) {
+        winners[lt->k + n] = n;
+    }
+    for (n = lt->k - 1; n >= 1; n--) {
+        a = winners[2 * n];
+        b = winners[2 * n + 1];
+        if (lt_before(lt, a, b)) {
+            winners[n] = a;
+            lt->losers[n] = b;
+        } else {
+            winners[n] = b;
+            lt->losers[n] = a;
+        }
+    }
+    lt->losers[0] = winners[1];
+    free(winners);
+    return 0;
+}
 
-	return 1;
+/** Returns the record that should be written next, or NULL if every
+ *  reader has run out of records.
+ */
+static inline struct merger_ft *lt_top(merger_losertree_t *lt) {
+    return lt->heads[lt->losers[0]];
 }
 
+/** Replays the matches along the path from a reader's leaf to the root,
+ *  after the head record for that reader has been replaced.
+ */
+static inline void lt_replay(merger_losertree_t *lt, int source) {
+
+    int winner = source;
+    int n = (source + lt->k) / 2;
+    int tmp;
+
+    while (n >= 1) {
+        if (lt_before(lt, lt->losers[n], winner)) {
+            tmp = lt->losers[n];
+            lt->losers[n] = winner;
+            winner = tmp;
+        }
+        n = n / 2;
+    }
+    lt->losers[0] = winner;
+}
 
 volatile int halted = 0;
 
@@ -246,77 +633,189 @@ static inline void combine_flowtuple_records(struct merger_ft *prev,
 
 }
 
-/** Function that operates a reader thread */
-static void *start_reader(void *arg) {
-    avromerge_reader_t *rdata = (avromerge_reader_t *)arg;
-    corsaro_avro_reader_t *avrdr = corsaro_create_avro_reader(rdata->logger,
-            rdata->source);
-    avro_value_t *record;
+/** Sends a batch of records (or the NULL end marker) to the merger.
+ *
+ *  Returns 0 if the batch was sent, -1 if the program is halting or an
+ *  error occurred. If the batch was not sent, it is returned to the pool.
+ */
+static int send_batch(avromerge_reader_t *rdata, merger_batch_t *batch) {
+
+    int sendret;
+
+    /* Don't actually block inside zeromq -- we want to be able to detect
+     * when the user wants the program to halt, so we end up with this
+     * slightly messy block of code.
+     */
+    while (!halted) {
+        /* non-blocking send */
+        sendret = zmq_send(rdata->outsock, &(batch),
+                sizeof(merger_batch_t *), ZMQ_DONTWAIT);
+        if (sendret == sizeof(merger_batch_t *)) {
+            return 0;
+        }
+        if (errno != EAGAIN) {
+            corsaro_log(rdata->logger,
+                    "Error sending message on push socket %s: %s",
+                    rdata->sockname, strerror(errno));
+            break;
+        }
+        /* send would have blocked, so the merger is still busy with
+         * our earlier batches */
+        usleep(100);
+    }
+
+    /* free the batch here, since we're never going to send it. The
+     * merger recv loop might already be over.
+     */
+    put_batch(rdata->pool, batch);
+    return -1;
+}
 
-    int ret = 1, sendret;
-    struct merger_ft *tosend, **end;
+/** Waits until the main thread hands out a new set of files to merge.
+ *
+ *  Parameters: control     the control structure shared with main
+ *              seen        the generation of the last merge this thread
+ *                          took part in, updated to the new generation
+ *  Returns: 1 if there is a new merge to take part in, 0 if the thread
+ *           should exit.
+ */
+static int wait_for_merge(merge_control_t *control, uint64_t *seen) {
+
+    int ret = 1;
+
+    pthread_mutex_lock(&(control->mutex));
+    while (!control->shutdown && control->generation == *seen) {
+        pthread_cond_wait(&(control->start), &(control->mutex));
+    }
+    if (control->shutdown) {
+        ret = 0;
+    } else {
+        *seen = control->generation;
+    }
+    pthread_mutex_unlock(&(control->mutex));
+    return ret;
+}
 
-    /* The reader thread is very simple -- it opens the given avro file,
-     * reads records from it, decodes them back into 'struct flowtuple'
-     * instances then forwards them back to the main thread via a zeromq
-     * queue.
+/** Reads the records from a reader's current input file and sends them
+ *  on to the merger, followed by an end marker.
+ */
+static void read_input(avromerge_reader_t *rdata) {
+    corsaro_flowtuple_reader_t *ftrdr = NULL;
+    merger_batch_t *batch;
+    struct merger_ft *rec, last;
+    uint8_t havelast = 0;
+
+    int ret = 1;
+
+    /* The reader is very simple -- it opens the given avro file, reads
+     * records from it, decodes them back into 'struct flowtuple' instances
+     * in batches and then forwards each full batch to the merger via a
+     * zeromq queue.
      *
-     * The queue is deliberately configured with a relatively low HWM to
-     * ensure that we don't create a large backlog of messages; instead
-     * the reader will effectively block until the main thread has processed
-     * the previous messages it had sent.
+     * The queue is deliberately configured with a low HWM to ensure that
+     * we don't create a large backlog of batches; instead the reader will
+     * effectively block until the merger has processed the previous
+     * batches it had sent.
      */
+    rdata->violations = 0;
+    rdata->error = 0;
+
+    /* If there is no file for us this time, or it can't be opened, we
+     * still need to tell the merger that there is nothing coming from
+     * this reader */
+    if (rdata->source == NULL) {
+        ret = 0;
+    } else if ((ftrdr = corsaro_create_flowtuple_reader(rdata->logger,
+                    rdata->source)) == NULL) {
+        ret = -1;
+    } else if (rdata->haslow) {
+        /* Jump straight to our key range, if the file has an index */
+        if (corsaro_seek_flowtuple_reader(ftrdr, rdata->lowhi,
+                    rdata->lowlo) < 0) {
+            ret = -1;
+        }
+    }
+
+    batch = get_batch(rdata->pool);
+    if (batch == NULL) {
+        corsaro_log(rdata->logger,
+                "Unable to allocate record batch for reader %d",
+                rdata->readerid);
+        goto endreader;
+    }
 
     while (ret > 0 && !halted) {
-        ret = corsaro_read_next_avro_record(avrdr, &(record));
+        rec = &(batch->recs[batch->count]);
+        ret = corsaro_read_next_flowtuple(ftrdr, &(rec->ft));
 
         if (ret <= 0) {
             break;
         }
-        tosend = calloc(1, sizeof(struct merger_ft));
-        tosend->source = rdata->readerid;
-        tosend->pqueue_pos = 0;
+        rec->source = rdata->readerid;
+        calc_merge_key(rec);
 
-        decode_flowtuple_from_avro(record, &(tosend->ft));
+        /* The merge relies on the input being sorted, so keep count of
+         * any records that are out of order */
+        if (havelast && ft_cmp(rec, &last) < 0) {
+            rdata->violations ++;
+        }
+        last = *rec;
+        havelast = 1;
 
-        /* Don't actually block inside zeromq -- we want to be able to detect
-         * when the user wants the program to halt, so we end up with this
-         * slightly messy block of code.
-         */
-        while (!halted) {
-            /* non-blocking send */
-            sendret = zmq_send(rdata->outsock, &(tosend),
-                    sizeof(struct merger_ft **), ZMQ_DONTWAIT);
-            if (sendret != sizeof(struct merger_ft **)) {
-                if (errno == EAGAIN) {
-                    /* send would have blocked, check for halt condition */
-                    if (halted) {
-                        /* free tosend here, since we're never going to send it.
-                         * the merger recv loop might already be over.
-                         */
-                        free(tosend);
-                        goto endreader;
-                    }
-                    usleep(10);
-                    continue;
-                }
-                corsaro_log(rdata->logger,
-                        "Error sending message on push socket %s: %s",
-                        rdata->sockname, strerror(errno));
-                goto endreader;
-            }
+        /* Only pass on records that fall within our key range */
+        if (rdata->haslow && merge_key_cmp(rec->keyhi, rec->keylo,
+                    rdata->lowhi, rdata->lowlo) < 0) {
+            continue;
+        }
+        if (rdata->hashigh && merge_key_cmp(rec->keyhi, rec->keylo,
+                    rdata->highhi, rdata->highlo) >= 0) {
             break;
         }
+        batch->count ++;
+
+        if (batch->count < MERGER_BATCH_SIZE) {
+            continue;
+        }
+
+        if (send_batch(rdata, batch) < 0) {
+            goto endreader;
+        }
+        batch = get_batch(rdata->pool);
+        if (batch == NULL) {
+            corsaro_log(rdata->logger,
+                    "Unable to allocate record batch for reader %d",
+                    rdata->readerid);
+            goto endreader;
+        }
+    }
+
+    /* Let the main thread know if we couldn't read the whole file, e.g.
+     * because it was missing, truncated or corrupt */
+    if (ret < 0) {
+        rdata->error = 1;
+    }
+
+    /* Send whatever is left over in the final batch */
+    if (batch->count > 0) {
+        if (send_batch(rdata, batch) < 0) {
+            goto endreader;
+        }
+    } else {
+        put_batch(rdata->pool, batch);
     }
 
+    /* Close the file before we send the end marker, as the main thread
+     * may hand us a different file as soon as the merger is done */
+    corsaro_destroy_flowtuple_reader(ftrdr);
+    ftrdr = NULL;
+
     /* If we get here, we've run out of records to send. Send an obvious
      * "end" marker to let the merger know that we're done.
      */
     if (!halted) {
-        end = calloc(1, sizeof(struct merger_ft *));
-        *end = NULL;
-        if (zmq_send(rdata->outsock, end, sizeof(struct merger_ft **),
-                    0) != sizeof(struct merger_ft **)) {
+        batch = NULL;
+        if (zmq_send(rdata->outsock, &(batch), sizeof(merger_batch_t *),
+                    0) != sizeof(merger_batch_t *)) {
             corsaro_log(rdata->logger,
                 "Error sending final message on push socket %s: %s",
                 rdata->sockname, strerror(errno));
@@ -324,153 +823,1602 @@ static void *start_reader(void *arg) {
     }
 
 endreader:
-	corsaro_destroy_avro_reader(avrdr);
-    pthread_exit(NULL);
+    corsaro_destroy_flowtuple_reader(ftrdr);
 }
 
-/** Merges flowtuple records received from the reader threads, making
- *  sure to emit them in sorted order. The records are then re-encoded as
- *  avro and written to a file using the given avro writer.
- *
- *  Parameters: logger      a corsaro logging instance
- *              avwrt       an open and started corsaro avro writer instance
- *              zmq_ctxt    the zeromq context for this process
- *              tcount      the number of reader threads that have been started
+/** Function that operates a reader thread, which reads the input file it
+ *  has been given for each merge.
  */
-void run_merger(corsaro_logger_t *logger, corsaro_avro_writer_t *avwrt,
-        void *zmq_ctxt, int tcount) {
-    void **insocks;
-    int inhwm = 100;
-    int i, ret;
-    char sockname[1024];
-    char recvbuf[1024];
-    struct merger_ft **recvd, *next, *prev;
-	pqueue_t *pq;
+static void *start_reader(void *arg) {
+    avromerge_reader_t *rdata = (avromerge_reader_t *)arg;
+    uint64_t seen = 0;
 
-    insocks = calloc(tcount, sizeof(void *));
-	pq = pqueue_init(tcount, ft_cmp_pri, ft_get_pos, ft_set_pos);
+    while (wait_for_merge(rdata->control, &seen)) {
+        read_input(rdata);
+    }
+    pthread_exit(NULL);
+}
 
-    /* Set up a zeromq socket to receive flowtuples from each of the reader
-     * threads.
-     */
-    for (i = 0; i < tcount; i++) {
-        insocks[i] = zmq_socket(zmq_ctxt, ZMQ_PULL);
+/** Function that operates a sampling thread, which reads every record in
+ *  an input file and keeps a uniform random sample of their merge keys.
+ */
+static void *start_sampler(void *arg) {
+    avromerge_sampler_t *sdata = (avromerge_sampler_t *)arg;
+    corsaro_flowtuple_reader_t *ftrdr = corsaro_create_flowtuple_reader(
+            sdata->logger, sdata->source);
+    struct merger_ft rec;
+    unsigned int seed = (unsigned int)(uintptr_t)sdata;
+    uint64_t j;
+
+    while (!halted && ftrdr &&
+            corsaro_read_next_flowtuple(ftrdr, &(rec.ft)) > 0) {
+        calc_merge_key(&rec);
+        sdata->records ++;
+
+        if (sdata->samplecount < MERGER_SAMPLE_SIZE) {
+            j = sdata->samplecount;
+            sdata->samplecount ++;
+        } else {
+            j = (((uint64_t)rand_r(&seed)) * (RAND_MAX + 1ULL) +
+                    rand_r(&seed)) % sdata->records;
+            if (j >= MERGER_SAMPLE_SIZE) {
+                continue;
+            }
+        }
+        sdata->samples[j * 2] = rec.keyhi;
+        sdata->samples[j * 2 + 1] = rec.keylo;
+    }
+
+	corsaro_destroy_flowtuple_reader(ftrdr);
+    pthread_exit(NULL);
+}
 
-        snprintf(sockname, 1024, "%s-%d", BASE_SOCKETNAME, i);
+static int sample_cmp(const void *a, const void *b) {
+    const merger_sample_t *sa = (const merger_sample_t *)a;
+    const merger_sample_t *sb = (const merger_sample_t *)b;
 
-        if (zmq_setsockopt(insocks[i], ZMQ_RCVHWM, &inhwm, sizeof(inhwm)) < 0) {
-            corsaro_log(logger, "unable to configure pull socket %s: %s",
-                    sockname, strerror(errno));
-            goto endmerger;
-        }
+    return merge_key_cmp(sa->keyhi, sa->keylo, sb->keyhi, sb->keylo);
+}
 
-        if (zmq_connect(insocks[i], sockname) != 0) {
-            corsaro_log(logger, "failed to connect to pull socket %s: %s",
-                    sockname, strerror(errno));
-            goto endmerger;
-        }
+/** Builds a set of weighted key samples from the block indexes of the
+ *  input files, with one sample per block.
+ *
+ *  Returns: the number of samples, or -1 if any input has no index.
+ */
+static int64_t samples_from_indexes(corsaro_logger_t *logger, char **sources,
+        int input_c, merger_sample_t **samples, double *records) {
 
-        /* Read the first available record and put it in the priority queue */
-        ret = zmq_recv(insocks[i], recvbuf, 1024, 0);
-        if (ret < 0) {
-            corsaro_log(logger, "failed to read first flowtuple from pull socket %s: %s",
-                    sockname, strerror(errno));
-            goto endmerger;
-        }
+    corsaro_avro_index_t **indexes;
+    uint64_t total = 0, j;
+    int64_t ret = -1;
+    int i;
 
-        recvd = (struct merger_ft **)recvbuf;
-        if (*recvd != NULL) {
-            pqueue_insert(pq, *recvd);
+    indexes = calloc(input_c, sizeof(corsaro_avro_index_t *));
+    if (indexes == NULL) {
+        return -1;
+    }
+    for (i = 0; i < input_c; i++) {
+        indexes[i] = corsaro_load_avro_index(logger, sources[i]);
+        if (indexes[i] == NULL) {
+            goto endindex;
         }
+        total += indexes[i]->count;
     }
 
-    prev = NULL;
-    while (!halted && (next = (struct merger_ft *)(pqueue_pop(pq)))) {
+    *samples = calloc(total + 1, sizeof(merger_sample_t));
+    if (*samples == NULL) {
+        goto endindex;
+    }
 
-        /* If we see two flowtuples that are the same (but presumably
-         * came from different interim files), we need to combine them
-         * into a single entry.
-         */
-        if (ft_same(prev, next)) {
-            combine_flowtuple_records(prev, next);
-            free(prev);
-        } else if (prev) {
-            encode_flowtuple_as_avro(&(prev->ft), avwrt, logger);
-    		if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
-	    		corsaro_log(logger, "Error while writing merged avro record...");
-		    }
-            if (prev->ft.interval_ts != next->ft.interval_ts) {
-                corsaro_log(logger, "Merged all flowtuples from interval %u",
-                        prev->ft.interval_ts);
-            }
-            free(prev);
+    /* Each block stands in for all of its records, at its lowest key */
+    total = 0;
+    *records = 0;
+    for (i = 0; i < input_c; i++) {
+        for (j = 0; j < indexes[i]->count; j++) {
+            (*samples)[total].keyhi = indexes[i]->entries[j].minhi;
+            (*samples)[total].keylo = indexes[i]->entries[j].minlo;
+            (*samples)[total].weight = indexes[i]->entries[j].records;
+            *records += indexes[i]->entries[j].records;
+            total ++;
         }
-        prev = next;
+    }
+    ret = total;
 
-        /* Read the next record from the reader thread that provided the
-         * one we just popped and put it in the priority queue.
-         * Again, make sure we don't let zeromq block so that we can
-         * react to user interrupts.
-         */
-        while (!halted) {
-            ret = zmq_recv(insocks[next->source], recvbuf, 1024, ZMQ_DONTWAIT);
-            if (ret < 0) {
-                if (errno == EAGAIN) {
-                    if (halted) {
-                        goto endmerger;
-                    }
-                    usleep(10);
-                    continue;
-                }
-                corsaro_log(logger, "failed to read flowtuple from pull socket %s: %s",
-                        sockname, strerror(errno));
-                goto endmerger;
-            }
+endindex:
+    for (i = 0; i < input_c; i++) {
+        corsaro_free_avro_index(indexes[i]);
+    }
+    free(indexes);
+    return ret;
+}
 
-            recvd = (struct merger_ft **)recvbuf;
-            if (*recvd != NULL) {
-                pqueue_insert(pq, *recvd);
-            }
-            break;
-        }
+/** Chooses the keys that split the combined inputs into 'partitions'
+ *  ranges of roughly equal size. If every input has a block index, the
+ *  index entries are used to choose the ranges; otherwise, the merge keys
+ *  of every input are sampled.
+ *
+ *  Parameters: logger      a corsaro logging instance
+ *              sources     the names of the input files
+ *              input_c     the number of input files
+ *              partitions  the number of ranges to split the inputs into
+ *              bounds      updated to contain the key (as a high, low pair)
+ *                          at which each range after the first begins
+ *  Returns: 0 if successful, -1 if an error occurs.
+ */
+static int choose_partition_bounds(corsaro_logger_t *logger, char **sources,
+        int input_c, int partitions, uint64_t *bounds) {
+
+    avromerge_sampler_t *samplers = NULL;
+    merger_sample_t *samples = NULL;
+    int64_t total = 0;
+    uint32_t i, j;
+    double records = 0, target, sofar = 0;
+    int p, ret = -1;
+
+    total = samples_from_indexes(logger, sources, input_c, &samples,
+            &records);
+    if (total >= 0) {
+        corsaro_log(logger,
+                "Using %ld index entries covering %.0f records to split into %d ranges",
+                total, records, partitions);
+        goto choose;
     }
+    total = 0;
 
-    /* Make sure we write out the last flowtuple */
-    if (prev != NULL) {
-        encode_flowtuple_as_avro(&(prev->ft), avwrt, logger);
-        if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
-            corsaro_log(logger, "Error while writing merged avro record...");
-        }
-        corsaro_log(logger, "Merged all flowtuples from final interval %u",
-                prev->ft.interval_ts);
+    samplers = calloc(input_c, sizeof(avromerge_sampler_t));
+    samples = calloc(input_c * MERGER_SAMPLE_SIZE, sizeof(merger_sample_t));
+    if (samplers == NULL || samples == NULL) {
+        corsaro_log(logger, "unable to allocate space for key samples");
+        goto endsample;
     }
 
-endmerger:
-    if (prev) {
-        free(prev);
+    for (i = 0; i < input_c; i++) {
+        samplers[i].source = sources[i];
+        samplers[i].logger = logger;
+        pthread_create(&(samplers[i].threadid), NULL, start_sampler,
+                &(samplers[i]));
+    }
+    for (i = 0; i < input_c; i++) {
+        pthread_join(samplers[i].threadid, NULL);
+    }
+    if (halted) {
+        goto endsample;
     }
-	for (i = 0; i < tcount; i++) {
-        if (insocks[i]) {
-    		zmq_close(insocks[i]);
-        }
-	}
-	free(insocks);
-	pqueue_free(pq);
-}
 
-int main(int argc, char *argv[]) {
-    char *outputpath = NULL;
-    int input_c, i;
-    struct sigaction sigact;
-    sigset_t sig_before, sig_block_all;
-    avromerge_reader_t *readers;
-    void **push_sockets;
+    /* Each sample stands in for an equal share of its input's records */
+    for (i = 0; i < input_c; i++) {
+        for (j = 0; j < samplers[i].samplecount; j++) {
+            samples[total].keyhi = samplers[i].samples[j * 2];
+            samples[total].keylo = samplers[i].samples[j * 2 + 1];
+            samples[total].weight = ((double)samplers[i].records) /
+                    samplers[i].samplecount;
+            total ++;
+        }
+        records += samplers[i].records;
+    }
+    corsaro_log(logger, "Sampled %ld keys from %.0f records to split into %d ranges",
+            total, records, partitions);
+
+choose:
+    qsort(samples, total, sizeof(merger_sample_t), sample_cmp);
+
+    j = 0;
+    for (p = 1; p < partitions; p++) {
+        target = (records * p) / partitions;
+        while (j < total && sofar + samples[j].weight <= target) {
+            sofar += samples[j].weight;
+            j ++;
+        }
+        if (j < total) {
+            bounds[p * 2] = samples[j].keyhi;
+            bounds[p * 2 + 1] = samples[j].keylo;
+        } else {
+            bounds[p * 2] = UINT64_MAX;
+            bounds[p * 2 + 1] = UINT64_MAX;
+        }
+    }
+    ret = 0;
+
+endsample:
+    free(samplers);
+    free(samples);
+    return ret;
+}
+
+/** Receives the next batch of records from a reader thread.
+ *
+ *  Returns 1 if a batch was received, 0 if the reader has no more records
+ *  and -1 if the program is halting or an error occurred.
+ */
+static int recv_batch(corsaro_logger_t *logger, void *insock,
+        merger_batch_t **batch) {
+
+    int ret;
+
+    /* Make sure we don't let zeromq block so that we can react to user
+     * interrupts.
+     */
+    while (!halted) {
+        ret = zmq_recv(insock, batch, sizeof(merger_batch_t *),
+                ZMQ_DONTWAIT);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                usleep(10);
+                continue;
+            }
+            corsaro_log(logger, "failed to read flowtuples from pull socket: %s",
+                    strerror(errno));
+            return -1;
+        }
+
+        if (*batch == NULL) {
+            return 0;
+        }
+        (*batch)->next = 0;
+        return 1;
+    }
+    return -1;
+}
+
+/** Merges flowtuple records received from the reader threads, making
+ *  sure to emit them in sorted order. The records are then re-encoded as
+ *  avro and written to a file using the given avro writer.
+ *
+ *  Each reader thread sends batches of records; the merger keeps the
+ *  current batch from each reader and works through it in order, with
+ *  the record at the head of each batch being a leaf in a tournament
+ *  tree that picks the next record to write.
+ *
+ *  Parameters: logger      a corsaro logging instance
+ *              avwrt       an open and started corsaro avro writer instance
+ *              insocks     a connected zeromq pull socket for each reader
+ *              tcount      the number of reader threads that have been started
+ *              pool        the pool that used batches are returned to
+ *              partid      the key range being merged, or -1 if the merge
+ *                          is not partitioned
+ *  Returns: 0 if the merge completed (or was halted by the user), -1 if
+ *           an error occurred.
+ */
+static int run_merger(corsaro_logger_t *logger, corsaro_avro_writer_t *avwrt,
+        void **insocks, int tcount, merger_batch_pool_t *pool, int partid) {
+    merger_batch_t **batches;
+    int i, ret;
+    struct merger_ft *next, prev;
+    uint8_t haveprev = 0;
+    merger_batch_t *batch;
+    merger_losertree_t *lt;
+    uint64_t inrecs = 0, outrecs = 0;
+    struct timespec starttime, endtime;
+    double elapsed;
+    int result = -1;
+
+    batches = calloc(tcount, sizeof(merger_batch_t *));
+    lt = lt_create(tcount);
+    if (lt == NULL) {
+        corsaro_log(logger, "unable to allocate tournament tree for merging");
+        goto endmerger;
+    }
+
+    /* Read the first available batch from each reader and make its first
+     * record the head for that reader */
+    for (i = 0; i < tcount; i++) {
+        ret = recv_batch(logger, insocks[i], &(batches[i]));
+        if (ret < 0) {
+            corsaro_log(logger,
+                    "failed to read first flowtuples from reader %d", i);
+            goto endmerger;
+        }
+
+        if (ret > 0) {
+            lt->heads[i] = &(batches[i]->recs[0]);
+        }
+    }
+
+    if (lt_build(lt) < 0) {
+        corsaro_log(logger, "unable to allocate tournament tree for merging");
+        goto endmerger;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    while (!halted && (next = lt_top(lt))) {
+
+        inrecs ++;
+
+        /* If we see two flowtuples that are the same (but presumably
+         * came from different interim files), we need to combine them
+         * into a single entry.
+         */
+        if (haveprev && ft_same(&prev, next)) {
+            combine_flowtuple_records(&prev, next);
+        } else if (haveprev) {
+            encode_flowtuple_as_avro(&(prev.ft), avwrt, logger);
+    		if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
+	    		corsaro_log(logger, "Error while writing merged avro record...");
+		    }
+            outrecs ++;
+            if (prev.ft.interval_ts != next->ft.interval_ts) {
+                corsaro_log(logger, "Merged all flowtuples from interval %u",
+                        prev.ft.interval_ts);
+            }
+        }
+
+        /* Copy the record, as its batch may be reused once we move on */
+        prev = *next;
+        haveprev = 1;
+
+        /* Move on to the next record from the same reader, fetching a new
+         * batch from the reader thread if we have used up the current one.
+         */
+        i = next->source;
+        batch = batches[i];
+        batch->next ++;
+        if (batch->next < batch->count) {
+            lt->heads[i] = &(batch->recs[batch->next]);
+        } else {
+            put_batch(pool, batch);
+            batches[i] = NULL;
+            lt->heads[i] = NULL;
+
+            ret = recv_batch(logger, insocks[i], &(batches[i]));
+            if (ret < 0) {
+                goto endmerger;
+            }
+            if (ret > 0) {
+                lt->heads[i] = &(batches[i]->recs[0]);
+            }
+        }
+        lt_replay(lt, i);
+    }
+
+    /* Make sure we write out the last flowtuple */
+    if (haveprev && !halted) {
+        encode_flowtuple_as_avro(&(prev.ft), avwrt, logger);
+        if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
+            corsaro_log(logger, "Error while writing merged avro record...");
+        }
+        outrecs ++;
+        corsaro_log(logger, "Merged all flowtuples from final interval %u",
+                prev.ft.interval_ts);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endtime);
+    elapsed = (endtime.tv_sec - starttime.tv_sec) +
+            (endtime.tv_nsec - starttime.tv_nsec) / 1000000000.0;
+    if (partid >= 0) {
+        corsaro_log(logger,
+                "Range %d: merged %lu flowtuples into %lu in %.2f seconds (%.0f records/sec)",
+                partid, inrecs, outrecs, elapsed,
+                elapsed > 0 ? inrecs / elapsed : 0.0);
+    } else {
+        corsaro_log(logger,
+                "Merged %lu flowtuples into %lu in %.2f seconds (%.0f records/sec)",
+                inrecs, outrecs, elapsed,
+                elapsed > 0 ? inrecs / elapsed : 0.0);
+    }
+    result = 0;
+
+endmerger:
+	for (i = 0; i < tcount; i++) {
+        put_batch(pool, batches[i]);
+	}
+    free(batches);
+    lt_free(lt);
+    return result;
+}
+
+/** Function that operates the merger thread for one key range. The
+ *  thread connects to its readers once, and then merges each set of
+ *  files that the main thread hands out until it is told to exit.
+ */
+static void *start_partition(void *arg) {
+    merge_partition_t *part = (merge_partition_t *)arg;
+    merge_control_t *control = part->control;
+    void **insocks;
+    int inhwm = 4;
+    int i, connected = 1;
+    char sockname[1024];
+    uint64_t seen = 0;
+
+    /* Set up a zeromq socket to receive flowtuples from each of the reader
+     * threads.
+     */
+    insocks = calloc(part->input_c, sizeof(void *));
+    for (i = 0; i < part->input_c; i++) {
+        insocks[i] = zmq_socket(part->zmq_ctxt, ZMQ_PULL);
+
+        snprintf(sockname, 1024, "%s-%d-%d", BASE_SOCKETNAME, part->partid,
+                i);
+
+        if (zmq_setsockopt(insocks[i], ZMQ_RCVHWM, &inhwm,
+                    sizeof(inhwm)) < 0) {
+            corsaro_log(part->logger, "unable to configure pull socket %s: %s",
+                    sockname, strerror(errno));
+            connected = 0;
+            break;
+        }
+
+        if (zmq_connect(insocks[i], sockname) != 0) {
+            corsaro_log(part->logger,
+                    "failed to connect to pull socket %s: %s",
+                    sockname, strerror(errno));
+            connected = 0;
+            break;
+        }
+    }
+
+    while (wait_for_merge(control, &seen)) {
+        if (!connected || run_merger(part->logger, part->avwrt, insocks,
+                    part->input_c, part->pool, part->partid) < 0) {
+            part->error = 1;
+        }
+
+        pthread_mutex_lock(&(control->mutex));
+        control->finished ++;
+        pthread_cond_signal(&(control->finish));
+        pthread_mutex_unlock(&(control->mutex));
+    }
+
+    for (i = 0; i < part->input_c; i++) {
+        if (insocks[i]) {
+            zmq_close(insocks[i]);
+        }
+    }
+    free(insocks);
+    pthread_exit(NULL);
+}
+
+/** Removes an avro file that is no longer needed (e.g. the output for a key
+ *  range that has been concatenated into the main output file), along with
+ *  its .done file and index.
+ */
+static void remove_avro_file(char *fname) {
+    char extra[1024];
+
+    unlink(fname);
+    snprintf(extra, sizeof(extra), "%s.done", fname);
+    unlink(extra);
+    snprintf(extra, sizeof(extra), "%s%s", fname, CORSARO_AVRO_INDEX_SUFFIX);
+    unlink(extra);
+}
+
+/** Creates an empty marker file, named after the given file plus a
+ *  suffix (e.g. ".done").
+ */
+static void touch_marker_file(corsaro_logger_t *logger, char *fname,
+        const char *suffix) {
+    char markname[1100];
+    FILE *mark;
+
+    snprintf(markname, sizeof(markname), "%s%s", fname, suffix);
+    mark = fopen(markname, "w");
+    if (mark == NULL) {
+        corsaro_log(logger, "unable to create %s file %s", suffix, markname);
+        return;
+    }
+    fclose(mark);
+}
+
+
+
+/** Creates the reader and merger threads, along with the sockets that
+ *  connect them and the avro writers for each key range. The threads then
+ *  wait for merge_files() to give them something to do.
+ *
+ *  The number of partitions, readers per partition and the output options
+ *  must be set in the context before calling this function.
+ *
+ *  Returns 0 on success, -1 if an error occurs.
+ */
+static int start_merge_threads(merge_context_t *ctx) {
+    int i, p;
+    int outhwm = 4;
+    sigset_t sig_before, sig_block_all;
+
+    ctx->zmq_ctxt = zmq_ctx_new();
+    pthread_mutex_init(&(ctx->pool.mutex), NULL);
+    ctx->pool.freelist = NULL;
+
+    pthread_mutex_init(&(ctx->control.mutex), NULL);
+    pthread_cond_init(&(ctx->control.start), NULL);
+    pthread_cond_init(&(ctx->control.finish), NULL);
+    ctx->control.generation = 0;
+    ctx->control.finished = 0;
+    ctx->control.shutdown = 0;
+
+    ctx->bounds = calloc(ctx->partitions * 2, sizeof(uint64_t));
+    ctx->violations = calloc(ctx->input_c, sizeof(uint64_t));
+    ctx->parts = calloc(ctx->partitions, sizeof(merge_partition_t));
+    ctx->partnames = calloc(ctx->partitions, sizeof(char *));
+
+    for (p = 0; p < ctx->partitions; p++) {
+        merge_partition_t *part = &(ctx->parts[p]);
+
+        part->partid = (ctx->partitions > 1) ? p : -1;
+        part->input_c = ctx->input_c;
+        part->logger = ctx->logger;
+        part->zmq_ctxt = ctx->zmq_ctxt;
+        part->pool = &(ctx->pool);
+        part->control = &(ctx->control);
+        part->readers = calloc(ctx->input_c, sizeof(avromerge_reader_t));
+
+        for (i = 0; i < ctx->input_c; i++) {
+            char sockname[1024];
+            avromerge_reader_t *rdr = &(part->readers[i]);
+
+            /* Create the reader output sockets here, so we can close them
+             * once both the reader threads have ended and the merging
+             * process has finished reading from them. Helps avoid
+             * deadlocks on exit.
+             */
+            snprintf(sockname, 1024, "%s-%d-%d", BASE_SOCKETNAME,
+                    part->partid, i);
+            rdr->outsock = zmq_socket(ctx->zmq_ctxt, ZMQ_PUSH);
+            rdr->sockname = strdup(sockname);
+
+            if (zmq_setsockopt(rdr->outsock, ZMQ_SNDHWM, &outhwm,
+                    sizeof(outhwm)) < 0) {
+                corsaro_log(ctx->logger, "Error configuring push socket %s: %s",
+                        sockname, strerror(errno));
+                return -1;
+            }
+
+            if (zmq_bind(rdr->outsock, sockname) < 0) {
+                corsaro_log(ctx->logger, "Unable to bind push socket %s: %s",
+                        sockname, strerror(errno));
+                return -1;
+            }
+
+            rdr->readerid = i;
+            rdr->logger = ctx->logger;
+            rdr->pool = &(ctx->pool);
+            rdr->control = &(ctx->control);
+        }
+
+        /* Set up the avro writer that we're going to use for writing this
+         * range's flowtuples to disk. The same writer is reused for each
+         * merge. FLOWTUPLE_RESULT_SCHEMA is defined in corsaro_flowtuple.h
+         */
+        part->avwrt = corsaro_create_avro_writer(ctx->logger,
+                FLOWTUPLE_RESULT_SCHEMA);
+        if (part->avwrt == NULL) {
+            return -1;
+        }
+        corsaro_enable_avro_writer_index(part->avwrt, ctx->writeindex);
+
+        /* We only create the .done file once we know the merge succeeded
+         * and doesn't need to be repeated */
+        corsaro_set_avro_writer_done_file(part->avwrt, 0);
+    }
+
+    sigemptyset(&sig_block_all);
+    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
+        corsaro_log(ctx->logger, "Error in pthread_sigmask?: %s",
+                strerror(errno));
+        return -1;
+    }
+
+    for (p = 0; p < ctx->partitions; p++) {
+        merge_partition_t *part = &(ctx->parts[p]);
+
+        for (i = 0; i < ctx->input_c; i++) {
+            pthread_create(&(part->readers[i].threadid), NULL, start_reader,
+                    &(part->readers[i]));
+        }
+        pthread_create(&(part->threadid), NULL, start_partition, part);
+    }
+    ctx->running = 1;
+
+    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
+        corsaro_log(ctx->logger, "Error in pthread_sigmask?: %s",
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/** Tells the reader and merger threads to exit, waits for them to do so
+ *  and then tidies up everything that start_merge_threads() created.
+ */
+static void stop_merge_threads(merge_context_t *ctx) {
+    int i, p;
+    merger_batch_t *batch;
+
+    if (ctx->running) {
+        pthread_mutex_lock(&(ctx->control.mutex));
+        ctx->control.shutdown = 1;
+        pthread_cond_broadcast(&(ctx->control.start));
+        pthread_mutex_unlock(&(ctx->control.mutex));
+
+        for (p = 0; p < ctx->partitions; p++) {
+            pthread_join(ctx->parts[p].threadid, NULL);
+            for (i = 0; i < ctx->input_c; i++) {
+                pthread_join(ctx->parts[p].readers[i].threadid, NULL);
+            }
+        }
+        ctx->running = 0;
+    }
+
+    for (p = 0; p < ctx->partitions && ctx->parts; p++) {
+        merge_partition_t *part = &(ctx->parts[p]);
+
+        for (i = 0; i < ctx->input_c && part->readers; i++) {
+            if (part->readers[i].outsock) {
+                zmq_close(part->readers[i].outsock);
+            }
+            free(part->readers[i].sockname);
+        }
+        free(part->readers);
+        if (part->avwrt) {
+            corsaro_destroy_avro_writer(part->avwrt);
+        }
+        free(part->outname);
+    }
+    zmq_ctx_destroy(ctx->zmq_ctxt);
+
+    free(ctx->parts);
+    free(ctx->partnames);
+    free(ctx->bounds);
+    free(ctx->violations);
+
+    while (ctx->pool.freelist) {
+        batch = ctx->pool.freelist;
+        ctx->pool.freelist = batch->nextfree;
+        free(batch);
+    }
+    pthread_mutex_destroy(&(ctx->pool.mutex));
+    pthread_mutex_destroy(&(ctx->control.mutex));
+    pthread_cond_destroy(&(ctx->control.start));
+    pthread_cond_destroy(&(ctx->control.finish));
+}
+
+/** Merges a set of interim files into the given output file, using the
+ *  threads created by start_merge_threads().
+ *
+ *  Parameters: ctx         the merge context, with its threads running
+ *              sources     the names of the files to merge
+ *              count       the number of files to merge, which must be no
+ *                          more than the number of readers in the context
+ *              outputpath  the file to write the merged flowtuples to
+ *              isrun       set if the output is an intermediate run, which
+ *                          is always written as a single indexed file
+ *  Returns: 0 if the files were merged (or need repairing, see
+ *           ctx->violations), -1 if an error occurred or, without repairs,
+ *           any of the files were unsorted.
+ */
+static int merge_files(merge_context_t *ctx, char **sources, int count,
+        char *outputpath, uint8_t isrun) {
+    merge_control_t *control = &(ctx->control);
+    const char *marker = ".done";
+    int i, p;
+    int failed = 0, unsorted = 0;
+
+    if (count > ctx->input_c) {
+        corsaro_log(ctx->logger,
+                "Cannot merge %d files with only %d readers", count,
+                ctx->input_c);
+        return -1;
+    }
+
+    /* If we're splitting the merge into key ranges, take a look at the
+     * inputs first so we can choose ranges of a similar size.
+     */
+    if (ctx->partitions > 1) {
+        if (choose_partition_bounds(ctx->logger, sources, count,
+                    ctx->partitions, ctx->bounds) < 0) {
+            return -1;
+        }
+    }
+
+    for (p = 0; p < ctx->partitions; p++) {
+        merge_partition_t *part = &(ctx->parts[p]);
+
+        free(part->outname);
+        if (ctx->partitions == 1) {
+            part->outname = strdup(outputpath);
+        } else {
+            part->outname = malloc(strlen(outputpath) + 16);
+            sprintf(part->outname, "%s.%d", outputpath, p);
+        }
+        ctx->partnames[p] = part->outname;
+
+        /* Runs are read again in the next pass, so index them if that
+         * pass can make use of it */
+        if (isrun) {
+            corsaro_enable_avro_writer_index(part->avwrt,
+                    ctx->partitions > 1);
+        } else {
+            corsaro_enable_avro_writer_index(part->avwrt, ctx->writeindex);
+        }
+
+        if (corsaro_start_avro_block_writer(part->avwrt, part->outname,
+                    CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) < 0) {
+            /* Don't leave behind any ranges that we have already started */
+            while (--p >= 0) {
+                corsaro_close_avro_writer(ctx->parts[p].avwrt);
+                remove_avro_file(ctx->parts[p].outname);
+            }
+            return -1;
+        }
+        part->error = 0;
+
+        /* Readers that have no file this time still take part, but just
+         * tell the merger that they have nothing to send */
+        for (i = 0; i < ctx->input_c; i++) {
+            avromerge_reader_t *rdr = &(part->readers[i]);
+
+            rdr->source = (i < count) ? sources[i] : NULL;
+            if (p > 0) {
+                rdr->haslow = 1;
+                rdr->lowhi = ctx->bounds[p * 2];
+                rdr->lowlo = ctx->bounds[p * 2 + 1];
+            }
+            if (p < ctx->partitions - 1) {
+                rdr->hashigh = 1;
+                rdr->highhi = ctx->bounds[(p + 1) * 2];
+                rdr->highlo = ctx->bounds[(p + 1) * 2 + 1];
+            }
+        }
+    }
+
+    /* Wake up the threads and wait for every range to be merged */
+    pthread_mutex_lock(&(control->mutex));
+    control->finished = 0;
+    control->generation ++;
+    pthread_cond_broadcast(&(control->start));
+    while (control->finished < ctx->partitions) {
+        pthread_cond_wait(&(control->finish), &(control->mutex));
+    }
+    pthread_mutex_unlock(&(control->mutex));
+
+    for (i = 0; i < count; i++) {
+        ctx->violations[i] = 0;
+        for (p = 0; p < ctx->partitions; p++) {
+            ctx->violations[i] += ctx->parts[p].readers[i].violations;
+            if (ctx->parts[p].readers[i].error && !failed) {
+                corsaro_log(ctx->logger, "Unable to read all of %s",
+                        sources[i]);
+                failed = 1;
+            }
+        }
+        if (ctx->violations[i] > 0) {
+            corsaro_log(ctx->logger,
+                    "Warning: found %lu out of order flowtuples in %s",
+                    ctx->violations[i], sources[i]);
+            unsorted ++;
+        }
+    }
+
+    for (p = 0; p < ctx->partitions; p++) {
+        if (corsaro_close_avro_writer(ctx->parts[p].avwrt) < 0) {
+            failed = 1;
+        }
+        if (ctx->parts[p].error) {
+            failed = 1;
+        }
+    }
+
+    /* Don't leave an incomplete merge behind, otherwise the interval
+     * won't be merged again if we are restarted */
+    if (halted || failed) {
+        for (p = 0; p < ctx->partitions; p++) {
+            remove_avro_file(ctx->partnames[p]);
+        }
+        return -1;
+    }
+
+    /* If some of the inputs need sorting, the caller is going to merge
+     * them again, so don't let anyone pick up this output */
+    if (unsorted > 0 && ctx->repair) {
+        for (p = 0; p < ctx->partitions; p++) {
+            remove_avro_file(ctx->partnames[p]);
+        }
+        return 0;
+    }
+
+    /* Otherwise the output can't be trusted to be sorted. An intermediate
+     * run is of no use to anyone; a final output is kept for inspection
+     * but gets a .failed file instead of a .done file.
+     */
+    if (unsorted > 0) {
+        corsaro_log(ctx->logger,
+                "%d of the input files were not sorted, so %s is not correctly ordered%s (use -u to sort them first)",
+                unsorted, outputpath, (ctx->partitions > 1) ?
+                " and may be missing flowtuples" : "");
+        if (isrun) {
+            for (p = 0; p < ctx->partitions; p++) {
+                remove_avro_file(ctx->partnames[p]);
+            }
+            return -1;
+        }
+        marker = ".failed";
+        failed = 1;
+    }
+
+    /* Stitch the ranges back together into a single sorted file, unless
+     * the user asked for one file per range.
+     */
+    if (ctx->partitions > 1 && (isrun || !ctx->splitoutput)) {
+        if (corsaro_concat_avro_files(ctx->logger, outputpath,
+                    ctx->partnames, ctx->partitions) < 0) {
+            corsaro_log(ctx->logger, "Unable to combine merged ranges into %s",
+                    outputpath);
+            failed = 1;
+        } else {
+            for (p = 0; p < ctx->partitions; p++) {
+                remove_avro_file(ctx->partnames[p]);
+            }
+            touch_marker_file(ctx->logger, outputpath, marker);
+        }
+    } else {
+        for (p = 0; p < ctx->partitions; p++) {
+            touch_marker_file(ctx->logger, ctx->partnames[p], marker);
+        }
+    }
+
+    if (failed) {
+        return -1;
+    }
+    return 0;
+}
+
+static int input_size_cmp(const void *a, const void *b) {
+    const merge_input_t *ia = (const merge_input_t *)a;
+    const merge_input_t *ib = (const merge_input_t *)b;
+
+    if (ia->size < ib->size) {
+        return -1;
+    }
+    if (ia->size > ib->size) {
+        return 1;
+    }
+    return 0;
+}
+
+/** Works out the name for a temporary file used while merging into the
+ *  given output file, e.g. an intermediate run of a multi-pass merge.
+ */
+static char *temp_file_name(merge_context_t *ctx, char *outputpath,
+        const char *kind, int a, int b) {
+    char *name;
+    const char *base = outputpath;
+    size_t len;
+
+    if (ctx->tempdir) {
+        base = strrchr(outputpath, '/');
+        base = base ? base + 1 : outputpath;
+        len = strlen(ctx->tempdir) + strlen(base) + strlen(kind) + 40;
+        name = malloc(len);
+        snprintf(name, len, "%s/%s.%s-%d-%d", ctx->tempdir, base, kind, a,
+                b);
+    } else {
+        len = strlen(outputpath) + strlen(kind) + 40;
+        name = malloc(len);
+        snprintf(name, len, "%s.%s-%d-%d", outputpath, kind, a, b);
+    }
+    return name;
+}
+
+static int merge_inputs(merge_context_t *ctx, char **sources, int count,
+        char *outputpath, uint8_t isrun);
+
+static int sort_ft_cmp(const void *a, const void *b) {
+    return ft_cmp((struct merger_ft *)a, (struct merger_ft *)b);
+}
+
+/** Writes a sorted chunk of records from an unsorted input to a file */
+static int write_sorted_chunk(merge_context_t *ctx, struct merger_ft *recs,
+        uint64_t count, char *fname) {
+    corsaro_avro_writer_t *avwrt;
+    uint64_t i;
+    int ret = 0;
+
+    qsort(recs, count, sizeof(struct merger_ft), sort_ft_cmp);
+
+    avwrt = corsaro_create_avro_writer(ctx->logger, FLOWTUPLE_RESULT_SCHEMA);
+    if (avwrt == NULL) {
+        return -1;
+    }
+    if (corsaro_start_avro_block_writer(avwrt, fname,
+                CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) < 0) {
+        corsaro_destroy_avro_writer(avwrt);
+        return -1;
+    }
+    for (i = 0; i < count && !halted; i++) {
+        encode_flowtuple_as_avro(&(recs[i].ft), avwrt, ctx->logger);
+        if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
+            corsaro_log(ctx->logger, "Error while writing sorted avro record...");
+            ret = -1;
+            break;
+        }
+    }
+    if (corsaro_close_avro_writer(avwrt) < 0) {
+        ret = -1;
+    }
+    corsaro_destroy_avro_writer(avwrt);
+    if (halted) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/** Sorts an input file that has turned out to be unsorted.
+ *
+ *  Up to ctx->sortrecs records are sorted in memory at a time. If the file
+ *  holds more records than that, each sorted chunk is written to its own
+ *  file and the chunks are then merged like any other set of inputs.
+ *
+ *  Returns the name of the sorted file, which the caller must remove once
+ *  it is done with it, or NULL if an error occurred.
+ */
+static char *sort_input_file(merge_context_t *ctx, char *source,
+        char *outputpath, int inputid) {
+    corsaro_flowtuple_reader_t *ftrdr;
+    struct merger_ft *recs;
+    char *sortedname, **chunks = NULL, **tmp;
+    uint64_t used = 0, total = 0;
+    int ret = 1, chunkcount = 0, i, failed = 0;
+
+    ftrdr = corsaro_create_flowtuple_reader(ctx->logger, source);
+    if (ftrdr == NULL) {
+        return NULL;
+    }
+    recs = malloc(ctx->sortrecs * sizeof(struct merger_ft));
+    if (recs == NULL) {
+        corsaro_log(ctx->logger,
+                "Unable to allocate memory to sort %s", source);
+        corsaro_destroy_flowtuple_reader(ftrdr);
+        return NULL;
+    }
+    sortedname = temp_file_name(ctx, outputpath, "sorted", inputid, 0);
+
+    while (ret > 0 && !halted) {
+        ret = corsaro_read_next_flowtuple(ftrdr, &(recs[used].ft));
+        if (ret < 0) {
+            failed = 1;
+            break;
+        }
+        if (ret > 0) {
+            calc_merge_key(&(recs[used]));
+            used ++;
+            total ++;
+        }
+        if (used < ctx->sortrecs && ret > 0) {
+            continue;
+        }
+        if (used == 0) {
+            break;
+        }
+
+        /* If everything fits in memory, the sorted chunk is our output */
+        if (ret == 0 && chunkcount == 0) {
+            if (write_sorted_chunk(ctx, recs, used, sortedname) < 0) {
+                failed = 1;
+            }
+            used = 0;
+            break;
+        }
+
+        tmp = realloc(chunks, (chunkcount + 1) * sizeof(char *));
+        if (tmp == NULL) {
+            failed = 1;
+            break;
+        }
+        chunks = tmp;
+        chunks[chunkcount] = temp_file_name(ctx, outputpath, "sorted",
+                inputid, chunkcount + 1);
+        chunkcount ++;
+        if (write_sorted_chunk(ctx, recs, used, chunks[chunkcount - 1]) < 0) {
+            failed = 1;
+            break;
+        }
+        used = 0;
+    }
+    corsaro_destroy_flowtuple_reader(ftrdr);
+    free(recs);
+
+    if (!failed && !halted && chunkcount > 0) {
+        corsaro_log(ctx->logger,
+                "Merging %d sorted chunks of %s", chunkcount, source);
+        if (merge_inputs(ctx, chunks, chunkcount, sortedname, 1) < 0) {
+            failed = 1;
+        }
+    }
+    for (i = 0; i < chunkcount; i++) {
+        remove_avro_file(chunks[i]);
+        free(chunks[i]);
+    }
+    free(chunks);
+
+    if (failed || halted) {
+        corsaro_log(ctx->logger, "Unable to sort %s", source);
+        remove_avro_file(sortedname);
+        free(sortedname);
+        return NULL;
+    }
+    corsaro_log(ctx->logger, "Sorted %lu flowtuples from %s", total, source);
+    return sortedname;
+}
+
+/** Merges a set of files with merge_files(), then checks whether any of
+ *  them were unsorted. If so, and repairs are enabled, the unsorted files
+ *  are sorted and the merge is done again.
+ *
+ *  Returns: 0 if the files were merged, -1 if an error occurred.
+ */
+static int merge_checked_files(merge_context_t *ctx, char **sources,
+        int count, char *outputpath, uint8_t isrun) {
+    char **names, **sorted;
+    uint64_t *violations;
+    int i, unsorted = 0, ret = 0;
+
+    if (merge_files(ctx, sources, count, outputpath, isrun) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (ctx->violations[i] > 0) {
+            unsorted ++;
+        }
+    }
+    /* Without -u, merge_files() has already failed the merge */
+    if (unsorted == 0 || !ctx->repair) {
+        return 0;
+    }
+
+    /* merge_files() has already discarded the output. Sorting a large
+     * input runs merges of its own, which overwrite the context's
+     * violation counts, so take a copy of them first. */
+    corsaro_log(ctx->logger,
+            "Sorting %d unsorted input files and merging them again",
+            unsorted);
+
+    names = calloc(count, sizeof(char *));
+    sorted = calloc(count, sizeof(char *));
+    violations = calloc(count, sizeof(uint64_t));
+    if (names == NULL || sorted == NULL || violations == NULL) {
+        corsaro_log(ctx->logger,
+                "Unable to allocate memory to repair unsorted inputs");
+        ret = -1;
+        goto endrepair;
+    }
+    memcpy(violations, ctx->violations, count * sizeof(uint64_t));
+
+    for (i = 0; i < count; i++) {
+        names[i] = sources[i];
+        if (violations[i] == 0) {
+            continue;
+        }
+        sorted[i] = sort_input_file(ctx, sources[i], outputpath, i);
+        if (sorted[i] == NULL) {
+            ret = -1;
+            goto endrepair;
+        }
+        names[i] = sorted[i];
+    }
+
+    ret = merge_files(ctx, names, count, outputpath, isrun);
+
+endrepair:
+    for (i = 0; i < count && sorted; i++) {
+        if (sorted[i]) {
+            remove_avro_file(sorted[i]);
+            free(sorted[i]);
+        }
+    }
+    free(sorted);
+    free(names);
+    free(violations);
+    return ret;
+}
+
+/** Merges any number of input files into the given output file.
+ *
+ *  If there are more inputs than the context has readers, groups of inputs
+ *  are first merged into intermediate runs, until there are few enough
+ *  files left to merge into the output. Each pass merges just enough of
+ *  the smallest files to make the next pass fit, so inputs are re-read and
+ *  re-written as few times as possible. The number of threads, open files
+ *  and record batches in use therefore depends only on the number of
+ *  readers, not on the number of inputs.
+ *
+ *  Runs are removed once they have been merged into the next pass. If
+ *  'isrun' is set, the output is for our own use (e.g. a sorted copy of an
+ *  input) and is always written as a single file.
+ *
+ *  Returns: 0 if the files were merged, -1 if an error occurred.
+ */
+static int merge_inputs(merge_context_t *ctx, char **sources, int count,
+        char *outputpath, uint8_t isrun) {
+    merge_input_t *inputs, *next;
+    char **names;
+    struct stat st;
+    int fanin = ctx->input_c;
+    int i, j, groups, size, used, nextcount, merging;
+    uint8_t partial;
+    int pass = 0, ret = -1;
+
+    if (count <= fanin) {
+        return merge_checked_files(ctx, sources, count, outputpath, isrun);
+    }
+
+    if (fanin < 2) {
+        corsaro_log(ctx->logger,
+                "Need to be able to merge at least two files at once to merge %d files",
+                count);
+        return -1;
+    }
+
+    inputs = calloc(count, sizeof(merge_input_t));
+    next = calloc(count, sizeof(merge_input_t));
+    names = calloc(fanin, sizeof(char *));
+    for (i = 0; i < count; i++) {
+        inputs[i].name = sources[i];
+        if (stat(sources[i], &st) == 0) {
+            inputs[i].size = st.st_size;
+        }
+    }
+
+    while (count > fanin && !halted) {
+        pass ++;
+        qsort(inputs, count, sizeof(merge_input_t), input_size_cmp);
+
+        /* Each group of files that we merge reduces the number of files by
+         * one less than the size of the group. If we can get down to
+         * 'fanin' files with groups that use no more than the files we
+         * have, do just that and leave the larger files for the final
+         * merge. Otherwise, merge all of the files in evenly sized groups
+         * and see where that gets us.
+         */
+        groups = ((count - fanin) + (fanin - 2)) / (fanin - 1);
+        partial = (groups * fanin <= count);
+        if (partial) {
+            /* The first group takes whatever is left over */
+            size = (count - fanin) - (groups - 1) * (fanin - 1) + 1;
+            merging = size + (groups - 1) * fanin;
+        } else {
+            groups = (count + fanin - 1) / fanin;
+            size = count / groups;
+            merging = count;
+        }
+
+        corsaro_log(ctx->logger,
+                "Merge pass %d: merging %d of %d files into %d intermediate runs",
+                pass, merging, count, groups);
+
+        used = 0;
+        nextcount = 0;
+        for (j = 0; j < groups && !halted; j++) {
+            int gsize;
+
+            if (partial) {
+                gsize = (j == 0) ? size : fanin;
+            } else {
+                gsize = size + ((j < count % groups) ? 1 : 0);
+            }
+
+            for (i = 0; i < gsize; i++) {
+                names[i] = inputs[used + i].name;
+            }
+
+            next[nextcount].name = temp_file_name(ctx, outputpath, "run",
+                    pass, j);
+            next[nextcount].isrun = 1;
+            if (merge_checked_files(ctx, names, gsize, next[nextcount].name,
+                        1) < 0) {
+                free(next[nextcount].name);
+                next[nextcount].name = NULL;
+                goto endmerge;
+            }
+            if (stat(next[nextcount].name, &st) == 0) {
+                next[nextcount].size = st.st_size;
+            }
+            nextcount ++;
+
+            for (i = 0; i < gsize; i++) {
+                if (inputs[used + i].isrun) {
+                    remove_avro_file(inputs[used + i].name);
+                    free(inputs[used + i].name);
+                }
+                inputs[used + i].name = NULL;
+            }
+            used += gsize;
+        }
+
+        /* Carry the files that we didn't merge into the next pass */
+        for (i = used; i < count; i++) {
+            next[nextcount] = inputs[i];
+            inputs[i].name = NULL;
+            nextcount ++;
+        }
+        memcpy(inputs, next, nextcount * sizeof(merge_input_t));
+        memset(next, 0, count * sizeof(merge_input_t));
+        count = nextcount;
+    }
+
+    if (!halted) {
+        for (i = 0; i < count; i++) {
+            names[i] = inputs[i].name;
+        }
+        ret = merge_checked_files(ctx, names, count, outputpath, isrun);
+    }
+
+endmerge:
+    /* Tidy up any runs that are still around */
+    for (i = 0; i < count; i++) {
+        if (inputs[i].name && inputs[i].isrun) {
+            remove_avro_file(inputs[i].name);
+            free(inputs[i].name);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (next[i].name && next[i].isrun) {
+            remove_avro_file(next[i].name);
+            free(next[i].name);
+        }
+    }
+    free(inputs);
+    free(next);
+    free(names);
+    return ret;
+}
+
+/** Checks whether a file name is that of an interim file, i.e. it ends in
+ *  "--" followed by the number of the thread that wrote it.
+ *
+ *  Returns the thread number, or -1 if the name is not an interim file. If
+ *  it is, 'baselen' is set to the length of the name without the suffix.
+ */
+static int interim_file_number(const char *name, size_t *baselen) {
+    const char *sep = strrchr(name, '-');
+    const char *c;
+
+    if (sep == NULL || sep == name || *(sep - 1) != '-' || sep[1] == '\0') {
+        return -1;
+    }
+    for (c = sep + 1; *c != '\0'; c++) {
+        if (*c < '0' || *c > '9') {
+            return -1;
+        }
+    }
+    *baselen = (sep - 1) - name;
+    return (int)strtol(sep + 1, NULL, 10);
+}
+
+/** Works out where the merged output for an interval should be written */
+static void interval_output_path(watch_config_t *cfg, const char *base,
+        char *buf, size_t buflen) {
+    const char *name = strrchr(base, '/');
+
+    name = name ? name + 1 : base;
+    snprintf(buf, buflen, "%s/%s", cfg->outdir, name);
+}
+
+/** Checks whether an interval has already been dealt with, based on
+ *  whether the .done file for its output exists, or there is a .failed
+ *  file from an earlier attempt to merge it.
+ */
+static int interval_is_merged(merge_context_t *ctx, watch_config_t *cfg,
+        const char *base) {
+    char outname[1024];
+    char donename[1100];
+    struct stat st;
+
+    interval_output_path(cfg, base, outname, sizeof(outname));
+    snprintf(donename, sizeof(donename), "%s.failed", outname);
+    if (stat(donename, &st) == 0) {
+        return 1;
+    }
+    if (ctx->partitions > 1 && ctx->splitoutput) {
+        snprintf(donename, sizeof(donename), "%s.%d.done", outname,
+                ctx->partitions - 1);
+    } else {
+        snprintf(donename, sizeof(donename), "%s.done", outname);
+    }
+    return stat(donename, &st) == 0;
+}
+
+/** Checks whether an interim file has been completely written */
+static int interim_file_complete(watch_config_t *cfg, const char *fname) {
+    char donename[1100];
+    struct stat st;
+
+    if (stat(fname, &st) != 0) {
+        return 0;
+    }
+    if (cfg->renamed) {
+        return 1;
+    }
+    snprintf(donename, sizeof(donename), "%s.done", fname);
+    return stat(donename, &st) == 0;
+}
+
+/** Scans the watched directory for interim files, adding any intervals
+ *  that we haven't seen before to the pending list. Intervals are kept in
+ *  the order that we first saw them, with intervals found in the same scan
+ *  ordered by name.
+ *
+ *  Returns 0 on success, -1 if the directory could not be read.
+ */
+static int scan_watch_dir(merge_context_t *ctx, watch_config_t *cfg,
+        pending_interval_t **pending, time_t now) {
+    DIR *dir;
+    struct dirent *ent;
+    pending_interval_t *pi, **prev;
+    char base[1024];
+    size_t baselen;
+    int num;
+
+    dir = opendir(cfg->watchdir);
+    if (dir == NULL) {
+        corsaro_log(ctx->logger, "unable to read directory %s: %s",
+                cfg->watchdir, strerror(errno));
+        return -1;
+    }
+
+    for (pi = *pending; pi != NULL; pi = pi->next) {
+        pi->present = 0;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        num = interim_file_number(ent->d_name, &baselen);
+        if (num < 0 || num >= cfg->inputs) {
+            continue;
+        }
+        if (snprintf(base, sizeof(base), "%s/%.*s", cfg->watchdir,
+                    (int)baselen, ent->d_name) >= (int)sizeof(base)) {
+            continue;
+        }
+
+        for (pi = *pending; pi != NULL; pi = pi->next) {
+            if (strcmp(pi->base, base) == 0) {
+                break;
+            }
+        }
+        if (pi) {
+            pi->present = 1;
+            continue;
+        }
+
+        if (interval_is_merged(ctx, cfg, base)) {
+            continue;
+        }
+
+        pi = calloc(1, sizeof(pending_interval_t));
+        if (pi == NULL || (pi->base = strdup(base)) == NULL) {
+            corsaro_log(ctx->logger,
+                    "unable to allocate memory to track interval %s", base);
+            free(pi);
+            continue;
+        }
+        pi->firstseen = now;
+        pi->present = 1;
+
+        prev = pending;
+        while (*prev && ((*prev)->firstseen < now ||
+                    strcmp((*prev)->base, base) < 0)) {
+            prev = &((*prev)->next);
+        }
+        pi->next = *prev;
+        *prev = pi;
+    }
+    closedir(dir);
+
+    /* Forget about any intervals whose files have been taken away */
+    prev = pending;
+    while (*prev) {
+        pi = *prev;
+        if (pi->present) {
+            prev = &(pi->next);
+            continue;
+        }
+        *prev = pi->next;
+        free(pi->base);
+        free(pi);
+    }
+    return 0;
+}
+
+/** Merges a pending interval if all of its interim files are complete, or
+ *  if we have waited long enough for them.
+ *
+ *  If the merge fails (e.g. because one of the interim files is corrupt),
+ *  a .failed file is created for the interval's output so that we don't
+ *  keep trying to merge it, even if we are restarted. Removing the .failed
+ *  file will make us try again.
+ *
+ *  Returns 1 if the interval has been dealt with (merged, or failed to
+ *  merge) and 0 if it is still waiting for files.
+ */
+static int try_merge_interval(merge_context_t *ctx, watch_config_t *cfg,
+        pending_interval_t *pi, time_t now) {
+    char **sources;
+    char outname[1024];
+    int i, count = 0, ret = 0;
+
+    sources = calloc(cfg->inputs, sizeof(char *));
+    if (sources == NULL) {
+        corsaro_log(ctx->logger,
+                "unable to allocate memory to merge interval %s", pi->base);
+        return 0;
+    }
+    for (i = 0; i < cfg->inputs; i++) {
+        char *fname = malloc(strlen(pi->base) + 16);
+
+        if (fname == NULL) {
+            corsaro_log(ctx->logger,
+                    "unable to allocate memory to merge interval %s",
+                    pi->base);
+            goto endinterval;
+        }
+        sprintf(fname, "%s--%d", pi->base, i);
+        if (interim_file_complete(cfg, fname)) {
+            sources[count] = fname;
+            count ++;
+        } else {
+            free(fname);
+        }
+    }
+
+    if (count < cfg->inputs) {
+        if (count == 0 || now - pi->firstseen < cfg->timeout) {
+            goto endinterval;
+        }
+        corsaro_log(ctx->logger,
+                "Warning: only %d of %d interim files for %s arrived within %d seconds, merging those that did",
+                count, cfg->inputs, pi->base, cfg->timeout);
+    }
+
+    interval_output_path(cfg, pi->base, outname, sizeof(outname));
+    corsaro_log(ctx->logger, "Merging %d interim files into %s", count,
+            outname);
+    if (merge_inputs(ctx, sources, count, outname, 0) < 0) {
+        if (!halted) {
+            corsaro_log(ctx->logger,
+                    "Failed to merge interim files for %s, skipping it (remove %s.failed to try again)",
+                    pi->base, outname);
+            touch_marker_file(ctx->logger, outname, ".failed");
+            ret = 1;
+        }
+        goto endinterval;
+    }
+    ret = 1;
+
+    if (cfg->removeinputs && !halted) {
+        for (i = 0; i < count; i++) {
+            remove_avro_file(sources[i]);
+        }
+    }
+
+endinterval:
+    for (i = 0; i < count; i++) {
+        free(sources[i]);
+    }
+    free(sources);
+    return ret;
+}
+
+/** Runs corsaroftmerge as a daemon, merging each interval's interim files
+ *  as soon as they have all been written to the watched directory.
+ *
+ *  The directory is watched with inotify, so we notice new files as soon
+ *  as they appear. It is also rescanned every second so that intervals
+ *  which have waited too long for their files can be merged anyway; if
+ *  inotify is unavailable, we fall back to relying on that alone.
+ *
+ *  Returns 0 when the daemon is halted, -1 if an error occurs.
+ */
+static int run_daemon(merge_context_t *ctx, watch_config_t *cfg) {
+    pending_interval_t *pending = NULL, *pi, **prev;
+    struct pollfd pfd;
+    char evbuf[4096];
+    int ret = 0, merged;
+    time_t now;
+
+    pfd.fd = inotify_init1(IN_NONBLOCK);
+    pfd.events = POLLIN;
+    if (pfd.fd < 0) {
+        corsaro_log(ctx->logger,
+                "unable to create inotify instance, polling %s instead: %s",
+                cfg->watchdir, strerror(errno));
+    } else if (inotify_add_watch(pfd.fd, cfg->watchdir,
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        corsaro_log(ctx->logger,
+                "unable to watch %s with inotify, polling instead: %s",
+                cfg->watchdir, strerror(errno));
+        close(pfd.fd);
+        pfd.fd = -1;
+    }
+
+    corsaro_log(ctx->logger, "Watching %s for interim files, writing merged files to %s",
+            cfg->watchdir, cfg->outdir);
+
+    while (!halted) {
+        now = time(NULL);
+        if (scan_watch_dir(ctx, cfg, &pending, now) < 0) {
+            ret = -1;
+            break;
+        }
+
+        /* Merge whichever intervals are ready, oldest first */
+        prev = &pending;
+        while (*prev && !halted) {
+            pi = *prev;
+            merged = try_merge_interval(ctx, cfg, pi, now);
+            if (merged == 0) {
+                prev = &(pi->next);
+                continue;
+            }
+            *prev = pi->next;
+            free(pi->base);
+            free(pi);
+        }
+
+        /* Wait for something to change in the directory. A negative fd is
+         * ignored by poll(), so this also serves as our polling interval. */
+        if (poll(&pfd, 1, 1000) > 0) {
+            while (read(pfd.fd, evbuf, sizeof(evbuf)) > 0) {
+            }
+        }
+    }
+
+    while (pending) {
+        pi = pending;
+        pending = pi->next;
+        free(pi->base);
+        free(pi);
+    }
+    if (pfd.fd >= 0) {
+        close(pfd.fd);
+    }
+    return ret;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] -o <output filename> <input file 1> ... <input file N>\n"
+        "       %s [options] -w <watch directory> -n <files per interval> [-o <output directory>]\n\n",
+        prog, prog);
+    fprintf(stderr,
+        "    -l <mode>       logging mode: stderr, syslog or disabled\n"
+        "    -p <count>      merge <count> key ranges in parallel\n"
+        "    -s              write each key range to its own file\n"
+        "    -x              write a block index alongside the output\n"
+        "    -F <count>      merge at most <count> files at once, using several\n"
+        "                    passes if there are more inputs (default %d)\n"
+        "    -t <dir>        write the intermediate files of a multi-pass merge\n"
+        "                    to <dir>\n"
+        "    -u              sort any inputs that turn out to be unsorted, then\n"
+        "                    merge them again\n"
+        "    -m <MB>         memory to use when sorting an unsorted input\n"
+        "                    (default %d)\n"
+        "    -w <dir>        watch <dir> and merge each interval as it completes\n"
+        "    -n <count>      number of interim files written for each interval\n"
+        "    -T <secs>       merge an incomplete interval after <secs> seconds\n"
+        "                    (default 300)\n"
+        "    -R              interim files are complete once they appear, rather\n"
+        "                    than once their .done file is created\n"
+        "    -r              remove interim files once they have been merged\n",
+        MERGER_DEFAULT_FANIN, MERGER_DEFAULT_SORT_MEMORY);
+}
+
+int main(int argc, char *argv[]) {
+    char *outputpath = NULL;
+    struct sigaction sigact;
     corsaro_logger_t *logger;
-    void *zmq_ctxt;
-	corsaro_avro_writer_t *avwrt = NULL;
-    int outhwm = 100;
+    merge_context_t ctx;
+    watch_config_t cfg;
 	int logmode = GLOBAL_LOGMODE_STDERR;
 	char *logmodestr = NULL;
+    int partitions = 1;
+    int splitoutput = 0;
+    uint8_t writeindex = 0;
+    int inputs = 0;
+    int fanin = MERGER_DEFAULT_FANIN;
+    char *tempdir = NULL;
+    uint8_t repair = 0;
+    uint64_t sortmem = MERGER_DEFAULT_SORT_MEMORY;
+    int failed = 0;
 
     sigact.sa_handler = cleanup_signal;
     sigemptyset(&sigact.sa_mask);
@@ -480,17 +2428,32 @@ int main(int argc, char *argv[]) {
     sigaction(SIGTERM, &sigact, NULL);
     signal(SIGPIPE, SIG_IGN);
 
-    zmq_ctxt = zmq_ctx_new();
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.timeout = 300;
 
     while (1) {
         int optind;
         struct option long_options[] = {
             { "outputfile", 1, 0, 'o'},
             { "log", 1, 0, 'l'},
+            { "partitions", 1, 0, 'p'},
+            { "splitoutput", 0, 0, 's'},
+            { "index", 0, 0, 'x'},
+            { "watch", 1, 0, 'w'},
+            { "inputs", 1, 0, 'n'},
+            { "timeout", 1, 0, 'T'},
+            { "renamed", 0, 0, 'R'},
+            { "remove", 0, 0, 'r'},
+            { "fanin", 1, 0, 'F'},
+            { "tempdir", 1, 0, 't'},
+            { "repair", 0, 0, 'u'},
+            { "sortmemory", 1, 0, 'm'},
+            { "help", 0, 0, 'h'},
             { NULL, 0, 0, 0 }
         };
 
-        int c  = getopt_long(argc, argv, "o:l:", long_options, &optind);
+        int c  = getopt_long(argc, argv, "o:l:p:sxw:n:T:RrF:t:um:h", long_options,
+                &optind);
         if (c == -1) {
             break;
         }
@@ -502,6 +2465,48 @@ int main(int argc, char *argv[]) {
 			case 'l':
 				logmodestr = optarg;
 				break;
+            case 'p':
+                partitions = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                splitoutput = 1;
+                break;
+            case 'x':
+                writeindex = 1;
+                break;
+            case 'w':
+                cfg.watchdir = optarg;
+                break;
+            case 'n':
+                inputs = strtol(optarg, NULL, 0);
+                break;
+            case 'T':
+                cfg.timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'R':
+                cfg.renamed = 1;
+                break;
+            case 'r':
+                cfg.removeinputs = 1;
+                break;
+            case 'F':
+                fanin = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                tempdir = optarg;
+                break;
+            case 'u':
+                repair = 1;
+                break;
+            case 'm':
+                sortmem = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
         }
 
     }
@@ -532,88 +2537,75 @@ int main(int argc, char *argv[]) {
 		logger = NULL;
 	}
 
-    if (outputpath == NULL) {
-        corsaro_log(logger, "Must specify an output file path with -o!");
+    if (partitions < 1 || partitions > 256) {
+        corsaro_log(logger, "Number of partitions must be between 1 and 256");
         return -1;
     }
 
-    if (optind >= argc) {
-        corsaro_log(logger, "No inputs specified -- exiting");
-        return 0;
+    if (fanin < 2) {
+        corsaro_log(logger, "Fan-in must be at least 2");
+        return -1;
     }
 
-    /* Create one reader thread per input file specified on the command line */
-    input_c = argc - optind;
-    readers = calloc(input_c, sizeof(avromerge_reader_t));
-    push_sockets = calloc(input_c, sizeof(void *));
-
-    sigemptyset(&sig_block_all);
-    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
-        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
-        return 1;
+    if (sortmem < 1) {
+        corsaro_log(logger, "Sort memory must be at least 1 MB");
+        return -1;
     }
 
-    for (i = 0; i < input_c; i++) {
-        char sockname[1024];
-
-        /* Create the reader output sockets here, so we can close them
-         * once both the reader threads have ended and the merging process
-         * has finished reading from them. Helps avoid deadlocks on exit.
-         */
-        snprintf(sockname, 1024, "%s-%d", BASE_SOCKETNAME, i);
-        push_sockets[i] = zmq_socket(zmq_ctxt, ZMQ_PUSH);
-
-        if (zmq_setsockopt(push_sockets[i], ZMQ_SNDHWM, &outhwm,
-                sizeof(outhwm)) < 0) {
-            corsaro_log(logger, "Error configuring push socket %s: %s",
-                    sockname, strerror(errno));
-            return 1;
+    if (cfg.watchdir) {
+        if (optind < argc) {
+            corsaro_log(logger,
+                    "Input files cannot be given when watching a directory");
+            return -1;
         }
-
-        if (zmq_bind(push_sockets[i], sockname) < 0) {
-            corsaro_log(logger, "Unable to bind push socket %s: %s",
-                    sockname, strerror(errno));
-            return 1;
+        if (inputs < 1) {
+            corsaro_log(logger,
+                    "Must specify the number of interim files per interval with -n!");
+            return -1;
+        }
+        if (cfg.timeout < 0) {
+            corsaro_log(logger, "Timeout must not be negative");
+            return -1;
+        }
+        cfg.outdir = outputpath ? outputpath : cfg.watchdir;
+        cfg.inputs = inputs;
+    } else {
+        if (outputpath == NULL) {
+            corsaro_log(logger, "Must specify an output file path with -o!");
+            return -1;
         }
 
-        readers[i].readerid = i;
-        readers[i].sockname = strdup(sockname);
-        readers[i].source = argv[optind+i];
-        readers[i].logger = logger;
-        readers[i].outsock = push_sockets[i];
-        pthread_create(&(readers[i].threadid), NULL, start_reader, &(readers[i]));
+        if (optind >= argc) {
+            corsaro_log(logger, "No inputs specified -- exiting");
+            return 0;
+        }
+        inputs = argc - optind;
     }
 
-    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
-        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
-        return 1;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.logger = logger;
+    ctx.partitions = partitions;
+    ctx.input_c = (inputs < fanin) ? inputs : fanin;
+    ctx.tempdir = tempdir;
+    ctx.repair = repair;
+    ctx.sortrecs = (sortmem * 1024 * 1024) / sizeof(struct merger_ft);
+    ctx.splitoutput = splitoutput;
+    ctx.writeindex = writeindex;
+
+    if (start_merge_threads(&ctx) < 0) {
+        failed = 1;
+    } else if (cfg.watchdir) {
+        if (run_daemon(&ctx, &cfg) < 0) {
+            failed = 1;
+        }
+    } else if (merge_inputs(&ctx, argv + optind, inputs, outputpath,
+                0) < 0) {
+        failed = 1;
     }
 
-    /* Set up the avro writer that we're going to use for writing all
-     * of the flowtuples to a single avro file on disk.
-     * FLOWTUPLE_RESULT_SCHEMA is defined in corsaro_flowtuple.h
-     */
-	avwrt = corsaro_create_avro_writer(logger, FLOWTUPLE_RESULT_SCHEMA);
-	if (avwrt == NULL) {
-		return 1;
-	}
-
-	if (corsaro_start_avro_writer(avwrt, outputpath, 0) < 0) {
-		return 1;
-	}
-
-    run_merger(logger, avwrt, zmq_ctxt, input_c);
-
     /* All done -- tidy everything up */
-	corsaro_destroy_avro_writer(avwrt);
-    for (i = 0; i < input_c; i++) {
-        pthread_join(readers[i].threadid, NULL);
-        zmq_close(push_sockets[i]);
-    }
-    free(readers);
-    free(push_sockets);
-    zmq_ctx_destroy(zmq_ctxt);
-    return 0;
+    stop_merge_threads(&ctx);
+    return failed;
 
 }
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,1294 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+#include "libcorsaro_log.h"
+#include "libcorsaro_avro.h"
+#include "plugins/corsaro_flowtuple.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Tool that finds the flowtuples in a set of flowtuple avro files that
+ *  match some simple predicates, and writes them out as text, CSV or avro.
+ *
+ *  If a file has a block index, blocks whose key range shows that they
+ *  cannot contain any matching flowtuples are skipped without being read.
+ *  The remaining blocks (or whole files, if there is no index) are decoded
+ *  and filtered by a set of worker threads, and the matching flowtuples
+ *  are written out in file order by the main thread.
+ */
+
+/** Maximum number of values that can be given for each predicate */
+#define QUERY_MAX_VALUES 64
+
+/** Number of matching flowtuples that a worker passes to the writer in a
+ *  single chunk.
+ */
+#define QUERY_CHUNK_SIZE 4096
+
+/** Maximum number of chunks that workers can have waiting for the writer,
+ *  not counting the chunks for the job that the writer is working on.
+ */
+#define QUERY_MAX_QUEUED_CHUNKS 256
+
+enum {
+    QUERY_OUTPUT_TEXT,
+    QUERY_OUTPUT_CSV,
+    QUERY_OUTPUT_AVRO,
+};
+
+/** An IPv4 prefix, stored as the first and last addresses that it covers */
+typedef struct query_prefix {
+    uint32_t first;
+    uint32_t last;
+} query_prefix_t;
+
+/** The predicates that a flowtuple must satisfy to be included in the
+ *  output. Each list is ignored if it is empty, otherwise the flowtuple
+ *  must match at least one of the values in the list.
+ */
+typedef struct ftquery {
+    /** If set, only flowtuples from intervals starting within
+     *  [starttime, endtime) match */
+    uint8_t hastime;
+    uint32_t starttime;
+    uint32_t endtime;
+
+    uint8_t protos[QUERY_MAX_VALUES];
+    int proto_c;
+    uint16_t srcports[QUERY_MAX_VALUES];
+    int srcport_c;
+    uint16_t dstports[QUERY_MAX_VALUES];
+    int dstport_c;
+    query_prefix_t srcpfxs[QUERY_MAX_VALUES];
+    int srcpfx_c;
+    query_prefix_t dstpfxs[QUERY_MAX_VALUES];
+    int dstpfx_c;
+    uint32_t asns[QUERY_MAX_VALUES];
+    int asn_c;
+    /** Country codes, in the same form as corsaro_flowtuple_data */
+    uint16_t netacq_countries[QUERY_MAX_VALUES];
+    int netacq_country_c;
+    uint16_t maxmind_countries[QUERY_MAX_VALUES];
+    int maxmind_country_c;
+
+    /** -1 to match any value, otherwise the value that the flag must
+     *  have */
+    int spoofed;
+    int masscan;
+} ftquery_t;
+
+/** A set of matching flowtuples, passed from a worker to the writer */
+typedef struct query_chunk {
+    struct corsaro_flowtuple_data fts[QUERY_CHUNK_SIZE];
+    uint32_t count;
+    struct query_chunk *next;
+} query_chunk_t;
+
+/** A unit of work for the worker threads: either a single block from an
+ *  indexed file, or a whole file that has no index.
+ */
+typedef struct query_job {
+    /** The index of the input file to read */
+    int fileid;
+    /** The position of the block in the file's index, or -1 to read the
+     *  whole file */
+    int64_t block;
+    /** Number of flowtuples in the block */
+    uint64_t records;
+
+    /** Matching flowtuples that are waiting to be written */
+    query_chunk_t *head;
+    query_chunk_t *tail;
+    /** Set once the worker has finished with the job */
+    uint8_t done;
+    /** Set if the worker was unable to read all of the job's flowtuples */
+    uint8_t failed;
+} query_job_t;
+
+/** State that is shared between the worker threads and the writer */
+typedef struct query_state {
+    pthread_mutex_t mutex;
+    /** Signalled when a chunk is added to a job or a job is finished */
+    pthread_cond_t chunkready;
+    /** Signalled when the writer takes chunks or moves to the next job */
+    pthread_cond_t chunkspace;
+
+    ftquery_t *query;
+    char **sources;
+    corsaro_logger_t *logger;
+
+    query_job_t *jobs;
+    uint64_t job_c;
+    /** The next job to be given to a worker */
+    uint64_t nextjob;
+    /** The job that the writer is currently writing */
+    uint64_t writejob;
+    /** Number of chunks waiting for the writer */
+    uint64_t queued;
+    /** Chunks that the writer has finished with */
+    query_chunk_t *freechunks;
+
+    /** Number of flowtuples decoded and matched by all workers */
+    uint64_t decoded;
+    uint64_t matched;
+} query_state_t;
+
+volatile int halted = 0;
+
+/** Signal handler for when we get a haltable signal (SIGINT, SIGTERM)
+ */
+static void cleanup_signal(int sig) {
+    (void)sig;
+    halted = 1;
+}
+
+static int u8_in_list(uint8_t val, uint8_t *list, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (list[i] == val) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int u16_in_list(uint16_t val, uint16_t *list, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (list[i] == val) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int u32_in_list(uint32_t val, uint32_t *list, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (list[i] == val) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int addr_in_prefixes(uint32_t addr, query_prefix_t *pfxs, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (addr >= pfxs[i].first && addr <= pfxs[i].last) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/** Checks whether a flowtuple satisfies every predicate in a query */
+static int ft_matches(ftquery_t *q, struct corsaro_flowtuple_data *ft) {
+
+    if (q->hastime && (ft->interval_ts < q->starttime ||
+                ft->interval_ts >= q->endtime)) {
+        return 0;
+    }
+    if (q->proto_c > 0 && !u8_in_list(ft->protocol, q->protos, q->proto_c)) {
+        return 0;
+    }
+    if (q->srcport_c > 0 && !u16_in_list(ft->src_port, q->srcports,
+                q->srcport_c)) {
+        return 0;
+    }
+    if (q->dstport_c > 0 && !u16_in_list(ft->dst_port, q->dstports,
+                q->dstport_c)) {
+        return 0;
+    }
+    if (q->srcpfx_c > 0 && !addr_in_prefixes(ft->src_ip, q->srcpfxs,
+                q->srcpfx_c)) {
+        return 0;
+    }
+    if (q->dstpfx_c > 0 && !addr_in_prefixes(ft->dst_ip, q->dstpfxs,
+                q->dstpfx_c)) {
+        return 0;
+    }
+    if (q->asn_c > 0 && !u32_in_list(ft->prefixasn, q->asns, q->asn_c)) {
+        return 0;
+    }
+    if (q->netacq_country_c > 0 && !u16_in_list(ft->netacq_country,
+                q->netacq_countries, q->netacq_country_c)) {
+        return 0;
+    }
+    if (q->maxmind_country_c > 0 && !u16_in_list(ft->maxmind_country,
+                q->maxmind_countries, q->maxmind_country_c)) {
+        return 0;
+    }
+    if (q->spoofed >= 0 && ft->is_spoofed != q->spoofed) {
+        return 0;
+    }
+    if (q->masscan >= 0 && ft->is_masscan != q->masscan) {
+        return 0;
+    }
+    return 1;
+}
+
+/** Checks whether a block could contain flowtuples that match a query,
+ *  using the minimum and maximum sort keys for the block.
+ *
+ *  The sort key (see corsaro_flowtuple_sort_key()) is the interval, then
+ *  the protocol, TTL, TCP flags, source address, destination address and
+ *  the top byte of the source port. Every flowtuple in the block lies
+ *  within the min and max values of the first field of the key, and the
+ *  same is true of each following field for as long as the min and max
+ *  keys agree on all of the fields before it.
+ */
+static int block_may_match(ftquery_t *q, corsaro_avro_index_entry_t *e) {
+
+    uint32_t lo, hi;
+    int i;
+
+    /* Interval */
+    lo = (uint32_t)(e->minhi >> 32);
+    hi = (uint32_t)(e->maxhi >> 32);
+    if (q->hastime && (hi < q->starttime || lo >= q->endtime)) {
+        return 0;
+    }
+    if (lo != hi) {
+        return 1;
+    }
+
+    /* Protocol */
+    lo = (e->minhi >> 24) & 0xff;
+    hi = (e->maxhi >> 24) & 0xff;
+    if (q->proto_c > 0) {
+        for (i = 0; i < q->proto_c; i++) {
+            if (q->protos[i] >= lo && q->protos[i] <= hi) {
+                break;
+            }
+        }
+        if (i == q->proto_c) {
+            return 0;
+        }
+    }
+    if (lo != hi) {
+        return 1;
+    }
+
+    /* TTL and TCP flags -- we have no predicates for these, but they
+     * need to be the same for the later fields to be useful */
+    if (((e->minhi >> 8) & 0xffff) != ((e->maxhi >> 8) & 0xffff)) {
+        return 1;
+    }
+
+    /* Source address */
+    lo = (uint32_t)(((e->minhi & 0xff) << 24) | (e->minlo >> 40));
+    hi = (uint32_t)(((e->maxhi & 0xff) << 24) | (e->maxlo >> 40));
+    if (q->srcpfx_c > 0) {
+        for (i = 0; i < q->srcpfx_c; i++) {
+            if (q->srcpfxs[i].first <= hi && q->srcpfxs[i].last >= lo) {
+                break;
+            }
+        }
+        if (i == q->srcpfx_c) {
+            return 0;
+        }
+    }
+    if (lo != hi) {
+        return 1;
+    }
+
+    /* Destination address */
+    lo = (uint32_t)((e->minlo >> 8) & 0xffffffff);
+    hi = (uint32_t)((e->maxlo >> 8) & 0xffffffff);
+    if (q->dstpfx_c > 0) {
+        for (i = 0; i < q->dstpfx_c; i++) {
+            if (q->dstpfxs[i].first <= hi && q->dstpfxs[i].last >= lo) {
+                break;
+            }
+        }
+        if (i == q->dstpfx_c) {
+            return 0;
+        }
+    }
+    if (lo != hi) {
+        return 1;
+    }
+
+    /* Top byte of the source port */
+    lo = e->minlo & 0xff;
+    hi = e->maxlo & 0xff;
+    if (q->srcport_c > 0) {
+        for (i = 0; i < q->srcport_c; i++) {
+            if ((q->srcports[i] >> 8) >= lo && (q->srcports[i] >> 8) <= hi) {
+                break;
+            }
+        }
+        if (i == q->srcport_c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/** Takes an empty chunk, allocating a new one if there are no spare
+ *  chunks. Must be called with the state mutex held.
+ */
+static query_chunk_t *get_chunk(query_state_t *state) {
+    query_chunk_t *chunk = state->freechunks;
+
+    if (chunk) {
+        state->freechunks = chunk->next;
+    } else {
+        chunk = (query_chunk_t *)malloc(sizeof(query_chunk_t));
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+    chunk->count = 0;
+    chunk->next = NULL;
+    return chunk;
+}
+
+/** Hands a chunk of matching flowtuples to the writer and returns a new,
+ *  empty, chunk for the worker to fill.
+ *
+ *  Workers that get too far ahead of the writer are made to wait here, so
+ *  that a query that matches a lot of flowtuples doesn't end up holding
+ *  them all in memory. The worker for the job that the writer is waiting
+ *  on is never held up, so the writer can always make progress.
+ */
+static query_chunk_t *publish_chunk(query_state_t *state, uint64_t jobid,
+        query_chunk_t *chunk) {
+
+    query_job_t *job = &(state->jobs[jobid]);
+    query_chunk_t *next;
+
+    pthread_mutex_lock(&(state->mutex));
+    while (jobid != state->writejob && !halted &&
+            state->queued >= QUERY_MAX_QUEUED_CHUNKS) {
+        pthread_cond_wait(&(state->chunkspace), &(state->mutex));
+    }
+
+    if (job->tail) {
+        job->tail->next = chunk;
+    } else {
+        job->head = chunk;
+    }
+    job->tail = chunk;
+    state->queued ++;
+
+    next = get_chunk(state);
+    pthread_cond_broadcast(&(state->chunkready));
+    pthread_mutex_unlock(&(state->mutex));
+    return next;
+}
+
+/** Reads the flowtuples for a single job, passing any matching flowtuples
+ *  on to the writer.
+ *
+ *  @return 0 if every flowtuple for the job was read, -1 otherwise.
+ */
+static int run_query_job(query_state_t *state, uint64_t jobid,
+        corsaro_flowtuple_reader_t *ftrdr, uint64_t *decoded,
+        uint64_t *matched) {
+
+    query_job_t *job = &(state->jobs[jobid]);
+    query_chunk_t *chunk;
+    uint64_t count = 0;
+    int ret = 1;
+
+    if (job->block >= 0 && corsaro_seek_flowtuple_reader_block(ftrdr,
+                job->block) <= 0) {
+        corsaro_log(state->logger, "Unable to seek to block %ld of %s",
+                job->block, state->sources[job->fileid]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&(state->mutex));
+    chunk = get_chunk(state);
+    pthread_mutex_unlock(&(state->mutex));
+    if (chunk == NULL) {
+        corsaro_log(state->logger, "Unable to allocate query result chunk");
+        return -1;
+    }
+
+    while (!halted) {
+        if (job->block >= 0 && count == job->records) {
+            break;
+        }
+        ret = corsaro_read_next_flowtuple(ftrdr,
+                &(chunk->fts[chunk->count]));
+        if (ret <= 0) {
+            break;
+        }
+        count ++;
+
+        if (!ft_matches(state->query, &(chunk->fts[chunk->count]))) {
+            continue;
+        }
+        chunk->count ++;
+        if (chunk->count == QUERY_CHUNK_SIZE) {
+            (*matched) += chunk->count;
+            chunk = publish_chunk(state, jobid, chunk);
+            if (chunk == NULL) {
+                corsaro_log(state->logger,
+                        "Unable to allocate query result chunk");
+                ret = -1;
+                break;
+            }
+        }
+    }
+    (*decoded) += count;
+
+    if (chunk && chunk->count > 0) {
+        (*matched) += chunk->count;
+        chunk = publish_chunk(state, jobid, chunk);
+    }
+    if (chunk) {
+        pthread_mutex_lock(&(state->mutex));
+        chunk->next = state->freechunks;
+        state->freechunks = chunk;
+        pthread_mutex_unlock(&(state->mutex));
+    }
+
+    if (ret < 0) {
+        return -1;
+    }
+    if (job->block >= 0 && count < job->records && !halted) {
+        corsaro_log(state->logger, "Block %ld of %s ended early",
+                job->block, state->sources[job->fileid]);
+        return -1;
+    }
+    return 0;
+}
+
+/** Function that operates a worker thread, which takes jobs in order and
+ *  decodes and filters the flowtuples for each one.
+ */
+static void *start_worker(void *arg) {
+    query_state_t *state = (query_state_t *)arg;
+    corsaro_flowtuple_reader_t *ftrdr = NULL;
+    int openfile = -1;
+    uint64_t jobid, decoded = 0, matched = 0;
+    query_job_t *job;
+    int ret;
+
+    while (!halted) {
+        pthread_mutex_lock(&(state->mutex));
+        jobid = state->nextjob;
+        if (jobid < state->job_c) {
+            state->nextjob ++;
+        }
+        pthread_mutex_unlock(&(state->mutex));
+
+        if (jobid >= state->job_c) {
+            break;
+        }
+        job = &(state->jobs[jobid]);
+
+        /* Jobs are in file order, so we can usually keep using the
+         * reader from the previous job */
+        if (job->fileid != openfile) {
+            corsaro_destroy_flowtuple_reader(ftrdr);
+            ftrdr = corsaro_create_flowtuple_reader(state->logger,
+                    state->sources[job->fileid]);
+            openfile = job->fileid;
+        }
+
+        if (ftrdr == NULL) {
+            ret = -1;
+        } else {
+            ret = run_query_job(state, jobid, ftrdr, &decoded, &matched);
+        }
+
+        pthread_mutex_lock(&(state->mutex));
+        job->done = 1;
+        if (ret < 0) {
+            job->failed = 1;
+        }
+        pthread_cond_broadcast(&(state->chunkready));
+        pthread_mutex_unlock(&(state->mutex));
+    }
+
+    corsaro_destroy_flowtuple_reader(ftrdr);
+
+    pthread_mutex_lock(&(state->mutex));
+    state->decoded += decoded;
+    state->matched += matched;
+    /* Make sure the writer isn't left waiting on a job that we never got
+     * around to because we were halted */
+    pthread_cond_broadcast(&(state->chunkready));
+    pthread_mutex_unlock(&(state->mutex));
+    pthread_exit(NULL);
+}
+
+/* Appends the decimal form of an unsigned integer to a buffer */
+static inline char *put_uint(char *ptr, uint32_t val) {
+    char tmp[10];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + (val % 10);
+        val /= 10;
+    } while (val > 0);
+
+    while (n > 0) {
+        *ptr++ = tmp[--n];
+    }
+    return ptr;
+}
+
+/* Appends an IPv4 address, in dotted quad form, to a buffer */
+static inline char *put_ipv4(char *ptr, uint32_t addr) {
+    ptr = put_uint(ptr, (addr >> 24) & 0xff);
+    *ptr++ = '.';
+    ptr = put_uint(ptr, (addr >> 16) & 0xff);
+    *ptr++ = '.';
+    ptr = put_uint(ptr, (addr >> 8) & 0xff);
+    *ptr++ = '.';
+    return put_uint(ptr, addr & 0xff);
+}
+
+/* Appends a two character country / continent code to a buffer */
+static inline char *put_geo(char *ptr, uint16_t code) {
+    if (code & 0xff) {
+        *ptr++ = (char)(code & 0xff);
+    }
+    if (code >> 8) {
+        *ptr++ = (char)(code >> 8);
+    }
+    return ptr;
+}
+
+/** Writes a flowtuple as a line of text, with the fields in the same order
+ *  as FLOWTUPLE_RESULT_SCHEMA, separated by 'sep'.
+ *
+ *  This is where most of the time goes when a query matches a lot of
+ *  flowtuples, so we format the line ourselves rather than use fprintf.
+ */
+static void write_ft_text(FILE *out, struct corsaro_flowtuple_data *ft,
+        char sep) {
+
+    static const char hex[] = "0123456789abcdef";
+    char line[256];
+    char *ptr = line;
+
+    ptr = put_uint(ptr, ft->interval_ts);
+    *ptr++ = sep;
+    ptr = put_ipv4(ptr, ft->src_ip);
+    *ptr++ = sep;
+    ptr = put_ipv4(ptr, ft->dst_ip);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->src_port);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->dst_port);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->protocol);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->ttl);
+    *ptr++ = sep;
+    *ptr++ = '0';
+    *ptr++ = 'x';
+    *ptr++ = hex[ft->tcp_flags >> 4];
+    *ptr++ = hex[ft->tcp_flags & 0x0f];
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->ip_len);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->tcp_synlen);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->tcp_synwinlen);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->packet_cnt);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->is_spoofed);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->is_masscan);
+    *ptr++ = sep;
+    ptr = put_geo(ptr, ft->maxmind_continent);
+    *ptr++ = sep;
+    ptr = put_geo(ptr, ft->maxmind_country);
+    *ptr++ = sep;
+    ptr = put_geo(ptr, ft->netacq_continent);
+    *ptr++ = sep;
+    ptr = put_geo(ptr, ft->netacq_country);
+    *ptr++ = sep;
+    ptr = put_uint(ptr, ft->prefixasn);
+    *ptr++ = '\n';
+
+    fwrite(line, 1, ptr - line, out);
+}
+
+/** Writes the matching flowtuples for every job to the output, in job
+ *  order.
+ *
+ *  @return 0 if every job completed successfully, -1 otherwise.
+ */
+static int write_results(query_state_t *state, int format, FILE *out,
+        corsaro_avro_writer_t *avwrt) {
+
+    query_chunk_t *chunks, *c, *last;
+    query_job_t *job;
+    uint64_t w, n;
+    uint32_t i;
+    int failed = 0;
+
+    for (w = 0; w < state->job_c && !halted; w++) {
+        job = &(state->jobs[w]);
+
+        pthread_mutex_lock(&(state->mutex));
+        state->writejob = w;
+        pthread_cond_broadcast(&(state->chunkspace));
+        pthread_mutex_unlock(&(state->mutex));
+
+        while (!halted) {
+            pthread_mutex_lock(&(state->mutex));
+            while (job->head == NULL && !job->done && !halted) {
+                pthread_cond_wait(&(state->chunkready), &(state->mutex));
+            }
+            chunks = job->head;
+            job->head = job->tail = NULL;
+            n = 0;
+            for (c = chunks; c; c = c->next) {
+                n ++;
+            }
+            state->queued -= n;
+            if (n > 0) {
+                pthread_cond_broadcast(&(state->chunkspace));
+            }
+            pthread_mutex_unlock(&(state->mutex));
+
+            if (chunks == NULL) {
+                /* No chunks left, and the job is finished */
+                break;
+            }
+
+            last = NULL;
+            for (c = chunks; c; c = c->next) {
+                for (i = 0; i < c->count; i++) {
+                    if (format == QUERY_OUTPUT_AVRO) {
+                        encode_flowtuple_as_avro(&(c->fts[i]), avwrt,
+                                state->logger);
+                        if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
+                            corsaro_log(state->logger,
+                                    "Error while writing avro record...");
+                        }
+                    } else {
+                        write_ft_text(out, &(c->fts[i]),
+                                format == QUERY_OUTPUT_CSV ? ',' : '|');
+                    }
+                }
+                last = c;
+            }
+
+            pthread_mutex_lock(&(state->mutex));
+            last->next = state->freechunks;
+            state->freechunks = chunks;
+            pthread_mutex_unlock(&(state->mutex));
+        }
+
+        if (job->failed) {
+            failed = 1;
+        }
+    }
+
+    /* Wake up any worker that is still waiting for space */
+    pthread_mutex_lock(&(state->mutex));
+    pthread_cond_broadcast(&(state->chunkspace));
+    pthread_mutex_unlock(&(state->mutex));
+
+    if (halted) {
+        return -1;
+    }
+    return failed ? -1 : 0;
+}
+
+/** Adds the jobs for an input file to the job list, skipping any blocks
+ *  that the file's index shows cannot contain matching flowtuples.
+ *
+ *  @return 0 on success, -1 if an error occurs.
+ */
+static int add_file_jobs(query_state_t *state, int fileid,
+        uint64_t *jobsalloc, uint64_t *blocks, uint64_t *skipped) {
+
+    corsaro_flowtuple_reader_t *ftrdr;
+    corsaro_avro_index_t *idx;
+    query_job_t *job;
+    uint64_t i, needed;
+
+    ftrdr = corsaro_create_flowtuple_reader(state->logger,
+            state->sources[fileid]);
+    if (ftrdr == NULL) {
+        return -1;
+    }
+
+    idx = corsaro_get_flowtuple_reader_index(ftrdr);
+    needed = state->job_c + (idx ? idx->count : 1);
+    if (needed > *jobsalloc) {
+        query_job_t *tmp;
+        uint64_t newalloc = *jobsalloc ? *jobsalloc * 2 : 1024;
+
+        while (newalloc < needed) {
+            newalloc *= 2;
+        }
+        tmp = (query_job_t *)realloc(state->jobs,
+                newalloc * sizeof(query_job_t));
+        if (tmp == NULL) {
+            corsaro_log(state->logger,
+                    "Unable to allocate memory for query jobs");
+            corsaro_destroy_flowtuple_reader(ftrdr);
+            return -1;
+        }
+        state->jobs = tmp;
+        *jobsalloc = newalloc;
+    }
+
+    if (idx == NULL) {
+        corsaro_log(state->logger,
+                "%s has no block index, every flowtuple will be read",
+                state->sources[fileid]);
+        job = &(state->jobs[state->job_c]);
+        memset(job, 0, sizeof(query_job_t));
+        job->fileid = fileid;
+        job->block = -1;
+        state->job_c ++;
+        corsaro_destroy_flowtuple_reader(ftrdr);
+        return 0;
+    }
+
+    for (i = 0; i < idx->count; i++) {
+        (*blocks) ++;
+        if (!block_may_match(state->query, &(idx->entries[i]))) {
+            (*skipped) ++;
+            continue;
+        }
+        job = &(state->jobs[state->job_c]);
+        memset(job, 0, sizeof(query_job_t));
+        job->fileid = fileid;
+        job->block = (int64_t)i;
+        job->records = idx->entries[i].records;
+        state->job_c ++;
+    }
+
+    corsaro_destroy_flowtuple_reader(ftrdr);
+    return 0;
+}
+
+/** Parses an IPv4 prefix, e.g. "192.168.0.0/16". A plain address is
+ *  treated as a /32.
+ */
+static int parse_prefix(char *str, query_prefix_t *pfx) {
+
+    char addrstr[INET_ADDRSTRLEN];
+    char *slash = strchr(str, '/');
+    struct in_addr addr;
+    unsigned long len = 32;
+    uint32_t mask;
+    size_t addrlen;
+
+    addrlen = slash ? (size_t)(slash - str) : strlen(str);
+    if (addrlen >= sizeof(addrstr)) {
+        return -1;
+    }
+    memcpy(addrstr, str, addrlen);
+    addrstr[addrlen] = '\0';
+
+    if (inet_pton(AF_INET, addrstr, &addr) != 1) {
+        return -1;
+    }
+    if (slash) {
+        char *end;
+        len = strtoul(slash + 1, &end, 10);
+        if (*end != '\0' || end == slash + 1 || len > 32) {
+            return -1;
+        }
+    }
+
+    mask = (len == 0) ? 0 : (0xffffffff << (32 - len));
+    pfx->first = ntohl(addr.s_addr) & mask;
+    pfx->last = pfx->first | ~mask;
+    return 0;
+}
+
+/** Parses a comma-separated list of predicate values, appending them to
+ *  'list'. Each value is parsed according to 'kind'.
+ */
+static int parse_value_list(corsaro_logger_t *logger, const char *optname,
+        char *str, char kind, void *list, int *count) {
+
+    char *tok, *saveptr = NULL, *end;
+    unsigned long val;
+
+    for (tok = strtok_r(str, ",", &saveptr); tok != NULL;
+            tok = strtok_r(NULL, ",", &saveptr)) {
+
+        if (*count >= QUERY_MAX_VALUES) {
+            corsaro_log(logger, "Too many values for %s (max %d)", optname,
+                    QUERY_MAX_VALUES);
+            return -1;
+        }
+
+        switch(kind) {
+            case 'p':
+                if (parse_prefix(tok,
+                            &(((query_prefix_t *)list)[*count])) < 0) {
+                    corsaro_log(logger, "Invalid prefix for %s: %s",
+                            optname, tok);
+                    return -1;
+                }
+                break;
+            case 'c':
+                if (strlen(tok) != 2) {
+                    corsaro_log(logger,
+                            "Invalid country code for %s: %s (must be two characters)",
+                            optname, tok);
+                    return -1;
+                }
+                ((uint16_t *)list)[*count] = ((uint8_t)tok[0]) |
+                        (((uint16_t)(uint8_t)tok[1]) << 8);
+                break;
+            default:
+                errno = 0;
+                val = strtoul(tok, &end, 0);
+                if (errno != 0 || *end != '\0' || end == tok ||
+                        (kind == '8' && val > 0xff) ||
+                        (kind == 'h' && val > 0xffff) ||
+                        (kind == 'w' && val > 0xffffffff)) {
+                    corsaro_log(logger, "Invalid value for %s: %s", optname,
+                            tok);
+                    return -1;
+                }
+                if (kind == '8') {
+                    ((uint8_t *)list)[*count] = (uint8_t)val;
+                } else if (kind == 'h') {
+                    ((uint16_t *)list)[*count] = (uint16_t)val;
+                } else {
+                    ((uint32_t *)list)[*count] = (uint32_t)val;
+                }
+                break;
+        }
+        (*count) ++;
+    }
+    return 0;
+}
+
+static int parse_flag(char *str) {
+    if (strcmp(str, "yes") == 0 || strcmp(str, "1") == 0) {
+        return 1;
+    }
+    if (strcmp(str, "no") == 0 || strcmp(str, "0") == 0) {
+        return 0;
+    }
+    return -2;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr,
+"Usage: %s [options] <input file 1> ... <input file N>\n\n"
+"Predicates:\n"
+"  -b, --start <ts>           only intervals starting at or after <ts>\n"
+"  -e, --end <ts>             only intervals starting before <ts>\n"
+"  -P, --protocol <list>      IP protocol numbers\n"
+"  -s, --srcport <list>       source ports (or ICMP types)\n"
+"  -d, --dstport <list>       destination ports (or ICMP codes)\n"
+"  -S, --srcip <list>         source IPv4 prefixes, e.g. 10.0.0.0/8\n"
+"  -D, --dstip <list>         destination IPv4 prefixes\n"
+"  -a, --asn <list>           source ASNs (pfx2as)\n"
+"  -c, --country <list>       source country codes (netacq-edge)\n"
+"  -m, --mmcountry <list>     source country codes (maxmind)\n"
+"      --spoofed <yes|no>     whether the source was probably spoofed\n"
+"      --masscan <yes|no>     whether the flow looked like masscan\n\n"
+"Output:\n"
+"  -f, --format <fmt>         'text' (default), 'csv' or 'avro'\n"
+"  -o, --outputfile <file>    write output to <file> instead of stdout\n"
+"  -t, --threads <count>      number of worker threads (default 4)\n"
+"  -l, --log <mode>           'stderr' (default), 'syslog' or 'disabled'\n\n"
+"Lists are comma-separated and options may be repeated. A flowtuple must\n"
+"match one of the values given for every option that is used.\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    char *outputpath = NULL;
+    char *formatstr = NULL;
+    int logmode = GLOBAL_LOGMODE_STDERR;
+    char *logmodestr = NULL;
+    struct sigaction sigact;
+    sigset_t sig_before, sig_block_all;
+    corsaro_logger_t *logger;
+    corsaro_avro_writer_t *avwrt = NULL;
+    FILE *out = stdout;
+    pthread_t *workers;
+    query_chunk_t *chunk;
+    query_state_t state;
+    ftquery_t query;
+    int format = QUERY_OUTPUT_TEXT;
+    int threads = 4;
+    int input_c, i, ret;
+    int failed = 0;
+    uint64_t jobsalloc = 0, blocks = 0, skipped = 0;
+    unsigned long ts;
+    char *end;
+    struct timespec starttime, endtime;
+    double elapsed;
+
+    sigact.sa_handler = cleanup_signal;
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = SA_RESTART;
+
+    sigaction(SIGINT, &sigact, NULL);
+    sigaction(SIGTERM, &sigact, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&query, 0, sizeof(query));
+    query.spoofed = -1;
+    query.masscan = -1;
+
+    /* Log to stderr while we parse the options, so that any problems with
+     * the predicates get reported somewhere useful */
+    logger = init_corsaro_logger("corsaroftquery", "");
+
+    while (1) {
+        int optind;
+        struct option long_options[] = {
+            { "outputfile", 1, 0, 'o'},
+            { "log", 1, 0, 'l'},
+            { "format", 1, 0, 'f'},
+            { "threads", 1, 0, 't'},
+            { "start", 1, 0, 'b'},
+            { "end", 1, 0, 'e'},
+            { "protocol", 1, 0, 'P'},
+            { "srcport", 1, 0, 's'},
+            { "dstport", 1, 0, 'd'},
+            { "srcip", 1, 0, 'S'},
+            { "dstip", 1, 0, 'D'},
+            { "asn", 1, 0, 'a'},
+            { "country", 1, 0, 'c'},
+            { "mmcountry", 1, 0, 'm'},
+            { "spoofed", 1, 0, 1},
+            { "masscan", 1, 0, 2},
+            { "help", 0, 0, 'h'},
+            { NULL, 0, 0, 0 }
+        };
+
+        int c  = getopt_long(argc, argv, "o:l:f:t:b:e:P:s:d:S:D:a:c:m:h",
+                long_options, &optind);
+        if (c == -1) {
+            break;
+        }
+
+        ret = 0;
+        switch(c) {
+            case 'o':
+                outputpath = optarg;
+                break;
+            case 'l':
+                logmodestr = optarg;
+                break;
+            case 'f':
+                formatstr = optarg;
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 'b':
+            case 'e':
+                errno = 0;
+                ts = strtoul(optarg, &end, 0);
+                if (errno != 0 || *end != '\0' || ts > 0xffffffff) {
+                    corsaro_log(logger, "Invalid timestamp: %s", optarg);
+                    return 1;
+                }
+                if (!query.hastime) {
+                    query.hastime = 1;
+                    query.starttime = 0;
+                    query.endtime = 0xffffffff;
+                }
+                if (c == 'b') {
+                    query.starttime = ts;
+                } else {
+                    query.endtime = ts;
+                }
+                break;
+            case 'P':
+                ret = parse_value_list(logger, "--protocol", optarg, '8',
+                        query.protos, &(query.proto_c));
+                break;
+            case 's':
+                ret = parse_value_list(logger, "--srcport", optarg, 'h',
+                        query.srcports, &(query.srcport_c));
+                break;
+            case 'd':
+                ret = parse_value_list(logger, "--dstport", optarg, 'h',
+                        query.dstports, &(query.dstport_c));
+                break;
+            case 'S':
+                ret = parse_value_list(logger, "--srcip", optarg, 'p',
+                        query.srcpfxs, &(query.srcpfx_c));
+                break;
+            case 'D':
+                ret = parse_value_list(logger, "--dstip", optarg, 'p',
+                        query.dstpfxs, &(query.dstpfx_c));
+                break;
+            case 'a':
+                ret = parse_value_list(logger, "--asn", optarg, 'w',
+                        query.asns, &(query.asn_c));
+                break;
+            case 'c':
+                ret = parse_value_list(logger, "--country", optarg, 'c',
+                        query.netacq_countries, &(query.netacq_country_c));
+                break;
+            case 'm':
+                ret = parse_value_list(logger, "--mmcountry", optarg, 'c',
+                        query.maxmind_countries,
+                        &(query.maxmind_country_c));
+                break;
+            case 1:
+                query.spoofed = parse_flag(optarg);
+                if (query.spoofed < -1) {
+                    corsaro_log(logger, "--spoofed must be 'yes' or 'no'");
+                    return 1;
+                }
+                break;
+            case 2:
+                query.masscan = parse_flag(optarg);
+                if (query.masscan < -1) {
+                    corsaro_log(logger, "--masscan must be 'yes' or 'no'");
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+        if (ret < 0) {
+            return 1;
+        }
+    }
+
+    /* Configure our logging */
+    if (logmodestr != NULL) {
+        if (strcmp(logmodestr, "stderr") == 0 ||
+                    strcmp(logmodestr, "terminal") == 0) {
+            logmode = GLOBAL_LOGMODE_STDERR;
+        } else if (strcmp(logmodestr, "syslog") == 0) {
+            logmode = GLOBAL_LOGMODE_SYSLOG;
+        } else if (strcmp(logmodestr, "disabled") == 0 ||
+                strcmp(logmodestr, "off") == 0 ||
+                strcmp(logmodestr, "none") == 0) {
+            logmode = GLOBAL_LOGMODE_DISABLED;
+        } else {
+            fprintf(stderr, "corsaroftquery: unexpected logmode: %s\n",
+                    logmodestr);
+            return 1;
+        }
+    }
+
+    if (logmode != GLOBAL_LOGMODE_STDERR) {
+        destroy_corsaro_logger(logger);
+        if (logmode == GLOBAL_LOGMODE_SYSLOG) {
+            logger = init_corsaro_logger("corsaroftquery", NULL);
+        } else {
+            logger = NULL;
+        }
+    }
+
+    if (formatstr != NULL) {
+        if (strcmp(formatstr, "text") == 0) {
+            format = QUERY_OUTPUT_TEXT;
+        } else if (strcmp(formatstr, "csv") == 0) {
+            format = QUERY_OUTPUT_CSV;
+        } else if (strcmp(formatstr, "avro") == 0) {
+            format = QUERY_OUTPUT_AVRO;
+        } else {
+            corsaro_log(logger, "Unknown output format: %s", formatstr);
+            return 1;
+        }
+    }
+
+    if (format == QUERY_OUTPUT_AVRO && outputpath == NULL) {
+        corsaro_log(logger,
+                "Must specify an output file path with -o for avro output!");
+        return 1;
+    }
+
+    if (threads < 1 || threads > 256) {
+        corsaro_log(logger, "Number of threads must be between 1 and 256");
+        return 1;
+    }
+
+    if (query.hastime && query.endtime <= query.starttime) {
+        corsaro_log(logger, "End time must be after the start time");
+        return 1;
+    }
+
+    if (optind >= argc) {
+        corsaro_log(logger, "No inputs specified -- exiting");
+        return 0;
+    }
+    input_c = argc - optind;
+
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&(state.mutex), NULL);
+    pthread_cond_init(&(state.chunkready), NULL);
+    pthread_cond_init(&(state.chunkspace), NULL);
+    state.query = &query;
+    state.sources = argv + optind;
+    state.logger = logger;
+
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    /* Work out which parts of each file we need to look at */
+    for (i = 0; i < input_c; i++) {
+        if (add_file_jobs(&state, i, &jobsalloc, &blocks, &skipped) < 0) {
+            return 1;
+        }
+    }
+    if (blocks > 0) {
+        corsaro_log(logger,
+                "Skipped %lu of %lu indexed blocks that cannot match the query",
+                skipped, blocks);
+    }
+
+    if (format == QUERY_OUTPUT_AVRO) {
+        avwrt = corsaro_create_avro_writer(logger, FLOWTUPLE_RESULT_SCHEMA);
+        if (avwrt == NULL) {
+            return 1;
+        }
+        if (corsaro_start_avro_block_writer(avwrt, outputpath,
+                    CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) < 0) {
+            return 1;
+        }
+    } else {
+        if (outputpath) {
+            out = fopen(outputpath, "w");
+            if (out == NULL) {
+                corsaro_log(logger, "Unable to open output file %s: %s",
+                        outputpath, strerror(errno));
+                return 1;
+            }
+        }
+        setvbuf(out, NULL, _IOFBF, 1024 * 1024);
+        if (format == QUERY_OUTPUT_CSV) {
+            fprintf(out, "time,src_ip,dst_ip,src_port,dst_port,protocol,ttl,tcp_flags,ip_len,tcp_synlen,tcp_synwinlen,packet_cnt,is_spoofed,is_masscan,maxmind_continent,maxmind_country,netacq_continent,netacq_country,prefix2asn\n");
+        }
+    }
+
+    sigemptyset(&sig_block_all);
+    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
+        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
+        return 1;
+    }
+
+    workers = calloc(threads, sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+        pthread_create(&(workers[i]), NULL, start_worker, &state);
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
+        corsaro_log(logger, "Error in pthread_sigmask?: %s", strerror(errno));
+        return 1;
+    }
+
+    if (write_results(&state, format, out, avwrt) < 0) {
+        failed = 1;
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    if (avwrt) {
+        corsaro_destroy_avro_writer(avwrt);
+    } else if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(out);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &endtime);
+    elapsed = (endtime.tv_sec - starttime.tv_sec) +
+            (endtime.tv_nsec - starttime.tv_nsec) / 1000000000.0;
+    corsaro_log(logger,
+            "Decoded %lu flowtuples, %lu matched, in %.2f seconds (%.0f flowtuples/sec)",
+            state.decoded, state.matched, elapsed,
+            elapsed > 0 ? state.decoded / elapsed : 0.0);
+
+    /* Any chunks left in unfinished jobs belong on the free list too */
+    for (i = 0; i < state.job_c; i++) {
+        if (state.jobs[i].tail) {
+            state.jobs[i].tail->next = state.freechunks;
+            state.freechunks = state.jobs[i].head;
+        }
+    }
+    while (state.freechunks) {
+        chunk = state.freechunks;
+        state.freechunks = chunk->next;
+        free(chunk);
+    }
+    free(state.jobs);
+    pthread_cond_destroy(&(state.chunkready));
+    pthread_cond_destroy(&(state.chunkspace));
+    pthread_mutex_destroy(&(state.mutex));
+
+    if (logger) {
+        destroy_corsaro_logger(logger);
+    }
+    return failed;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
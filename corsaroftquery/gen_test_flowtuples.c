@@ -0,0 +1,219 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+#include "libcorsaro_log.h"
+#include "libcorsaro_avro.h"
+#include "libcorsaro_flowtuple.h"
+
+#include <libipmeta.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Writes a synthetic, sorted flowtuple avro file with a block index, for
+ *  checking that queries which skip blocks using the index find the same
+ *  flowtuples as a query that reads the whole file.
+ *
+ *  The output depends only on the seed, so every run of the check uses
+ *  the same data.
+ */
+
+#define TEST_FIRST_INTERVAL 1600000000
+#define TEST_INTERVAL_LENGTH 300
+#define TEST_INTERVALS 12
+#define TEST_FLOWS_PER_INTERVAL 20000
+
+struct test_ft {
+    uint64_t keyhi;
+    uint64_t keylo;
+    struct corsaro_flowtuple_data ft;
+};
+
+static uint64_t rngstate;
+
+static inline uint32_t next_random(void) {
+    /* xorshift64*, so that the data doesn't depend on the libc */
+    rngstate ^= rngstate >> 12;
+    rngstate ^= rngstate << 25;
+    rngstate ^= rngstate >> 27;
+    return (uint32_t)((rngstate * 2685821657736338717ULL) >> 32);
+}
+
+static inline uint16_t geo_code(const char *code) {
+    return (uint16_t)code[0] | ((uint16_t)code[1] << 8);
+}
+
+static int test_ft_cmp(const void *a, const void *b) {
+    const struct test_ft *fa = (const struct test_ft *)a;
+    const struct test_ft *fb = (const struct test_ft *)b;
+
+    if (fa->keyhi != fb->keyhi) {
+        return (fa->keyhi < fb->keyhi) ? -1 : 1;
+    }
+    if (fa->keylo != fb->keylo) {
+        return (fa->keylo < fb->keylo) ? -1 : 1;
+    }
+    return 0;
+}
+
+static void make_flowtuple(struct corsaro_flowtuple_data *ft,
+        uint32_t interval) {
+
+    static const char *countries[] = {"US", "CN", "RU", "BR", "DE", "NL",
+            "IN", "KR"};
+    static const uint16_t dstports[] = {445, 23, 80, 22, 3389};
+    static const uint8_t ttls[] = {64, 128, 255};
+    uint32_t r;
+
+    memset(ft, 0, sizeof(struct corsaro_flowtuple_data));
+    ft->interval_ts = interval;
+
+    r = next_random() % 20;
+    if (r < 12) {
+        ft->protocol = 6;
+        ft->tcp_flags = 2;
+        ft->tcp_synlen = 20 + (next_random() % 5) * 4;
+        ft->tcp_synwinlen = next_random() & 0xffff;
+    } else if (r < 17) {
+        ft->protocol = 17;
+    } else {
+        ft->protocol = 1;
+    }
+
+    r = next_random() % 4;
+    ft->ttl = (r < 3) ? ttls[r] : (next_random() & 0xff);
+
+    /* Some sources come from a single /24, so that prefix queries have
+     * something to find */
+    if (next_random() % 10 == 0) {
+        ft->src_ip = 0xc0000200 | (next_random() & 0xff);
+    } else {
+        ft->src_ip = next_random();
+    }
+    ft->dst_ip = 0x2c000000 | (next_random() & 0xffffff);
+
+    ft->src_port = next_random() & 0xffff;
+    r = next_random() % 6;
+    ft->dst_port = (r < 5) ? dstports[r] : (next_random() & 0xffff);
+
+    ft->ip_len = 40 + (next_random() % 100);
+    ft->packet_cnt = 1 + (next_random() % 5);
+    ft->is_spoofed = next_random() & 1;
+    ft->is_masscan = (next_random() % 10 == 0);
+    ft->maxmind_continent = geo_code("NA");
+    ft->maxmind_country = geo_code(countries[next_random() % 8]);
+    ft->netacq_continent = geo_code("NA");
+    ft->netacq_country = geo_code(countries[next_random() % 8]);
+    ft->prefixasn = 64512 + (next_random() % 16);
+    ft->tagproviders = (1 << IPMETA_PROVIDER_MAXMIND) |
+            (1 << IPMETA_PROVIDER_NETACQ_EDGE) |
+            (1 << IPMETA_PROVIDER_PFX2AS);
+}
+
+int main(int argc, char *argv[]) {
+    corsaro_logger_t *logger;
+    corsaro_avro_writer_t *avwrt;
+    struct test_ft *fts;
+    uint64_t count = TEST_INTERVALS * TEST_FLOWS_PER_INTERVAL, i;
+    int ret = 0;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output file> <seed>\n", argv[0]);
+        return 1;
+    }
+
+    rngstate = strtoull(argv[2], NULL, 10) * 0x9e3779b97f4a7c15ULL + 1;
+    logger = init_corsaro_logger("gen_test_flowtuples", "");
+
+    fts = calloc(count, sizeof(struct test_ft));
+    if (fts == NULL) {
+        corsaro_log(logger, "Unable to allocate memory for test flowtuples");
+        destroy_corsaro_logger(logger);
+        return 1;
+    }
+    for (i = 0; i < count; i++) {
+        make_flowtuple(&(fts[i].ft), TEST_FIRST_INTERVAL +
+                (i / TEST_FLOWS_PER_INTERVAL) * TEST_INTERVAL_LENGTH);
+        corsaro_flowtuple_sort_key(&(fts[i].ft), &(fts[i].keyhi),
+                &(fts[i].keylo));
+    }
+    qsort(fts, count, sizeof(struct test_ft), test_ft_cmp);
+
+    avwrt = corsaro_create_avro_writer(logger, FLOWTUPLE_RESULT_SCHEMA);
+    if (avwrt == NULL) {
+        free(fts);
+        destroy_corsaro_logger(logger);
+        return 1;
+    }
+    corsaro_enable_avro_writer_index(avwrt, 1);
+    corsaro_set_avro_writer_done_file(avwrt, 0);
+    if (corsaro_start_avro_block_writer(avwrt, argv[1],
+                CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) < 0) {
+        ret = 1;
+        goto endgen;
+    }
+    for (i = 0; i < count; i++) {
+        encode_flowtuple_as_avro(&(fts[i].ft), avwrt, logger);
+        if (corsaro_append_avro_writer(avwrt, NULL) < 0) {
+            corsaro_log(logger, "Error while writing test flowtuples");
+            ret = 1;
+            break;
+        }
+    }
+    if (corsaro_close_avro_writer(avwrt) < 0) {
+        ret = 1;
+    }
+
+endgen:
+    corsaro_destroy_avro_writer(avwrt);
+    free(fts);
+    destroy_corsaro_logger(logger);
+    return ret;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Checks that corsaroftquery finds exactly the same flowtuples when it uses
+# a file's block index to skip blocks as it does when it has to read the
+# whole file. This covers the index written by the avro block writer, the
+# index that corsaroftmerge writes when it stitches key ranges back
+# together, and the block seeking done by the flowtuple reader.
+#
+# Run by 'make check', from the build directory.
+
+TESTDIR=block_skip_test
+QUERY=./corsaroftquery
+MERGE=../corsaroftmerge/corsaroftmerge
+GEN=./gen_test_flowtuples
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# Prints the number of flowtuples that a query decoded, from its log
+decoded() {
+    sed -n 's/.*Decoded \([0-9]*\) flowtuples.*/\1/p' "$1"
+}
+
+rm -rf $TESTDIR
+mkdir $TESTDIR || exit 1
+
+$GEN $TESTDIR/first.avro 1 || fail "unable to write test flowtuples"
+$GEN $TESTDIR/second.avro 2 || fail "unable to write test flowtuples"
+[ -f $TESTDIR/first.avro.idx ] || fail "no index was written"
+
+$MERGE -l disabled -x -p 2 -o $TESTDIR/merged.avro $TESTDIR/first.avro \
+        $TESTDIR/second.avro || fail "unable to merge test flowtuples"
+[ -f $TESTDIR/merged.avro.idx ] || fail "no index was written when merging"
+
+# Copies of the files without an index have to be read in full
+cp $TESTDIR/first.avro $TESTDIR/first-noindex.avro
+cp $TESTDIR/merged.avro $TESTDIR/merged-noindex.avro
+
+found=0
+skipped=0
+queries=0
+
+while read -r query; do
+    for name in first merged; do
+        queries=$((queries + 1))
+        out=$TESTDIR/q$queries
+
+        $QUERY -t 1 $query $TESTDIR/$name-noindex.avro > $out.full \
+                2> $out.full.log || fail "full scan failed: $query"
+        $QUERY -t 4 $query $TESTDIR/$name.avro > $out.index \
+                2> $out.index.log || fail "indexed query failed: $query"
+
+        cmp -s $out.full $out.index || \
+                fail "$name.avro: indexed query '$query' found different flowtuples"
+
+        if [ -s $out.full ]; then
+            found=$((found + 1))
+        fi
+        if [ "$(decoded $out.index.log)" -lt "$(decoded $out.full.log)" ]; then
+            skipped=$((skipped + 1))
+        fi
+    done
+done <<EOF
+-P 6 -d 445
+-b 1600000900 -e 1600001800
+-b 1600000600 -e 1600000900 -P 17
+-b 1600001200 -e 1600001500 -P 1 -c US
+-b 1600003000
+-e 1600000301
+-S 192.0.2.0/24 -a 64520
+-b 1600000300 -e 1600000600 -P 6 -S 192.0.2.0/25
+-b 1600002100 -e 1600002400 -P 6,17 -D 44.128.0.0/9 --spoofed yes
+-b 1600000000 -e 1600000300 -s 0,1,2,3 -m CN
+-b 1600009000
+EOF
+
+# Make sure the check actually tested something
+[ $found -ge 16 ] || fail "only $found of $queries queries found any flowtuples"
+[ $skipped -ge 16 ] || fail "only $skipped of $queries queries skipped any blocks"
+
+echo "PASS: $queries queries matched a full scan, $skipped of them skipped blocks"
+rm -rf $TESTDIR
+exit 0
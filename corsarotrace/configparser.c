@@ -211,6 +211,87 @@ static int parse_remaining_config(corsaro_trace_global_t *glob,
         }
     }
 
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "nativereceiver")) {
+        if (parse_onoff_option(glob->logger, (char *)value->data.scalar.value,
+                &(glob->nativereceiver), "native receiver") < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "recvbatchsize")) {
+        unsigned long batch = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+        if (batch > CORSARO_TRACE_MAX_RECV_BATCH) {
+            corsaro_log(glob->logger,
+                    "recvbatchsize %lu is larger than the maximum of %u, using %u instead",
+                    batch, CORSARO_TRACE_MAX_RECV_BATCH,
+                    CORSARO_TRACE_MAX_RECV_BATCH);
+            batch = CORSARO_TRACE_MAX_RECV_BATCH;
+        }
+        glob->recvbatchsize = batch;
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "recvbufsize")) {
+        glob->recvbufsize = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "recordfile")) {
+        glob->recordfile = strdup((char *)value->data.scalar.value);
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "replayrealtime")) {
+        if (parse_onoff_option(glob->logger, (char *)value->data.scalar.value,
+                &(glob->replayrealtime), "replay in real time") < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "mergelookahead")) {
+        glob->mergelookahead = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "stragglertimeout")) {
+        glob->stragglertimeout = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "asyncwrites")) {
+        if (parse_onoff_option(glob->logger, (char *)value->data.scalar.value,
+                &(glob->asyncwrites), "asynchronous file writing") < 0) {
+            return -1;
+        }
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "writerqueuesize")) {
+        glob->writerqueuesize = strtoul((char *)value->data.scalar.value,
+                NULL, 10);
+    }
+
+    if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+            && !strcmp((char *)key->data.scalar.value, "mergelagpolicy")) {
+        if (strcasecmp((char *)value->data.scalar.value, "wait") == 0) {
+            glob->mergelagpolicy = CORSARO_TRACE_LAG_WAIT;
+        } else if (strcasecmp((char *)value->data.scalar.value, "close") == 0) {
+            glob->mergelagpolicy = CORSARO_TRACE_LAG_CLOSE;
+        } else {
+            corsaro_log(glob->logger,
+                    "invalid value for mergelagpolicy: %s, expected 'wait' or 'close'",
+                    (char *)value->data.scalar.value);
+            return -1;
+        }
+    }
+
     if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
             && !strcmp((char *)key->data.scalar.value, "monitorid")) {
         glob->monitorid = strdup((char *)value->data.scalar.value);
@@ -297,12 +378,49 @@ static void log_configuration(corsaro_trace_global_t *glob) {
     corsaro_log(glob->logger, "packets are being read from %s",
             glob->source_uri);
 
+    if (glob->replayprefix) {
+        corsaro_log(glob->logger, "replaying tagged records from %s-tXX %s",
+                glob->replayprefix,
+                glob->replayrealtime ? "in real time" : "at full speed");
+    } else if (glob->nativereceiver) {
+        corsaro_log(glob->logger,
+                "using native nDAG receiver (batch size %u, socket buffer %u bytes)",
+                glob->recvbatchsize, glob->recvbufsize);
+    }
+
+    if (glob->recordfile) {
+        corsaro_log(glob->logger,
+                "recording tagged records to files beginning with '%s'",
+                glob->recordfile);
+    }
+
     if (glob->control_uri) {
         corsaro_log(glob->logger,
                 "connecting to corsarotagger control socket: %s",
                 glob->control_uri);
     }
 
+    corsaro_log(glob->logger,
+            "merger will hold up to %u intervals, %s when a worker falls behind",
+            glob->mergelookahead,
+            glob->mergelagpolicy == CORSARO_TRACE_LAG_WAIT ?
+                    "pausing faster workers" : "merging without it");
+
+    if (glob->stragglertimeout > 0) {
+        corsaro_log(glob->logger,
+                "closing intervals %u seconds after the first worker reports them",
+                glob->stragglertimeout);
+    }
+
+    if (glob->asyncwrites) {
+        corsaro_log(glob->logger,
+                "writing output files on a separate thread, with up to %u MB queued",
+                glob->writerqueuesize);
+    } else {
+        corsaro_log(glob->logger,
+                "writing output files on the plugin merging threads");
+    }
+
     if (glob->boundstartts != 0) {
         corsaro_log(glob->logger, "ignoring all packets before timestamp %u",
                 glob->boundstartts);
@@ -427,6 +545,22 @@ corsaro_trace_global_t *corsaro_trace_init_global(char *filename, int logmode) {
     glob->removerouted = 0;
     glob->removenotscan = 0;
 
+    glob->nativereceiver = 0;
+    glob->recvbatchsize = 64;
+    glob->recvbufsize = 32 * 1024 * 1024;
+    glob->replayrealtime = 0;
+    glob->recordfile = NULL;
+    glob->replayprefix = NULL;
+
+    glob->mergelookahead = 8;
+    glob->mergelagpolicy = CORSARO_TRACE_LAG_WAIT;
+    glob->mergebase = 0;
+    glob->stragglertimeout = 0;
+    glob->liveinput = 1;
+    glob->asyncwrites = 1;
+    glob->writerqueuesize = 64;
+    glob->filewriter = NULL;
+
     glob->subsource = CORSARO_TRACE_SOURCE_FANNER;
     glob->logger = NULL;
     glob->source_uri = NULL;
@@ -439,6 +573,7 @@ corsaro_trace_global_t *corsaro_trace_init_global(char *filename, int logmode) {
     glob->ipmeta_state = NULL;
 
     pthread_mutex_init(&(glob->mutex), NULL);
+    pthread_cond_init(&(glob->mergecond), NULL);
 
     init_libts_ascii_backend(&(glob->libtsascii));
     init_libts_dbats_backend(&(glob->libtsdbats));
@@ -501,6 +636,43 @@ corsaro_trace_global_t *corsaro_trace_init_global(char *filename, int logmode) {
         return NULL;
     }
 
+    if (strncmp(glob->source_uri, "tagreplay:", 10) == 0) {
+        glob->replayprefix = strdup(glob->source_uri + 10);
+    }
+
+    if (glob->recordfile && glob->replayprefix) {
+        corsaro_log(glob->logger,
+                "corsarotrace: 'recordfile' cannot be used with a tagreplay: packetsource");
+        corsaro_trace_free_global(glob);
+        corsaro_cleanse_plugin_list(allplugins);
+        return NULL;
+    }
+
+    if (glob->recordfile && !glob->nativereceiver) {
+        corsaro_log(glob->logger,
+                "recording tagged records requires the native receiver, ignoring 'recordfile'");
+        free(glob->recordfile);
+        glob->recordfile = NULL;
+    }
+
+    if (glob->mergelookahead == 0) {
+        corsaro_log(glob->logger,
+                "mergelookahead must be at least 1, using the default of 8");
+        glob->mergelookahead = 8;
+    }
+
+    if (glob->recvbatchsize == 0) {
+        corsaro_log(glob->logger,
+                "recvbatchsize must be at least 1, using the default of 64");
+        glob->recvbatchsize = 64;
+    }
+
+    if (glob->writerqueuesize == 0) {
+        corsaro_log(glob->logger,
+                "writerqueuesize must be at least 1, using the default of 64");
+        glob->writerqueuesize = 64;
+    }
+
     log_configuration(glob);
 
     /* Ok to cleanse this now, the config parsing above should have made
@@ -538,6 +710,13 @@ void corsaro_trace_free_global(corsaro_trace_global_t *glob) {
 
     corsaro_cleanse_plugin_list(glob->active_plugins);
 
+    /* Only stop the file writer once the plugins have been destroyed, as
+     * they may have queued the closing of their last output files.
+     */
+    if (glob->filewriter) {
+        corsaro_destroy_filewriter(glob->filewriter);
+    }
+
     destroy_libts_ascii_backend(&(glob->libtsascii));
     destroy_libts_kafka_backend(&(glob->libtskafka));
     destroy_libts_dbats_backend(&(glob->libtsdbats));
@@ -566,6 +745,14 @@ void corsaro_trace_free_global(corsaro_trace_global_t *glob) {
         free(glob->control_uri);
     }
 
+    if (glob->recordfile) {
+        free(glob->recordfile);
+    }
+
+    if (glob->replayprefix) {
+        free(glob->replayprefix);
+    }
+
     corsaro_free_tagging_provider_config(&(glob->pfxtagopts),
             &(glob->maxtagopts), &(glob->netacqtagopts));
 
@@ -578,6 +765,7 @@ void corsaro_trace_free_global(corsaro_trace_global_t *glob) {
     }
 
     pthread_mutex_destroy(&(glob->mutex));
+    pthread_cond_destroy(&(glob->mergecond));
     destroy_corsaro_logger(glob->logger);
     free(glob);
 }
@@ -57,6 +57,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
+#include <time.h>
 
 #include <libtrace.h>
 #include <zmq.h>
@@ -67,14 +68,6 @@
 #include "libcorsaro_plugin.h"
 #include "libcorsaro_filtering.h"
 
-typedef struct pcaphdr_t {
-    uint32_t ts_sec;        /* Seconds portion of the timestamp */
-    uint32_t ts_usec;       /* Microseconds portion of the timestamp */
-    uint32_t caplen;        /* Capture length of the packet */
-    uint32_t wirelen;       /* The wire length of the packet */
-} pcaphdr_t;
-
-
 volatile int corsaro_halted = 0;
 
 libtrace_t *inputtrace = NULL;
@@ -82,61 +75,12 @@ libtrace_t *inputtrace = NULL;
 static void cleanup_signal(int sig) {
     (void)sig;
     corsaro_halted = 1;
-    trace_pstop(inputtrace);
+    if (inputtrace) {
+        trace_pstop(inputtrace);
+    }
 }
 
 
-static void fast_construct_packet(libtrace_t *deadtrace,
-        libtrace_packet_t *packet, corsaro_tagged_packet_header_t *taghdr,
-        char *packetcontent, uint16_t *packetbufsize)
-{
-
-    /* Clone of trace_construct_packet() but designed to minimise
-     * memory reallocations.
-     */
-    pcaphdr_t pcaphdr;
-
-    pcaphdr.ts_sec = taghdr->ts_sec;
-    pcaphdr.ts_usec = taghdr->ts_usec;
-    pcaphdr.caplen = taghdr->pktlen;
-    pcaphdr.wirelen = taghdr->pktlen;
-
-    packet->trace = deadtrace;
-    if (*packetbufsize < taghdr->pktlen + sizeof(pcaphdr)) {
-        if (taghdr->pktlen + sizeof(pcaphdr) > 512) {
-            packet->buffer = realloc(packet->buffer,
-                    taghdr->pktlen + sizeof(pcaphdr));
-            *packetbufsize = taghdr->pktlen + sizeof(pcaphdr);
-        } else {
-            packet->buffer = realloc(packet->buffer, 512);
-            *packetbufsize = 512;
-        }
-    }
-
-    packet->buf_control = TRACE_CTRL_PACKET;
-    packet->header = packet->buffer;
-    packet->payload = ((char *)(packet->buffer) + sizeof(pcaphdr));
-
-    memcpy(packet->payload, packetcontent, taghdr->pktlen);
-    memcpy(packet->header, &pcaphdr, sizeof(pcaphdr));
-    packet->type = TRACE_RT_DATA_DLT + TRACE_DLT_EN10MB;
-
-    packet->cached.l2_header = packet->payload;
-    packet->cached.l3_header = NULL;
-    packet->cached.l4_header = NULL;
-    packet->cached.link_type = TRACE_TYPE_ETH;
-    packet->cached.l3_ethertype = 0;
-    packet->cached.transport_proto = 0;
-    packet->cached.capture_length = taghdr->pktlen;
-    packet->cached.wire_length = taghdr->pktlen;
-    packet->cached.payload_length = -1;
-    packet->cached.l2_remaining = taghdr->pktlen;
-    packet->cached.l3_remaining = 0;
-    packet->cached.l4_remaining = 0;
-    packet->refcount = 0;
-    packet->which_trace_start = 0;
-}
-
 static int push_interval_result(corsaro_logger_t *logger,
 		corsaro_trace_worker_t *tls, void **result) {
 
@@ -158,6 +102,46 @@ static int push_interval_result(corsaro_logger_t *logger,
     return 0;
 }
 
+/* Blocks a worker that has got too far ahead of the oldest interval that
+ * the merger is still waiting on, so that the merger never has to hold
+ * more than 'mergelookahead' intervals.
+ *
+ * Only done for live inputs: when reading from a file, a worker that is
+ * not being given any packets will not report an interval until it
+ * reaches the end of the input, which it may never do if the workers
+ * that are being given packets are blocked here.
+ */
+static void wait_for_merge_lookahead(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls) {
+
+    struct timespec deadline;
+    uint8_t logged = 0;
+
+    if (glob->mergelagpolicy != CORSARO_TRACE_LAG_WAIT || glob->threads == 1
+            || !glob->liveinput) {
+        return;
+    }
+
+    pthread_mutex_lock(&(glob->mutex));
+    while (!corsaro_halted && tls->current_interval.number >=
+            glob->mergebase + glob->mergelookahead) {
+        if (!logged) {
+            corsaro_log(glob->logger,
+                    "worker %d is waiting for slower workers to finish interval %u",
+                    tls->workerid, glob->mergebase);
+            logged = 1;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec ++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&(glob->mergecond), &(glob->mutex), &deadline);
+    }
+    pthread_mutex_unlock(&(glob->mutex));
+}
+
 static int push_rotate_output(corsaro_logger_t *logger,
 		corsaro_trace_worker_t *tls, uint32_t ts) {
 
@@ -201,13 +185,12 @@ static int push_stop_merging(corsaro_logger_t *logger,
 }
 
 static void publish_thread_statistics(corsaro_trace_global_t *glob,
-        libtrace_thread_t *t, corsaro_trace_worker_t *tls) {
+        corsaro_trace_worker_t *tls) {
 
     FILE *f = NULL;
     char sfname[1024];
 
-    snprintf(sfname, 1024, "%s-t%02d", glob->statfilename,
-                trace_get_perpkt_thread_id(t));
+    snprintf(sfname, 1024, "%s-t%02d", glob->statfilename, tls->workerid);
 
     f = fopen(sfname, "w");
     if (!f) {
@@ -216,73 +199,30 @@ static void publish_thread_statistics(corsaro_trace_global_t *glob,
         return;
     }
 
-    fprintf(f, "time=%u accepted=%lu dropped=%lu dropinstances=%u previnterval=%lu\n",
+    fprintf(f, "time=%u accepted=%lu dropped=%lu dropinstances=%u previnterval=%lu late=%lu\n",
             tls->current_interval.time,
             tls->tracker->packetsreceived, tls->tracker->lostpackets,
             tls->tracker->lossinstances,
-            tls->pkts_from_prev_interval);
+            tls->pkts_from_prev_interval, tls->total_late_pkts);
     fclose(f);
 }
 
-static libtrace_packet_t * per_packet(libtrace_t *trace,
-		libtrace_thread_t *t, void *global, void *local,
-		libtrace_packet_t *packet) {
+/* Interval handling, filtering and plugin processing for a single packet.
+ * Shared by the libtrace per-packet callback and the native nDAG receiver.
+ */
+void corsaro_trace_process_packet(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls, libtrace_packet_t *packet,
+        corsaro_packet_tags_t *tags, uint32_t ts, uint16_t fbits) {
 
-	corsaro_trace_worker_t *tls = (corsaro_trace_worker_t *)local;
-	corsaro_trace_global_t *glob = (corsaro_trace_global_t *)global;
-    corsaro_packet_tags_t *tags, localtags;
-    corsaro_tagged_packet_header_t *taghdr;
 	void **interval_data;
     void **final_result;
-    uint16_t fbits = 0;
-
-	libtrace_linktype_t linktype;
-	uint32_t remaining;
-	uint32_t ts;
-
-	/* naughty to use ->header directly, but it's ok because I'm doing it */
 
 	if (tls->stopped) {
-		return packet;
+		return;
 	}
 
-	tags = trace_get_packet_meta(packet, &linktype, &remaining);
-
-    if (linktype == TRACE_TYPE_CORSAROTAG) {
-        if (tags == NULL) {
-            return packet;
-        }
-
-        if (remaining < sizeof(corsaro_packet_tags_t)) {
-            return packet;
-        }
-	    taghdr = (corsaro_tagged_packet_header_t *)(packet->header);
-        corsaro_update_tagged_loss_tracker(tls->tracker, taghdr);
-	    ts = ntohl(taghdr->ts_sec);
-        fbits = ntohs(taghdr->filterbits);
-    } else if (tls->tagger) {
-        struct timeval tv;
-        uint64_t filterbits;
-        /* packet is not from corsarotagger, but we have the ability to tag
-         * packets ourselves
-         */
-        if (corsaro_tag_packet(tls->tagger, &localtags, packet) < 0) {
-            corsaro_log(glob->logger,
-                    "error while tagging untagged packet");
-            return packet;
-        }
-        tags = &(localtags);
-        tv = trace_get_timeval(packet);
-        filterbits = bswap_be_to_host64(tags->filterbits);
-
-        ts = tv.tv_sec;
-        fbits = ((uint16_t)filterbits) & 0x0f;
-    } else {
-        tags = NULL;
-    }
-
     if (glob->boundstartts && ts < glob->boundstartts) {
-        return packet;
+        return;
     }
 
     if (glob->boundendts && ts >= glob->boundendts) {
@@ -303,7 +243,7 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
                     tls->current_interval.number);
         }
 		tls->stopped = 1;
-        return packet;
+        return;
     }
 
     if (tls->current_interval.time == 0) {
@@ -324,7 +264,7 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
                     "interval has somehow been assigned a bad value of %u\n",
                     glob->interval);
 			tls->stopped = 1;
-            return packet;
+            return;
         }
 
         pthread_mutex_lock(&(glob->mutex));
@@ -351,7 +291,7 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
 
     if (ts < tls->current_interval.time) {
         tls->pkts_from_prev_interval ++;
-        return packet;
+        return;
     }
 
     /* check if we have passed the end of an interval */
@@ -366,16 +306,18 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
         interval_data = corsaro_push_end_plugins(tls->plugins,
                 tls->current_interval.number, tls->next_report, complete);
 
+        wait_for_merge_lookahead(glob, tls);
         if (push_interval_result(glob->logger, tls, interval_data) < 0) {
             corsaro_log(glob->logger,
                     "error while publishing results for interval %u",
                     tls->current_interval.number);
 			tls->stopped = 1;
-            return packet;
+            return;
         }
 
+        corsaro_trace_report_stream_loss(glob, tls);
         if (glob->statfilename) {
-            publish_thread_statistics(glob, t, tls);
+            publish_thread_statistics(glob, tls);
         }
 
         if (tls->tracker->lostpackets > 0) {
@@ -395,7 +337,7 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
                         "error while pushing rotate message after interval %u",
                         tls->current_interval.number);
 				tls->stopped = 1;
-                return packet;
+                return;
             }
             tls->next_rotate += (glob->interval * glob->rotatefreq);
         }
@@ -413,6 +355,25 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
                     tls->current_interval.number - 1);
             tls->pkts_from_prev_interval = 0;
         }
+
+        if (tls->late_pkts > 0) {
+            corsaro_log(glob->logger, "worker thread %d dropped %lu packets for interval %u after it had been closed without this worker",
+                    tls->workerid, tls->late_pkts,
+                    tls->current_interval.number - 1);
+            tls->late_pkts = 0;
+        }
+    }
+
+    /* If the merger has already given up waiting for this worker and
+     * closed the current interval, any packets for it can only be
+     * discarded. mergebase is read without the lock -- a stale value
+     * just means a few extra packets are processed and thrown away by
+     * the merger instead.
+     */
+    if (glob->threads > 1 && tls->current_interval.number < glob->mergebase) {
+        tls->late_pkts ++;
+        tls->total_late_pkts ++;
+        return;
     }
 
     if (glob->removenotscan && !(fbits & CORSARO_FILTERBIT_LARGE_SCALE_SCAN)) {
@@ -435,20 +396,81 @@ static libtrace_packet_t * per_packet(libtrace_t *trace,
     tls->last_ts = ts;
     corsaro_push_packet_plugins(tls->plugins, packet, tags);
 
-    return packet;
+    return;
 
 filtered:
+    return;
+}
+
+static libtrace_packet_t * per_packet(libtrace_t *trace,
+		libtrace_thread_t *t, void *global, void *local,
+		libtrace_packet_t *packet) {
+
+	corsaro_trace_worker_t *tls = (corsaro_trace_worker_t *)local;
+	corsaro_trace_global_t *glob = (corsaro_trace_global_t *)global;
+    corsaro_packet_tags_t *tags, localtags;
+    corsaro_tagged_packet_header_t *taghdr;
+    uint16_t fbits = 0;
+
+	libtrace_linktype_t linktype;
+	uint32_t remaining;
+	uint32_t ts;
+
+	/* naughty to use ->header directly, but it's ok because I'm doing it */
+
+	if (tls->stopped) {
+		return packet;
+	}
+
+	tags = trace_get_packet_meta(packet, &linktype, &remaining);
+
+    if (linktype == TRACE_TYPE_CORSAROTAG) {
+        if (tags == NULL) {
+            return packet;
+        }
+
+        if (remaining < sizeof(corsaro_packet_tags_t)) {
+            return packet;
+        }
+	    taghdr = (corsaro_tagged_packet_header_t *)(packet->header);
+        corsaro_update_tagged_loss_tracker(tls->tracker, taghdr);
+	    ts = ntohl(taghdr->ts_sec);
+        fbits = ntohs(taghdr->filterbits);
+    } else if (tls->tagger) {
+        struct timeval tv;
+        uint64_t filterbits;
+        /* packet is not from corsarotagger, but we have the ability to tag
+         * packets ourselves
+         */
+        if (corsaro_tag_packet(tls->tagger, &localtags, packet) < 0) {
+            corsaro_log(glob->logger,
+                    "error while tagging untagged packet");
+            return packet;
+        }
+        tags = &(localtags);
+        tv = trace_get_timeval(packet);
+        filterbits = bswap_be_to_host64(tags->filterbits);
+
+        ts = tv.tv_sec;
+        fbits = ((uint16_t)filterbits) & 0x0f;
+    } else {
+        tags = NULL;
+    }
+
+    corsaro_trace_process_packet(glob, tls, packet, tags, ts, fbits);
     return packet;
 }
-static void *init_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
-		void *global) {
+
+
+corsaro_trace_worker_t *corsaro_trace_init_worker(corsaro_trace_global_t *glob,
+        int workerid) {
 
     corsaro_trace_worker_t *tls;
-	corsaro_trace_global_t *glob = (corsaro_trace_global_t *)global;
 
 	tls = calloc(1, sizeof(corsaro_trace_worker_t));
-	tls->workerid = trace_get_perpkt_thread_id(t);
+	tls->workerid = workerid;
 	tls->tracker = corsaro_create_tagged_loss_tracker(glob->threads);
+    tls->streamlosses = NULL;
     tls->tagger = corsaro_create_packet_tagger(glob->logger,
             glob->ipmeta_state);
 
@@ -480,16 +502,21 @@ static void *init_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
 	return tls;
 }
 
-static void halt_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
-		void *global, void *local) {
+static void *init_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
+		void *global) {
 
-	corsaro_trace_worker_t *tls = (corsaro_trace_worker_t *)local;
 	corsaro_trace_global_t *glob = (corsaro_trace_global_t *)global;
+
+    return corsaro_trace_init_worker(glob, trace_get_perpkt_thread_id(t));
+}
+
+void corsaro_trace_halt_worker(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls, uint8_t live) {
+
     void **final_result;
 
     if (tls->pkts_outstanding > 0) {
         uint8_t complete = 0;
-        libtrace_info_t *tinfo = trace_get_information(trace);
 
         /* Deal with case where we are reading from a rotated trace file and
          * have reached the end of the file.
@@ -499,7 +526,7 @@ static void halt_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
          * ensure plugins (e.g. report) will output a result for that last
          * interval.
          */
-        if (tinfo->live == 0 && tls->next_report - tls->last_ts <= 1) {
+        if (live == 0 && tls->next_report - tls->last_ts <= 1) {
             complete = 1;
             tls->last_ts = tls->next_report;
         }
@@ -528,11 +555,21 @@ static void halt_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
         corsaro_destroy_packet_tagger(tls->tagger);
     }
 
+    corsaro_trace_free_stream_loss(tls);
     zmq_close(tls->zmq_pushsock);
 }
 
-static inline void *reconnect_taggersock(corsaro_trace_global_t *glob,
-        void *current) {
+static void halt_corsarotrace_worker(libtrace_t *trace, libtrace_thread_t *t,
+		void *global, void *local) {
+
+	corsaro_trace_worker_t *tls = (corsaro_trace_worker_t *)local;
+	corsaro_trace_global_t *glob = (corsaro_trace_global_t *)global;
+    libtrace_info_t *tinfo = trace_get_information(trace);
+
+    corsaro_trace_halt_worker(glob, tls, tinfo->live);
+}
+
+void *reconnect_taggersock(corsaro_trace_global_t *glob, void *current) {
 
     void *newsock = NULL;
     if (current) {
@@ -548,85 +585,227 @@ static inline void *reconnect_taggersock(corsaro_trace_global_t *glob,
     return newsock;
 }
 
-static void process_mergeable_result(corsaro_trace_global_t *glob,
-        corsaro_trace_merger_t *merge, corsaro_result_msg_t *msg) {
+static inline corsaro_fin_interval_t *new_finished_interval(
+        corsaro_trace_global_t *glob, corsaro_result_msg_t *msg) {
 
-    corsaro_fin_interval_t *fin = merge->finished_intervals;
-    corsaro_fin_interval_t *prev = NULL;
+    corsaro_fin_interval_t *fin;
 
-    if (glob->threads == 1) {
-        corsaro_fin_interval_t quik;
-        quik.interval_id = msg->interval_num;
-        quik.timestamp = msg->interval_time;
-        quik.threads_ended = 1;
-        quik.next = NULL;
-        quik.rotate_after = 0;
-        quik.thread_plugin_data = (void ***)(calloc(glob->threads,
-                    sizeof(void **)));
-        quik.thread_plugin_data[0] = msg->plugindata;
-
-        if (corsaro_merge_plugin_outputs(glob->logger, merge->pluginset,
-                &quik, merge->zmq_taggersock) == CORSARO_MERGE_CONTROL_FAILURE)
-        {
-            merge->zmq_taggersock = reconnect_taggersock(glob,
-                    merge->zmq_taggersock);
-        }
-
-        free(msg->plugindata);
-        free(quik.thread_plugin_data);
-        return;
+    fin = (corsaro_fin_interval_t *)malloc(sizeof(corsaro_fin_interval_t));
+    fin->interval_id = msg->interval_num;
+    fin->timestamp = msg->interval_time;
+    fin->threads_ended = 0;
+    fin->next = NULL;
+    fin->rotate_after = 0;
+    fin->merges_pending = 0;
+    fin->thread_plugin_data = (void ***)(calloc(glob->threads,
+            sizeof(void **)));
+    return fin;
+}
+
+static void update_merge_base(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge, uint32_t newbase) {
+
+    merge->ringbase = newbase;
+
+    /* Let any workers that are waiting on the lookahead limit know that
+     * they may be able to continue.
+     */
+    pthread_mutex_lock(&(glob->mutex));
+    glob->mergebase = newbase;
+    pthread_cond_broadcast(&(glob->mergecond));
+    pthread_mutex_unlock(&(glob->mutex));
+}
+
+/* Hands the oldest interval in the ring over to the plugin mergers, even
+ * if some workers have not yet reported it.
+ */
+static void close_oldest_interval(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge) {
+
+    uint32_t slot = merge->ringbase % merge->ringsize;
+    corsaro_fin_interval_t *fin = merge->ring[slot];
+    int i;
+
+    if (fin) {
+        if (fin->threads_ended < glob->threads) {
+            corsaro_log(glob->logger,
+                    "forcing merge of interval %u with results from only %u of %u workers",
+                    fin->interval_id, fin->threads_ended, glob->threads);
+            for (i = 0; i < glob->threads; i++) {
+                if (!merge->workerstopped[i] &&
+                        merge->lastreported[i] < (int64_t)fin->interval_id) {
+                    corsaro_log(glob->logger,
+                            "worker %d is lagging: last reported interval %ld",
+                            i, merge->lastreported[i]);
+                }
+            }
+        }
+        if (fin->rotate_after) {
+            merge->next_rotate_interval = fin->interval_id + 1;
+        }
+        merge->ring[slot] = NULL;
+        merge->ringcount --;
+
+        /* The plugin merge threads take ownership of fin; each plugin
+         * merges (and rotates) intervals in the order they are
+         * dispatched here.
+         */
+        corsaro_trace_dispatch_merge(merge, fin);
+    }
+    update_merge_base(glob, merge, merge->ringbase + 1);
+}
+
+static void log_worker_lag(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge, uint32_t newest) {
+
+    int i;
+
+    for (i = 0; i < glob->threads; i++) {
+        if (merge->workerstopped[i]) {
+            continue;
+        }
+        if (merge->lastreported[i] + 1 < (int64_t)newest) {
+            corsaro_log(glob->logger,
+                    "worker %d is %ld intervals behind (last reported interval %ld, newest %u)",
+                    i, (int64_t)newest - merge->lastreported[i] - 1,
+                    merge->lastreported[i], newest);
+        }
+    }
+}
+
+static inline int interval_is_complete(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge, uint32_t interval) {
+
+    int i;
+
+    /* Workers report intervals in order, so a worker has finished with
+     * an interval once it has reported that interval or a later one.
+     */
+    for (i = 0; i < glob->threads; i++) {
+        if (merge->workerstopped[i]) {
+            continue;
+        }
+        if (merge->lastreported[i] < (int64_t)interval) {
+            return 0;
+        }
     }
+    return 1;
+}
+
+static void close_completed_intervals(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge) {
+
+    corsaro_fin_interval_t *fin;
 
-    while (fin != NULL) {
-        if (fin->interval_id == msg->interval_num) {
+    while (merge->ringcount > 0) {
+        fin = merge->ring[merge->ringbase % merge->ringsize];
+        if (fin != NULL && !interval_is_complete(glob, merge,
+                    fin->interval_id)) {
             break;
         }
-        prev = fin;
-        fin = fin->next;
+        close_oldest_interval(glob, merge);
     }
+}
 
-    if (fin != NULL) {
-        int i;
+/* Closes any intervals that have been waiting longer than the straggler
+ * timeout since the first worker reported them. Workers that still have
+ * not reported are treated as having ended the interval with no results.
+ */
+static void close_straggling_intervals(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge) {
 
-        fin->thread_plugin_data[fin->threads_ended] = msg->plugindata;
-        fin->threads_ended ++;
-        if (fin->threads_ended == glob->threads) {
-            assert(fin == merge->finished_intervals);
-            if (corsaro_merge_plugin_outputs(glob->logger, merge->pluginset,
-                    fin, merge->zmq_taggersock) ==
-                    CORSARO_MERGE_CONTROL_FAILURE) {
-                merge->zmq_taggersock = reconnect_taggersock(glob,
-                        merge->zmq_taggersock);
-            }
-            if (fin->rotate_after) {
-                corsaro_rotate_plugin_output(glob->logger, merge->pluginset);
-                merge->next_rotate_interval = msg->interval_num + 1;
-            }
-            merge->finished_intervals = fin->next;
-            for (i = 0; i < glob->threads; i++) {
-                free(fin->thread_plugin_data[i]);
+    corsaro_fin_interval_t *fin;
+    uint32_t slot;
+    time_t now;
+    int i;
+
+    if (glob->stragglertimeout == 0 || glob->threads == 1) {
+        return;
+    }
+
+    now = time(NULL);
+    while (merge->ringcount > 0) {
+        slot = merge->ringbase % merge->ringsize;
+        fin = merge->ring[slot];
+        if (fin == NULL) {
+            close_oldest_interval(glob, merge);
+            continue;
+        }
+
+        if (now - merge->ringopened[slot] < glob->stragglertimeout) {
+            break;
+        }
+
+        for (i = 0; i < glob->threads; i++) {
+            if (merge->workerstopped[i] ||
+                    merge->lastreported[i] >= (int64_t)fin->interval_id) {
+                continue;
             }
-            free(fin->thread_plugin_data);
-            free(fin);
+            corsaro_log(glob->logger,
+                    "worker %d has not reported interval %u after %u seconds, closing it without this worker",
+                    i, fin->interval_id, glob->stragglertimeout);
+            merge->lastreported[i] = fin->interval_id;
         }
-    } else {
-        fin = (corsaro_fin_interval_t *)malloc(sizeof(corsaro_fin_interval_t));
-        fin->interval_id = msg->interval_num;
-        fin->timestamp = msg->interval_time;
-        fin->threads_ended = 1;
-        fin->next = NULL;
-        fin->rotate_after = 0;
-        fin->thread_plugin_data = (void ***)(calloc(glob->threads,
-                sizeof(void **)));
+        close_oldest_interval(glob, merge);
+        close_completed_intervals(glob, merge);
+    }
+}
+
+static void process_mergeable_result(corsaro_trace_global_t *glob,
+        corsaro_trace_merger_t *merge, corsaro_result_msg_t *msg) {
+
+    corsaro_fin_interval_t *fin;
+    uint32_t slot;
+
+    /* A straggling worker may already have been given synthetic ends
+     * for intervals beyond this one.
+     */
+    if ((int64_t)msg->interval_num > merge->lastreported[msg->source]) {
+        merge->lastreported[msg->source] = msg->interval_num;
+    }
+
+    if (glob->threads == 1) {
+        fin = new_finished_interval(glob, msg);
         fin->thread_plugin_data[0] = msg->plugindata;
+        fin->threads_ended = 1;
+        corsaro_trace_dispatch_merge(merge, fin);
+        update_merge_base(glob, merge, msg->interval_num + 1);
+        return;
+    }
 
-        if (prev) {
-            prev->next = fin;
-        } else {
-            merge->finished_intervals = fin;
+    if (msg->interval_num < merge->ringbase) {
+        /* Interval has already been force-merged without this worker */
+        corsaro_log(glob->logger,
+                "discarding late result from worker %d for interval %u",
+                msg->source, msg->interval_num);
+        corsaro_release_plugin_results(glob->active_plugins,
+                msg->plugindata);
+        return;
+    }
+
+    /* The ring can only hold so many intervals -- if this result is too
+     * far ahead, the oldest intervals must be merged now.
+     */
+    while (msg->interval_num >= merge->ringbase + merge->ringsize) {
+        close_oldest_interval(glob, merge);
+    }
+
+    slot = msg->interval_num % merge->ringsize;
+    fin = merge->ring[slot];
+    if (fin == NULL) {
+        fin = new_finished_interval(glob, msg);
+        merge->ring[slot] = fin;
+        merge->ringopened[slot] = time(NULL);
+        merge->ringcount ++;
+        if (merge->ringcount > 1) {
+            log_worker_lag(glob, merge, msg->interval_num);
         }
     }
 
+    fin->thread_plugin_data[fin->threads_ended] = msg->plugindata;
+    fin->threads_ended ++;
+
+    close_completed_intervals(glob, merge);
 }
 
 static void *start_merger(void *tdata) {
@@ -636,11 +815,6 @@ static void *start_merger(void *tdata) {
     corsaro_fin_interval_t *fin;
 
     merge->zmq_pullsock = zmq_socket(glob->zmq_ctxt, ZMQ_PULL);
-    merge->zmq_taggersock = reconnect_taggersock(glob, NULL);
-
-    if (merge->zmq_taggersock == NULL) {
-        goto endmerger;
-    }
 
     if (zmq_bind(merge->zmq_pullsock, "inproc://pluginresults") != 0) {
         corsaro_log(glob->logger,
@@ -652,9 +826,26 @@ static void *start_merger(void *tdata) {
     merge->pluginset = corsaro_start_merging_plugins(glob->logger,
             glob->active_plugins, glob->plugincount, glob->threads);
 
+    if (corsaro_trace_start_plugin_mergers(merge) < 0) {
+        goto endmerger;
+    }
+
+    if (glob->stragglertimeout > 0) {
+        /* Wake up regularly to check for stragglers, even if every
+         * worker that is still reporting is blocked on the lookahead.
+         */
+        int timeout = 1000;
+        zmq_setsockopt(merge->zmq_pullsock, ZMQ_RCVTIMEO, &timeout,
+                sizeof(timeout));
+    }
+
     while (1) {
         if (zmq_recv(merge->zmq_pullsock, &res, sizeof(res), 0) < 0) {
-            if (errno == EINTR || errno == EAGAIN) {
+            if (errno == EAGAIN) {
+                close_straggling_intervals(glob, merge);
+                continue;
+            }
+            if (errno == EINTR) {
                 continue;
             }
 
@@ -666,48 +857,56 @@ static void *start_merger(void *tdata) {
 
         if (res.type == CORSARO_TRACE_MSG_STOP) {
             merge->stops_seen ++;
+            merge->workerstopped[res.source] = 1;
             if (merge->stops_seen == glob->threads) {
                 break;
             }
+            /* Intervals no longer need to wait for this worker */
+            close_completed_intervals(glob, merge);
         }
         else if (res.type == CORSARO_TRACE_MSG_ROTATE) {
-            fin = merge->finished_intervals;
-
-            if (fin == NULL && merge->next_rotate_interval <= res.interval_num) {
-                corsaro_rotate_plugin_output(glob->logger, merge->pluginset);
+            if (merge->ringcount == 0 &&
+                    merge->next_rotate_interval <= res.interval_num) {
+                corsaro_trace_dispatch_rotate(merge);
                 merge->next_rotate_interval = res.interval_num + 1;
                 continue;
             }
 
-            while (fin != NULL) {
-                if (fin->interval_id == res.interval_num) {
+            if (res.interval_num >= merge->ringbase &&
+                    res.interval_num < merge->ringbase + merge->ringsize) {
+                fin = merge->ring[res.interval_num % merge->ringsize];
+                if (fin && fin->interval_id == res.interval_num) {
                     fin->rotate_after = 1;
-                    break;
                 }
-                fin = fin->next;
             }
         } else if (res.type == CORSARO_TRACE_MSG_MERGE) {
             process_mergeable_result(glob, merge, &res);
         }
+        close_straggling_intervals(glob, merge);
     }
 endmerger:
-    while (merge->finished_intervals) {
-        fin = merge->finished_intervals;
-
-        if (corsaro_merge_plugin_outputs(glob->logger, merge->pluginset, fin,
-                merge->zmq_taggersock) == CORSARO_MERGE_CONTROL_FAILURE) {
-            if (merge->zmq_taggersock) {
-                zmq_close(merge->zmq_taggersock);
+    while (merge->ringcount > 0) {
+        uint32_t slot = merge->ringbase % merge->ringsize;
+
+        fin = merge->ring[slot];
+        if (fin && merge->pluginmergers == NULL) {
+            int i;
+
+            merge->ring[slot] = NULL;
+            merge->ringcount --;
+            for (i = 0; i < fin->threads_ended; i++) {
+                corsaro_release_plugin_results(glob->active_plugins,
+                        fin->thread_plugin_data[i]);
             }
-            merge->zmq_taggersock = NULL;
+            free(fin->thread_plugin_data);
+            free(fin);
+            merge->ringbase ++;
+            continue;
         }
-        merge->finished_intervals = fin->next;
-        free(fin);
+        close_oldest_interval(glob, merge);
     }
 
-    if (merge->zmq_taggersock) {
-       zmq_close(merge->zmq_taggersock);
-    }
+    corsaro_trace_stop_plugin_mergers(merge);
     corsaro_stop_plugins(merge->pluginset);
     pthread_exit(NULL);
 }
@@ -809,7 +1008,11 @@ int main(int argc, char *argv[]) {
 	libtrace_stat_t *stats;
 	libtrace_callback_set_t *processing = NULL;
     corsaro_plugin_proc_options_t stdopts;
+    corsaro_trace_ndag_source_t ndagsource;
     pthread_t fauxcontrol = 0;
+    int i;
+
+    memset(&ndagsource, 0, sizeof(ndagsource));
 
     glob = configure_corsaro(argc, argv);
     if (glob == NULL) {
@@ -869,9 +1072,36 @@ int main(int argc, char *argv[]) {
         corsaro_log(glob->logger, "started faux tagger control thread");
     }
 
+    if (glob->nativereceiver && !glob->replayprefix) {
+        if (corsaro_trace_discover_ndag_streams(glob, &ndagsource) < 0) {
+            goto endcorsarotrace;
+        }
+
+        /* Every processing thread must be fed by at least one stream,
+         * otherwise the merger will wait forever for its results.
+         */
+        if (ndagsource.numstreams < glob->threads) {
+            corsaro_log(glob->logger,
+                    "only %u streams are being multicast, reducing processing threads to match",
+                    ndagsource.numstreams);
+            glob->threads = ndagsource.numstreams;
+        }
+    }
+
+    if (glob->asyncwrites) {
+        glob->filewriter = corsaro_create_filewriter(glob->logger,
+                ((uint64_t)glob->writerqueuesize) * 1024 * 1024);
+        if (glob->filewriter == NULL) {
+            corsaro_log(glob->logger,
+                    "unable to start file writer thread, plugins will write their own output files");
+        }
+    }
+
     stdopts.template = glob->template;
     stdopts.monitorid = glob->monitorid;
     stdopts.procthreads = glob->threads;
+    stdopts.filewriter = glob->filewriter;
+    stdopts.stragglertimeout = glob->stragglertimeout;
     stdopts.libtsascii = &(glob->libtsascii);
     stdopts.libtskafka = &(glob->libtskafka);
     stdopts.libtsdbats = &(glob->libtsdbats);
@@ -888,7 +1118,18 @@ int main(int argc, char *argv[]) {
     merger.stops_seen = 0;
     merger.next_rotate_interval = 0;
     merger.pluginset = NULL;
-    merger.finished_intervals = NULL;
+    merger.ringsize = glob->mergelookahead;
+    merger.ringbase = 0;
+    merger.ringcount = 0;
+    merger.ring = calloc(merger.ringsize, sizeof(corsaro_fin_interval_t *));
+    merger.ringopened = calloc(merger.ringsize, sizeof(time_t));
+    merger.lastreported = calloc(glob->threads, sizeof(int64_t));
+    merger.workerstopped = calloc(glob->threads, sizeof(uint8_t));
+    for (i = 0; i < glob->threads; i++) {
+        merger.lastreported[i] = -1;
+    }
+    merger.pluginmergers = NULL;
+    merger.zmq_jobsocks = NULL;
 
     sigemptyset(&sig_block_all);
     if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
@@ -905,6 +1146,17 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (glob->replayprefix) {
+        glob->liveinput = 0;
+        corsaro_trace_run_replayers(glob);
+        goto joinmerger;
+    }
+
+    if (glob->nativereceiver) {
+        corsaro_trace_run_receivers(glob, &ndagsource);
+        goto joinmerger;
+    }
+
     inputtrace = trace_create(glob->source_uri);
     if (trace_is_err(inputtrace)) {
         libtrace_err_t err = trace_get_err(inputtrace);
@@ -913,6 +1165,7 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    glob->liveinput = trace_get_information(inputtrace)->live;
     trace_set_perpkt_threads(inputtrace, glob->threads);
 
     processing = trace_create_callback_set();
@@ -950,10 +1203,15 @@ int main(int argc, char *argv[]) {
 		corsaro_log(glob->logger, "missing packet count: unknown");
 	}
 
+joinmerger:
     pthread_join(merger.threadid, NULL);
     if (merger.zmq_pullsock) {
         zmq_close(merger.zmq_pullsock);
     }
+    free(merger.ring);
+    free(merger.ringopened);
+    free(merger.lastreported);
+    free(merger.workerstopped);
 
     if (fauxcontrol && control_sock) {
         ctrlreq.request_type = TAGGER_REQUEST_HALT_FAUX;
@@ -970,6 +1228,7 @@ int main(int argc, char *argv[]) {
     corsaro_log(glob->logger, "all threads have joined, exiting.");
 
 endcorsarotrace:
+    corsaro_trace_free_ndag_source(&ndagsource);
     if (control_sock) {
         zmq_close(control_sock);
     }
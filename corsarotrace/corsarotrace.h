@@ -50,9 +50,11 @@
 #ifndef CORSAROTRACE_H_
 #define CORSAROTRACE_H_
 
+#include <sys/socket.h>
 #include <libtrace.h>
 #include <libtrace_parallel.h>
 #include <libtrace/message_queue.h>
+#include <Judy.h>
 
 #include "libcorsaro.h"
 #include "libcorsaro_log.h"
@@ -60,9 +62,16 @@
 #include "libcorsaro_filtering.h"
 #include "libcorsaro_tagging.h"
 #include "libcorsaro_libtimeseries.h"
+#include "libcorsaro_tagrecord.h"
 
 #define INTERNAL_ZMQ_CONTROL_URI "inproc://corsarotrace_ipmeta"
 
+/* Largest number of datagrams that the native receiver will ask for in one
+ * recvmmsg() call -- the kernel will not return more than this (UIO_MAXIOV)
+ * anyway.
+ */
+#define CORSARO_TRACE_MAX_RECV_BATCH 1024
+
 enum {
     CORSARO_TRACE_MSG_MERGE = 0,
     CORSARO_TRACE_MSG_STOP = 1,
@@ -70,6 +79,41 @@ enum {
     CORSARO_TRACE_MSG_PACKET = 3,
 };
 
+/* nDAG framing used by corsarotagger when multicasting tagged packets.
+ * These mirror the definitions in libtrace's nDAG format module, which are
+ * not exported by libtrace itself.
+ */
+#define CORSARO_NDAG_MAGIC_NUMBER (0x4E5A)
+#define CORSARO_NDAG_EXPORT_VERSION 1
+
+enum {
+    CORSARO_NDAG_PKT_BEACON = 0x01,
+    CORSARO_NDAG_PKT_ENCAPERF = 0x02,
+    CORSARO_NDAG_PKT_RESTARTED = 0x03,
+    CORSARO_NDAG_PKT_ENCAPRT = 0x04,
+    CORSARO_NDAG_PKT_KEEPALIVE = 0x05,
+    CORSARO_NDAG_PKT_CORSAROTAG = 0x06,
+};
+
+typedef struct corsaro_ndag_common {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint16_t monitorid;
+} PACKED corsaro_ndag_common_t;
+
+typedef struct corsaro_ndag_encap {
+    uint64_t started;
+    uint32_t seqno;
+    uint16_t streamid;
+    uint16_t recordcount;
+} PACKED corsaro_ndag_encap_t;
+
+enum {
+    CORSARO_TRACE_LAG_WAIT = 0,
+    CORSARO_TRACE_LAG_CLOSE = 1,
+};
+
 enum {
     CORSARO_TRACE_SOURCE_FANNER,
     CORSARO_TRACE_SOURCE_TAGGER
@@ -102,6 +146,8 @@ typedef struct corsaro_trace_glob {
     char *filterstring;
     char *monitorid;
     char *control_uri;
+    char *recordfile;
+    char *replayprefix;
 
     libts_ascii_backend_t libtsascii;
     libts_kafka_backend_t libtskafka;
@@ -124,6 +170,28 @@ typedef struct corsaro_trace_glob {
     uint8_t removerouted;
     uint8_t removenotscan;
 
+    uint8_t nativereceiver;
+    uint16_t recvbatchsize;
+    uint32_t recvbufsize;
+    uint8_t replayrealtime;
+
+    uint32_t mergelookahead;
+    uint8_t mergelagpolicy;
+    uint32_t stragglertimeout;
+    /* Set if packets are arriving in real time, rather than being read
+     * from a file as fast as possible */
+    uint8_t liveinput;
+
+    /* Whether plugin output files are written by a separate thread */
+    uint8_t asyncwrites;
+    /* Megabytes of output that may be waiting for that thread */
+    uint32_t writerqueuesize;
+    corsaro_filewriter_t *filewriter;
+
+    /* Oldest interval not yet merged, updated by the merger */
+    uint32_t mergebase;
+    pthread_cond_t mergecond;
+
     void *zmq_ctxt;
 
     corsaro_ipmeta_state_t *ipmeta_state;
@@ -142,6 +210,12 @@ struct corsaro_trace_worker {
     uint64_t pkts_outstanding;
     uint64_t pkts_from_prev_interval;
 
+    /* Packets dropped because their interval had already been closed
+     * without this worker's results.
+     */
+    uint64_t late_pkts;
+    uint64_t total_late_pkts;
+
     uint32_t first_pkt_ts;
     uint32_t next_report;
     uint32_t next_rotate;
@@ -151,24 +225,132 @@ struct corsaro_trace_worker {
     corsaro_tagged_loss_tracker_t *tracker;
     corsaro_packet_tagger_t *tagger;
     void *zmq_pushsock;
+
+    /* Per-stream loss trackers, keyed by (tagger id << 16) | hashbin.
+     * Only populated when using the native receiver.
+     */
+    Pvoid_t streamlosses;
 };
 
+typedef struct corsaro_trace_ndag_source {
+    char *iface;
+    char *groupaddr;
+    uint16_t beaconport;
+
+    uint16_t numstreams;
+    uint16_t *streamports;
+} corsaro_trace_ndag_source_t;
+
+typedef struct corsaro_trace_receiver {
+    corsaro_trace_global_t *glob;
+    corsaro_trace_ndag_source_t *source;
+    corsaro_trace_worker_t *tls;
+    pthread_t threadid;
+    int workerid;
+
+    int *socks;
+    uint16_t sockcount;
+
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    uint8_t *ring;
+
+    libtrace_t *deadtrace;
+    libtrace_packet_t *packet;
+    uint16_t packetbufsize;
+
+    corsaro_tagrecord_writer_t *recorder;
+
+    uint64_t datagrams;
+    uint64_t truncated;
+    uint64_t malformed;
+} corsaro_trace_receiver_t;
+
+typedef struct corsaro_trace_merge_job {
+    uint8_t type;
+    corsaro_fin_interval_t *fin;
+} corsaro_trace_merge_job_t;
+
+typedef struct corsaro_trace_plugin_merger {
+    corsaro_trace_merger_t *merge;
+    int pluginindex;
+    pthread_t threadid;
+
+    void *zmq_jobsock;
+    void *zmq_taggersock;
+} corsaro_trace_plugin_merger_t;
+
 struct corsaro_trace_merger {
     corsaro_trace_global_t *glob;
     pthread_t threadid;
 
+    /* One merge thread per plugin, so a slow plugin merge only delays
+     * later merges for that same plugin.
+     */
+    corsaro_trace_plugin_merger_t *pluginmergers;
+    void **zmq_jobsocks;
+    pthread_mutex_t finmutex;
+
     int stops_seen;
     uint32_t next_rotate_interval;
     corsaro_plugin_set_t *pluginset;
-    corsaro_fin_interval_t *finished_intervals;
+
+    /* Intervals that are waiting on results from at least one worker,
+     * indexed by interval number modulo ringsize. ringbase is the oldest
+     * interval that has not yet been handed to the plugin mergers.
+     */
+    corsaro_fin_interval_t **ring;
+    uint32_t ringsize;
+    uint32_t ringbase;
+    uint32_t ringcount;
+
+    /* Wall-clock time at which the first result for each ring slot
+     * arrived, i.e. when the first worker saw a packet past the end of
+     * that interval.
+     */
+    time_t *ringopened;
+
+    /* Most recent interval reported by each worker, -1 if none */
+    int64_t *lastreported;
+    uint8_t *workerstopped;
 
     void *zmq_pullsock;
-    void *zmq_taggersock;
 };
 
+extern volatile int corsaro_halted;
+
 corsaro_trace_global_t *corsaro_trace_init_global(char *filename, int logmode);
 void corsaro_trace_free_global(corsaro_trace_global_t *glob);
 void *start_faux_control_thread(void *data);
 
+corsaro_trace_worker_t *corsaro_trace_init_worker(corsaro_trace_global_t *glob,
+        int workerid);
+void corsaro_trace_halt_worker(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls, uint8_t live);
+void corsaro_trace_process_packet(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls, libtrace_packet_t *packet,
+        corsaro_packet_tags_t *tags, uint32_t ts, uint16_t fbits);
+
+int corsaro_trace_discover_ndag_streams(corsaro_trace_global_t *glob,
+        corsaro_trace_ndag_source_t *source);
+int corsaro_trace_run_receivers(corsaro_trace_global_t *glob,
+        corsaro_trace_ndag_source_t *source);
+void corsaro_trace_free_ndag_source(corsaro_trace_ndag_source_t *source);
+int corsaro_trace_init_receiver(corsaro_trace_receiver_t *rx);
+void corsaro_trace_destroy_receiver(corsaro_trace_receiver_t *rx);
+void corsaro_trace_process_tagged_record(corsaro_trace_receiver_t *rx,
+        uint16_t hashbin, corsaro_tagged_packet_header_t *taghdr);
+int corsaro_trace_run_replayers(corsaro_trace_global_t *glob);
+void corsaro_trace_report_stream_loss(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls);
+void corsaro_trace_free_stream_loss(corsaro_trace_worker_t *tls);
+
+void *reconnect_taggersock(corsaro_trace_global_t *glob, void *current);
+int corsaro_trace_start_plugin_mergers(corsaro_trace_merger_t *merge);
+void corsaro_trace_dispatch_merge(corsaro_trace_merger_t *merge,
+        corsaro_fin_interval_t *fin);
+void corsaro_trace_dispatch_rotate(corsaro_trace_merger_t *merge);
+void corsaro_trace_stop_plugin_mergers(corsaro_trace_merger_t *merge);
+
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,287 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zmq.h>
+
+#include "libcorsaro_log.h"
+#include "libcorsaro_plugin.h"
+#include "corsarotrace.h"
+
+/** Releases one plugin's claim on a finished interval. Once every plugin
+ *  has merged the interval, the interval and its plugin results are freed.
+ *
+ *  @param merge        The merger that owns the finished interval.
+ *  @param fin          The finished interval to release.
+ */
+static void release_finished_interval(corsaro_trace_merger_t *merge,
+        corsaro_fin_interval_t *fin) {
+
+    int i;
+    uint8_t last = 0;
+
+    pthread_mutex_lock(&(merge->finmutex));
+    fin->merges_pending --;
+    if (fin->merges_pending == 0) {
+        last = 1;
+    }
+    pthread_mutex_unlock(&(merge->finmutex));
+
+    if (!last) {
+        return;
+    }
+
+    corsaro_log(merge->glob->logger, "completed merge for all plugins %u:%u.",
+            fin->interval_id, fin->timestamp);
+
+    for (i = 0; i < merge->glob->threads; i++) {
+        if (fin->thread_plugin_data[i]) {
+            free(fin->thread_plugin_data[i]);
+        }
+    }
+    free(fin->thread_plugin_data);
+    free(fin);
+}
+
+static void *start_plugin_merger(void *data) {
+
+    corsaro_trace_plugin_merger_t *pm = (corsaro_trace_plugin_merger_t *)data;
+    corsaro_trace_merger_t *merge = pm->merge;
+    corsaro_trace_global_t *glob = merge->glob;
+    corsaro_trace_merge_job_t job;
+
+    /* REQ sockets can't be shared between threads, so each plugin
+     * merger gets its own connection to the tagger.
+     */
+    pm->zmq_taggersock = reconnect_taggersock(glob, NULL);
+
+    while (1) {
+        if (zmq_recv(pm->zmq_jobsock, &job, sizeof(job), 0) < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            corsaro_log(glob->logger,
+                    "error receiving job in merge thread for plugin %d: %s",
+                    pm->pluginindex, strerror(errno));
+            break;
+        }
+
+        if (job.type == CORSARO_TRACE_MSG_STOP) {
+            break;
+        }
+
+        if (job.type == CORSARO_TRACE_MSG_ROTATE) {
+            corsaro_rotate_single_plugin_output(glob->logger,
+                    merge->pluginset, pm->pluginindex);
+            continue;
+        }
+
+        if (corsaro_merge_single_plugin_output(glob->logger, merge->pluginset,
+                    pm->pluginindex, job.fin, pm->zmq_taggersock) ==
+                CORSARO_MERGE_CONTROL_FAILURE) {
+            pm->zmq_taggersock = reconnect_taggersock(glob,
+                    pm->zmq_taggersock);
+        }
+
+        if (job.fin->rotate_after) {
+            corsaro_rotate_single_plugin_output(glob->logger,
+                    merge->pluginset, pm->pluginindex);
+        }
+        release_finished_interval(merge, job.fin);
+    }
+
+    if (pm->zmq_taggersock) {
+        zmq_close(pm->zmq_taggersock);
+    }
+    zmq_close(pm->zmq_jobsock);
+    pthread_exit(NULL);
+}
+
+int corsaro_trace_start_plugin_mergers(corsaro_trace_merger_t *merge) {
+
+    corsaro_trace_global_t *glob = merge->glob;
+    char sockname[1024];
+    int i, count;
+
+    count = merge->pluginset ? merge->pluginset->plugincount : 0;
+
+    pthread_mutex_init(&(merge->finmutex), NULL);
+    merge->pluginmergers = calloc(count, sizeof(corsaro_trace_plugin_merger_t));
+    merge->zmq_jobsocks = calloc(count, sizeof(void *));
+
+    for (i = 0; i < count; i++) {
+        corsaro_trace_plugin_merger_t *pm = &(merge->pluginmergers[i]);
+
+        snprintf(sockname, 1024, "inproc://pluginmergejobs-%d", i);
+
+        merge->zmq_jobsocks[i] = zmq_socket(glob->zmq_ctxt, ZMQ_PUSH);
+        if (zmq_bind(merge->zmq_jobsocks[i], sockname) != 0) {
+            corsaro_log(glob->logger,
+                    "unable to bind job socket for plugin merger %d: %s",
+                    i, strerror(errno));
+            return -1;
+        }
+
+        pm->merge = merge;
+        pm->pluginindex = i;
+        pm->zmq_jobsock = zmq_socket(glob->zmq_ctxt, ZMQ_PULL);
+        if (zmq_connect(pm->zmq_jobsock, sockname) != 0) {
+            corsaro_log(glob->logger,
+                    "unable to connect job socket for plugin merger %d: %s",
+                    i, strerror(errno));
+            zmq_close(pm->zmq_jobsock);
+            pm->zmq_jobsock = NULL;
+            return -1;
+        }
+
+        pthread_create(&(pm->threadid), NULL, start_plugin_merger, pm);
+    }
+    return 0;
+}
+
+void corsaro_trace_dispatch_merge(corsaro_trace_merger_t *merge,
+        corsaro_fin_interval_t *fin) {
+
+    corsaro_trace_merge_job_t job;
+    int i, count;
+
+    count = merge->pluginset ? merge->pluginset->plugincount : 0;
+
+    corsaro_log(merge->glob->logger, "commencing merge for all plugins %u:%u.",
+            fin->interval_id, fin->timestamp);
+
+    if (count == 0) {
+        fin->merges_pending = 1;
+        release_finished_interval(merge, fin);
+        return;
+    }
+
+    /* Set the full count before handing the interval to anyone, as the
+     * fastest plugin may finish before we've queued the rest.
+     */
+    fin->merges_pending = count;
+    job.type = CORSARO_TRACE_MSG_MERGE;
+    job.fin = fin;
+
+    for (i = 0; i < count; i++) {
+        if (merge->pluginmergers[i].threadid == 0 ||
+                zmq_send(merge->zmq_jobsocks[i], &job, sizeof(job), 0) < 0) {
+            corsaro_log(merge->glob->logger,
+                    "unable to queue merge of interval %u for plugin %d",
+                    fin->interval_id, i);
+            release_finished_interval(merge, fin);
+        }
+    }
+}
+
+void corsaro_trace_dispatch_rotate(corsaro_trace_merger_t *merge) {
+
+    corsaro_trace_merge_job_t job;
+    int i, count;
+
+    count = merge->pluginset ? merge->pluginset->plugincount : 0;
+    job.type = CORSARO_TRACE_MSG_ROTATE;
+    job.fin = NULL;
+
+    for (i = 0; i < count; i++) {
+        if (merge->pluginmergers[i].threadid == 0 ||
+                zmq_send(merge->zmq_jobsocks[i], &job, sizeof(job), 0) < 0) {
+            corsaro_log(merge->glob->logger,
+                    "unable to queue output rotation for plugin %d", i);
+        }
+    }
+}
+
+void corsaro_trace_stop_plugin_mergers(corsaro_trace_merger_t *merge) {
+
+    corsaro_trace_merge_job_t job;
+    int i, count;
+
+    if (merge->pluginmergers == NULL) {
+        return;
+    }
+
+    count = merge->pluginset ? merge->pluginset->plugincount : 0;
+    job.type = CORSARO_TRACE_MSG_STOP;
+    job.fin = NULL;
+
+    /* Queued merges are completed before the stop is seen */
+    for (i = 0; i < count; i++) {
+        if (merge->pluginmergers[i].threadid == 0) {
+            continue;
+        }
+        if (zmq_send(merge->zmq_jobsocks[i], &job, sizeof(job), 0) < 0) {
+            corsaro_log(merge->glob->logger,
+                    "unable to send stop to merger for plugin %d: %s", i,
+                    strerror(errno));
+            continue;
+        }
+        pthread_join(merge->pluginmergers[i].threadid, NULL);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (merge->zmq_jobsocks[i]) {
+            zmq_close(merge->zmq_jobsocks[i]);
+        }
+    }
+
+    free(merge->zmq_jobsocks);
+    free(merge->pluginmergers);
+    merge->zmq_jobsocks = NULL;
+    merge->pluginmergers = NULL;
+    pthread_mutex_destroy(&(merge->finmutex));
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,799 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <libtrace.h>
+#include <Judy.h>
+
+#include "libcorsaro_log.h"
+#include "libcorsaro_common.h"
+#include "libcorsaro_tagging.h"
+#include "corsarotrace.h"
+
+/* Largest datagram that we will ever accept from a corsarotagger. */
+#define RECEIVER_SLOT_SIZE (65536)
+
+typedef struct pcaphdr_t {
+    uint32_t ts_sec;        /* Seconds portion of the timestamp */
+    uint32_t ts_usec;       /* Microseconds portion of the timestamp */
+    uint32_t caplen;        /* Capture length of the packet */
+    uint32_t wirelen;       /* The wire length of the packet */
+} pcaphdr_t;
+
+static void fast_construct_packet(libtrace_t *deadtrace,
+        libtrace_packet_t *packet, corsaro_tagged_packet_header_t *taghdr,
+        char *packetcontent, uint16_t *packetbufsize)
+{
+
+    /* Clone of trace_construct_packet() but designed to minimise
+     * memory reallocations.
+     */
+    pcaphdr_t pcaphdr;
+
+    pcaphdr.ts_sec = taghdr->ts_sec;
+    pcaphdr.ts_usec = taghdr->ts_usec;
+    pcaphdr.caplen = taghdr->pktlen;
+    pcaphdr.wirelen = taghdr->pktlen;
+
+    packet->trace = deadtrace;
+    if (*packetbufsize < taghdr->pktlen + sizeof(pcaphdr)) {
+        if (taghdr->pktlen + sizeof(pcaphdr) > 512) {
+            packet->buffer = realloc(packet->buffer,
+                    taghdr->pktlen + sizeof(pcaphdr));
+            *packetbufsize = taghdr->pktlen + sizeof(pcaphdr);
+        } else {
+            packet->buffer = realloc(packet->buffer, 512);
+            *packetbufsize = 512;
+        }
+    }
+
+    packet->buf_control = TRACE_CTRL_PACKET;
+    packet->header = packet->buffer;
+    packet->payload = ((char *)(packet->buffer) + sizeof(pcaphdr));
+
+    memcpy(packet->payload, packetcontent, taghdr->pktlen);
+    memcpy(packet->header, &pcaphdr, sizeof(pcaphdr));
+    packet->type = TRACE_RT_DATA_DLT + TRACE_DLT_EN10MB;
+
+    packet->cached.l2_header = packet->payload;
+    packet->cached.l3_header = NULL;
+    packet->cached.l4_header = NULL;
+    packet->cached.link_type = TRACE_TYPE_ETH;
+    packet->cached.l3_ethertype = 0;
+    packet->cached.transport_proto = 0;
+    packet->cached.capture_length = taghdr->pktlen;
+    packet->cached.wire_length = taghdr->pktlen;
+    packet->cached.payload_length = -1;
+    packet->cached.l2_remaining = taghdr->pktlen;
+    packet->cached.l3_remaining = 0;
+    packet->cached.l4_remaining = 0;
+    packet->refcount = 0;
+    packet->which_trace_start = 0;
+}
+
+/** Splits an nDAG URI (ndag:<interface>,<groupaddr>,<beaconport>) into
+ *  its component parts.
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param uri          The URI to be parsed.
+ *  @param source       The nDAG source to populate with the parsed values.
+ *
+ *  @return 0 if successful, -1 if the URI is not a valid nDAG URI.
+ */
+static int parse_ndag_uri(corsaro_logger_t *logger, char *uri,
+        corsaro_trace_ndag_source_t *source) {
+
+    char *copy, *iface, *group, *port;
+
+    if (strncmp(uri, "ndag:", 5) != 0) {
+        corsaro_log(logger,
+                "native receiver requires an nDAG packet source, not %s", uri);
+        return -1;
+    }
+
+    copy = strdup(uri + 5);
+    iface = copy;
+
+    group = strchr(iface, ',');
+    if (group == NULL) {
+        goto badndaguri;
+    }
+    *group = '\0';
+    group ++;
+
+    port = strchr(group, ',');
+    if (port != NULL) {
+        *port = '\0';
+        port ++;
+        source->beaconport = (uint16_t)strtoul(port, NULL, 10);
+    } else {
+        source->beaconport = 9000;
+    }
+
+    source->iface = strdup(iface);
+    source->groupaddr = strdup(group);
+    free(copy);
+    return 0;
+
+badndaguri:
+    corsaro_log(logger,
+            "invalid nDAG URI %s: expected ndag:<interface>,<group>,<port>",
+            uri);
+    free(copy);
+    return -1;
+}
+
+/** Creates a UDP socket that has joined a multicast group on a given port.
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param source       The nDAG source describing the interface and group.
+ *  @param port         The port to bind to.
+ *  @param rcvbuf       The socket receive buffer size to request (0 to leave
+ *                      the system default in place).
+ *
+ *  @return the file descriptor of the new socket, or -1 if an error occurs.
+ */
+static int join_ndag_group(corsaro_logger_t *logger,
+        corsaro_trace_ndag_source_t *source, uint16_t port, uint32_t rcvbuf) {
+
+    struct addrinfo hints, *gotten = NULL;
+    struct group_req greq;
+    char portstr[16];
+    int sock = -1;
+    int reuse = 1;
+    int level;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_protocol = 0;
+
+    snprintf(portstr, 16, "%u", port);
+
+    if (getaddrinfo(source->groupaddr, portstr, &hints, &gotten) != 0) {
+        corsaro_log(logger, "unable to resolve multicast group %s: %s",
+                source->groupaddr, strerror(errno));
+        return -1;
+    }
+
+    sock = socket(gotten->ai_family, gotten->ai_socktype, 0);
+    if (sock < 0) {
+        corsaro_log(logger, "unable to create multicast socket: %s",
+                strerror(errno));
+        goto joinfail;
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                sizeof(reuse)) < 0) {
+        corsaro_log(logger, "unable to set SO_REUSEADDR on multicast socket: %s",
+                strerror(errno));
+        goto joinfail;
+    }
+
+    if (rcvbuf > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+                sizeof(rcvbuf)) < 0) {
+        corsaro_log(logger,
+                "warning: unable to set receive buffer size to %u on multicast socket: %s",
+                rcvbuf, strerror(errno));
+    }
+
+    if (bind(sock, gotten->ai_addr, gotten->ai_addrlen) < 0) {
+        corsaro_log(logger, "unable to bind to %s:%u: %s",
+                source->groupaddr, port, strerror(errno));
+        goto joinfail;
+    }
+
+    memset(&greq, 0, sizeof(greq));
+    greq.gr_interface = if_nametoindex(source->iface);
+    if (greq.gr_interface == 0) {
+        corsaro_log(logger, "unable to find interface %s: %s",
+                source->iface, strerror(errno));
+        goto joinfail;
+    }
+    memcpy(&(greq.gr_group), gotten->ai_addr, gotten->ai_addrlen);
+
+    if (gotten->ai_family == AF_INET6) {
+        level = IPPROTO_IPV6;
+    } else {
+        level = IPPROTO_IP;
+    }
+
+    if (setsockopt(sock, level, MCAST_JOIN_GROUP, &greq, sizeof(greq)) < 0) {
+        corsaro_log(logger, "unable to join multicast group %s on %s: %s",
+                source->groupaddr, source->iface, strerror(errno));
+        goto joinfail;
+    }
+
+    freeaddrinfo(gotten);
+    return sock;
+
+joinfail:
+    if (sock >= 0) {
+        close(sock);
+    }
+    freeaddrinfo(gotten);
+    return -1;
+}
+
+static int check_ndag_header(uint8_t *buf, uint32_t len, uint8_t *type) {
+
+    corsaro_ndag_common_t *common = (corsaro_ndag_common_t *)buf;
+
+    if (len < sizeof(corsaro_ndag_common_t)) {
+        return -1;
+    }
+
+    if (ntohl(common->magic) != CORSARO_NDAG_MAGIC_NUMBER) {
+        return -1;
+    }
+
+    if (common->version != CORSARO_NDAG_EXPORT_VERSION) {
+        return -1;
+    }
+
+    *type = common->type;
+    return 0;
+}
+
+int corsaro_trace_discover_ndag_streams(corsaro_trace_global_t *glob,
+        corsaro_trace_ndag_source_t *source) {
+
+    uint8_t buf[RECEIVER_SLOT_SIZE];
+    struct pollfd pfd;
+    uint16_t *ptr;
+    uint8_t type;
+    int sock, ret, i;
+
+    if (parse_ndag_uri(glob->logger, glob->source_uri, source) < 0) {
+        return -1;
+    }
+
+    sock = join_ndag_group(glob->logger, source, source->beaconport, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    corsaro_log(glob->logger,
+            "waiting for nDAG beacon on %s:%u...", source->groupaddr,
+            source->beaconport);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+
+    while (!corsaro_halted) {
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, 1000);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            corsaro_log(glob->logger, "error while polling beacon socket: %s",
+                    strerror(errno));
+            break;
+        }
+        if (ret == 0) {
+            continue;
+        }
+
+        ret = recv(sock, buf, RECEIVER_SLOT_SIZE, 0);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            corsaro_log(glob->logger, "error while reading beacon: %s",
+                    strerror(errno));
+            break;
+        }
+
+        if (check_ndag_header(buf, ret, &type) < 0 ||
+                type != CORSARO_NDAG_PKT_BEACON) {
+            continue;
+        }
+
+        if (ret < sizeof(corsaro_ndag_common_t) + sizeof(uint16_t)) {
+            continue;
+        }
+
+        ptr = (uint16_t *)(buf + sizeof(corsaro_ndag_common_t));
+        source->numstreams = ntohs(*ptr);
+        ptr ++;
+
+        if (source->numstreams == 0 || ret < sizeof(corsaro_ndag_common_t) +
+                    (source->numstreams + 1) * sizeof(uint16_t)) {
+            continue;
+        }
+
+        source->streamports = calloc(source->numstreams, sizeof(uint16_t));
+        for (i = 0; i < source->numstreams; i++) {
+            source->streamports[i] = ntohs(*ptr);
+            ptr ++;
+        }
+
+        corsaro_log(glob->logger, "nDAG beacon advertises %u streams",
+                source->numstreams);
+        close(sock);
+        return 0;
+    }
+
+    close(sock);
+    return -1;
+}
+
+void corsaro_trace_free_ndag_source(corsaro_trace_ndag_source_t *source) {
+    if (source->iface) {
+        free(source->iface);
+    }
+    if (source->groupaddr) {
+        free(source->groupaddr);
+    }
+    if (source->streamports) {
+        free(source->streamports);
+    }
+}
+
+static inline corsaro_tagged_loss_tracker_t *get_stream_tracker(
+        corsaro_trace_worker_t *tls, uint32_t taggerid, uint16_t hashbin) {
+
+    PWord_t pval;
+    Word_t key = (((Word_t)taggerid) << 16) | hashbin;
+    corsaro_tagged_loss_tracker_t *tracker;
+
+    JLI(pval, tls->streamlosses, key);
+    if (*pval == 0) {
+        tracker = corsaro_create_tagged_loss_tracker(0);
+        tracker->taggerid = taggerid;
+        *pval = (Word_t)tracker;
+    }
+    return (corsaro_tagged_loss_tracker_t *)(*pval);
+}
+
+static inline void log_tagger_loss(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls, uint32_t taggerid, uint64_t lost,
+        uint32_t instances, uint64_t received) {
+
+    if (lost == 0) {
+        return;
+    }
+    corsaro_log(glob->logger,
+            "warning: worker thread %d has observed %lu packets dropped from tagger %u in the past interval (%u instances) -- %lu",
+            tls->workerid, lost, taggerid, instances, received);
+}
+
+void corsaro_trace_report_stream_loss(corsaro_trace_global_t *glob,
+        corsaro_trace_worker_t *tls) {
+
+    Word_t index = 0;
+    PWord_t pval;
+    corsaro_tagged_loss_tracker_t *st;
+    uint32_t curtagger = 0;
+    uint64_t lost = 0, received = 0;
+    uint32_t instances = 0;
+    int seen = 0;
+
+    /* Keys are ordered by tagger first, so we can total each tagger as
+     * we walk its hashbins.
+     */
+    JLF(pval, tls->streamlosses, index);
+    while (pval) {
+        uint32_t taggerid = (uint32_t)(index >> 16);
+        uint16_t hashbin = (uint16_t)(index & 0xffff);
+
+        st = (corsaro_tagged_loss_tracker_t *)(*pval);
+
+        if (seen && taggerid != curtagger) {
+            log_tagger_loss(glob, tls, curtagger, lost, instances, received);
+            lost = 0;
+            instances = 0;
+            received = 0;
+        }
+        curtagger = taggerid;
+        seen = 1;
+
+        if (st->lostpackets > 0) {
+            corsaro_log(glob->logger,
+                    "warning: worker thread %d has observed %lu packets dropped from tagger %u, hashbin %u (%u instances) -- %lu",
+                    tls->workerid, st->lostpackets, taggerid, hashbin,
+                    st->lossinstances, st->packetsreceived);
+        }
+
+        lost += st->lostpackets;
+        instances += st->lossinstances;
+        received += st->packetsreceived;
+
+        tls->tracker->lostpackets += st->lostpackets;
+        tls->tracker->lossinstances += st->lossinstances;
+        tls->tracker->packetsreceived += st->packetsreceived;
+        tls->tracker->bytesreceived += st->bytesreceived;
+        corsaro_reset_tagged_loss_tracker(st);
+
+        JLN(pval, tls->streamlosses, index);
+    }
+
+    if (seen) {
+        log_tagger_loss(glob, tls, curtagger, lost, instances, received);
+    }
+}
+
+void corsaro_trace_free_stream_loss(corsaro_trace_worker_t *tls) {
+    Word_t index = 0;
+    PWord_t pval;
+    Word_t rcint;
+
+    JLF(pval, tls->streamlosses, index);
+    while (pval) {
+        corsaro_free_tagged_loss_tracker(
+                (corsaro_tagged_loss_tracker_t *)(*pval));
+        JLN(pval, tls->streamlosses, index);
+    }
+    JLFA(rcint, tls->streamlosses);
+}
+
+/** Decodes a single nDAG datagram and passes each tagged packet within it
+ *  on to the plugins.
+ *
+ *  @param rx           The receiver that read the datagram.
+ *  @param buf          The start of the datagram.
+ *  @param len          The length of the datagram.
+ */
+static void process_datagram(corsaro_trace_receiver_t *rx, uint8_t *buf,
+        uint32_t len) {
+
+    corsaro_trace_worker_t *tls = rx->tls;
+    corsaro_ndag_encap_t *encap;
+    corsaro_tagged_packet_header_t *taghdr;
+    uint16_t hashbin, pktlen;
+    uint32_t rem;
+    uint8_t *ptr;
+    uint8_t type;
+
+    if (check_ndag_header(buf, len, &type) < 0) {
+        rx->malformed ++;
+        return;
+    }
+
+    if (type != CORSARO_NDAG_PKT_CORSAROTAG) {
+        /* keep alives etc. carry no packets */
+        return;
+    }
+
+    if (len < sizeof(corsaro_ndag_common_t) + sizeof(corsaro_ndag_encap_t)) {
+        rx->malformed ++;
+        return;
+    }
+
+    encap = (corsaro_ndag_encap_t *)(buf + sizeof(corsaro_ndag_common_t));
+    hashbin = ntohs(encap->streamid);
+
+    ptr = buf + sizeof(corsaro_ndag_common_t) + sizeof(corsaro_ndag_encap_t);
+    rem = len - (sizeof(corsaro_ndag_common_t) + sizeof(corsaro_ndag_encap_t));
+
+    while (rem >= sizeof(corsaro_tagged_packet_header_t) && !tls->stopped) {
+        taghdr = (corsaro_tagged_packet_header_t *)ptr;
+        pktlen = ntohs(taghdr->pktlen);
+
+        if (rem - sizeof(corsaro_tagged_packet_header_t) < pktlen) {
+            rx->malformed ++;
+            return;
+        }
+
+        corsaro_trace_process_tagged_record(rx, hashbin, taghdr);
+
+        ptr += (sizeof(corsaro_tagged_packet_header_t) + pktlen);
+        rem -= (sizeof(corsaro_tagged_packet_header_t) + pktlen);
+    }
+}
+
+/* Loss tracking, optional recording and plugin processing for a single
+ * tagged record. Shared by the live receiver and the replayer.
+ */
+void corsaro_trace_process_tagged_record(corsaro_trace_receiver_t *rx,
+        uint16_t hashbin, corsaro_tagged_packet_header_t *taghdr) {
+
+    corsaro_trace_global_t *glob = rx->glob;
+    corsaro_trace_worker_t *tls = rx->tls;
+    corsaro_tagged_packet_header_t hosthdr;
+    corsaro_tagged_loss_tracker_t *tracker;
+
+    tracker = get_stream_tracker(tls, ntohl(taghdr->tagger_id), hashbin);
+    corsaro_update_tagged_loss_tracker(tracker, taghdr);
+
+    if (rx->recorder && corsaro_write_tagrecord(glob->logger, rx->recorder,
+                hashbin, taghdr) < 0) {
+        corsaro_log(glob->logger,
+                "disabling recording for worker %d", rx->workerid);
+        corsaro_destroy_tagrecord_writer(rx->recorder);
+        rx->recorder = NULL;
+    }
+
+    hosthdr.ts_sec = ntohl(taghdr->ts_sec);
+    hosthdr.ts_usec = ntohl(taghdr->ts_usec);
+    hosthdr.pktlen = ntohs(taghdr->pktlen);
+    hosthdr.wirelen = ntohs(taghdr->wirelen);
+
+    fast_construct_packet(rx->deadtrace, rx->packet, &hosthdr,
+            ((char *)taghdr) + sizeof(corsaro_tagged_packet_header_t),
+            &(rx->packetbufsize));
+
+    corsaro_trace_process_packet(glob, tls, rx->packet, &(taghdr->tags),
+            hosthdr.ts_sec, ntohs(taghdr->filterbits));
+}
+
+int corsaro_trace_init_receiver(corsaro_trace_receiver_t *rx) {
+
+    corsaro_trace_global_t *glob = rx->glob;
+    int i;
+
+    /* Only live receivers need a receive ring, replayers read straight
+     * from the record file.
+     */
+    if (rx->sockcount > 0) {
+        rx->msgs = calloc(glob->recvbatchsize, sizeof(struct mmsghdr));
+        rx->iovs = calloc(glob->recvbatchsize, sizeof(struct iovec));
+        rx->ring = malloc(((size_t)glob->recvbatchsize) * RECEIVER_SLOT_SIZE);
+
+        if (rx->msgs == NULL || rx->iovs == NULL || rx->ring == NULL) {
+            corsaro_log(glob->logger,
+                    "out of memory while allocating receive ring for worker %d",
+                    rx->workerid);
+            return -1;
+        }
+
+        for (i = 0; i < glob->recvbatchsize; i++) {
+            rx->iovs[i].iov_base = rx->ring +
+                    (((size_t)i) * RECEIVER_SLOT_SIZE);
+            rx->iovs[i].iov_len = RECEIVER_SLOT_SIZE;
+            rx->msgs[i].msg_hdr.msg_iov = &(rx->iovs[i]);
+            rx->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    if (glob->recordfile) {
+        char fname[1024];
+
+        snprintf(fname, 1024, "%s-t%02d", glob->recordfile, rx->workerid);
+        rx->recorder = corsaro_create_tagrecord_writer(glob->logger, fname, 1);
+        if (rx->recorder == NULL) {
+            return -1;
+        }
+    }
+
+    rx->deadtrace = trace_create_dead("pcapfile:-");
+    rx->packet = trace_create_packet();
+    rx->packetbufsize = 0;
+    return 0;
+}
+
+void corsaro_trace_destroy_receiver(corsaro_trace_receiver_t *rx) {
+    int i;
+
+    for (i = 0; i < rx->sockcount; i++) {
+        close(rx->socks[i]);
+    }
+    if (rx->socks) {
+        free(rx->socks);
+    }
+    if (rx->msgs) {
+        free(rx->msgs);
+    }
+    if (rx->iovs) {
+        free(rx->iovs);
+    }
+    if (rx->ring) {
+        free(rx->ring);
+    }
+    if (rx->recorder) {
+        corsaro_log(rx->glob->logger, "worker %d recorded %lu tagged records",
+                rx->workerid, rx->recorder->records);
+        corsaro_destroy_tagrecord_writer(rx->recorder);
+        rx->recorder = NULL;
+    }
+    if (rx->packet) {
+        trace_destroy_packet(rx->packet);
+    }
+    if (rx->deadtrace) {
+        trace_destroy_dead(rx->deadtrace);
+    }
+}
+
+static void *start_receiver_thread(void *data) {
+
+    corsaro_trace_receiver_t *rx = (corsaro_trace_receiver_t *)data;
+    corsaro_trace_global_t *glob = rx->glob;
+    struct pollfd *pfds;
+    int i, j, ret;
+
+    rx->tls = corsaro_trace_init_worker(glob, rx->workerid);
+
+    pfds = calloc(rx->sockcount, sizeof(struct pollfd));
+    for (i = 0; i < rx->sockcount; i++) {
+        pfds[i].fd = rx->socks[i];
+        pfds[i].events = POLLIN;
+    }
+
+    if (corsaro_trace_init_receiver(rx) < 0) {
+        rx->tls->stopped = 1;
+    }
+
+    while (!corsaro_halted && !rx->tls->stopped) {
+        ret = poll(pfds, rx->sockcount, 100);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            corsaro_log(glob->logger,
+                    "error while polling sockets in receiver %d: %s",
+                    rx->workerid, strerror(errno));
+            break;
+        }
+
+        for (i = 0; i < rx->sockcount && ret > 0; i++) {
+            int got;
+
+            if (!(pfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            got = recvmmsg(rx->socks[i], rx->msgs, glob->recvbatchsize,
+                    MSG_DONTWAIT, NULL);
+            if (got < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                        errno == EINTR) {
+                    continue;
+                }
+                corsaro_log(glob->logger,
+                        "error while receiving datagrams in receiver %d: %s",
+                        rx->workerid, strerror(errno));
+                rx->tls->stopped = 1;
+                break;
+            }
+
+            for (j = 0; j < got; j++) {
+                rx->datagrams ++;
+                if (rx->msgs[j].msg_hdr.msg_flags & MSG_TRUNC) {
+                    rx->truncated ++;
+                    continue;
+                }
+                process_datagram(rx, (uint8_t *)rx->iovs[j].iov_base,
+                        rx->msgs[j].msg_len);
+            }
+        }
+    }
+
+    corsaro_trace_halt_worker(glob, rx->tls, 1);
+
+    corsaro_log(glob->logger,
+            "receiver %d read %lu datagrams (%lu truncated, %lu malformed)",
+            rx->workerid, rx->datagrams, rx->truncated,
+            rx->malformed);
+
+    free(pfds);
+    corsaro_free_tagged_loss_tracker(rx->tls->tracker);
+    free(rx->tls);
+    rx->tls = NULL;
+    pthread_exit(NULL);
+}
+
+int corsaro_trace_run_receivers(corsaro_trace_global_t *glob,
+        corsaro_trace_ndag_source_t *source) {
+
+    corsaro_trace_receiver_t *receivers;
+    sigset_t sig_before, sig_block_all;
+    int i, sock, ret = 0;
+
+    receivers = calloc(glob->threads, sizeof(corsaro_trace_receiver_t));
+
+    for (i = 0; i < glob->threads; i++) {
+        receivers[i].glob = glob;
+        receivers[i].source = source;
+        receivers[i].workerid = i;
+        receivers[i].socks = calloc(source->numstreams, sizeof(int));
+    }
+
+    /* Streams are dealt out to the processing threads round-robin */
+    for (i = 0; i < source->numstreams; i++) {
+        corsaro_trace_receiver_t *rx = &(receivers[i % glob->threads]);
+
+        sock = join_ndag_group(glob->logger, source, source->streamports[i],
+                glob->recvbufsize);
+        if (sock < 0) {
+            /* The merger still expects a stop message from every processing
+             * thread, so start them anyway and let them halt immediately.
+             */
+            corsaro_halted = 1;
+            ret = -1;
+            break;
+        }
+        rx->socks[rx->sockcount] = sock;
+        rx->sockcount ++;
+    }
+
+    sigfillset(&sig_block_all);
+    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
+        corsaro_log(glob->logger,
+                "unable to disable signals before starting receiver threads.");
+    }
+
+    for (i = 0; i < glob->threads; i++) {
+        pthread_create(&(receivers[i].threadid), NULL, start_receiver_thread,
+                &(receivers[i]));
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
+        corsaro_log(glob->logger,
+                "unable to re-enable signals after starting receiver threads.");
+    }
+
+    for (i = 0; i < glob->threads; i++) {
+        pthread_join(receivers[i].threadid, NULL);
+    }
+
+    for (i = 0; i < glob->threads; i++) {
+        corsaro_trace_destroy_receiver(&(receivers[i]));
+    }
+    free(receivers);
+    return ret;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
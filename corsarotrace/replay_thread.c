@@ -0,0 +1,218 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <libtrace.h>
+
+#include "libcorsaro_log.h"
+#include "libcorsaro_tagging.h"
+#include "libcorsaro_tagrecord.h"
+#include "corsarotrace.h"
+
+typedef struct corsaro_trace_replayer {
+    corsaro_trace_receiver_t rx;
+
+    /* Local copies of the replay start times, so we only need to take
+     * the global mutex once.
+     */
+    uint64_t first_pkt_us;
+    uint64_t first_wall_us;
+} corsaro_trace_replayer_t;
+
+/* Packet time and wall time of the first replayed record, shared by all
+ * replay threads so that they stay in step with each other.
+ */
+static uint64_t replay_first_pkt_us = 0;
+static uint64_t replay_first_wall_us = 0;
+
+static inline uint64_t wall_time_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/** Delays the replay of a record until the same amount of time has passed
+ *  since the start of the replay as had passed between the first record in
+ *  the recording and this one.
+ *
+ *  @param glob         The global state for this corsarotrace instance.
+ *  @param rp           The replayer that is about to replay the record.
+ *  @param taghdr       The tagged header of the record.
+ */
+static void pace_replay(corsaro_trace_global_t *glob,
+        corsaro_trace_replayer_t *rp, corsaro_tagged_packet_header_t *taghdr) {
+
+    uint64_t pktus, now, target;
+
+    pktus = ((uint64_t)ntohl(taghdr->ts_sec)) * 1000000 +
+            ntohl(taghdr->ts_usec);
+
+    if (rp->first_wall_us == 0) {
+        pthread_mutex_lock(&(glob->mutex));
+        if (replay_first_wall_us == 0) {
+            replay_first_pkt_us = pktus;
+            replay_first_wall_us = wall_time_us();
+        }
+        rp->first_pkt_us = replay_first_pkt_us;
+        rp->first_wall_us = replay_first_wall_us;
+        pthread_mutex_unlock(&(glob->mutex));
+    }
+
+    if (pktus <= rp->first_pkt_us) {
+        return;
+    }
+
+    target = rp->first_wall_us + (pktus - rp->first_pkt_us);
+    now = wall_time_us();
+    if (target > now) {
+        usleep(target - now);
+    }
+}
+
+static void *start_replay_thread(void *data) {
+
+    corsaro_trace_replayer_t *rp = (corsaro_trace_replayer_t *)data;
+    corsaro_trace_receiver_t *rx = &(rp->rx);
+    corsaro_trace_global_t *glob = rx->glob;
+    corsaro_tagrecord_reader_t *reader = NULL;
+    corsaro_tagged_packet_header_t *taghdr;
+    uint16_t hashbin;
+    char fname[1024];
+    int ret;
+
+    rx->tls = corsaro_trace_init_worker(glob, rx->workerid);
+
+    if (corsaro_trace_init_receiver(rx) < 0) {
+        rx->tls->stopped = 1;
+    }
+
+    /* Each replay thread reads the file recorded by the processing thread
+     * with the same id, so every thread sees exactly the records that it
+     * would have been given by the live receiver.
+     */
+    snprintf(fname, 1024, "%s-t%02d", glob->replayprefix, rx->workerid);
+    reader = corsaro_create_tagrecord_reader(glob->logger, fname);
+    if (reader == NULL) {
+        rx->tls->stopped = 1;
+    }
+
+    while (!corsaro_halted && !rx->tls->stopped) {
+        ret = corsaro_read_tagrecord(glob->logger, reader, &hashbin, &taghdr);
+        if (ret <= 0) {
+            break;
+        }
+
+        if (glob->replayrealtime) {
+            pace_replay(glob, rp, taghdr);
+        }
+        corsaro_trace_process_tagged_record(rx, hashbin, taghdr);
+    }
+
+    /* Treat the end of a recording like the end of a trace file */
+    corsaro_trace_halt_worker(glob, rx->tls, 0);
+
+    if (reader) {
+        corsaro_log(glob->logger, "worker %d replayed %lu records from %s",
+                rx->workerid, reader->records, fname);
+        corsaro_destroy_tagrecord_reader(reader);
+    }
+
+    corsaro_free_tagged_loss_tracker(rx->tls->tracker);
+    free(rx->tls);
+    rx->tls = NULL;
+    pthread_exit(NULL);
+}
+
+int corsaro_trace_run_replayers(corsaro_trace_global_t *glob) {
+
+    corsaro_trace_replayer_t *replayers;
+    sigset_t sig_before, sig_block_all;
+    int i;
+
+    replayers = calloc(glob->threads, sizeof(corsaro_trace_replayer_t));
+
+    sigfillset(&sig_block_all);
+    if (pthread_sigmask(SIG_SETMASK, &sig_block_all, &sig_before) < 0) {
+        corsaro_log(glob->logger,
+                "unable to disable signals before starting replay threads.");
+    }
+
+    for (i = 0; i < glob->threads; i++) {
+        replayers[i].rx.glob = glob;
+        replayers[i].rx.workerid = i;
+        pthread_create(&(replayers[i].rx.threadid), NULL, start_replay_thread,
+                &(replayers[i]));
+    }
+
+    if (pthread_sigmask(SIG_SETMASK, &sig_before, NULL) < 0) {
+        corsaro_log(glob->logger,
+                "unable to re-enable signals after starting replay threads.");
+    }
+
+    for (i = 0; i < glob->threads; i++) {
+        pthread_join(replayers[i].rx.threadid, NULL);
+        corsaro_trace_destroy_receiver(&(replayers[i].rx));
+    }
+
+    free(replayers);
+    return 0;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
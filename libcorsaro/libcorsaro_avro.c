@@ -47,10 +47,27 @@
  * MODIFICATIONS.
  */
 
+#include "config.h"
+
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "libcorsaro_avro.h"
 #include "libcorsaro.h"
@@ -80,9 +97,38 @@ corsaro_avro_writer_t *corsaro_create_avro_writer(corsaro_logger_t *logger,
     w->logger = logger;
     w->iface = NULL;
 
+    w->fname = NULL;
+
     w->encodespace = NULL;
     w->encodesize = 0;
     w->encodeused = 0;
+
+    w->blockout = NULL;
+    w->blockcodec = CORSARO_AVRO_CODEC_DEFLATE;
+    w->blocklevel = 0;
+    w->blockrecords = 0;
+    w->blockused = 0;
+    w->cpool = NULL;
+    w->pendinghead = NULL;
+    w->pendingtail = NULL;
+    w->pendingcount = 0;
+    w->sparejobs = NULL;
+    w->codecctx = NULL;
+    w->blockmode = 0;
+    w->filewriter = NULL;
+    w->fwfile = NULL;
+    w->outbuf = NULL;
+    w->outused = 0;
+    w->outsize = 0;
+    w->memwriter = NULL;
+    memset(&(w->stats), 0, sizeof(w->stats));
+    w->indexing = 0;
+    w->fileoffset = 0;
+    w->blockhaskeys = 0;
+    w->index = NULL;
+    w->indexcount = 0;
+    w->indexalloc = 0;
+    w->writedone = 1;
     return w;
 
 }
@@ -115,6 +161,84 @@ corsaro_avro_reader_t *corsaro_create_avro_reader(corsaro_logger_t *logger,
     return r;
 }
 
+/* Per-thread compression state, so that deflate streams and zstd contexts
+ * can be reused from one block to the next.
+ */
+typedef struct corsaro_avro_codec_ctx {
+    z_stream zstrm;
+    uint8_t zstrm_init;
+    int zlevel;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zctx;
+#endif
+} corsaro_avro_codec_ctx_t;
+
+/* A single block of encoded records, plus the compressed version of it */
+typedef struct corsaro_avro_block_job {
+    char *raw;
+    uint32_t rawsize;
+    uint32_t rawlen;
+    uint32_t records;
+
+    char *comp;
+    uint32_t compsize;
+    uint32_t complen;
+
+    uint8_t codec;
+    int level;
+    uint8_t done;
+    uint8_t failed;
+    uint64_t compressusec;
+
+    /* Range of record keys in the block, if the writer is indexing */
+    corsaro_avro_index_entry_t keys;
+    uint8_t haskeys;
+
+    /* Next job in the writer's pending or spare list */
+    struct corsaro_avro_block_job *next;
+    /* Next job in the compression pool's queue */
+    struct corsaro_avro_block_job *qnext;
+} corsaro_avro_block_job_t;
+
+struct corsaro_avro_compress_pool {
+    pthread_mutex_t mutex;
+    /* Signalled when a job is added to the queue or the pool is halted */
+    pthread_cond_t notempty;
+    /* Broadcast whenever a job has been compressed */
+    pthread_cond_t jobdone;
+
+    corsaro_avro_block_job_t *queuehead;
+    corsaro_avro_block_job_t *queuetail;
+
+    pthread_t *threads;
+    uint8_t threadcount;
+    uint8_t halted;
+    corsaro_logger_t *logger;
+};
+
+static void clear_avro_codec_ctx(corsaro_avro_codec_ctx_t *ctx) {
+    if (ctx->zstrm_init) {
+        deflateEnd(&(ctx->zstrm));
+        ctx->zstrm_init = 0;
+    }
+#ifdef HAVE_ZSTD
+    if (ctx->zctx) {
+        ZSTD_freeCCtx(ctx->zctx);
+        ctx->zctx = NULL;
+    }
+#endif
+}
+
+static void free_avro_block_job(corsaro_avro_block_job_t *job) {
+    if (job->raw) {
+        free(job->raw);
+    }
+    if (job->comp) {
+        free(job->comp);
+    }
+    free(job);
+}
+
 void corsaro_destroy_avro_writer(corsaro_avro_writer_t *writer) {
 
     if (writer->schema) {
@@ -126,7 +250,7 @@ void corsaro_destroy_avro_writer(corsaro_avro_writer_t *writer) {
         avro_value_decref(&(writer->value));
     }
 
-    if (writer->out) {
+    if (writer->out || writer->blockmode) {
         corsaro_close_avro_writer(writer);
         assert(writer->out == NULL);
     }
@@ -135,10 +259,33 @@ void corsaro_destroy_avro_writer(corsaro_avro_writer_t *writer) {
         free(writer->encodespace);
     }
 
+    while (writer->sparejobs) {
+        corsaro_avro_block_job_t *job = writer->sparejobs;
+        writer->sparejobs = job->next;
+        free_avro_block_job(job);
+    }
+
+    if (writer->codecctx) {
+        clear_avro_codec_ctx(writer->codecctx);
+        free(writer->codecctx);
+    }
+
+    if (writer->outbuf) {
+        free(writer->outbuf);
+    }
+
+    if (writer->memwriter) {
+        avro_writer_free(writer->memwriter);
+    }
+
     if (writer->fname) {
         free(writer->fname);
     }
 
+    if (writer->index) {
+        free(writer->index);
+    }
+
     free(writer);
 
 }
@@ -216,14 +363,50 @@ int corsaro_read_next_avro_record(corsaro_avro_reader_t *reader,
 }
 
 
+static int flush_avro_block(corsaro_avro_writer_t *writer);
+static int write_finished_avro_blocks(corsaro_avro_writer_t *writer,
+        uint32_t allowed);
+static int commit_avro_output(corsaro_avro_writer_t *writer);
+static int write_avro_index(corsaro_avro_writer_t *writer);
+
 int corsaro_close_avro_writer(corsaro_avro_writer_t *writer) {
 
-    if (writer->out == NULL) {
+    if (writer->blockmode) {
+        flush_avro_block(writer);
+        write_finished_avro_blocks(writer, 0);
+        writer->blockmode = 0;
+        writer->encodeused = 0;
+
+        if (writer->indexing) {
+            write_avro_index(writer);
+        }
+
+        if (writer->fwfile) {
+            /* The file writer creates the .done file for us, once
+             * everything before it has been written and the file closed.
+             */
+            commit_avro_output(writer);
+            corsaro_filewriter_close(writer->fwfile, writer->writedone);
+            writer->fwfile = NULL;
+            return 0;
+        }
+
+        if (fclose(writer->blockout) != 0) {
+            corsaro_log(writer->logger,
+                    "error while closing Avro output file %s: %s",
+                    writer->fname, strerror(errno));
+        }
+        writer->blockout = NULL;
+    } else if (writer->out == NULL) {
         return 0;
+    } else {
+        avro_file_writer_close(writer->out);
+        writer->out = NULL;
     }
 
-    avro_file_writer_close(writer->out);
-    writer->out = NULL;
+    if (!writer->writedone) {
+        return 0;
+    }
 
     char donebuf[1024];
     if (snprintf(donebuf, sizeof(donebuf), "%s.done", writer->fname)
@@ -242,7 +425,7 @@ int corsaro_close_avro_writer(corsaro_avro_writer_t *writer) {
 }
 
 int corsaro_is_avro_writer_active(corsaro_avro_writer_t *writer) {
-    if (writer->out != NULL) {
+    if (writer->out != NULL || writer->blockmode) {
         return 1;
     }
     return 0;
@@ -254,13 +437,16 @@ int corsaro_start_avro_writer(corsaro_avro_writer_t *writer, char *fname,
     int ret = -1;
     avro_schema_error_t error;
 
-    if (writer->out != NULL) {
+    if (writer->out != NULL || writer->blockmode) {
         corsaro_log(writer->logger,
                 "attempting to start an Avro writer when it is already open!");
         return -1;
     }
 
     /* Save file name so we can create a .done file */
+    if (writer->fname) {
+        free(writer->fname);
+    }
     writer->fname = strdup(fname);
 
     if (writer->schema == NULL) {
@@ -305,218 +491,1541 @@ int corsaro_start_avro_writer(corsaro_avro_writer_t *writer, char *fname,
 
 #define CORSARO_INIT_AVRO_ENCODING_SPACE (8096)
 
-int corsaro_start_avro_encoding(corsaro_avro_writer_t *writer) {
+/* Makes sure the output staging buffer has room for 'len' more bytes */
+static int reserve_avro_output(corsaro_avro_writer_t *writer, uint32_t len) {
 
-    if (writer->encodespace == NULL) {
-        writer->encodespace = (char *)malloc(CORSARO_INIT_AVRO_ENCODING_SPACE);
-        writer->encodesize = CORSARO_INIT_AVRO_ENCODING_SPACE;
+    char *tmp;
+    uint32_t newsize;
+
+    if (writer->outsize - writer->outused >= len) {
+        return 0;
     }
 
-    writer->encodeused = 0;
-    if (writer->encodespace == NULL) {
+    newsize = writer->outused + len + CORSARO_INIT_AVRO_ENCODING_SPACE;
+    tmp = (char *)realloc(writer->outbuf, newsize);
+    if (tmp == NULL) {
         return -1;
     }
+    writer->outbuf = tmp;
+    writer->outsize = newsize;
     return 0;
 }
 
-static inline void grow_encode_buffer(corsaro_avro_writer_t *writer) {
-    writer->encodespace = (char *)realloc(writer->encodespace,
-                writer->encodesize + CORSARO_INIT_AVRO_ENCODING_SPACE);
-    writer->encodesize += CORSARO_INIT_AVRO_ENCODING_SPACE;
-}
+static int write_avro_raw(corsaro_avro_writer_t *writer, const void *bytes,
+        uint32_t len) {
 
-int corsaro_encode_avro_field(corsaro_avro_writer_t *writer,
-        uint8_t fieldtype, void *fieldptr, uint32_t fieldlen) {
+    if (reserve_avro_output(writer, len) < 0) {
+        return -1;
+    }
+    memcpy(writer->outbuf + writer->outused, bytes, len);
+    writer->outused += len;
+    return 0;
+}
 
-    if (fieldtype == CORSARO_AVRO_LONG) {
-        int64_t l;
-        uint64_t n;
+/* Adds a zigzag varint to the output staging buffer, returning the number
+ * of bytes added.
+ */
+static int write_avro_long(corsaro_avro_writer_t *writer, int64_t l) {
 
-        if (fieldlen == 1) {
-            l = *(uint8_t *)(fieldptr);
-        } else if (fieldlen == 2) {
-            l = *(uint16_t *)(fieldptr);
-        } else if (fieldlen == 4) {
-            l = *(uint32_t *)(fieldptr);
-        } else if (fieldlen == 8) {
-            l = *(uint64_t *)(fieldptr);
-        } else {
-            corsaro_log(writer->logger,
-                    "unexpected integer size of %u when encoding avro.",
-                    fieldlen);
-            return -1;
-        }
+    uint8_t buf[10];
+    uint64_t n = (l << 1) ^ (l >> 63);
+    int i = 0;
 
-        if (writer->encodesize - writer->encodeused < 8) {
-            grow_encode_buffer(writer);
-        }
+    while (n & ~0x7F) {
+        buf[i] = (uint8_t)((n & 0x7F) | 0x80);
+        n >>= 7;
+        i ++;
+    }
+    buf[i] = (uint8_t)n;
+    i ++;
 
-        n = (l << 1) ^ (l >> 63);
+    if (write_avro_raw(writer, buf, i) < 0) {
+        return -1;
+    }
+    return i;
+}
 
-        while (n & ~0x7F) {
-            writer->encodespace[writer->encodeused] = 
-                    (char)((((uint8_t) n) & 0x7F) | 0x80);
-            n >>= 7;
-            writer->encodeused ++;
-        }
-        writer->encodespace[writer->encodeused] = (char)n;
-        writer->encodeused ++;
-    } else if (fieldtype == CORSARO_AVRO_STRING) {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &fieldlen,
-                sizeof(fieldlen)) < 0) {
-            corsaro_log(writer->logger,
-                    "unable to encode length of avro string.");
-            return -1;
-        }
+static int write_avro_bytes(corsaro_avro_writer_t *writer, const void *bytes,
+        uint32_t len) {
 
-        if (writer->encodesize - writer->encodeused < fieldlen) {
-            grow_encode_buffer(writer);
-        }
-        memcpy(writer->encodespace + writer->encodeused, fieldptr, fieldlen);
-        writer->encodeused += fieldlen;
-    } else {
-        corsaro_log(writer->logger,
-                "asked to encode unexpected avro type %u\n", fieldtype);
+    if (write_avro_long(writer, len) < 0) {
         return -1;
     }
-    return 0;
+    return write_avro_raw(writer, bytes, len);
 }
 
-int corsaro_encode_avro_integer_array(corsaro_avro_writer_t *writer,
-        void *arrayptr, uint8_t fieldlen, uint32_t fieldcount) {
+/* Passes everything in the output staging buffer on to the output file,
+ * either directly or via the writer's file writer service.
+ */
+static int commit_avro_output(corsaro_avro_writer_t *writer) {
 
-    uint8_t *array_start = (uint8_t *)arrayptr;
-    int i;
-    uint8_t zero = 0;
+    int ret = 0;
 
-    if (fieldcount > 0) {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &fieldcount,
-                sizeof(fieldcount)) < 0) {
-            corsaro_log(writer->logger,
-                    "unable to encode length of avro array.");
-            return -1;
-        }
+    if (writer->outused == 0) {
+        return 0;
     }
 
-    for (i = 0; i < fieldcount; i++) {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                array_start + (i * fieldlen), fieldlen) < 0) {
-            corsaro_log(writer->logger,
-                    "Unable to encode integer as an array element.");
-            return -1;
-        }
+    if (writer->fwfile) {
+        ret = corsaro_filewriter_write(writer->fwfile, writer->outbuf,
+                writer->outused);
+    } else if (fwrite(writer->outbuf, 1, writer->outused, writer->blockout)
+            != writer->outused) {
+        ret = -1;
     }
+    writer->outused = 0;
+    return ret;
+}
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &zero,
-            sizeof(zero)) < 0) {
-        corsaro_log(writer->logger,
-                "unable to encode end marker for avro array.");
+static const char *avro_codec_name(uint8_t codec) {
+    if (codec == CORSARO_AVRO_CODEC_SNAPPY) {
+        return "snappy";
+    }
+    if (codec == CORSARO_AVRO_CODEC_ZSTD) {
+        return "zstandard";
+    }
+    return "deflate";
+}
+
+/* Writes the container file header: magic, metadata map and sync marker */
+static int write_avro_file_header(corsaro_avro_writer_t *writer) {
+
+    const char *codec = avro_codec_name(writer->blockcodec);
+
+    if (write_avro_raw(writer, "Obj\x01", 4) < 0) {
+        return -1;
+    }
+
+    /* One map block containing two entries, then the end-of-map marker */
+    if (write_avro_long(writer, 2) < 0) {
+        return -1;
+    }
+    if (write_avro_bytes(writer, "avro.codec", strlen("avro.codec")) < 0) {
+        return -1;
+    }
+    if (write_avro_bytes(writer, codec, strlen(codec)) < 0) {
+        return -1;
+    }
+    if (write_avro_bytes(writer, "avro.schema", strlen("avro.schema")) < 0) {
+        return -1;
+    }
+    if (write_avro_bytes(writer, writer->schema_string,
+                strlen(writer->schema_string)) < 0) {
+        return -1;
+    }
+    if (write_avro_long(writer, 0) < 0) {
+        return -1;
+    }
+    if (write_avro_raw(writer, writer->sync, 16) < 0) {
         return -1;
     }
+    writer->fileoffset = writer->outused;
+    return commit_avro_output(writer);
+}
+
+static int ensure_compress_space(corsaro_avro_block_job_t *job,
+        uint32_t needed) {
+
+    char *tmp;
+
+    if (job->compsize >= needed) {
+        return 0;
+    }
 
+    tmp = (char *)realloc(job->comp, needed);
+    if (tmp == NULL) {
+        return -1;
+    }
+    job->comp = tmp;
+    job->compsize = needed;
     return 0;
 }
 
-avro_value_t *corsaro_populate_avro_item(corsaro_avro_writer_t *writer,
-        void *plugindata,
-        int (*callback)(corsaro_logger_t *logger, avro_value_t *av,
-                void *plugindata)) {
+static int deflate_avro_block(corsaro_avro_codec_ctx_t *ctx,
+        corsaro_avro_block_job_t *job, corsaro_logger_t *logger) {
 
-    if (writer->iface == NULL) {
-        writer->iface = avro_generic_class_from_schema(writer->schema);
+    int level = job->level;
 
-        if (writer->iface == NULL) {
-            corsaro_log(writer->logger,
-                    "unable to allocate memory for Avro output interface.");
-            return NULL;
-        }
+    if (level <= 0) {
+        level = Z_DEFAULT_COMPRESSION;
+    } else if (level > 9) {
+        level = 9;
+    }
 
-        if (avro_generic_value_new(writer->iface, &(writer->value))) {
-            corsaro_log(writer->logger,
-                    "unable to create Avro 'value' for output record: %s",
-                    avro_strerror());
-            return NULL;
-        }
+    if (ctx->zstrm_init && ctx->zlevel != level) {
+        deflateEnd(&(ctx->zstrm));
+        ctx->zstrm_init = 0;
+    }
 
+    if (!ctx->zstrm_init) {
+        memset(&(ctx->zstrm), 0, sizeof(ctx->zstrm));
+        /* Avro uses raw deflate, i.e. no zlib header or checksum */
+        if (deflateInit2(&(ctx->zstrm), level, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            corsaro_log(logger,
+                    "unable to initialise deflate stream for Avro output");
+            return -1;
+        }
+        ctx->zstrm_init = 1;
+        ctx->zlevel = level;
     }
 
-    if (callback(writer->logger, &(writer->value), plugindata) == -1) {
-        return NULL;
+    if (ensure_compress_space(job,
+                deflateBound(&(ctx->zstrm), job->rawlen)) < 0) {
+        corsaro_log(logger, "unable to allocate space to compress Avro block");
+        return -1;
     }
 
-    return &(writer->value);
+    ctx->zstrm.next_in = (Bytef *)job->raw;
+    ctx->zstrm.avail_in = job->rawlen;
+    ctx->zstrm.next_out = (Bytef *)job->comp;
+    ctx->zstrm.avail_out = job->compsize;
 
+    if (deflate(&(ctx->zstrm), Z_FINISH) != Z_STREAM_END) {
+        corsaro_log(logger, "unable to deflate Avro block: %s",
+                ctx->zstrm.msg ? ctx->zstrm.msg : "unknown error");
+        deflateReset(&(ctx->zstrm));
+        return -1;
+    }
+    job->complen = job->compsize - ctx->zstrm.avail_out;
+    deflateReset(&(ctx->zstrm));
+    return 0;
 }
 
-int corsaro_append_avro_writer(corsaro_avro_writer_t *writer,
-        avro_value_t *value) {
+/* Compresses a block using the codec that was chosen for it */
+static int compress_avro_block(corsaro_avro_codec_ctx_t *ctx,
+        corsaro_avro_block_job_t *job, corsaro_logger_t *logger) {
 
+    struct timeval start, end;
     int ret = 0;
-    errno = 0;
 
-    if (value == NULL) {
-        if (avro_file_writer_append_encoded(writer->out, writer->encodespace,
-                    writer->encodeused)) {
-            corsaro_log(writer->logger,
-                    "Unable to append encoded user record to Avro output file: %s",
-                    avro_strerror());
+    gettimeofday(&start, NULL);
+
+#ifdef HAVE_SNAPPY
+    if (job->codec == CORSARO_AVRO_CODEC_SNAPPY) {
+        size_t outlen = snappy_max_compressed_length(job->rawlen);
+        uint32_t crc;
+
+        if (ensure_compress_space(job, outlen + 4) < 0) {
+            corsaro_log(logger,
+                    "unable to allocate space to compress Avro block");
             ret = -1;
+        } else if (snappy_compress(job->raw, job->rawlen, job->comp,
+                    &outlen) != SNAPPY_OK) {
+            corsaro_log(logger, "unable to snappy compress Avro block");
+            ret = -1;
+        } else {
+            /* Avro's snappy codec appends a big-endian CRC32 of the
+             * uncompressed data to each block.
+             */
+            crc = htonl(crc32(0, (const Bytef *)job->raw, job->rawlen));
+            memcpy(job->comp + outlen, &crc, sizeof(crc));
+            job->complen = outlen + 4;
         }
-    } else {
-        if (avro_file_writer_append_value(writer->out, value)) {
-            corsaro_log(writer->logger,
-                    "Unable to encode user record for Avro output file: %s",
-                    avro_strerror());
+    } else
+#endif
+#ifdef HAVE_ZSTD
+    if (job->codec == CORSARO_AVRO_CODEC_ZSTD) {
+        size_t outlen;
+
+        if (ctx->zctx == NULL) {
+            ctx->zctx = ZSTD_createCCtx();
+        }
+        if (ctx->zctx == NULL) {
+            corsaro_log(logger,
+                    "unable to create zstd context for Avro output");
             ret = -1;
+        } else if (ensure_compress_space(job,
+                    ZSTD_compressBound(job->rawlen)) < 0) {
+            corsaro_log(logger,
+                    "unable to allocate space to compress Avro block");
+            ret = -1;
+        } else {
+            /* A level of zero means the zstd default */
+            outlen = ZSTD_compressCCtx(ctx->zctx, job->comp, job->compsize,
+                    job->raw, job->rawlen, job->level);
+            if (ZSTD_isError(outlen)) {
+                corsaro_log(logger, "unable to zstd compress Avro block: %s",
+                        ZSTD_getErrorName(outlen));
+                ret = -1;
+            } else {
+                job->complen = outlen;
+            }
         }
+    } else
+#endif
+    {
+        ret = deflate_avro_block(ctx, job, logger);
     }
 
-    if (errno != 0) {
-        corsaro_log(writer->logger,
-                "Error detected while writing user record to Avro output: %s",
-                strerror(errno));
-        ret = -1;
+    gettimeofday(&end, NULL);
+    job->compressusec = ((end.tv_sec - start.tv_sec) * 1000000) +
+            (end.tv_usec - start.tv_usec);
+    if (ret < 0) {
+        job->failed = 1;
     }
-
     return ret;
 }
 
-static char *stradd(const char *str, char *bufp, char *buflim)
-{
-    while (bufp < buflim && (*bufp = *str++) != '\0') {
-        ++bufp;
-    }
-    return bufp;
-}
+static void *start_avro_compress_worker(void *tdata) {
 
-char *corsaro_generate_avro_file_name(const char *template,
-        const char *plugin,
-        const char *monitorname,
-        uint32_t time,
-        int threadid)
-{
-    /* some of the structure of this code is borrowed from the
-       FreeBSD implementation of strftime */
+    corsaro_avro_compress_pool_t *pool = (corsaro_avro_compress_pool_t *)tdata;
+    corsaro_avro_codec_ctx_t ctx;
+    corsaro_avro_block_job_t *job;
 
-    /* the output buffer */
-    /* @todo change the code to dynamically realloc this if we need more
-       space */
-    char buf[1024];
-    char tbuf[1024];
-    char *bufp = buf;
-    char *buflim = buf + sizeof(buf);
+    memset(&ctx, 0, sizeof(ctx));
 
-    /* cast away const, but we don't modify the buffer */
-    char *tmpl = (char*)template;
-    char secs[11]; /* length of UINT32_MAX +1 */
-    struct timeval tv;
+    while (1) {
+        pthread_mutex_lock(&(pool->mutex));
+        while (pool->queuehead == NULL && !pool->halted) {
+            pthread_cond_wait(&(pool->notempty), &(pool->mutex));
+        }
 
-    if (template == NULL) {
-        return NULL;
-    }
+        /* Only stop once every queued block has been compressed, so that
+         * no writer is left waiting on a block that will never finish.
+         */
+        if (pool->queuehead == NULL) {
+            pthread_mutex_unlock(&(pool->mutex));
+            break;
+        }
 
+        job = pool->queuehead;
+        pool->queuehead = job->qnext;
+        if (pool->queuehead == NULL) {
+            pool->queuetail = NULL;
+        }
+        pthread_mutex_unlock(&(pool->mutex));
 
-    for (; *tmpl; ++tmpl) {
+        compress_avro_block(&ctx, job, pool->logger);
+
+        pthread_mutex_lock(&(pool->mutex));
+        job->done = 1;
+        pthread_cond_broadcast(&(pool->jobdone));
+        pthread_mutex_unlock(&(pool->mutex));
+    }
+
+    clear_avro_codec_ctx(&ctx);
+    pthread_exit(NULL);
+}
+
+corsaro_avro_compress_pool_t *corsaro_create_avro_compress_pool(
+        corsaro_logger_t *logger, uint8_t threads) {
+
+    corsaro_avro_compress_pool_t *pool;
+    int i;
+
+    if (threads == 0) {
+        return NULL;
+    }
+
+    pool = (corsaro_avro_compress_pool_t *)calloc(1,
+            sizeof(corsaro_avro_compress_pool_t));
+    if (pool == NULL) {
+        corsaro_log(logger,
+                "unable to allocate memory for Avro compression pool");
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        corsaro_log(logger,
+                "unable to allocate memory for Avro compression pool");
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->notempty), NULL);
+    pthread_cond_init(&(pool->jobdone), NULL);
+    pool->logger = logger;
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL,
+                    start_avro_compress_worker, pool) != 0) {
+            corsaro_log(logger,
+                    "unable to start Avro compression thread %d", i);
+            break;
+        }
+        pool->threadcount ++;
+    }
+
+    if (pool->threadcount == 0) {
+        corsaro_destroy_avro_compress_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void corsaro_destroy_avro_compress_pool(corsaro_avro_compress_pool_t *pool) {
+
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->halted = 1;
+    pthread_cond_broadcast(&(pool->notempty));
+    pthread_mutex_unlock(&(pool->mutex));
+
+    for (i = 0; i < pool->threadcount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&(pool->mutex));
+    pthread_cond_destroy(&(pool->notempty));
+    pthread_cond_destroy(&(pool->jobdone));
+    free(pool->threads);
+    free(pool);
+}
+
+/* Writes a compressed block to the output file, along with its record
+ * count, size and sync marker.
+ */
+static int write_avro_block(corsaro_avro_writer_t *writer,
+        corsaro_avro_block_job_t *job) {
+
+    int a, b;
+
+    writer->stats.compressusec += job->compressusec;
+
+    if (job->failed) {
+        corsaro_log(writer->logger,
+                "dropping %u records from Avro output file %s because their block could not be compressed",
+                job->records, writer->fname);
+        return -1;
+    }
+
+    if ((a = write_avro_long(writer, job->records)) < 0 ||
+            (b = write_avro_long(writer, job->complen)) < 0 ||
+            write_avro_raw(writer, job->comp, job->complen) < 0 ||
+            write_avro_raw(writer, writer->sync, 16) < 0 ||
+            commit_avro_output(writer) < 0) {
+        writer->outused = 0;
+        corsaro_log(writer->logger,
+                "error while writing block to Avro output file %s: %s",
+                writer->fname, strerror(errno));
+        return -1;
+    }
+
+    if (writer->indexing) {
+        if (writer->indexcount == writer->indexalloc) {
+            corsaro_avro_index_entry_t *tmp;
+            uint64_t newalloc = writer->indexalloc ?
+                    writer->indexalloc * 2 : 256;
+
+            tmp = (corsaro_avro_index_entry_t *)realloc(writer->index,
+                    newalloc * sizeof(corsaro_avro_index_entry_t));
+            if (tmp == NULL) {
+                corsaro_log(writer->logger,
+                        "unable to grow index for Avro output file %s, index will not be written",
+                        writer->fname);
+                writer->indexing = 0;
+            } else {
+                writer->index = tmp;
+                writer->indexalloc = newalloc;
+            }
+        }
+        if (writer->indexing) {
+            corsaro_avro_index_entry_t *e =
+                    &(writer->index[writer->indexcount]);
+
+            if (job->haskeys) {
+                *e = job->keys;
+            } else {
+                memset(e, 0, sizeof(corsaro_avro_index_entry_t));
+            }
+            e->offset = writer->fileoffset;
+            e->records = job->records;
+            writer->indexcount ++;
+        }
+    }
+
+    writer->fileoffset += a + b + job->complen + 16;
+    writer->stats.blocks ++;
+    writer->stats.records += job->records;
+    writer->stats.rawbytes += job->rawlen;
+    writer->stats.writtenbytes += a + b + job->complen + 16;
+    return 0;
+}
+
+static void recycle_avro_block_job(corsaro_avro_writer_t *writer,
+        corsaro_avro_block_job_t *job) {
+    job->next = writer->sparejobs;
+    writer->sparejobs = job;
+}
+
+/* Writes any blocks at the front of the pending list that have finished
+ * compressing. If more than 'allowed' blocks are still pending, waits for
+ * the compression threads until that is no longer the case.
+ */
+static int write_finished_avro_blocks(corsaro_avro_writer_t *writer,
+        uint32_t allowed) {
+
+    corsaro_avro_compress_pool_t *pool = writer->cpool;
+    corsaro_avro_block_job_t *job;
+    struct timeval start, end;
+    int ret = 0;
+
+    if (pool == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    while (writer->pendinghead) {
+        job = writer->pendinghead;
+        if (!job->done) {
+            if (writer->pendingcount <= allowed) {
+                break;
+            }
+            gettimeofday(&start, NULL);
+            pthread_cond_wait(&(pool->jobdone), &(pool->mutex));
+            gettimeofday(&end, NULL);
+            writer->stats.stallusec += ((end.tv_sec - start.tv_sec) *
+                    1000000) + (end.tv_usec - start.tv_usec);
+            continue;
+        }
+
+        writer->pendinghead = job->next;
+        if (writer->pendinghead == NULL) {
+            writer->pendingtail = NULL;
+        }
+        writer->pendingcount --;
+        pthread_mutex_unlock(&(pool->mutex));
+
+        if (write_avro_block(writer, job) < 0) {
+            ret = -1;
+        }
+        recycle_avro_block_job(writer, job);
+
+        pthread_mutex_lock(&(pool->mutex));
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+    return ret;
+}
+
+/* Hands the complete records in the encoding buffer over to be compressed
+ * and written out as a single avro block.
+ */
+static int flush_avro_block(corsaro_avro_writer_t *writer) {
+
+    corsaro_avro_block_job_t *job;
+    corsaro_avro_compress_pool_t *pool = writer->cpool;
+    uint32_t leftover, needed;
+    char *tmp;
+    uint32_t tmpsize;
+    int ret;
+
+    if (writer->blockrecords == 0) {
+        writer->encodeused = 0;
+        writer->blockused = 0;
+        return 0;
+    }
+
+    if (writer->sparejobs) {
+        job = writer->sparejobs;
+        writer->sparejobs = job->next;
+    } else {
+        job = (corsaro_avro_block_job_t *)calloc(1,
+                sizeof(corsaro_avro_block_job_t));
+        if (job == NULL) {
+            corsaro_log(writer->logger,
+                    "unable to allocate memory for Avro block");
+            return -1;
+        }
+    }
+
+    /* The block takes the encoding buffer as it is, and the writer carries
+     * on with the (empty) buffer from a previous block.
+     */
+    leftover = writer->encodeused - writer->blockused;
+    needed = CORSARO_AVRO_BLOCK_SIZE + CORSARO_INIT_AVRO_ENCODING_SPACE;
+    if (needed < leftover + CORSARO_INIT_AVRO_ENCODING_SPACE) {
+        needed = leftover + CORSARO_INIT_AVRO_ENCODING_SPACE;
+    }
+
+    tmp = job->raw;
+    tmpsize = job->rawsize;
+    if (tmpsize < needed) {
+        tmp = (char *)realloc(tmp, needed);
+        if (tmp == NULL) {
+            corsaro_log(writer->logger,
+                    "unable to allocate Avro block buffer");
+            recycle_avro_block_job(writer, job);
+            return -1;
+        }
+        tmpsize = needed;
+    }
+
+    job->raw = writer->encodespace;
+    job->rawsize = writer->encodesize;
+    job->rawlen = writer->blockused;
+    job->records = writer->blockrecords;
+    job->codec = writer->blockcodec;
+    job->level = writer->blocklevel;
+    job->done = 0;
+    job->failed = 0;
+    job->compressusec = 0;
+    job->next = NULL;
+    job->qnext = NULL;
+    job->keys = writer->blockkeys;
+    job->haskeys = writer->blockhaskeys;
+    writer->blockhaskeys = 0;
+
+    /* Keep any partially encoded record that follows the block */
+    writer->encodespace = tmp;
+    writer->encodesize = tmpsize;
+    if (leftover > 0) {
+        memcpy(writer->encodespace, job->raw + writer->blockused, leftover);
+    }
+    writer->encodeused = leftover;
+    writer->blockused = 0;
+    writer->blockrecords = 0;
+
+    if (pool == NULL) {
+        if (writer->codecctx == NULL) {
+            writer->codecctx = (corsaro_avro_codec_ctx_t *)calloc(1,
+                    sizeof(corsaro_avro_codec_ctx_t));
+            if (writer->codecctx == NULL) {
+                corsaro_log(writer->logger,
+                        "unable to allocate Avro compression state");
+                recycle_avro_block_job(writer, job);
+                return -1;
+            }
+        }
+        compress_avro_block(writer->codecctx, job, writer->logger);
+        ret = write_avro_block(writer, job);
+        recycle_avro_block_job(writer, job);
+        return ret;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->queuetail) {
+        pool->queuetail->qnext = job;
+    } else {
+        pool->queuehead = job;
+    }
+    pool->queuetail = job;
+    pthread_cond_signal(&(pool->notempty));
+
+    if (writer->pendingtail) {
+        writer->pendingtail->next = job;
+    } else {
+        writer->pendinghead = job;
+    }
+    writer->pendingtail = job;
+    writer->pendingcount ++;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    /* Allow a couple of blocks per compression thread to be in flight
+     * before making the writer wait.
+     */
+    return write_finished_avro_blocks(writer, pool->threadcount * 2);
+}
+
+int corsaro_drain_avro_writer(corsaro_avro_writer_t *writer) {
+    return write_finished_avro_blocks(writer, 0);
+}
+
+void corsaro_get_avro_writer_stats(corsaro_avro_writer_t *writer,
+        corsaro_avro_writer_stats_t *stats, uint8_t reset) {
+
+    memcpy(stats, &(writer->stats), sizeof(corsaro_avro_writer_stats_t));
+    if (reset) {
+        memset(&(writer->stats), 0, sizeof(corsaro_avro_writer_stats_t));
+    }
+}
+
+void corsaro_enable_avro_writer_index(corsaro_avro_writer_t *writer,
+        uint8_t enabled) {
+    writer->indexing = enabled;
+}
+
+void corsaro_set_avro_writer_done_file(corsaro_avro_writer_t *writer,
+        uint8_t enabled) {
+    writer->writedone = enabled;
+}
+
+static inline void put_index_u64(uint8_t *ptr, uint64_t val) {
+    int i;
+    for (i = 7; i >= 0; i--) {
+        ptr[i] = (uint8_t)(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static inline uint64_t get_index_u64(const uint8_t *ptr) {
+    uint64_t val = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        val = (val << 8) | ptr[i];
+    }
+    return val;
+}
+
+#define CORSARO_AVRO_INDEX_VERSION 1
+#define CORSARO_AVRO_INDEX_ENTRY_SIZE 48
+
+/* Writes a set of index entries to a sidecar file */
+static int save_avro_index(corsaro_logger_t *logger, const char *avroname,
+        corsaro_avro_index_entry_t *entries, uint64_t count) {
+
+    char idxname[1024];
+    uint8_t buf[CORSARO_AVRO_INDEX_ENTRY_SIZE];
+    FILE *f;
+    uint64_t i;
+
+    if (snprintf(idxname, sizeof(idxname), "%s%s", avroname,
+                CORSARO_AVRO_INDEX_SUFFIX) >= sizeof(idxname)) {
+        corsaro_log(logger, "unable to build index file name for %s",
+                avroname);
+        return -1;
+    }
+
+    f = fopen(idxname, "w");
+    if (f == NULL) {
+        corsaro_log(logger, "unable to open Avro index file %s: %s",
+                idxname, strerror(errno));
+        return -1;
+    }
+
+    memcpy(buf, "CAVI", 4);
+    buf[4] = buf[5] = buf[6] = 0;
+    buf[7] = CORSARO_AVRO_INDEX_VERSION;
+    put_index_u64(buf + 8, count);
+    if (fwrite(buf, 1, 16, f) != 16) {
+        goto writeerror;
+    }
+
+    for (i = 0; i < count; i++) {
+        put_index_u64(buf, entries[i].offset);
+        put_index_u64(buf + 8, entries[i].records);
+        put_index_u64(buf + 16, entries[i].minhi);
+        put_index_u64(buf + 24, entries[i].minlo);
+        put_index_u64(buf + 32, entries[i].maxhi);
+        put_index_u64(buf + 40, entries[i].maxlo);
+        if (fwrite(buf, 1, CORSARO_AVRO_INDEX_ENTRY_SIZE, f) !=
+                CORSARO_AVRO_INDEX_ENTRY_SIZE) {
+            goto writeerror;
+        }
+    }
+
+    if (fclose(f) != 0) {
+        f = NULL;
+        goto writeerror;
+    }
+    return 0;
+
+writeerror:
+    corsaro_log(logger, "error while writing Avro index file %s: %s",
+            idxname, strerror(errno));
+    if (f) {
+        fclose(f);
+    }
+    unlink(idxname);
+    return -1;
+}
+
+static int write_avro_index(corsaro_avro_writer_t *writer) {
+    int ret = save_avro_index(writer->logger, writer->fname, writer->index,
+            writer->indexcount);
+    writer->indexcount = 0;
+    return ret;
+}
+
+corsaro_avro_index_t *corsaro_load_avro_index(corsaro_logger_t *logger,
+        const char *filename) {
+
+    char idxname[1024];
+    uint8_t buf[CORSARO_AVRO_INDEX_ENTRY_SIZE];
+    corsaro_avro_index_t *idx = NULL;
+    FILE *f;
+    uint64_t i, count;
+
+    if (snprintf(idxname, sizeof(idxname), "%s%s", filename,
+                CORSARO_AVRO_INDEX_SUFFIX) >= sizeof(idxname)) {
+        return NULL;
+    }
+
+    /* Not having an index is perfectly normal, so don't complain */
+    f = fopen(idxname, "r");
+    if (f == NULL) {
+        return NULL;
+    }
+
+    if (fread(buf, 1, 16, f) != 16 || memcmp(buf, "CAVI", 4) != 0 ||
+            buf[4] != 0 || buf[5] != 0 || buf[6] != 0 ||
+            buf[7] != CORSARO_AVRO_INDEX_VERSION) {
+        goto badindex;
+    }
+    count = get_index_u64(buf + 8);
+
+    idx = (corsaro_avro_index_t *)calloc(1, sizeof(corsaro_avro_index_t));
+    if (idx == NULL) {
+        goto badindex;
+    }
+    if (count > 0) {
+        idx->entries = (corsaro_avro_index_entry_t *)calloc(count,
+                sizeof(corsaro_avro_index_entry_t));
+        if (idx->entries == NULL) {
+            goto badindex;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (fread(buf, 1, CORSARO_AVRO_INDEX_ENTRY_SIZE, f) !=
+                CORSARO_AVRO_INDEX_ENTRY_SIZE) {
+            goto badindex;
+        }
+        idx->entries[i].offset = get_index_u64(buf);
+        idx->entries[i].records = get_index_u64(buf + 8);
+        idx->entries[i].minhi = get_index_u64(buf + 16);
+        idx->entries[i].minlo = get_index_u64(buf + 24);
+        idx->entries[i].maxhi = get_index_u64(buf + 32);
+        idx->entries[i].maxlo = get_index_u64(buf + 40);
+    }
+    idx->count = count;
+    fclose(f);
+    return idx;
+
+badindex:
+    corsaro_log(logger, "ignoring invalid Avro index file %s", idxname);
+    corsaro_free_avro_index(idx);
+    fclose(f);
+    return NULL;
+}
+
+void corsaro_free_avro_index(corsaro_avro_index_t *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    free(idx->entries);
+    free(idx);
+}
+
+uint64_t corsaro_find_avro_index_block(corsaro_avro_index_t *idx,
+        uint64_t keyhi, uint64_t keylo) {
+
+    uint64_t i;
+    corsaro_avro_index_entry_t *e;
+
+    /* Blocks are not guaranteed to be in key order, so we can't do a
+     * binary search. Indexes are small enough that a linear scan is cheap
+     * compared with reading even one block.
+     */
+    for (i = 0; i < idx->count; i++) {
+        e = &(idx->entries[i]);
+        if (e->maxhi > keyhi || (e->maxhi == keyhi && e->maxlo >= keylo)) {
+            return i;
+        }
+    }
+    return idx->count;
+}
+
+/* Reads a zigzag varint from an avro container file, keeping a copy of
+ * the raw bytes so they can be written out again unchanged. Returns 1 if
+ * a value was read, 0 if the file ended before the first byte and -1 if
+ * the value was truncated or too long.
+ */
+static int read_container_long(FILE *f, int64_t *val, uint8_t *raw,
+        int *rawlen) {
+
+    uint64_t n = 0;
+    int shift = 0, c;
+
+    *rawlen = 0;
+    do {
+        c = fgetc(f);
+        if (c == EOF) {
+            return (*rawlen == 0) ? 0 : -1;
+        }
+        if (*rawlen == 10) {
+            return -1;
+        }
+        raw[*rawlen] = (uint8_t)c;
+        (*rawlen) ++;
+        n |= ((uint64_t)(c & 0x7F)) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *val = (int64_t)((n >> 1) ^ -(n & 1));
+    return 1;
+}
+
+/* Appends bytes to a growable buffer holding an avro container header */
+static int append_container_header(char **hdr, uint32_t *hdrsize,
+        uint32_t *hdrlen, const void *bytes, uint32_t len) {
+
+    char *tmp;
+
+    if (*hdrlen + len > *hdrsize) {
+        tmp = (char *)realloc(*hdr, *hdrlen + len + 4096);
+        if (tmp == NULL) {
+            return -1;
+        }
+        *hdr = tmp;
+        *hdrsize = *hdrlen + len + 4096;
+    }
+    if (bytes) {
+        memcpy(*hdr + *hdrlen, bytes, len);
+        *hdrlen += len;
+    }
+    return 0;
+}
+
+/* Reads the header of an avro container file (everything up to, but not
+ * including, the sync marker) into a buffer, growing it as required.
+ */
+static int read_container_header(FILE *f, char **hdr, uint32_t *hdrsize,
+        uint32_t *hdrlen) {
+
+    uint8_t raw[10];
+    int rawlen, i;
+    int64_t count, len;
+
+    *hdrlen = 0;
+
+    /* Magic */
+    if (fread(raw, 1, 4, f) != 4 || memcmp(raw, "Obj\x01", 4) != 0) {
+        return -1;
+    }
+    if (append_container_header(hdr, hdrsize, hdrlen, raw, 4) < 0) {
+        return -1;
+    }
+
+    /* Metadata map: blocks of key/value pairs, ending with an empty block */
+    while (1) {
+        if (read_container_long(f, &count, raw, &rawlen) <= 0 ||
+                append_container_header(hdr, hdrsize, hdrlen, raw,
+                        rawlen) < 0) {
+            return -1;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            count = -count;
+            /* Negative counts are followed by the block size in bytes */
+            if (read_container_long(f, &len, raw, &rawlen) <= 0 ||
+                    append_container_header(hdr, hdrsize, hdrlen, raw,
+                            rawlen) < 0) {
+                return -1;
+            }
+        }
+        for (i = 0; i < count * 2; i++) {
+            if (read_container_long(f, &len, raw, &rawlen) <= 0 || len < 0 ||
+                    append_container_header(hdr, hdrsize, hdrlen, raw,
+                            rawlen) < 0) {
+                return -1;
+            }
+            /* Make room for the key or value, then read it in place */
+            if (append_container_header(hdr, hdrsize, hdrlen, NULL,
+                        len) < 0) {
+                return -1;
+            }
+            if (fread(*hdr + *hdrlen, 1, len, f) != (size_t)len) {
+                return -1;
+            }
+            *hdrlen += len;
+        }
+    }
+    return 0;
+}
+
+int corsaro_concat_avro_files(corsaro_logger_t *logger, char *outname,
+        char **innames, int count) {
+
+    FILE *out = NULL, *in = NULL;
+    char *firsthdr = NULL, *hdr = NULL, *buf = NULL;
+    uint32_t firstlen = 0, hdrsize = 0, hdrlen = 0;
+    uint32_t bufsize = 0;
+    uint8_t firstsync[16], sync[16], raw[10];
+    int64_t records, blocklen;
+    int i, rawlen, ret = -1, r;
+    corsaro_avro_index_t *idx;
+    corsaro_avro_index_entry_t *entries = NULL;
+    uint64_t entrycount = 0, j;
+    uint8_t indexed = 1;
+    off_t inbase, outbase;
+
+    out = fopen(outname, "w");
+    if (out == NULL) {
+        corsaro_log(logger, "error opening Avro output file %s: %s",
+                outname, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        in = fopen(innames[i], "r");
+        if (in == NULL) {
+            corsaro_log(logger, "error opening Avro input file %s: %s",
+                    innames[i], strerror(errno));
+            goto endconcat;
+        }
+
+        if (read_container_header(in, &hdr, &hdrsize, &hdrlen) < 0 ||
+                fread(sync, 1, 16, in) != 16) {
+            corsaro_log(logger, "invalid Avro container header in %s",
+                    innames[i]);
+            goto endconcat;
+        }
+
+        if (i == 0) {
+            /* The first file's header and sync marker are used for the
+             * whole output file.
+             */
+            firsthdr = hdr;
+            firstlen = hdrlen;
+            hdr = NULL;
+            hdrsize = 0;
+            memcpy(firstsync, sync, 16);
+            if (fwrite(firsthdr, 1, firstlen, out) != firstlen ||
+                    fwrite(firstsync, 1, 16, out) != 16) {
+                goto writeerror;
+            }
+        } else if (hdrlen != firstlen || memcmp(hdr, firsthdr, hdrlen) != 0) {
+            corsaro_log(logger,
+                    "cannot concatenate %s: schema or codec differs from %s",
+                    innames[i], innames[0]);
+            goto endconcat;
+        }
+
+        /* If every input has an index, we can produce an index for the
+         * output as well -- the blocks just move to a different offset.
+         */
+        if (indexed && (idx = corsaro_load_avro_index(logger,
+                        innames[i])) != NULL) {
+            corsaro_avro_index_entry_t *tmp;
+
+            inbase = ftello(in);
+            outbase = ftello(out);
+            tmp = (corsaro_avro_index_entry_t *)realloc(entries,
+                    (entrycount + idx->count + 1) *
+                    sizeof(corsaro_avro_index_entry_t));
+            if (tmp == NULL) {
+                indexed = 0;
+            } else {
+                entries = tmp;
+                for (j = 0; j < idx->count; j++) {
+                    entries[entrycount] = idx->entries[j];
+                    entries[entrycount].offset = idx->entries[j].offset -
+                            inbase + outbase;
+                    entrycount ++;
+                }
+            }
+            corsaro_free_avro_index(idx);
+        } else {
+            indexed = 0;
+        }
+
+        /* Copy each block as is, but replace the sync marker that follows
+         * it with the one from the output file's header.
+         */
+        while ((r = read_container_long(in, &records, raw, &rawlen)) > 0) {
+            if (fwrite(raw, 1, rawlen, out) != (size_t)rawlen) {
+                goto writeerror;
+            }
+            if (read_container_long(in, &blocklen, raw, &rawlen) <= 0 ||
+                    blocklen < 0) {
+                r = -1;
+                break;
+            }
+            if (fwrite(raw, 1, rawlen, out) != (size_t)rawlen) {
+                goto writeerror;
+            }
+            if (blocklen > bufsize) {
+                char *tmp = (char *)realloc(buf, blocklen);
+                if (tmp == NULL) {
+                    corsaro_log(logger,
+                            "unable to allocate buffer for Avro block");
+                    goto endconcat;
+                }
+                buf = tmp;
+                bufsize = blocklen;
+            }
+            if (fread(buf, 1, blocklen, in) != (size_t)blocklen ||
+                    fread(sync, 1, 16, in) != 16) {
+                r = -1;
+                break;
+            }
+            if (fwrite(buf, 1, blocklen, out) != (size_t)blocklen ||
+                    fwrite(firstsync, 1, 16, out) != 16) {
+                goto writeerror;
+            }
+        }
+        if (r < 0) {
+            corsaro_log(logger, "truncated Avro block in %s", innames[i]);
+            goto endconcat;
+        }
+        fclose(in);
+        in = NULL;
+    }
+
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto writeerror;
+    }
+    out = NULL;
+    ret = 0;
+
+    if (indexed) {
+        save_avro_index(logger, outname, entries, entrycount);
+    }
+    goto endconcat;
+
+writeerror:
+    corsaro_log(logger, "error writing to Avro output file %s: %s",
+            outname, strerror(errno));
+
+endconcat:
+    if (in) {
+        fclose(in);
+    }
+    if (out) {
+        fclose(out);
+    }
+    free(firsthdr);
+    free(hdr);
+    free(buf);
+    free(entries);
+    return ret;
+}
+
+/* Picks a new random sync marker for a block writer's output file. Every
+ * file needs its own marker, so that a reader resyncing (or scanning
+ * concatenated files) can't mistake one file's marker for another's.
+ */
+static void choose_avro_sync_marker(corsaro_avro_writer_t *writer) {
+    struct timeval tv;
+    unsigned int seed;
+    int fd, i;
+    ssize_t got = 0;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        got = read(fd, writer->sync, sizeof(writer->sync));
+        close(fd);
+    }
+    if (got == sizeof(writer->sync)) {
+        return;
+    }
+
+    /* No /dev/urandom, so fall back to a thread-safe generator that is
+     * seeded differently for each writer and each file */
+    gettimeofday(&tv, NULL);
+    seed = (unsigned int)(tv.tv_sec ^ tv.tv_usec ^ (getpid() << 16) ^
+            (uintptr_t)writer);
+    for (i = 0; i < 16; i++) {
+        writer->sync[i] = (uint8_t)(rand_r(&seed) & 0xff);
+    }
+}
+
+int corsaro_start_avro_block_writer(corsaro_avro_writer_t *writer,
+        char *fname, uint8_t codec, int level,
+        corsaro_avro_compress_pool_t *cpool) {
+
+    if (writer->out != NULL || writer->blockmode) {
+        corsaro_log(writer->logger,
+                "attempting to start an Avro writer when it is already open!");
+        return -1;
+    }
+
+    /* Same fallback as libavro: an unavailable codec means deflate */
+    writer->blockcodec = CORSARO_AVRO_CODEC_DEFLATE;
+#ifdef HAVE_SNAPPY
+    if (codec == CORSARO_AVRO_CODEC_SNAPPY) {
+        writer->blockcodec = CORSARO_AVRO_CODEC_SNAPPY;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CORSARO_AVRO_CODEC_ZSTD) {
+        writer->blockcodec = CORSARO_AVRO_CODEC_ZSTD;
+    }
+#endif
+    writer->blocklevel = level;
+    writer->cpool = cpool;
+
+    /* Only needed if the caller wants to populate avro values */
+    if (writer->schema == NULL) {
+        avro_schema_error_t error;
+
+        if (avro_schema_from_json(writer->schema_string,
+                    strlen(writer->schema_string),
+                    &(writer->schema), &error)) {
+            corsaro_log(writer->logger,
+                    "unable to parse Avro schema string: %s",
+                    avro_strerror());
+            return -1;
+        }
+    }
+
+    if (writer->encodesize < CORSARO_AVRO_BLOCK_SIZE +
+            CORSARO_INIT_AVRO_ENCODING_SPACE) {
+        char *tmp = (char *)realloc(writer->encodespace,
+                CORSARO_AVRO_BLOCK_SIZE + CORSARO_INIT_AVRO_ENCODING_SPACE);
+        if (tmp == NULL) {
+            corsaro_log(writer->logger,
+                    "unable to allocate Avro block buffer");
+            return -1;
+        }
+        writer->encodespace = tmp;
+        writer->encodesize = CORSARO_AVRO_BLOCK_SIZE +
+                CORSARO_INIT_AVRO_ENCODING_SPACE;
+    }
+
+    if (writer->filewriter) {
+        writer->fwfile = corsaro_filewriter_open(writer->filewriter, fname);
+        if (writer->fwfile == NULL) {
+            corsaro_log(writer->logger,
+                    "error queueing Avro output file %s for writing", fname);
+            return -1;
+        }
+    } else {
+        writer->blockout = fopen(fname, "w");
+        if (writer->blockout == NULL) {
+            corsaro_log(writer->logger,
+                    "error opening Avro output file %s: %s", fname,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    if (writer->fname) {
+        free(writer->fname);
+    }
+    writer->fname = strdup(fname);
+
+    choose_avro_sync_marker(writer);
+    writer->encodeused = 0;
+    writer->blockused = 0;
+    writer->blockrecords = 0;
+    writer->outused = 0;
+    writer->fileoffset = 0;
+    writer->blockhaskeys = 0;
+    writer->indexcount = 0;
+
+    if (write_avro_file_header(writer) < 0) {
+        corsaro_log(writer->logger,
+                "error writing header to Avro output file %s: %s", fname,
+                strerror(errno));
+        if (writer->fwfile) {
+            corsaro_filewriter_close(writer->fwfile, 0);
+            writer->fwfile = NULL;
+        } else {
+            fclose(writer->blockout);
+            writer->blockout = NULL;
+        }
+        return -1;
+    }
+    writer->blockmode = 1;
+    return 0;
+}
+
+void corsaro_set_avro_writer_filewriter(corsaro_avro_writer_t *writer,
+        corsaro_filewriter_t *fw) {
+    writer->filewriter = fw;
+}
+
+int corsaro_start_avro_encoding(corsaro_avro_writer_t *writer) {
+
+    if (writer->encodespace == NULL) {
+        writer->encodespace = (char *)malloc(CORSARO_INIT_AVRO_ENCODING_SPACE);
+        writer->encodesize = CORSARO_INIT_AVRO_ENCODING_SPACE;
+    }
+
+    /* Block writers keep the records that have already been appended,
+     * but discard anything left over from an incomplete record.
+     */
+    if (writer->blockmode) {
+        writer->encodeused = writer->blockused;
+    } else {
+        writer->encodeused = 0;
+    }
+    if (writer->encodespace == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline void grow_encode_buffer(corsaro_avro_writer_t *writer) {
+    writer->encodespace = (char *)realloc(writer->encodespace,
+                writer->encodesize + CORSARO_INIT_AVRO_ENCODING_SPACE);
+    writer->encodesize += CORSARO_INIT_AVRO_ENCODING_SPACE;
+}
+
+int corsaro_reserve_avro_encoding(corsaro_avro_writer_t *writer,
+        uint32_t len) {
+
+    char *tmp;
+    uint32_t newsize;
+
+    if (writer->encodesize - writer->encodeused >= len) {
+        return 0;
+    }
+
+    newsize = writer->encodeused + len + CORSARO_INIT_AVRO_ENCODING_SPACE;
+    tmp = (char *)realloc(writer->encodespace, newsize);
+    if (tmp == NULL) {
+        corsaro_log(writer->logger,
+                "unable to grow Avro encoding buffer to %u bytes", newsize);
+        return -1;
+    }
+    writer->encodespace = tmp;
+    writer->encodesize = newsize;
+    return 0;
+}
+
+int corsaro_encode_avro_field(corsaro_avro_writer_t *writer,
+        uint8_t fieldtype, void *fieldptr, uint32_t fieldlen) {
+
+    if (fieldtype == CORSARO_AVRO_LONG) {
+        int64_t l;
+        uint64_t n;
+
+        if (fieldlen == 1) {
+            l = *(uint8_t *)(fieldptr);
+        } else if (fieldlen == 2) {
+            l = *(uint16_t *)(fieldptr);
+        } else if (fieldlen == 4) {
+            l = *(uint32_t *)(fieldptr);
+        } else if (fieldlen == 8) {
+            l = *(uint64_t *)(fieldptr);
+        } else {
+            corsaro_log(writer->logger,
+                    "unexpected integer size of %u when encoding avro.",
+                    fieldlen);
+            return -1;
+        }
+
+        if (writer->encodesize - writer->encodeused < 8) {
+            grow_encode_buffer(writer);
+        }
+
+        n = (l << 1) ^ (l >> 63);
+
+        while (n & ~0x7F) {
+            writer->encodespace[writer->encodeused] = 
+                    (char)((((uint8_t) n) & 0x7F) | 0x80);
+            n >>= 7;
+            writer->encodeused ++;
+        }
+        writer->encodespace[writer->encodeused] = (char)n;
+        writer->encodeused ++;
+    } else if (fieldtype == CORSARO_AVRO_STRING) {
+        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &fieldlen,
+                sizeof(fieldlen)) < 0) {
+            corsaro_log(writer->logger,
+                    "unable to encode length of avro string.");
+            return -1;
+        }
+
+        if (writer->encodesize - writer->encodeused < fieldlen) {
+            grow_encode_buffer(writer);
+        }
+        memcpy(writer->encodespace + writer->encodeused, fieldptr, fieldlen);
+        writer->encodeused += fieldlen;
+    } else {
+        corsaro_log(writer->logger,
+                "asked to encode unexpected avro type %u\n", fieldtype);
+        return -1;
+    }
+    return 0;
+}
+
+int corsaro_encode_avro_integer_array(corsaro_avro_writer_t *writer,
+        void *arrayptr, uint8_t fieldlen, uint32_t fieldcount) {
+
+    uint8_t *array_start = (uint8_t *)arrayptr;
+    int i;
+    uint8_t zero = 0;
+
+    if (fieldcount > 0) {
+        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &fieldcount,
+                sizeof(fieldcount)) < 0) {
+            corsaro_log(writer->logger,
+                    "unable to encode length of avro array.");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < fieldcount; i++) {
+        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
+                array_start + (i * fieldlen), fieldlen) < 0) {
+            corsaro_log(writer->logger,
+                    "Unable to encode integer as an array element.");
+            return -1;
+        }
+    }
+
+    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG, &zero,
+            sizeof(zero)) < 0) {
+        corsaro_log(writer->logger,
+                "unable to encode end marker for avro array.");
+        return -1;
+    }
+
+    return 0;
+}
+
+avro_value_t *corsaro_populate_avro_item(corsaro_avro_writer_t *writer,
+        void *plugindata,
+        int (*callback)(corsaro_logger_t *logger, avro_value_t *av,
+                void *plugindata)) {
+
+    if (writer->iface == NULL) {
+        writer->iface = avro_generic_class_from_schema(writer->schema);
+
+        if (writer->iface == NULL) {
+            corsaro_log(writer->logger,
+                    "unable to allocate memory for Avro output interface.");
+            return NULL;
+        }
+
+        if (avro_generic_value_new(writer->iface, &(writer->value))) {
+            corsaro_log(writer->logger,
+                    "unable to create Avro 'value' for output record: %s",
+                    avro_strerror());
+            return NULL;
+        }
+
+    }
+
+    if (callback(writer->logger, &(writer->value), plugindata) == -1) {
+        return NULL;
+    }
+
+    return &(writer->value);
+
+}
+
+/* Encodes an avro value onto the end of a block writer's current block */
+static int encode_avro_value(corsaro_avro_writer_t *writer,
+        avro_value_t *value) {
+
+    size_t size;
+
+    if (avro_value_sizeof(value, &size)) {
+        corsaro_log(writer->logger,
+                "unable to determine encoded size of Avro record: %s",
+                avro_strerror());
+        return -1;
+    }
+
+    /* Discard any partially encoded record */
+    writer->encodeused = writer->blockused;
+    if (corsaro_reserve_avro_encoding(writer, size) < 0) {
+        return -1;
+    }
+
+    if (writer->memwriter == NULL) {
+        writer->memwriter = avro_writer_memory(
+                writer->encodespace + writer->encodeused, size);
+        if (writer->memwriter == NULL) {
+            corsaro_log(writer->logger,
+                    "unable to create Avro memory writer: %s",
+                    avro_strerror());
+            return -1;
+        }
+    } else {
+        avro_writer_memory_set_dest(writer->memwriter,
+                writer->encodespace + writer->encodeused, size);
+    }
+
+    if (avro_value_write(writer->memwriter, value)) {
+        corsaro_log(writer->logger,
+                "unable to encode user record for Avro output file: %s",
+                avro_strerror());
+        return -1;
+    }
+    writer->encodeused += size;
+    return 0;
+}
+
+int corsaro_append_avro_writer(corsaro_avro_writer_t *writer,
+        avro_value_t *value) {
+
+    int ret = 0;
+    errno = 0;
+
+    if (writer->blockmode) {
+        if (value != NULL && encode_avro_value(writer, value) < 0) {
+            return -1;
+        }
+
+        /* The record is now in the block buffer, so just mark it as
+         * complete and write the block if it is big enough.
+         */
+        writer->blockused = writer->encodeused;
+        writer->blockrecords ++;
+        if (writer->blockused >= CORSARO_AVRO_BLOCK_SIZE) {
+            return flush_avro_block(writer);
+        }
+        return 0;
+    }
+
+    if (value == NULL) {
+        if (avro_file_writer_append_encoded(writer->out, writer->encodespace,
+                    writer->encodeused)) {
+            corsaro_log(writer->logger,
+                    "Unable to append encoded user record to Avro output file: %s",
+                    avro_strerror());
+            ret = -1;
+        }
+    } else {
+        if (avro_file_writer_append_value(writer->out, value)) {
+            corsaro_log(writer->logger,
+                    "Unable to encode user record for Avro output file: %s",
+                    avro_strerror());
+            ret = -1;
+        }
+    }
+
+    if (errno != 0) {
+        corsaro_log(writer->logger,
+                "Error detected while writing user record to Avro output: %s",
+                strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static char *stradd(const char *str, char *bufp, char *buflim)
+{
+    while (bufp < buflim && (*bufp = *str++) != '\0') {
+        ++bufp;
+    }
+    return bufp;
+}
+
+char *corsaro_generate_avro_file_name(const char *template,
+        const char *plugin,
+        const char *monitorname,
+        uint32_t time,
+        int threadid)
+{
+    /* some of the structure of this code is borrowed from the
+       FreeBSD implementation of strftime */
+
+    /* the output buffer */
+    /* @todo change the code to dynamically realloc this if we need more
+       space */
+    char buf[1024];
+    char tbuf[1024];
+    char *bufp = buf;
+    char *buflim = buf + sizeof(buf);
+
+    /* cast away const, but we don't modify the buffer */
+    char *tmpl = (char*)template;
+    char secs[11]; /* length of UINT32_MAX +1 */
+    struct timeval tv;
+
+    if (template == NULL) {
+        return NULL;
+    }
+
+
+    for (; *tmpl; ++tmpl) {
         if (*tmpl == '%') {
             switch (*++tmpl) {
                 case '\0':
@@ -586,4 +2095,494 @@ char *corsaro_generate_avro_file_name(const char *template,
 }
 
 
+/* Decoding avro container files directly, one block at a time */
+
+struct corsaro_avro_block_reader {
+    char *filename;
+    corsaro_logger_t *logger;
+
+    /** The whole file, mapped into memory */
+    uint8_t *map;
+    size_t maplen;
+    /** Start of the next block in the mapped file */
+    const uint8_t *cursor;
+    /** Start of the first block, just after the header */
+    const uint8_t *firstblock;
+
+    /** Codec used to compress each block */
+    uint8_t codec;
+    /** Writer schema, as a nul-terminated JSON string */
+    char *schema;
+    /** Sync marker that should follow each block */
+    uint8_t sync[16];
+
+    /** Decompressed contents of the current block */
+    uint8_t *block;
+    uint32_t blocksize;
+
+    z_stream inflater;
+    uint8_t inflateready;
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zdctx;
+#endif
+};
+
+/* Makes sure the block buffer can hold at least 'needed' bytes */
+static int grow_block_buffer(corsaro_avro_block_reader_t *rdr,
+        uint64_t needed) {
+
+    uint8_t *tmp;
+    uint64_t newsize = rdr->blocksize ? rdr->blocksize : 65536;
+
+    if (needed <= rdr->blocksize) {
+        return 0;
+    }
+    if (needed > UINT32_MAX) {
+        return -1;
+    }
+    while (newsize < needed) {
+        newsize *= 2;
+    }
+    if (newsize > UINT32_MAX) {
+        newsize = UINT32_MAX;
+    }
+    tmp = (uint8_t *)realloc(rdr->block, newsize);
+    if (tmp == NULL) {
+        return -1;
+    }
+    rdr->block = tmp;
+    rdr->blocksize = (uint32_t)newsize;
+    return 0;
+}
+
+/* Parses the container header at the start of the mapped file, saving the
+ * codec, schema and sync marker.
+ */
+static int parse_avro_block_header(corsaro_avro_block_reader_t *rdr) {
+
+    const uint8_t *ptr = rdr->map;
+    const uint8_t *end = rdr->map + rdr->maplen;
+    int64_t count, klen, vlen, i;
+    const uint8_t *key, *val;
+    char codecname[16];
+
+    if (rdr->maplen < 4 || memcmp(ptr, "Obj\x01", 4) != 0) {
+        corsaro_log(rdr->logger, "%s is not an Avro container file",
+                rdr->filename);
+        return -1;
+    }
+    ptr += 4;
+
+    strcpy(codecname, "null");
+    while (1) {
+        if (corsaro_get_avro_long(&ptr, end, &count) < 0) {
+            goto badheader;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            count = -count;
+            if (corsaro_get_avro_long(&ptr, end, &klen) < 0) {
+                goto badheader;
+            }
+        }
+        for (i = 0; i < count; i++) {
+            if (corsaro_get_avro_long(&ptr, end, &klen) < 0 || klen < 0 ||
+                    klen > end - ptr) {
+                goto badheader;
+            }
+            key = ptr;
+            ptr += klen;
+            if (corsaro_get_avro_long(&ptr, end, &vlen) < 0 || vlen < 0 ||
+                    vlen > end - ptr) {
+                goto badheader;
+            }
+            val = ptr;
+            ptr += vlen;
+
+            if (klen == 10 && memcmp(key, "avro.codec", 10) == 0) {
+                if (vlen >= (int64_t)sizeof(codecname)) {
+                    goto badheader;
+                }
+                memcpy(codecname, val, vlen);
+                codecname[vlen] = '\0';
+            } else if (klen == 11 && memcmp(key, "avro.schema", 11) == 0) {
+                free(rdr->schema);
+                rdr->schema = (char *)malloc(vlen + 1);
+                if (rdr->schema == NULL) {
+                    goto badheader;
+                }
+                memcpy(rdr->schema, val, vlen);
+                rdr->schema[vlen] = '\0';
+            }
+        }
+    }
+
+    if (end - ptr < 16 || rdr->schema == NULL) {
+        goto badheader;
+    }
+    memcpy(rdr->sync, ptr, 16);
+    rdr->cursor = ptr + 16;
+    rdr->firstblock = rdr->cursor;
+
+    if (strcmp(codecname, "null") == 0) {
+        rdr->codec = CORSARO_AVRO_CODEC_NULL;
+    } else if (strcmp(codecname, "deflate") == 0) {
+        rdr->codec = CORSARO_AVRO_CODEC_DEFLATE;
+#ifdef HAVE_SNAPPY
+    } else if (strcmp(codecname, "snappy") == 0) {
+        rdr->codec = CORSARO_AVRO_CODEC_SNAPPY;
+#endif
+#ifdef HAVE_ZSTD
+    } else if (strcmp(codecname, "zstandard") == 0) {
+        rdr->codec = CORSARO_AVRO_CODEC_ZSTD;
+#endif
+    } else {
+        corsaro_log(rdr->logger, "unsupported Avro codec '%s' in %s",
+                codecname, rdr->filename);
+        return -1;
+    }
+    return 0;
+
+badheader:
+    corsaro_log(rdr->logger, "invalid Avro container header in %s",
+            rdr->filename);
+    return -1;
+}
+
+corsaro_avro_block_reader_t *corsaro_create_avro_block_reader(
+        corsaro_logger_t *logger, char *filename) {
+
+    corsaro_avro_block_reader_t *rdr;
+    struct stat st;
+    int fd;
+
+    rdr = (corsaro_avro_block_reader_t *)calloc(1,
+            sizeof(corsaro_avro_block_reader_t));
+    if (rdr == NULL) {
+        corsaro_log(logger, "unable to allocate memory for Avro block reader.");
+        return NULL;
+    }
+    rdr->logger = logger;
+    rdr->filename = strdup(filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        corsaro_log(logger, "unable to open Avro file %s for reading: %s",
+                filename, strerror(errno));
+        goto failed;
+    }
+    if (fstat(fd, &st) < 0) {
+        corsaro_log(logger, "unable to stat Avro file %s: %s",
+                filename, strerror(errno));
+        close(fd);
+        goto failed;
+    }
+    rdr->maplen = st.st_size;
+    if (rdr->maplen > 0) {
+        rdr->map = (uint8_t *)mmap(NULL, rdr->maplen, PROT_READ, MAP_PRIVATE,
+                fd, 0);
+        if (rdr->map == MAP_FAILED) {
+            corsaro_log(logger, "unable to map Avro file %s: %s",
+                    filename, strerror(errno));
+            rdr->map = NULL;
+            close(fd);
+            goto failed;
+        }
+        madvise(rdr->map, rdr->maplen, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (parse_avro_block_header(rdr) < 0) {
+        goto failed;
+    }
+    return rdr;
+
+failed:
+    corsaro_destroy_avro_block_reader(rdr);
+    return NULL;
+}
+
+void corsaro_destroy_avro_block_reader(corsaro_avro_block_reader_t *rdr) {
+
+    if (rdr == NULL) {
+        return;
+    }
+    if (rdr->map) {
+        munmap(rdr->map, rdr->maplen);
+    }
+    if (rdr->inflateready) {
+        inflateEnd(&(rdr->inflater));
+    }
+#ifdef HAVE_ZSTD
+    if (rdr->zdctx) {
+        ZSTD_freeDCtx(rdr->zdctx);
+    }
+#endif
+    free(rdr->block);
+    free(rdr->schema);
+    free(rdr->filename);
+    free(rdr);
+}
+
+const char *corsaro_get_avro_block_reader_schema(
+        corsaro_avro_block_reader_t *rdr) {
+    return rdr->schema;
+}
+
+static int inflate_avro_block(corsaro_avro_block_reader_t *rdr,
+        const uint8_t *comp, uint32_t complen, uint32_t *outlen) {
+
+    int ret;
+
+    if (!rdr->inflateready) {
+        memset(&(rdr->inflater), 0, sizeof(z_stream));
+        /* Avro uses raw deflate, without the zlib header */
+        if (inflateInit2(&(rdr->inflater), -15) != Z_OK) {
+            return -1;
+        }
+        rdr->inflateready = 1;
+    } else if (inflateReset(&(rdr->inflater)) != Z_OK) {
+        return -1;
+    }
+
+    if (grow_block_buffer(rdr, ((uint64_t)complen) * 4) < 0) {
+        return -1;
+    }
+    rdr->inflater.next_in = (Bytef *)comp;
+    rdr->inflater.avail_in = complen;
+    rdr->inflater.next_out = rdr->block;
+    rdr->inflater.avail_out = rdr->blocksize;
+
+    while (1) {
+        ret = inflate(&(rdr->inflater), Z_FINISH);
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_BUF_ERROR && ret != Z_OK) {
+            return -1;
+        }
+        if (rdr->inflater.avail_out != 0) {
+            /* Ran out of input before the end of the stream */
+            return -1;
+        }
+        if (grow_block_buffer(rdr, ((uint64_t)rdr->blocksize) * 2) < 0) {
+            return -1;
+        }
+        rdr->inflater.next_out = rdr->block + rdr->inflater.total_out;
+        rdr->inflater.avail_out = rdr->blocksize - rdr->inflater.total_out;
+    }
+    *outlen = rdr->inflater.total_out;
+    return 0;
+}
+
+#ifdef HAVE_SNAPPY
+static int unsnappy_avro_block(corsaro_avro_block_reader_t *rdr,
+        const uint8_t *comp, uint32_t complen, uint32_t *outlen) {
+
+    size_t len;
+    uint32_t crc;
+
+    /* Each block ends with a CRC32 of the uncompressed data */
+    if (complen < 4) {
+        return -1;
+    }
+    complen -= 4;
+    if (snappy_uncompressed_length((const char *)comp, complen, &len)
+            != SNAPPY_OK) {
+        return -1;
+    }
+    if (grow_block_buffer(rdr, len) < 0) {
+        return -1;
+    }
+    if (snappy_uncompress((const char *)comp, complen, (char *)rdr->block,
+                &len) != SNAPPY_OK) {
+        return -1;
+    }
+    memcpy(&crc, comp + complen, sizeof(crc));
+    if (ntohl(crc) != crc32(0, (const Bytef *)rdr->block, len)) {
+        return -1;
+    }
+    *outlen = len;
+    return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int unzstd_avro_block(corsaro_avro_block_reader_t *rdr,
+        const uint8_t *comp, uint32_t complen, uint32_t *outlen) {
+
+    unsigned long long len;
+    size_t ret;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+
+    if (rdr->zdctx == NULL) {
+        rdr->zdctx = ZSTD_createDCtx();
+        if (rdr->zdctx == NULL) {
+            return -1;
+        }
+    }
+
+    len = ZSTD_getFrameContentSize(comp, complen);
+    if (len == ZSTD_CONTENTSIZE_ERROR) {
+        return -1;
+    }
+    if (len != ZSTD_CONTENTSIZE_UNKNOWN) {
+        if (grow_block_buffer(rdr, len) < 0) {
+            return -1;
+        }
+        ret = ZSTD_decompressDCtx(rdr->zdctx, rdr->block, rdr->blocksize,
+                comp, complen);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        *outlen = ret;
+        return 0;
+    }
+
+    /* The frame doesn't say how big it is, so stream it out instead */
+    ZSTD_DCtx_reset(rdr->zdctx, ZSTD_reset_session_only);
+    if (grow_block_buffer(rdr, ((uint64_t)complen) * 4) < 0) {
+        return -1;
+    }
+    in.src = comp;
+    in.size = complen;
+    in.pos = 0;
+    out.dst = rdr->block;
+    out.size = rdr->blocksize;
+    out.pos = 0;
+    while (1) {
+        ret = ZSTD_decompressStream(rdr->zdctx, &out, &in);
+        if (ZSTD_isError(ret)) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        if (out.pos == out.size) {
+            if (grow_block_buffer(rdr, ((uint64_t)rdr->blocksize) * 2) < 0) {
+                return -1;
+            }
+            out.dst = rdr->block;
+            out.size = rdr->blocksize;
+        } else if (in.pos == in.size) {
+            return -1;
+        }
+    }
+    *outlen = out.pos;
+    return 0;
+}
+#endif
+
+/* Finds the bounds of the block at the reader's cursor and checks its
+ * sync marker, moving the cursor on to the following block. Returns 1 if
+ * a block was found, 0 if the cursor is at the end of the file and -1 if
+ * the block is invalid.
+ */
+static int next_avro_block_bounds(corsaro_avro_block_reader_t *rdr,
+        const uint8_t **comp, int64_t *complen, int64_t *count) {
+
+    const uint8_t *ptr = rdr->cursor;
+    const uint8_t *end = rdr->map + rdr->maplen;
+
+    if (ptr == end) {
+        return 0;
+    }
+
+    if (corsaro_get_avro_long(&ptr, end, count) < 0 || *count < 0 ||
+            corsaro_get_avro_long(&ptr, end, complen) < 0 || *complen < 0 ||
+            *complen > UINT32_MAX || end - ptr < *complen + 16) {
+        corsaro_log(rdr->logger, "truncated Avro block in %s", rdr->filename);
+        return -1;
+    }
+    *comp = ptr;
+    ptr += *complen;
+    if (memcmp(ptr, rdr->sync, 16) != 0) {
+        corsaro_log(rdr->logger, "Avro block in %s has a bad sync marker",
+                rdr->filename);
+        return -1;
+    }
+    rdr->cursor = ptr + 16;
+    return 1;
+}
+
+int corsaro_skip_next_avro_block(corsaro_avro_block_reader_t *rdr,
+        uint64_t *offset, uint64_t *records) {
+
+    const uint8_t *comp;
+    int64_t count, complen;
+    uint64_t start = rdr->cursor - rdr->map;
+    int ret;
+
+    ret = next_avro_block_bounds(rdr, &comp, &complen, &count);
+    if (ret <= 0) {
+        return ret;
+    }
+    *offset = start;
+    *records = count;
+    return 1;
+}
+
+int corsaro_read_next_avro_block(corsaro_avro_block_reader_t *rdr,
+        const uint8_t **data, uint32_t *len, uint64_t *records) {
+
+    int64_t count, complen;
+    const uint8_t *comp;
+    int ret;
+
+    ret = next_avro_block_bounds(rdr, &comp, &complen, &count);
+    if (ret <= 0) {
+        return ret;
+    }
+    ret = -1;
+
+    switch (rdr->codec) {
+        case CORSARO_AVRO_CODEC_NULL:
+            *data = comp;
+            *len = complen;
+            ret = 0;
+            break;
+        case CORSARO_AVRO_CODEC_DEFLATE:
+            ret = inflate_avro_block(rdr, comp, complen, len);
+            *data = rdr->block;
+            break;
+#ifdef HAVE_SNAPPY
+        case CORSARO_AVRO_CODEC_SNAPPY:
+            ret = unsnappy_avro_block(rdr, comp, complen, len);
+            *data = rdr->block;
+            break;
+#endif
+#ifdef HAVE_ZSTD
+        case CORSARO_AVRO_CODEC_ZSTD:
+            ret = unzstd_avro_block(rdr, comp, complen, len);
+            *data = rdr->block;
+            break;
+#endif
+    }
+
+    if (ret < 0) {
+        corsaro_log(rdr->logger, "unable to decompress Avro block in %s",
+                rdr->filename);
+        return -1;
+    }
+    *records = count;
+    return 1;
+}
+
+
+int corsaro_seek_avro_block_reader(corsaro_avro_block_reader_t *rdr,
+        uint64_t offset) {
+
+    if (offset < (uint64_t)(rdr->firstblock - rdr->map) ||
+            offset > rdr->maplen) {
+        corsaro_log(rdr->logger, "cannot seek to offset %lu in %s",
+                offset, rdr->filename);
+        return -1;
+    }
+    rdr->cursor = rdr->map + offset;
+    return 0;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -53,8 +53,11 @@
 
 #include "libcorsaro.h"
 #include "libcorsaro_log.h"
+#include "libcorsaro_filewriter.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <avro.h>
 
 typedef struct corsaro_avro_reader {
@@ -70,6 +73,60 @@ typedef struct corsaro_avro_reader {
 
 
 
+typedef struct corsaro_avro_compress_pool corsaro_avro_compress_pool_t;
+typedef struct corsaro_avro_block_reader corsaro_avro_block_reader_t;
+
+/** Statistics about the blocks that a block writer has written */
+typedef struct corsaro_avro_writer_stats {
+    /** Number of blocks written */
+    uint64_t blocks;
+    /** Number of records written */
+    uint64_t records;
+    /** Bytes of encoded records, before compression */
+    uint64_t rawbytes;
+    /** Bytes written to the file, including block headers and sync
+     *  markers.
+     */
+    uint64_t writtenbytes;
+    /** Microseconds spent compressing blocks, summed over all of the
+     *  threads that compressed them.
+     */
+    uint64_t compressusec;
+    /** Microseconds that the writing thread spent waiting for the
+     *  compression threads.
+     */
+    uint64_t stallusec;
+} corsaro_avro_writer_stats_t;
+
+/** Describes one block of an avro container file in a sidecar index.
+ *
+ *  Record keys are 128-bit values supplied by whoever wrote the file, e.g.
+ *  corsaro_flowtuple_sort_key() for flowtuple files.
+ */
+typedef struct corsaro_avro_index_entry {
+    /** Offset of the start of the block within the avro file */
+    uint64_t offset;
+    /** Number of records in the block */
+    uint64_t records;
+    /** Lowest record key in the block. For files written in key order,
+     *  this is the key of the first record. */
+    uint64_t minhi;
+    uint64_t minlo;
+    /** Highest record key in the block. For files written in key order,
+     *  this is the key of the last record. */
+    uint64_t maxhi;
+    uint64_t maxlo;
+} corsaro_avro_index_entry_t;
+
+/** A block index, as loaded from the sidecar file of an avro file */
+typedef struct corsaro_avro_index {
+    uint64_t count;
+    corsaro_avro_index_entry_t *entries;
+} corsaro_avro_index_t;
+
+/** Suffix added to an avro file name to get the name of its index */
+#define CORSARO_AVRO_INDEX_SUFFIX ".idx"
+
 typedef struct corsaro_avro_writer {
     const char *schema_string;
     avro_schema_t schema;
@@ -85,8 +142,91 @@ typedef struct corsaro_avro_writer {
 
     corsaro_logger_t *logger;
 
+    /* The following are only used by writers that were started with
+     * corsaro_start_avro_block_writer(). These writers build avro
+     * container blocks themselves: encoded records are appended to
+     * 'encodespace' one after the other, and the whole buffer is
+     * compressed and written out as a single block once it is full.
+     */
+
+    /** Set while a block writer has an output file open */
+    uint8_t blockmode;
+    /** Output file for block writers that do their own file I/O */
+    FILE *blockout;
+    /** If set, block writers hand their output to this service rather
+     *  than writing it themselves.
+     */
+    corsaro_filewriter_t *filewriter;
+    /** Output file for block writers that use a file writer service */
+    corsaro_filewriter_file_t *fwfile;
+    /** Header and block bytes waiting to be passed to the output file */
+    char *outbuf;
+    uint32_t outused;
+    uint32_t outsize;
+    /** Used to encode avro values appended to a block writer */
+    avro_writer_t memwriter;
+    /** Codec used to compress each block */
+    uint8_t blockcodec;
+    /** Compression level passed to the codec (0 = codec default) */
+    int blocklevel;
+    /** Number of complete records in the current block */
+    uint32_t blockrecords;
+    /** Bytes of 'encodespace' used by complete records */
+    uint32_t blockused;
+    /** Threads to compress blocks on. If NULL, blocks are compressed by
+     *  the thread that is writing records.
+     */
+    corsaro_avro_compress_pool_t *cpool;
+    /** Blocks that have been handed to the compression threads, in the
+     *  order that they must be written to the file.
+     */
+    struct corsaro_avro_block_job *pendinghead;
+    struct corsaro_avro_block_job *pendingtail;
+    uint32_t pendingcount;
+    /** Finished block jobs that can be reused for later blocks */
+    struct corsaro_avro_block_job *sparejobs;
+    /** Compression state used when there is no compression pool */
+    struct corsaro_avro_codec_ctx *codecctx;
+    /** Sync marker written after the header and each block */
+    uint8_t sync[16];
+    /** Running totals for the blocks written by this writer */
+    corsaro_avro_writer_stats_t stats;
+
+    /** If set, block writers keep an index entry for each block and write
+     *  the index to a sidecar file when the output file is closed.
+     */
+    uint8_t indexing;
+    /** Offset in the output file at which the next block will start */
+    uint64_t fileoffset;
+    /** Range of record keys in the block that is being built */
+    corsaro_avro_index_entry_t blockkeys;
+    uint8_t blockhaskeys;
+    /** Index entries for the blocks written to the current file */
+    corsaro_avro_index_entry_t *index;
+    uint64_t indexcount;
+    uint64_t indexalloc;
+
+    /** If set (the default), closing the writer creates an empty
+     *  "<fname>.done" file once the output file is complete.
+     */
+    uint8_t writedone;
+
 } corsaro_avro_writer_t;
 
+/** Codecs that a block writer may use to compress its blocks */
+enum {
+    CORSARO_AVRO_CODEC_DEFLATE,
+    CORSARO_AVRO_CODEC_SNAPPY,
+    CORSARO_AVRO_CODEC_ZSTD,
+    /** Only used when reading: blocks are not compressed */
+    CORSARO_AVRO_CODEC_NULL,
+};
+
+/** The amount of encoded record data that a block writer collects before
+ *  compressing and writing a block.
+ */
+#define CORSARO_AVRO_BLOCK_SIZE (64 * 1024)
+
 enum {
     CORSARO_AVRO_LONG,
     CORSARO_AVRO_STRING,
@@ -132,12 +272,304 @@ int corsaro_encode_avro_field(corsaro_avro_writer_t *writer,
 int corsaro_encode_avro_integer_array(corsaro_avro_writer_t *writer,
         void *arrayptr, uint8_t fieldlen, uint32_t fieldcount);
 
+/** Starts a set of threads that compress blocks on behalf of avro block
+ *  writers. A single pool may be shared by any number of writers, but it
+ *  must not be destroyed until all of those writers have been closed.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param threads      The number of compression threads to start
+ *  @return a pointer to the new pool, or NULL if an error occurs.
+ */
+corsaro_avro_compress_pool_t *corsaro_create_avro_compress_pool(
+        corsaro_logger_t *logger, uint8_t threads);
+
+/** Stops the threads in a compression pool and frees the pool.
+ *
+ *  @param pool         The pool to destroy
+ */
+void corsaro_destroy_avro_compress_pool(corsaro_avro_compress_pool_t *pool);
+
+/** Opens an avro output file that is written one block at a time by
+ *  corsaro itself, rather than one record at a time via libavro.
+ *
+ *  Records may be added either by appending an avro_value_t with
+ *  corsaro_append_avro_writer(), or by using corsaro_start_avro_encoding()
+ *  and the encoding functions followed by corsaro_append_avro_writer()
+ *  with a NULL value. The resulting file is a standard avro container
+ *  file.
+ *
+ *  If a compression pool is given, full blocks are compressed by the
+ *  threads in the pool and written out in order as they complete.
+ *
+ *  @param writer       The avro writer to start
+ *  @param fname        The name of the file to write to
+ *  @param codec        The codec to compress blocks with. If the codec is
+ *                      not available, deflate is used instead.
+ *  @param level        The compression level for the codec, or 0 to use
+ *                      the codec's default level.
+ *  @param cpool        The compression pool to use, or NULL to compress
+ *                      blocks on the calling thread.
+ *  @return 0 if successful, -1 if an error occurs.
+ */
+int corsaro_start_avro_block_writer(corsaro_avro_writer_t *writer,
+        char *fname, uint8_t codec, int level,
+        corsaro_avro_compress_pool_t *cpool);
+
+/** Makes a block writer pass its output to a file writer service, so that
+ *  opening, writing and closing its output files happens on the service's
+ *  thread. Must be called before the writer is started; the setting
+ *  applies to every file that the writer subsequently opens.
+ *
+ *  @param writer       The avro writer to configure
+ *  @param fw           The file writer service to use, or NULL to go back
+ *                      to writing files directly.
+ */
+void corsaro_set_avro_writer_filewriter(corsaro_avro_writer_t *writer,
+        corsaro_filewriter_t *fw);
+
+/** Waits for every block that a block writer has handed to its compression
+ *  pool and writes them to the output file. Records that have not yet
+ *  filled a block are kept for the next block.
+ *
+ *  @param writer       The avro writer to drain
+ *  @return 0 if successful, -1 if any block could not be written.
+ */
+int corsaro_drain_avro_writer(corsaro_avro_writer_t *writer);
+
+/** Copies the statistics for the blocks written by a block writer.
+ *
+ *  @param writer       The avro writer to get statistics for
+ *  @param stats        Updated to contain the statistics
+ *  @param reset        If non-zero, the writer's statistics are reset to
+ *                      zero afterwards.
+ */
+void corsaro_get_avro_writer_stats(corsaro_avro_writer_t *writer,
+        corsaro_avro_writer_stats_t *stats, uint8_t reset);
+
+/** Concatenates several avro container files into a single container
+ *  file, without decoding or recompressing any of the records. Every
+ *  input must have been written with the same schema and codec; the
+ *  records appear in the output in the order that the inputs are given.
+ *
+ *  If every input has a sidecar index, an index is also written for the
+ *  output file.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param outname      The name of the file to write to
+ *  @param innames      The names of the files to concatenate
+ *  @param count        The number of files in 'innames'
+ *  @return 0 if successful, -1 if an error occurs.
+ */
+int corsaro_concat_avro_files(corsaro_logger_t *logger, char *outname,
+        char **innames, int count);
+
+/** Makes a block writer write a sidecar index (named after the output
+ *  file, plus CORSARO_AVRO_INDEX_SUFFIX) listing the offset, record count
+ *  and key range of every block. Record keys are set by calling
+ *  corsaro_set_avro_record_key() before appending each record. Must be
+ *  called before the writer is started.
+ *
+ *  The index consists of a 16 byte header -- the magic "CAVI", a 32-bit
+ *  version number and a 64-bit entry count -- followed by one entry per
+ *  block, each made up of the six 64-bit fields of
+ *  corsaro_avro_index_entry_t. All values are in network byte order.
+ *
+ *  @param writer       The avro writer to configure
+ *  @param enabled      Whether the writer should write an index
+ */
+void corsaro_enable_avro_writer_index(corsaro_avro_writer_t *writer,
+        uint8_t enabled);
+
+/** Controls whether closing an avro writer creates a "<fname>.done" file
+ *  alongside the output file. Writers create the .done file by default;
+ *  callers that want to check the output before announcing it can turn
+ *  this off and create the .done file themselves.
+ *
+ *  @param writer       The avro writer to configure
+ *  @param enabled      Whether closing the writer should create a .done file
+ */
+void corsaro_set_avro_writer_done_file(corsaro_avro_writer_t *writer,
+        uint8_t enabled);
+
+/** Sets the key of the next record to be appended to an avro writer, so
+ *  that it can be included in the index. Has no effect unless indexing
+ *  has been enabled for the writer.
+ */
+static inline void corsaro_set_avro_record_key(corsaro_avro_writer_t *writer,
+        uint64_t keyhi, uint64_t keylo) {
+
+    corsaro_avro_index_entry_t *k = &(writer->blockkeys);
+
+    if (!writer->indexing) {
+        return;
+    }
+    if (!writer->blockhaskeys) {
+        k->minhi = k->maxhi = keyhi;
+        k->minlo = k->maxlo = keylo;
+        writer->blockhaskeys = 1;
+        return;
+    }
+    if (keyhi < k->minhi || (keyhi == k->minhi && keylo < k->minlo)) {
+        k->minhi = keyhi;
+        k->minlo = keylo;
+    }
+    if (keyhi > k->maxhi || (keyhi == k->maxhi && keylo > k->maxlo)) {
+        k->maxhi = keyhi;
+        k->maxlo = keylo;
+    }
+}
+
+/** Loads the sidecar index for an avro file.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param filename     The name of the avro file (not the index itself)
+ *  @return the loaded index, or NULL if the file has no index or the index
+ *          is invalid.
+ */
+corsaro_avro_index_t *corsaro_load_avro_index(corsaro_logger_t *logger,
+        const char *filename);
+
+/** Frees an index returned by corsaro_load_avro_index() */
+void corsaro_free_avro_index(corsaro_avro_index_t *idx);
+
+/** Finds the first block in an index that may contain records with keys
+ *  at or above the given key, i.e. the first block whose highest key is
+ *  not below it.
+ *
+ *  @return the position of the block in the index, or idx->count if no
+ *          block can contain such a record.
+ */
+uint64_t corsaro_find_avro_index_block(corsaro_avro_index_t *idx,
+        uint64_t keyhi, uint64_t keylo);
+
+/** Makes sure there is room for at least 'len' more bytes of encoded
+ *  record data in an avro writer's encoding buffer.
+ *
+ *  @return 0 if successful, -1 if the buffer could not be grown.
+ */
+int corsaro_reserve_avro_encoding(corsaro_avro_writer_t *writer,
+        uint32_t len);
+
+/** Appends an integer to the current record using the avro zigzag varint
+ *  encoding. There must already be at least 10 bytes reserved.
+ */
+static inline void corsaro_put_avro_long(corsaro_avro_writer_t *writer,
+        int64_t l) {
+
+    uint64_t n = (l << 1) ^ (l >> 63);
+    char *ptr = writer->encodespace + writer->encodeused;
+
+    while (n & ~0x7F) {
+        *ptr = (char)((((uint8_t) n) & 0x7F) | 0x80);
+        n >>= 7;
+        ptr ++;
+    }
+    *ptr = (char)n;
+    writer->encodeused += (ptr - (writer->encodespace +
+            writer->encodeused)) + 1;
+}
+
+/** Appends a string to the current record. The length (as a varint) and
+ *  the string contents must already have room reserved.
+ */
+static inline void corsaro_put_avro_string(corsaro_avro_writer_t *writer,
+        const char *str, uint32_t len) {
+
+    corsaro_put_avro_long(writer, len);
+    memcpy(writer->encodespace + writer->encodeused, str, len);
+    writer->encodeused += len;
+}
+
 corsaro_avro_reader_t *corsaro_create_avro_reader(corsaro_logger_t *logger,
         char *filename);
 void corsaro_destroy_avro_reader(corsaro_avro_reader_t *reader);
 int corsaro_read_next_avro_record(corsaro_avro_reader_t *reader,
         avro_value_t **av);
 
+/** Reads a zigzag varint (an avro int or long) from an encoded record,
+ *  advancing the pointer past it.
+ *
+ *  @return 0 if successful, -1 if the varint runs past 'end'.
+ */
+static inline int corsaro_get_avro_long(const uint8_t **ptr,
+        const uint8_t *end, int64_t *val) {
+
+    const uint8_t *p = *ptr;
+    uint64_t n = 0;
+    int shift = 0;
+
+    do {
+        if (p == end || shift > 63) {
+            return -1;
+        }
+        n |= ((uint64_t)(*p & 0x7F)) << shift;
+        shift += 7;
+    } while (*(p++) & 0x80);
+
+    *ptr = p;
+    *val = (int64_t)((n >> 1) ^ -(n & 1));
+    return 0;
+}
+
+/** Opens an avro container file for reading one block at a time, without
+ *  going through libavro. The file is mapped into memory and its header is
+ *  parsed straight away; each block is then decompressed on request and
+ *  handed back as raw encoded records, which the caller decodes itself.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param filename     The name of the file to read
+ *  @return a pointer to the new block reader, or NULL if the file could
+ *          not be opened or is not a valid avro container file.
+ */
+corsaro_avro_block_reader_t *corsaro_create_avro_block_reader(
+        corsaro_logger_t *logger, char *filename);
+
+/** Closes an avro block reader and frees its resources.
+ *
+ *  @param rdr          The block reader to destroy
+ */
+void corsaro_destroy_avro_block_reader(corsaro_avro_block_reader_t *rdr);
+
+/** Returns the writer schema of the file being read by a block reader, as
+ *  a JSON string.
+ */
+const char *corsaro_get_avro_block_reader_schema(
+        corsaro_avro_block_reader_t *rdr);
+
+/** Decompresses the next block in the file being read by a block reader.
+ *
+ *  @param rdr          The block reader to read from
+ *  @param data         Set to point to the encoded records in the block.
+ *                      Only valid until the next call to this function.
+ *  @param len          Set to the number of bytes of encoded records
+ *  @param records      Set to the number of records in the block
+ *  @return 1 if a block was read, 0 if there are no more blocks, or -1 if
+ *          the block was invalid or could not be decompressed.
+ */
+int corsaro_read_next_avro_block(corsaro_avro_block_reader_t *rdr,
+        const uint8_t **data, uint32_t *len, uint64_t *records);
+
+/** Moves a block reader past the next block in the file without
+ *  decompressing it. Useful for finding where each block starts, so that
+ *  the blocks can be shared out between several readers.
+ *
+ *  @param rdr          The block reader to move
+ *  @param offset       Set to the offset in the file where the block starts
+ *  @param records      Set to the number of records in the block
+ *  @return 1 if a block was skipped, 0 if there are no more blocks, or -1
+ *          if the block was invalid.
+ */
+int corsaro_skip_next_avro_block(corsaro_avro_block_reader_t *rdr,
+        uint64_t *offset, uint64_t *records);
+
+/** Moves a block reader to the block that starts at the given offset in
+ *  the file, typically taken from the file's index.
+ *
+ *  @return 0 if successful, -1 if the offset is not within the file.
+ */
+int corsaro_seek_avro_block_reader(corsaro_avro_block_reader_t *rdr,
+        uint64_t offset);
+
 
 /* Helper functions to simplify Avro population callback functions */
 #define CORSARO_AVRO_GET_FIELD_REF(av, f, index, name, plugin) \
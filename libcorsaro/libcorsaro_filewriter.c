@@ -0,0 +1,525 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "libcorsaro_filewriter.h"
+#include "libcorsaro_log.h"
+
+enum {
+    CORSARO_FILEWRITER_OP_OPEN,
+    CORSARO_FILEWRITER_OP_WRITE,
+    CORSARO_FILEWRITER_OP_CLOSE,
+};
+
+struct corsaro_filewriter_file {
+    corsaro_filewriter_t *fw;
+    char *fname;
+    int fd;
+    /** Set if the file could not be opened or written to */
+    uint8_t failed;
+    uint64_t written;
+};
+
+typedef struct corsaro_filewriter_op {
+    uint8_t type;
+    corsaro_filewriter_file_t *file;
+    char *buf;
+    uint32_t len;
+    uint8_t writedone;
+    struct timeval queued;
+    struct corsaro_filewriter_op *next;
+} corsaro_filewriter_op_t;
+
+struct corsaro_filewriter {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    /** Signalled whenever an operation is added to the queue */
+    pthread_cond_t notempty;
+    /** Broadcast whenever an operation has been completed */
+    pthread_cond_t notfull;
+
+    corsaro_filewriter_op_t *head;
+    corsaro_filewriter_op_t *tail;
+
+    uint64_t maxqueued;
+    uint8_t halted;
+    /** Set while writers are waiting on the queue, so that we only log
+     *  the first time that it fills up.
+     */
+    uint8_t stalling;
+
+    corsaro_filewriter_stats_t stats;
+    time_t lastreport;
+    corsaro_logger_t *logger;
+};
+
+static inline uint64_t usec_between(struct timeval *start,
+        struct timeval *end) {
+    return ((end->tv_sec - start->tv_sec) * 1000000) +
+            (end->tv_usec - start->tv_usec);
+}
+
+static void free_writer_file(corsaro_filewriter_file_t *file) {
+    if (file->fname) {
+        free(file->fname);
+    }
+    free(file);
+}
+
+static void perform_open(corsaro_filewriter_t *fw,
+        corsaro_filewriter_file_t *file) {
+
+    file->fd = open(file->fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file->fd < 0) {
+        corsaro_log(fw->logger, "error opening output file %s: %s",
+                file->fname, strerror(errno));
+        file->failed = 1;
+    }
+}
+
+static void perform_write(corsaro_filewriter_t *fw,
+        corsaro_filewriter_file_t *file, corsaro_filewriter_op_t *op) {
+
+    uint32_t done = 0;
+    ssize_t ret;
+
+    if (file->failed) {
+        return;
+    }
+
+    while (done < op->len) {
+        ret = write(file->fd, op->buf + done, op->len - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            corsaro_log(fw->logger,
+                    "error writing to output file %s: %s (further writes to this file will be discarded)",
+                    file->fname, strerror(errno));
+            file->failed = 1;
+            return;
+        }
+        done += ret;
+    }
+    file->written += done;
+}
+
+static void perform_close(corsaro_filewriter_t *fw,
+        corsaro_filewriter_file_t *file, uint8_t writedone) {
+
+    char donebuf[1024];
+    int fd;
+
+    if (file->fd >= 0 && close(file->fd) != 0) {
+        corsaro_log(fw->logger, "error while closing output file %s: %s",
+                file->fname, strerror(errno));
+        file->failed = 1;
+    }
+    file->fd = -1;
+
+    if (!writedone) {
+        return;
+    }
+
+    if (file->failed) {
+        corsaro_log(fw->logger,
+                "not creating .done file for %s, as it was not written successfully",
+                file->fname);
+        return;
+    }
+
+    if (snprintf(donebuf, sizeof(donebuf), "%s.done", file->fname)
+            >= sizeof(donebuf)) {
+        corsaro_log(fw->logger, "unable to build .done file name");
+        return;
+    }
+
+    fd = open(donebuf, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        corsaro_log(fw->logger, "unable to create .done file %s: %s",
+                donebuf, strerror(errno));
+        return;
+    }
+    close(fd);
+}
+
+/* Logs the statistics for the last reporting period and starts a new one.
+ * Must be called with the mutex held.
+ */
+static void report_filewriter_stats(corsaro_filewriter_t *fw, time_t now) {
+
+    corsaro_filewriter_stats_t *s = &(fw->stats);
+
+    if (s->writes > 0 || s->closes > 0 || s->stalls > 0) {
+        corsaro_log(fw->logger,
+                "file writer: %lu bytes in %lu writes, %lu files closed; write latency mean %.3f ms, max %.3f ms; slowest close %.3f ms; queue depth %u ops / %lu bytes (max %lu bytes); %lu stalls totalling %.3f ms",
+                s->byteswritten, s->writes, s->closes,
+                s->writes ? (s->totallatency / 1000.0) / s->writes : 0.0,
+                s->maxlatency / 1000.0, s->maxclose / 1000.0,
+                s->queuedops, s->queuedbytes, s->maxqueuedbytes,
+                s->stalls, s->stallusec / 1000.0);
+    }
+
+    s->maxqueuedbytes = s->queuedbytes;
+    s->writes = 0;
+    s->byteswritten = 0;
+    s->totallatency = 0;
+    s->maxlatency = 0;
+    s->closes = 0;
+    s->maxclose = 0;
+    s->stalls = 0;
+    s->stallusec = 0;
+    fw->lastreport = now;
+}
+
+static void *start_filewriter_thread(void *data) {
+
+    corsaro_filewriter_t *fw = (corsaro_filewriter_t *)data;
+    corsaro_filewriter_op_t *op;
+    struct timeval start, end;
+    struct timespec ts;
+    uint64_t latency, closetime;
+
+    pthread_mutex_lock(&(fw->mutex));
+    while (1) {
+        while (fw->head == NULL && !fw->halted) {
+            gettimeofday(&end, NULL);
+            if (end.tv_sec - fw->lastreport >=
+                    CORSARO_FILEWRITER_REPORT_FREQ) {
+                report_filewriter_stats(fw, end.tv_sec);
+            }
+            ts.tv_sec = end.tv_sec + 1;
+            ts.tv_nsec = end.tv_usec * 1000;
+            pthread_cond_timedwait(&(fw->notempty), &(fw->mutex), &ts);
+        }
+
+        /* Only stop once everything that was queued has been done */
+        if (fw->head == NULL) {
+            break;
+        }
+
+        op = fw->head;
+        fw->head = op->next;
+        if (fw->head == NULL) {
+            fw->tail = NULL;
+        }
+        pthread_mutex_unlock(&(fw->mutex));
+
+        gettimeofday(&start, NULL);
+        if (op->type == CORSARO_FILEWRITER_OP_OPEN) {
+            perform_open(fw, op->file);
+        } else if (op->type == CORSARO_FILEWRITER_OP_WRITE) {
+            perform_write(fw, op->file, op);
+        } else if (op->type == CORSARO_FILEWRITER_OP_CLOSE) {
+            perform_close(fw, op->file, op->writedone);
+            free_writer_file(op->file);
+        }
+        gettimeofday(&end, NULL);
+
+        pthread_mutex_lock(&(fw->mutex));
+        fw->stats.queuedops --;
+        if (op->type == CORSARO_FILEWRITER_OP_WRITE) {
+            latency = usec_between(&(op->queued), &end);
+            fw->stats.queuedbytes -= op->len;
+            fw->stats.writes ++;
+            fw->stats.byteswritten += op->len;
+            fw->stats.totallatency += latency;
+            if (latency > fw->stats.maxlatency) {
+                fw->stats.maxlatency = latency;
+            }
+        } else if (op->type == CORSARO_FILEWRITER_OP_CLOSE) {
+            closetime = usec_between(&start, &end);
+            fw->stats.closes ++;
+            if (closetime > fw->stats.maxclose) {
+                fw->stats.maxclose = closetime;
+            }
+        }
+        if (fw->stalling && fw->stats.queuedbytes <= fw->maxqueued / 2) {
+            fw->stalling = 0;
+        }
+        pthread_cond_broadcast(&(fw->notfull));
+
+        if (end.tv_sec - fw->lastreport >= CORSARO_FILEWRITER_REPORT_FREQ) {
+            report_filewriter_stats(fw, end.tv_sec);
+        }
+
+        if (op->buf) {
+            free(op->buf);
+        }
+        free(op);
+    }
+
+    gettimeofday(&end, NULL);
+    report_filewriter_stats(fw, end.tv_sec);
+    pthread_mutex_unlock(&(fw->mutex));
+    pthread_exit(NULL);
+}
+
+/* Adds an operation to the queue, waiting first if there is already too
+ * much data waiting to be written.
+ */
+static int enqueue_op(corsaro_filewriter_t *fw, corsaro_filewriter_op_t *op) {
+
+    struct timeval start, end;
+
+    pthread_mutex_lock(&(fw->mutex));
+    if (fw->halted) {
+        pthread_mutex_unlock(&(fw->mutex));
+        corsaro_log(fw->logger,
+                "attempted to use a file writer after it has been stopped");
+        return -1;
+    }
+
+    if (fw->stats.queuedbytes > 0 &&
+            fw->stats.queuedbytes + op->len > fw->maxqueued) {
+        if (!fw->stalling) {
+            corsaro_log(fw->logger,
+                    "file writer has %lu bytes waiting to be written, waiting for it to catch up",
+                    fw->stats.queuedbytes);
+            fw->stalling = 1;
+        }
+        fw->stats.stalls ++;
+        gettimeofday(&start, NULL);
+        while (fw->stats.queuedbytes > 0 &&
+                fw->stats.queuedbytes + op->len > fw->maxqueued) {
+            pthread_cond_wait(&(fw->notfull), &(fw->mutex));
+        }
+        gettimeofday(&end, NULL);
+        fw->stats.stallusec += usec_between(&start, &end);
+    }
+
+    gettimeofday(&(op->queued), NULL);
+    op->next = NULL;
+    if (fw->tail) {
+        fw->tail->next = op;
+    } else {
+        fw->head = op;
+    }
+    fw->tail = op;
+
+    fw->stats.queuedops ++;
+    fw->stats.queuedbytes += op->len;
+    if (fw->stats.queuedbytes > fw->stats.maxqueuedbytes) {
+        fw->stats.maxqueuedbytes = fw->stats.queuedbytes;
+    }
+    pthread_cond_signal(&(fw->notempty));
+    pthread_mutex_unlock(&(fw->mutex));
+    return 0;
+}
+
+static corsaro_filewriter_op_t *create_op(corsaro_filewriter_file_t *file,
+        uint8_t type) {
+
+    corsaro_filewriter_op_t *op;
+
+    op = (corsaro_filewriter_op_t *)calloc(1, sizeof(corsaro_filewriter_op_t));
+    if (op == NULL) {
+        corsaro_log(file->fw->logger,
+                "unable to allocate memory for file writer operation");
+        return NULL;
+    }
+    op->type = type;
+    op->file = file;
+    return op;
+}
+
+corsaro_filewriter_t *corsaro_create_filewriter(corsaro_logger_t *logger,
+        uint64_t maxqueued) {
+
+    corsaro_filewriter_t *fw;
+    struct timeval tv;
+
+    fw = (corsaro_filewriter_t *)calloc(1, sizeof(corsaro_filewriter_t));
+    if (fw == NULL) {
+        corsaro_log(logger, "unable to allocate memory for file writer");
+        return NULL;
+    }
+
+    fw->logger = logger;
+    fw->maxqueued = maxqueued;
+    gettimeofday(&tv, NULL);
+    fw->lastreport = tv.tv_sec;
+
+    pthread_mutex_init(&(fw->mutex), NULL);
+    pthread_cond_init(&(fw->notempty), NULL);
+    pthread_cond_init(&(fw->notfull), NULL);
+
+    if (pthread_create(&(fw->tid), NULL, start_filewriter_thread, fw) != 0) {
+        corsaro_log(logger, "unable to start file writer thread");
+        pthread_mutex_destroy(&(fw->mutex));
+        pthread_cond_destroy(&(fw->notempty));
+        pthread_cond_destroy(&(fw->notfull));
+        free(fw);
+        return NULL;
+    }
+    return fw;
+}
+
+void corsaro_destroy_filewriter(corsaro_filewriter_t *fw) {
+
+    if (fw == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(fw->mutex));
+    fw->halted = 1;
+    pthread_cond_signal(&(fw->notempty));
+    pthread_mutex_unlock(&(fw->mutex));
+
+    pthread_join(fw->tid, NULL);
+
+    pthread_mutex_destroy(&(fw->mutex));
+    pthread_cond_destroy(&(fw->notempty));
+    pthread_cond_destroy(&(fw->notfull));
+    free(fw);
+}
+
+corsaro_filewriter_file_t *corsaro_filewriter_open(corsaro_filewriter_t *fw,
+        const char *fname) {
+
+    corsaro_filewriter_file_t *file;
+    corsaro_filewriter_op_t *op;
+
+    file = (corsaro_filewriter_file_t *)calloc(1,
+            sizeof(corsaro_filewriter_file_t));
+    if (file == NULL) {
+        corsaro_log(fw->logger,
+                "unable to allocate memory for file writer output file");
+        return NULL;
+    }
+    file->fw = fw;
+    file->fd = -1;
+    file->fname = strdup(fname);
+    if (file->fname == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    op = create_op(file, CORSARO_FILEWRITER_OP_OPEN);
+    if (op == NULL) {
+        free_writer_file(file);
+        return NULL;
+    }
+    if (enqueue_op(fw, op) < 0) {
+        free(op);
+        free_writer_file(file);
+        return NULL;
+    }
+    return file;
+}
+
+int corsaro_filewriter_write(corsaro_filewriter_file_t *file,
+        const void *buf, uint32_t len) {
+
+    corsaro_filewriter_op_t *op;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    op = create_op(file, CORSARO_FILEWRITER_OP_WRITE);
+    if (op == NULL) {
+        return -1;
+    }
+
+    op->buf = (char *)malloc(len);
+    if (op->buf == NULL) {
+        corsaro_log(file->fw->logger,
+                "unable to allocate %u bytes for file writer buffer", len);
+        free(op);
+        return -1;
+    }
+    memcpy(op->buf, buf, len);
+    op->len = len;
+
+    if (enqueue_op(file->fw, op) < 0) {
+        free(op->buf);
+        free(op);
+        return -1;
+    }
+    return 0;
+}
+
+int corsaro_filewriter_close(corsaro_filewriter_file_t *file,
+        uint8_t writedone) {
+
+    corsaro_filewriter_op_t *op;
+
+    op = create_op(file, CORSARO_FILEWRITER_OP_CLOSE);
+    if (op == NULL) {
+        return -1;
+    }
+    op->writedone = writedone;
+
+    if (enqueue_op(file->fw, op) < 0) {
+        free(op);
+        return -1;
+    }
+    return 0;
+}
+
+void corsaro_filewriter_get_stats(corsaro_filewriter_t *fw,
+        corsaro_filewriter_stats_t *stats) {
+
+    pthread_mutex_lock(&(fw->mutex));
+    memcpy(stats, &(fw->stats), sizeof(corsaro_filewriter_stats_t));
+    pthread_mutex_unlock(&(fw->mutex));
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
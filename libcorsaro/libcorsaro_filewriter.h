@@ -0,0 +1,170 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef CORSARO_FILEWRITER_H_
+#define CORSARO_FILEWRITER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "libcorsaro_log.h"
+
+/** A service that performs file I/O on behalf of other threads.
+ *
+ *  Opening, writing, closing and creating the ".done" marker for an
+ *  output file are all queued and carried out in order on the service's
+ *  own thread, so a slow write or close (e.g. on network storage) does not
+ *  hold up the thread that produced the data.
+ *
+ *  If too much data is waiting to be written, threads that try to queue
+ *  more will block until the service has caught up.
+ */
+typedef struct corsaro_filewriter corsaro_filewriter_t;
+
+/** How often (in seconds) a file writer service logs its statistics */
+#define CORSARO_FILEWRITER_REPORT_FREQ 60
+
+/** An output file that is being written by a file writer service */
+typedef struct corsaro_filewriter_file corsaro_filewriter_file_t;
+
+/** Statistics describing how well a file writer service is keeping up */
+typedef struct corsaro_filewriter_stats {
+    /** Number of operations currently waiting in the queue */
+    uint32_t queuedops;
+    /** Number of bytes currently waiting to be written */
+    uint64_t queuedbytes;
+    /** Largest number of bytes waiting at once since the stats were last
+     *  logged.
+     */
+    uint64_t maxqueuedbytes;
+
+    /** Number of writes completed since the stats were last logged */
+    uint64_t writes;
+    /** Number of bytes written since the stats were last logged */
+    uint64_t byteswritten;
+    /** Total and largest time (in microseconds) between a write being
+     *  queued and it completing.
+     */
+    uint64_t totallatency;
+    uint64_t maxlatency;
+
+    /** Number of files closed since the stats were last logged */
+    uint64_t closes;
+    /** Largest time (in microseconds) taken to close a file */
+    uint64_t maxclose;
+
+    /** Number of times that a thread had to wait for the queue to drain */
+    uint64_t stalls;
+    /** Total time (in microseconds) that threads spent waiting */
+    uint64_t stallusec;
+} corsaro_filewriter_stats_t;
+
+/** Starts a new file writer service.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param maxqueued    The number of bytes that may be waiting to be
+ *                      written before writers are made to wait.
+ *  @return a pointer to the new service, or NULL if an error occurs.
+ */
+corsaro_filewriter_t *corsaro_create_filewriter(corsaro_logger_t *logger,
+        uint64_t maxqueued);
+
+/** Stops a file writer service, once everything that has been queued has
+ *  been written, and frees it.
+ *
+ *  @param fw           The service to stop
+ */
+void corsaro_destroy_filewriter(corsaro_filewriter_t *fw);
+
+/** Queues the opening of a new output file.
+ *
+ *  @param fw           The service that will write the file
+ *  @param fname        The name of the file to open
+ *  @return a handle for the file, or NULL if an error occurs. Errors that
+ *          occur when the file is actually opened are logged by the
+ *          service, and any later writes to the file are discarded.
+ */
+corsaro_filewriter_file_t *corsaro_filewriter_open(corsaro_filewriter_t *fw,
+        const char *fname);
+
+/** Queues a write to an output file. The data is copied, so the caller
+ *  may reuse the buffer as soon as this function returns.
+ *
+ *  @param file         The file to write to
+ *  @param buf          The data to write
+ *  @param len          The amount of data to write
+ *  @return 0 if the write was queued, -1 if an error occurs.
+ */
+int corsaro_filewriter_write(corsaro_filewriter_file_t *file,
+        const void *buf, uint32_t len);
+
+/** Queues the closing of an output file. The handle must not be used
+ *  again once this function has been called.
+ *
+ *  @param file         The file to close
+ *  @param writedone    If non-zero, an empty "<fname>.done" file is
+ *                      created once the file has been closed successfully.
+ *  @return 0 if the close was queued, -1 if an error occurs.
+ */
+int corsaro_filewriter_close(corsaro_filewriter_file_t *file,
+        uint8_t writedone);
+
+/** Copies the current statistics for a file writer service. The service
+ *  logs these statistics (and then resets the counters) once every
+ *  CORSARO_FILEWRITER_REPORT_FREQ seconds while it is busy.
+ *
+ *  @param fw           The service to get statistics for
+ *  @param stats        Updated to contain the statistics
+ */
+void corsaro_filewriter_get_stats(corsaro_filewriter_t *fw,
+        corsaro_filewriter_stats_t *stats);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
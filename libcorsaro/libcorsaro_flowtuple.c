@@ -55,160 +55,81 @@
 #include "libcorsaro_log.h"
 #include <libipmeta.h>
 
-void encode_flowtuple_as_avro(struct corsaro_flowtuple_data *ft,
-        corsaro_avro_writer_t *writer, corsaro_logger_t *logger) {
-
-    char valspace[128];
-    uint32_t zero = 0;
-
-    if (corsaro_start_avro_encoding(writer) < 0) {
-        return;
-    }
-
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->interval_ts), sizeof(ft->interval_ts)) < 0) {
-        return;
-    }
-
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->src_ip), sizeof(ft->src_ip)) < 0) {
-        return;
-    }
-
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->dst_ip), sizeof(ft->dst_ip)) < 0) {
-        return;
-    }
-
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->src_port), sizeof(ft->src_port)) < 0) {
-        return;
-    }
+/** The largest number of bytes that a single encoded flowtuple can occupy:
+ *  15 varints of up to 10 bytes each, plus four 2-character strings.
+ */
+#define FLOWTUPLE_MAX_ENCODED_SIZE ((15 * 10) + (4 * 3))
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->dst_port), sizeof(ft->dst_port)) < 0) {
-        return;
-    }
+/* Writes a two character country / continent code as an avro string */
+static inline void put_ft_geo_string(corsaro_avro_writer_t *writer,
+        uint16_t code) {
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->protocol), sizeof(ft->protocol)) < 0) {
-        return;
-    }
+    char valspace[2];
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->ttl), sizeof(ft->ttl)) < 0) {
-        return;
-    }
+    valspace[0] = (char)(code & 0xff);
+    valspace[1] = (char)((code >> 8) & 0xff);
+    corsaro_put_avro_string(writer, valspace, 2);
+}
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->tcp_flags), sizeof(ft->tcp_flags)) < 0) {
-        return;
-    }
+void encode_flowtuple_as_avro(struct corsaro_flowtuple_data *ft,
+        corsaro_avro_writer_t *writer, corsaro_logger_t *logger) {
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->ip_len), sizeof(ft->ip_len)) < 0) {
+    if (corsaro_start_avro_encoding(writer) < 0) {
         return;
     }
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->tcp_synlen), sizeof(ft->tcp_synlen)) < 0) {
-        return;
-    }
+    if (writer->indexing) {
+        uint64_t keyhi, keylo;
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->tcp_synwinlen), sizeof(ft->tcp_synwinlen)) < 0) {
-        return;
+        corsaro_flowtuple_sort_key(ft, &keyhi, &keylo);
+        corsaro_set_avro_record_key(writer, keyhi, keylo);
     }
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->packet_cnt), sizeof(ft->packet_cnt)) < 0) {
+    /* Reserve room for the whole record up front, so the individual
+     * fields can be written without any further bounds checks.
+     */
+    if (corsaro_reserve_avro_encoding(writer,
+                FLOWTUPLE_MAX_ENCODED_SIZE) < 0) {
         return;
     }
 
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->is_spoofed), sizeof(ft->is_spoofed)) < 0) {
-        return;
-    }
-
-    if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                &(ft->is_masscan), sizeof(ft->is_masscan)) < 0) {
-        return;
-    }
+    corsaro_put_avro_long(writer, ft->interval_ts);
+    corsaro_put_avro_long(writer, ft->src_ip);
+    corsaro_put_avro_long(writer, ft->dst_ip);
+    corsaro_put_avro_long(writer, ft->src_port);
+    corsaro_put_avro_long(writer, ft->dst_port);
+    corsaro_put_avro_long(writer, ft->protocol);
+    corsaro_put_avro_long(writer, ft->ttl);
+    corsaro_put_avro_long(writer, ft->tcp_flags);
+    corsaro_put_avro_long(writer, ft->ip_len);
+    corsaro_put_avro_long(writer, ft->tcp_synlen);
+    corsaro_put_avro_long(writer, ft->tcp_synwinlen);
+    corsaro_put_avro_long(writer, ft->packet_cnt);
+    corsaro_put_avro_long(writer, ft->is_spoofed);
+    corsaro_put_avro_long(writer, ft->is_masscan);
 
     assert(ft->tagproviders != 0);
 
     if (ft->tagproviders & (1 << IPMETA_PROVIDER_MAXMIND)) {
-        valspace[0] = (char)(ft->maxmind_continent & 0xff);
-        valspace[1] = (char)((ft->maxmind_continent >> 8) & 0xff);
-        valspace[2] = '\0';
-
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                    valspace, 2) < 0) {
-            return;
-        }
-
-        valspace[0] = (char)(ft->maxmind_country & 0xff);
-        valspace[1] = (char)((ft->maxmind_country >> 8) & 0xff);
-        valspace[2] = '\0';
-
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                    valspace, 2) < 0) {
-            return;
-        }
-
+        put_ft_geo_string(writer, ft->maxmind_continent);
+        put_ft_geo_string(writer, ft->maxmind_country);
     } else {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                "??", 2) < 0) {
-            return;
-        }
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                "??", 2) < 0) {
-            return;
-        }
+        corsaro_put_avro_string(writer, "??", 2);
+        corsaro_put_avro_string(writer, "??", 2);
     }
 
-
     if (ft->tagproviders & (1 << IPMETA_PROVIDER_NETACQ_EDGE)) {
-        valspace[0] = (char)(ft->netacq_continent & 0xff);
-        valspace[1] = (char)((ft->netacq_continent >> 8) & 0xff);
-        valspace[2] = '\0';
-
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                    valspace, 2) < 0) {
-            return;
-        }
-
-        valspace[0] = (char)(ft->netacq_country & 0xff);
-        valspace[1] = (char)((ft->netacq_country >> 8) & 0xff);
-        valspace[2] = '\0';
-
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                    valspace, 2) < 0) {
-            return;
-        }
-
+        put_ft_geo_string(writer, ft->netacq_continent);
+        put_ft_geo_string(writer, ft->netacq_country);
     } else {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                "??", 2) < 0) {
-            return;
-        }
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_STRING,
-                "??", 2) < 0) {
-            return;
-        }
+        corsaro_put_avro_string(writer, "??", 2);
+        corsaro_put_avro_string(writer, "??", 2);
     }
 
     if (ft->tagproviders & (1 << IPMETA_PROVIDER_PFX2AS)) {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                    &(ft->prefixasn), sizeof(ft->prefixasn)) < 0) {
-            return;
-        }
-
+        corsaro_put_avro_long(writer, ft->prefixasn);
     } else {
-        if (corsaro_encode_avro_field(writer, CORSARO_AVRO_LONG,
-                    &(zero), sizeof(zero)) < 0) {
-            return;
-        }
+        corsaro_put_avro_long(writer, 0);
     }
 }
 
@@ -321,4 +242,252 @@ int decode_flowtuple_from_avro(avro_value_t *record,
     ft->hash_val = 0;
 }
 
+/* Reads a two character country / continent code from an encoded avro
+ * string.
+ */
+static inline int get_ft_geo_string(const uint8_t **ptr, const uint8_t *end,
+        uint16_t *code) {
+
+    int64_t len;
+
+    if (corsaro_get_avro_long(ptr, end, &len) < 0 || len < 0 ||
+            len > end - *ptr) {
+        return -1;
+    }
+    *code = 0;
+    if (len > 0) {
+        *code = (*ptr)[0];
+    }
+    if (len > 1) {
+        *code |= ((uint16_t)((*ptr)[1])) << 8;
+    }
+    *ptr += len;
+    return 0;
+}
+
+/* Decodes a single binary flowtuple record, in the field order given by
+ * FLOWTUPLE_RESULT_SCHEMA.
+ */
+static int decode_flowtuple_binary(const uint8_t **ptr, const uint8_t *end,
+        struct corsaro_flowtuple_data *ft) {
+
+    int64_t v[14];
+    int64_t asn;
+    /* Decoded into locals, as the flowtuple struct is packed and its
+     * fields may not be aligned */
+    uint16_t geo[4];
+    int i;
+
+    for (i = 0; i < 14; i++) {
+        if (corsaro_get_avro_long(ptr, end, &(v[i])) < 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < 4; i++) {
+        if (get_ft_geo_string(ptr, end, &(geo[i])) < 0) {
+            return -1;
+        }
+    }
+    if (corsaro_get_avro_long(ptr, end, &asn) < 0) {
+        return -1;
+    }
+
+    ft->maxmind_continent = geo[0];
+    ft->maxmind_country = geo[1];
+    ft->netacq_continent = geo[2];
+    ft->netacq_country = geo[3];
+
+    ft->interval_ts = (uint32_t)v[0];
+    ft->src_ip = (uint32_t)v[1];
+    ft->dst_ip = (uint32_t)v[2];
+    ft->src_port = (uint16_t)v[3];
+    ft->dst_port = (uint16_t)v[4];
+    ft->protocol = (uint8_t)v[5];
+    ft->ttl = (uint8_t)v[6];
+    ft->tcp_flags = (uint8_t)v[7];
+    ft->ip_len = (uint16_t)v[8];
+    ft->tcp_synlen = (uint16_t)v[9];
+    ft->tcp_synwinlen = (uint16_t)v[10];
+    ft->packet_cnt = (uint32_t)v[11];
+    ft->is_spoofed = (uint8_t)v[12];
+    ft->is_masscan = (uint8_t)v[13];
+    ft->prefixasn = (uint32_t)asn;
+
+    ft->tagproviders = (1 << IPMETA_PROVIDER_MAXMIND) |
+            (1 << IPMETA_PROVIDER_NETACQ_EDGE) |
+            (1 << IPMETA_PROVIDER_PFX2AS);
+
+    ft->hash_val = 0;
+    return 0;
+}
+
+/* Checks whether an avro writer schema is the flowtuple schema that
+ * decode_flowtuple_binary() understands.
+ */
+static int is_flowtuple_schema(const char *json) {
+
+    avro_schema_t ours = NULL, theirs = NULL;
+    avro_schema_error_t error;
+    int same = 0;
+
+    if (avro_schema_from_json(FLOWTUPLE_RESULT_SCHEMA,
+                strlen(FLOWTUPLE_RESULT_SCHEMA), &ours, &error) == 0 &&
+            avro_schema_from_json(json, strlen(json), &theirs, &error) == 0) {
+        same = avro_schema_equal(ours, theirs);
+    }
+
+    if (ours) {
+        avro_schema_decref(ours);
+    }
+    if (theirs) {
+        avro_schema_decref(theirs);
+    }
+    return same;
+}
+
+corsaro_flowtuple_reader_t *corsaro_create_flowtuple_reader(
+        corsaro_logger_t *logger, char *filename) {
+
+    corsaro_flowtuple_reader_t *reader;
+
+    reader = (corsaro_flowtuple_reader_t *)calloc(1,
+            sizeof(corsaro_flowtuple_reader_t));
+    if (reader == NULL) {
+        corsaro_log(logger, "unable to allocate memory for flowtuple reader.");
+        return NULL;
+    }
+    reader->logger = logger;
+    reader->filename = filename;
+
+    reader->blocks = corsaro_create_avro_block_reader(logger, filename);
+    if (reader->blocks && !is_flowtuple_schema(
+                corsaro_get_avro_block_reader_schema(reader->blocks))) {
+        corsaro_log(logger,
+                "%s does not use the standard flowtuple schema, reading it via libavro instead",
+                filename);
+        corsaro_destroy_avro_block_reader(reader->blocks);
+        reader->blocks = NULL;
+    }
+
+    if (reader->blocks == NULL) {
+        reader->generic = corsaro_create_avro_reader(logger, filename);
+        if (reader->generic == NULL) {
+            free(reader);
+            return NULL;
+        }
+    }
+    return reader;
+}
+
+void corsaro_destroy_flowtuple_reader(corsaro_flowtuple_reader_t *reader) {
+
+    if (reader == NULL) {
+        return;
+    }
+    if (reader->blocks) {
+        corsaro_destroy_avro_block_reader(reader->blocks);
+    }
+    if (reader->generic) {
+        corsaro_destroy_avro_reader(reader->generic);
+    }
+    corsaro_free_avro_index(reader->index);
+    free(reader);
+}
+
+corsaro_avro_index_t *corsaro_get_flowtuple_reader_index(
+        corsaro_flowtuple_reader_t *reader) {
+
+    if (reader->blocks == NULL) {
+        return NULL;
+    }
+
+    if (!reader->triedindex) {
+        reader->index = corsaro_load_avro_index(reader->logger,
+                reader->filename);
+        reader->triedindex = 1;
+    }
+    return reader->index;
+}
+
+int corsaro_seek_flowtuple_reader_block(corsaro_flowtuple_reader_t *reader,
+        uint64_t block) {
+
+    corsaro_avro_index_t *idx = corsaro_get_flowtuple_reader_index(reader);
+
+    if (idx == NULL || block >= idx->count) {
+        return 0;
+    }
+
+    if (corsaro_seek_avro_block_reader(reader->blocks,
+                idx->entries[block].offset) < 0) {
+        return -1;
+    }
+    reader->ptr = NULL;
+    reader->end = NULL;
+    reader->remaining = 0;
+    return 1;
+}
+
+int corsaro_seek_flowtuple_reader(corsaro_flowtuple_reader_t *reader,
+        uint64_t keyhi, uint64_t keylo) {
+
+    corsaro_avro_index_t *idx = corsaro_get_flowtuple_reader_index(reader);
+    uint64_t blk;
+
+    if (idx == NULL || idx->count == 0) {
+        return 0;
+    }
+
+    /* If every flowtuple is below the key, the last block is as good a
+     * place as any to end up.
+     */
+    blk = corsaro_find_avro_index_block(idx, keyhi, keylo);
+    if (blk == idx->count) {
+        blk --;
+    }
+    return corsaro_seek_flowtuple_reader_block(reader, blk);
+}
+
+int corsaro_read_next_flowtuple(corsaro_flowtuple_reader_t *reader,
+        struct corsaro_flowtuple_data *ft) {
+
+    avro_value_t *record;
+    uint32_t len;
+    int ret;
+
+    if (reader->generic) {
+        ret = corsaro_read_next_avro_record(reader->generic, &record);
+        if (ret <= 0) {
+            return ret;
+        }
+        decode_flowtuple_from_avro(record, ft);
+        return 1;
+    }
+
+    while (reader->remaining == 0) {
+        if (reader->ptr != reader->end) {
+            corsaro_log(reader->logger,
+                    "unexpected data at the end of an Avro block in %s",
+                    reader->filename);
+            return -1;
+        }
+        ret = corsaro_read_next_avro_block(reader->blocks, &(reader->ptr),
+                &len, &(reader->remaining));
+        if (ret <= 0) {
+            reader->ptr = reader->end = NULL;
+            return ret;
+        }
+        reader->end = reader->ptr + len;
+    }
+
+    if (decode_flowtuple_binary(&(reader->ptr), reader->end, ft) < 0) {
+        corsaro_log(reader->logger, "truncated flowtuple record in %s",
+                reader->filename);
+        return -1;
+    }
+    reader->remaining --;
+    return 1;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
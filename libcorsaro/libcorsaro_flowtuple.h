@@ -157,6 +157,34 @@ struct corsaro_flowtuple_data {
   uint16_t tagproviders;
 } PACKED;
 
+/** Packs the leading fields of a flowtuple's sort order into a 128-bit
+ *  key, for comparing flowtuples quickly and for indexing flowtuple files.
+ *
+ *  The order is the same as the sort order used by the flowtuple plugin,
+ *  except that the interval comes first. The key covers everything up to
+ *  the top byte of the source port:
+ *
+ *  High word:  | INTERVAL (32) | PROTO | TTL | FLAGS | SRC_IP_1 |
+ *  Low word:   | SRC_IP_2-4 (24) | DST_IP (32) | SPORT_1 |
+ *
+ *  As the interval is in the top 32 bits, all of the flowtuples for an
+ *  interval starting at 'ts' have keys between (ts << 32, 0) and
+ *  ((ts + 1) << 32, 0).
+ */
+static inline void corsaro_flowtuple_sort_key(
+        struct corsaro_flowtuple_data *ft, uint64_t *keyhi,
+        uint64_t *keylo) {
+
+    *keyhi = (((uint64_t)ft->interval_ts) << 32) |
+            (((uint64_t)ft->protocol) << 24) |
+            (((uint64_t)ft->ttl) << 16) |
+            (((uint64_t)ft->tcp_flags) << 8) |
+            (((uint64_t)ft->src_ip) >> 24);
+    *keylo = (((uint64_t)(ft->src_ip & 0x00FFFFFF)) << 40) |
+            (((uint64_t)ft->dst_ip) << 8) |
+            (((uint64_t)ft->src_port) >> 8);
+}
+
 /* Utility functions for other programs that want to handle flowtuple
  * objects, e.g. corsaroftmerge
  */
@@ -166,6 +194,92 @@ void encode_flowtuple_as_avro(struct corsaro_flowtuple_data *ft,
 int decode_flowtuple_from_avro(avro_value_t *record,
         struct corsaro_flowtuple_data *ft);
 
+/** Reads flowtuple records from an avro file. Files written with the
+ *  standard flowtuple schema are decoded directly from the binary avro
+ *  blocks; anything else is read via libavro instead.
+ */
+typedef struct corsaro_flowtuple_reader {
+    corsaro_logger_t *logger;
+    char *filename;
+
+    /** Block reader for the file, NULL if the generic reader is in use */
+    corsaro_avro_block_reader_t *blocks;
+    /** Encoded records remaining in the current block */
+    const uint8_t *ptr;
+    const uint8_t *end;
+    uint64_t remaining;
+
+    /** libavro-based reader, used if the schema is not the one we expect */
+    corsaro_avro_reader_t *generic;
+
+    /** The file's block index, loaded on the first seek */
+    corsaro_avro_index_t *index;
+    uint8_t triedindex;
+} corsaro_flowtuple_reader_t;
+
+/** Opens a flowtuple avro file for reading.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param filename     The name of the file to read
+ *  @return a pointer to the new reader, or NULL if an error occurs.
+ */
+corsaro_flowtuple_reader_t *corsaro_create_flowtuple_reader(
+        corsaro_logger_t *logger, char *filename);
+
+/** Closes a flowtuple reader and frees its resources.
+ *
+ *  @param reader       The reader to destroy
+ */
+void corsaro_destroy_flowtuple_reader(corsaro_flowtuple_reader_t *reader);
+
+/** Reads the next flowtuple from a flowtuple avro file.
+ *
+ *  @param reader       The reader to read from
+ *  @param ft           The flowtuple structure to populate
+ *  @return 1 if a flowtuple was read, 0 if there are no more flowtuples,
+ *          or -1 if an error occurs.
+ */
+int corsaro_read_next_flowtuple(corsaro_flowtuple_reader_t *reader,
+        struct corsaro_flowtuple_data *ft);
+
+/** Skips ahead to the first block of a flowtuple file that may contain
+ *  flowtuples with a sort key (see corsaro_flowtuple_sort_key()) at or
+ *  above the given key, using the file's block index. The first flowtuples
+ *  read after seeking may still have lower keys, so callers must continue
+ *  to check the keys of the flowtuples they read.
+ *
+ *  @param reader       The reader to move
+ *  @param keyhi        The high 64 bits of the key to seek to
+ *  @param keylo        The low 64 bits of the key to seek to
+ *  @return 1 if the reader was moved, 0 if the file has no index (the
+ *          reader is left where it was), or -1 if an error occurs.
+ */
+int corsaro_seek_flowtuple_reader(corsaro_flowtuple_reader_t *reader,
+        uint64_t keyhi, uint64_t keylo);
+
+/** Returns the block index for the file being read by a flowtuple reader,
+ *  loading it if necessary.
+ *
+ *  @param reader       The reader to get the index for
+ *  @return a pointer to the index, or NULL if the file has no index or is
+ *          not being read block by block. The index belongs to the reader
+ *          and must not be freed by the caller.
+ */
+corsaro_avro_index_t *corsaro_get_flowtuple_reader_index(
+        corsaro_flowtuple_reader_t *reader);
+
+/** Moves a flowtuple reader to the start of a particular block, as
+ *  numbered by the file's block index. The next flowtuple read will be
+ *  the first flowtuple in that block.
+ *
+ *  @param reader       The reader to move
+ *  @param block        The position of the block in the file's index
+ *  @return 1 if the reader was moved, 0 if the file has no index or the
+ *          block does not exist, or -1 if an error occurs.
+ */
+int corsaro_seek_flowtuple_reader_block(corsaro_flowtuple_reader_t *reader,
+        uint64_t block);
+
 
 #endif
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -395,11 +395,52 @@ int corsaro_push_start_plugins(corsaro_plugin_set_t *pset, uint32_t intervalid,
     return 0;
 }
 
+static corsaro_plugin_t *get_plugin_by_index(corsaro_plugin_set_t *pset,
+        int index) {
+
+    corsaro_plugin_t *p = pset->active_plugins;
+
+    while (p != NULL && index > 0) {
+        p = p->next;
+        index --;
+    }
+    return p;
+}
+
+int corsaro_rotate_single_plugin_output(corsaro_logger_t *logger,
+        corsaro_plugin_set_t *pset, int index) {
+
+    corsaro_plugin_t *p = NULL;
+
+    if (pset == NULL) {
+        corsaro_log(logger,
+                "NULL plugin set provided when rotating output.");
+        return -1;
+    }
+
+    p = get_plugin_by_index(pset, index);
+    if (p == NULL) {
+        corsaro_log(logger,
+                "invalid plugin index %d provided when rotating output.",
+                index);
+        return -1;
+    }
+
+    corsaro_log(logger, "rotating output for plugin %s", p->name);
+
+    if (p->rotate_output(p, pset->plugin_state[index])) {
+        corsaro_log(logger,
+                "unable to rotate output file for plugin %s",
+                p->name);
+        return -1;
+    }
+    return 0;
+}
+
 int corsaro_rotate_plugin_output(corsaro_logger_t *logger,
         corsaro_plugin_set_t *pset) {
 
     corsaro_log(logger, "rotating plugin output");
-    corsaro_plugin_t *p = NULL;
     int errors = 0;
     int index = 0;
 
@@ -409,76 +450,87 @@ int corsaro_rotate_plugin_output(corsaro_logger_t *logger,
         return -1;
     }
 
-    p = pset->active_plugins;
-    while (p != NULL) {
-        corsaro_log(logger, "rotating output for plugin %s", p->name);
-
-        if (p->rotate_output(p, pset->plugin_state[index])) {
-            corsaro_log(logger,
-                    "unable to rotate output file for plugin %s",
-                    p->name);
+    for (index = 0; index < pset->plugincount; index++) {
+        if (corsaro_rotate_single_plugin_output(logger, pset, index) < 0) {
             errors ++;
-            p = p->next;
-            index ++;
-            continue;
         }
-
-        p = p->next;
-        index ++;
     }
 
     return errors;
 
 }
 
-int corsaro_merge_plugin_outputs(corsaro_logger_t *logger,
-        corsaro_plugin_set_t *pset, corsaro_fin_interval_t *fin,
+int corsaro_merge_single_plugin_output(corsaro_logger_t *logger,
+        corsaro_plugin_set_t *pset, int index, corsaro_fin_interval_t *fin,
         void *tagsock) {
 
     corsaro_plugin_t *p = NULL;
-    int index = 0;
     void **plugin_state_ptrs = NULL;
     int pindex = 0;
-    int sockreload = 0, r;
-
-    corsaro_log(logger, "commencing merge for all plugins %u:%u.",
-            fin->interval_id, fin->timestamp);
+    int r;
 
     if (pset == NULL) {
         corsaro_log(logger,
                 "NULL plugin set provided when merging output.");
-        return 1;
+        return CORSARO_MERGE_BAD_ARGUMENTS;
+    }
+
+    p = get_plugin_by_index(pset, index);
+    if (p == NULL) {
+        corsaro_log(logger,
+                "invalid plugin index %d provided when merging output.",
+                index);
+        return CORSARO_MERGE_BAD_ARGUMENTS;
     }
 
-    p = pset->active_plugins;
     plugin_state_ptrs = calloc(fin->threads_ended, sizeof(void *));
+    for (pindex = 0; pindex < fin->threads_ended; pindex ++) {
+        plugin_state_ptrs[pindex] = fin->thread_plugin_data[pindex][index];
+    }
 
-    while (p != NULL) {
-        for (pindex = 0; pindex < fin->threads_ended; pindex ++) {
-            plugin_state_ptrs[pindex] = fin->thread_plugin_data[pindex][index];
-        }
+    r = p->merge_interval_results(p, pset->plugin_state[index],
+            plugin_state_ptrs, fin, tagsock);
+    free(plugin_state_ptrs);
 
-        if ((r = p->merge_interval_results(p, pset->plugin_state[index],
-                plugin_state_ptrs, fin, tagsock)) == -1) {
-
-            if (r == CORSARO_MERGE_CONTROL_FAILURE) {
-                sockreload = 1;
-                if (tagsock) {
-                    corsaro_log(logger, "flagged tagger control socket as needing a reconnect");
-                    tagsock = NULL;
-                }
-            } else {
-                corsaro_log(logger,
-                        "unable to merge interval results for plugin %s",
-                        p->name);
-            }
+    if (r == CORSARO_MERGE_CONTROL_FAILURE) {
+        if (tagsock) {
+            corsaro_log(logger, "flagged tagger control socket as needing a reconnect");
         }
+        return CORSARO_MERGE_CONTROL_FAILURE;
+    }
 
-        p = p->next;
-        index ++;
+    if (r < 0) {
+        corsaro_log(logger,
+                "unable to merge interval results for plugin %s",
+                p->name);
+    }
+    return r;
+}
+
+int corsaro_merge_plugin_outputs(corsaro_logger_t *logger,
+        corsaro_plugin_set_t *pset, corsaro_fin_interval_t *fin,
+        void *tagsock) {
+
+    int index = 0;
+    int sockreload = 0;
+
+    corsaro_log(logger, "commencing merge for all plugins %u:%u.",
+            fin->interval_id, fin->timestamp);
+
+    if (pset == NULL) {
+        corsaro_log(logger,
+                "NULL plugin set provided when merging output.");
+        return 1;
+    }
+
+    for (index = 0; index < pset->plugincount; index++) {
+        if (corsaro_merge_single_plugin_output(logger, pset, index, fin,
+                    tagsock) == CORSARO_MERGE_CONTROL_FAILURE) {
+            sockreload = 1;
+            tagsock = NULL;
+        }
     }
 
-    free(plugin_state_ptrs);
     corsaro_log(logger, "completed merge for all plugins %u:%u.",
             fin->interval_id, fin->timestamp);
     if (sockreload) {
@@ -488,6 +540,27 @@ int corsaro_merge_plugin_outputs(corsaro_logger_t *logger,
 
 }
 
+void corsaro_release_plugin_results(corsaro_plugin_t *plist,
+        void **plugin_data) {
+
+    int index = 0;
+    corsaro_plugin_t *p = plist;
+
+    if (plugin_data == NULL) {
+        return;
+    }
+
+    while (p != NULL) {
+        if (plugin_data[index] && p->release_interval_result) {
+            p->release_interval_result(p, plugin_data[index]);
+        }
+        plugin_data[index] = NULL;
+        p = p->next;
+        index ++;
+    }
+    free(plugin_data);
+}
+
 int corsaro_is_backscatter_packet(libtrace_packet_t *packet,
         corsaro_packet_tags_t *tags) {
     void *temp = NULL;
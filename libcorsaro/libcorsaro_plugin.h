@@ -57,6 +57,7 @@
 #include "libcorsaro.h"
 #include "libcorsaro_log.h"
 #include "libcorsaro_libtimeseries.h"
+#include "libcorsaro_filewriter.h"
 
 /** Convenience macros that define all the function prototypes for the corsaro
  * plugin API
@@ -83,7 +84,8 @@
     int plugin##_halt_merging(corsaro_plugin_t *p, void *local); \
     int plugin##_merge_interval_results(corsaro_plugin_t *p, void *local, \
             void **tomerge, corsaro_fin_interval_t *fin, void *tagsock);  \
-    int plugin##_rotate_output(corsaro_plugin_t *p, void *local);
+    int plugin##_rotate_output(corsaro_plugin_t *p, void *local);    \
+    void plugin##_release_interval_result(corsaro_plugin_t *p, void *result);
 
 
 typedef enum corsaro_plugin_id {
@@ -119,6 +121,14 @@ typedef struct corsaro_plugin_proc_options {
     libts_dbats_backend_t *libtsdbats;
     char *monitorid;
     uint8_t procthreads;
+    /** Service for writing output files off the merging threads, or NULL
+     *  if plugins should write their own files.
+     */
+    corsaro_filewriter_t *filewriter;
+    /** Seconds to wait for every processing thread to end an interval
+     *  before closing it without them, or 0 to wait indefinitely.
+     */
+    uint32_t stragglertimeout;
 } corsaro_plugin_proc_options_t;
 
 /** Corsaro state for a packet
@@ -179,6 +189,9 @@ struct corsaro_plugin {
     int (*merge_interval_results)(corsaro_plugin_t *p, void *local,
             void **tomerge, corsaro_fin_interval_t *fin, void *tagsock);
     int (*rotate_output)(corsaro_plugin_t *p, void *local);
+    /* Frees an interim result from end_interval that is never going to
+     * be passed to merge_interval_results */
+    void (*release_interval_result)(corsaro_plugin_t *p, void *result);
 
 
     /* High level global state variables */
@@ -225,9 +238,16 @@ int corsaro_push_packet_plugins(corsaro_plugin_set_t *pluginset,
         libtrace_packet_t *packet, corsaro_packet_tags_t *tags);
 int corsaro_rotate_plugin_output(corsaro_logger_t *logger,
         corsaro_plugin_set_t *pset);
+int corsaro_rotate_single_plugin_output(corsaro_logger_t *logger,
+        corsaro_plugin_set_t *pset, int index);
 int corsaro_merge_plugin_outputs(corsaro_logger_t *logger,
         corsaro_plugin_set_t *pset, corsaro_fin_interval_t *fin,
         void *tagsock);
+int corsaro_merge_single_plugin_output(corsaro_logger_t *logger,
+        corsaro_plugin_set_t *pset, int index, corsaro_fin_interval_t *fin,
+        void *tagsock);
+void corsaro_release_plugin_results(corsaro_plugin_t *plist,
+        void **plugin_data);
 
 int corsaro_is_backscatter_packet(libtrace_packet_t *packet,
         corsaro_packet_tags_t *tags);
@@ -237,7 +257,9 @@ int corsaro_is_backscatter_packet(libtrace_packet_t *packet,
   opts.libtsascii = NULL; \
   opts.libtsdbats = NULL; \
   opts.libtskafka = NULL; \
-  opts.monitorid = NULL;
+  opts.monitorid = NULL; \
+  opts.filewriter = NULL; \
+  opts.stragglertimeout = 0;
 
 #define CORSARO_PLUGIN_GENERATE_BASE_PTRS(plugin)               \
   plugin##_parse_config,              \
@@ -252,7 +274,7 @@ int corsaro_is_backscatter_packet(libtrace_packet_t *packet,
 #define CORSARO_PLUGIN_GENERATE_MERGE_PTRS(plugin)          \
   plugin##_init_merging, plugin##_halt_merging,                 \
   plugin##_merge_interval_results,                          \
-  plugin##_rotate_output
+  plugin##_rotate_output, plugin##_release_interval_result
 
 #define CORSARO_PLUGIN_GENERATE_TAIL                            \
   NULL, 0, 0, NULL, NULL
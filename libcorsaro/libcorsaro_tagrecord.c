@@ -0,0 +1,240 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include <wandio.h>
+#include "libcorsaro.h"
+#include "libcorsaro_log.h"
+#include "libcorsaro_tagrecord.h"
+
+#define TAGRECORD_PREAMBLE (sizeof(corsaro_tagrecord_header_t) + \
+        sizeof(corsaro_tagged_packet_header_t))
+
+corsaro_tagrecord_writer_t *corsaro_create_tagrecord_writer(
+        corsaro_logger_t *logger, char *filename, int level) {
+
+    corsaro_tagrecord_writer_t *writer;
+    corsaro_tagrecord_file_header_t fhdr;
+    int method;
+
+    method = wandio_detect_compression_type(filename);
+
+    writer = calloc(1, sizeof(corsaro_tagrecord_writer_t));
+    if (writer == NULL) {
+        corsaro_log(logger,
+                "out of memory while creating tagged record writer");
+        return NULL;
+    }
+
+    writer->io = wandio_wcreate(filename, method, level, O_CREAT);
+    if (writer->io == NULL) {
+        corsaro_log(logger,
+                "unable to open tagged record file %s for writing: %s",
+                filename, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    writer->filename = strdup(filename);
+
+    fhdr.magic = htonl(CORSARO_TAGRECORD_MAGIC);
+    fhdr.version = htons(CORSARO_TAGRECORD_VERSION);
+    fhdr.reserved = 0;
+
+    if (wandio_wwrite(writer->io, &fhdr, sizeof(fhdr)) != sizeof(fhdr)) {
+        corsaro_log(logger, "error while writing header to %s",
+                filename);
+        corsaro_destroy_tagrecord_writer(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+int corsaro_write_tagrecord(corsaro_logger_t *logger,
+        corsaro_tagrecord_writer_t *writer, uint16_t hashbin,
+        corsaro_tagged_packet_header_t *taghdr) {
+
+    corsaro_tagrecord_header_t rhdr;
+    int64_t reclen;
+
+    rhdr.hashbin = htons(hashbin);
+    reclen = sizeof(corsaro_tagged_packet_header_t) + ntohs(taghdr->pktlen);
+
+    if (wandio_wwrite(writer->io, &rhdr, sizeof(rhdr)) != sizeof(rhdr) ||
+            wandio_wwrite(writer->io, taghdr, reclen) != reclen) {
+        corsaro_log(logger, "error while writing tagged record to %s",
+                writer->filename);
+        return -1;
+    }
+
+    writer->records ++;
+    return 0;
+}
+
+void corsaro_destroy_tagrecord_writer(corsaro_tagrecord_writer_t *writer) {
+
+    if (writer == NULL) {
+        return;
+    }
+
+    if (writer->io) {
+        wandio_wdestroy(writer->io);
+    }
+    if (writer->filename) {
+        free(writer->filename);
+    }
+    free(writer);
+}
+
+corsaro_tagrecord_reader_t *corsaro_create_tagrecord_reader(
+        corsaro_logger_t *logger, char *filename) {
+
+    corsaro_tagrecord_reader_t *reader;
+    corsaro_tagrecord_file_header_t fhdr;
+
+    reader = calloc(1, sizeof(corsaro_tagrecord_reader_t));
+    if (reader == NULL) {
+        corsaro_log(logger,
+                "out of memory while creating tagged record reader");
+        return NULL;
+    }
+
+    reader->filename = strdup(filename);
+    reader->buf = malloc(TAGRECORD_PREAMBLE + CORSARO_TAGRECORD_MAX_PKTLEN);
+    reader->io = wandio_create(filename);
+    if (reader->io == NULL) {
+        corsaro_log(logger,
+                "unable to open tagged record file %s for reading: %s",
+                filename, strerror(errno));
+        corsaro_destroy_tagrecord_reader(reader);
+        return NULL;
+    }
+
+    if (wandio_read(reader->io, &fhdr, sizeof(fhdr)) != sizeof(fhdr) ||
+            ntohl(fhdr.magic) != CORSARO_TAGRECORD_MAGIC) {
+        corsaro_log(logger, "%s is not a tagged record file", filename);
+        corsaro_destroy_tagrecord_reader(reader);
+        return NULL;
+    }
+
+    if (ntohs(fhdr.version) != CORSARO_TAGRECORD_VERSION) {
+        corsaro_log(logger,
+                "%s uses unsupported tagged record format version %u",
+                filename, ntohs(fhdr.version));
+        corsaro_destroy_tagrecord_reader(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+int corsaro_read_tagrecord(corsaro_logger_t *logger,
+        corsaro_tagrecord_reader_t *reader, uint16_t *hashbin,
+        corsaro_tagged_packet_header_t **taghdr) {
+
+    corsaro_tagrecord_header_t *rhdr;
+    corsaro_tagged_packet_header_t *hdr;
+    int64_t ret;
+    uint16_t pktlen;
+
+    ret = wandio_read(reader->io, reader->buf, TAGRECORD_PREAMBLE);
+    if (ret == 0) {
+        return 0;
+    }
+    if (ret != TAGRECORD_PREAMBLE) {
+        corsaro_log(logger, "truncated tagged record in %s after %lu records",
+                reader->filename, reader->records);
+        return -1;
+    }
+
+    rhdr = (corsaro_tagrecord_header_t *)reader->buf;
+    hdr = (corsaro_tagged_packet_header_t *)(reader->buf +
+            sizeof(corsaro_tagrecord_header_t));
+    pktlen = ntohs(hdr->pktlen);
+
+    if (pktlen > 0 && wandio_read(reader->io, reader->buf +
+                TAGRECORD_PREAMBLE, pktlen) != pktlen) {
+        corsaro_log(logger, "truncated packet in %s after %lu records",
+                reader->filename, reader->records);
+        return -1;
+    }
+
+    *hashbin = ntohs(rhdr->hashbin);
+    *taghdr = hdr;
+    reader->records ++;
+    return 1;
+}
+
+void corsaro_destroy_tagrecord_reader(corsaro_tagrecord_reader_t *reader) {
+
+    if (reader == NULL) {
+        return;
+    }
+
+    if (reader->io) {
+        wandio_destroy(reader->io);
+    }
+    if (reader->buf) {
+        free(reader->buf);
+    }
+    if (reader->filename) {
+        free(reader->filename);
+    }
+    free(reader);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,186 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef LIBCORSARO_TAGRECORD_H_
+#define LIBCORSARO_TAGRECORD_H_
+
+#include <stdint.h>
+#include <wandio.h>
+
+#include "libcorsaro.h"
+#include "libcorsaro_log.h"
+#include "libcorsaro_tagging.h"
+
+/** Magic number at the start of every tagged record file ("CTAG") */
+#define CORSARO_TAGRECORD_MAGIC (0x43544147)
+
+/** Current version of the tagged record file format */
+#define CORSARO_TAGRECORD_VERSION (1)
+
+/** The largest packet that may be stored in a single tagged record */
+#define CORSARO_TAGRECORD_MAX_PKTLEN (65535)
+
+/** Header that appears once at the start of a tagged record file.
+ *  All fields are in network byte order.
+ */
+typedef struct corsaro_tagrecord_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+} PACKED corsaro_tagrecord_file_header_t;
+
+/** Header that precedes each tagged record in a file.
+ *
+ *  The header is followed by a corsaro_tagged_packet_header_t and then
+ *  the (possibly truncated) packet contents, exactly as they were sent by
+ *  corsarotagger. All fields are in network byte order.
+ */
+typedef struct corsaro_tagrecord_header {
+    /** The hashbin (i.e. nDAG stream) that the record was received on */
+    uint16_t hashbin;
+} PACKED corsaro_tagrecord_header_t;
+
+/** Structure to store state for a tagged record file writer */
+typedef struct corsaro_tagrecord_writer {
+    /** The wandio handle for the output file */
+    iow_t *io;
+
+    /** The name of the file being written */
+    char *filename;
+
+    /** The number of records written to the file so far */
+    uint64_t records;
+} corsaro_tagrecord_writer_t;
+
+/** Structure to store state for a tagged record file reader */
+typedef struct corsaro_tagrecord_reader {
+    /** The wandio handle for the input file */
+    io_t *io;
+
+    /** The name of the file being read */
+    char *filename;
+
+    /** Buffer holding the most recently read record */
+    uint8_t *buf;
+
+    /** The number of records read from the file so far */
+    uint64_t records;
+} corsaro_tagrecord_reader_t;
+
+/** Creates a writer for a new tagged record file.
+ *
+ *  The compression method is derived from the file name suffix (e.g. ".gz").
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param filename     The path of the file to create.
+ *  @param level        The compression level to use (0 - 9).
+ *
+ *  @return a pointer to a new tagged record writer, or NULL if an error
+ *          occurred.
+ */
+corsaro_tagrecord_writer_t *corsaro_create_tagrecord_writer(
+        corsaro_logger_t *logger, char *filename, int level);
+
+/** Writes a single tagged record to a tagged record file.
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param writer       The writer to write the record with.
+ *  @param hashbin      The hashbin that the record was received on.
+ *  @param taghdr       The tagged packet header, as received from the
+ *                      tagger. The packet contents must immediately follow
+ *                      the header in memory.
+ *
+ *  @return 0 if successful, -1 if an error occurred.
+ */
+int corsaro_write_tagrecord(corsaro_logger_t *logger,
+        corsaro_tagrecord_writer_t *writer, uint16_t hashbin,
+        corsaro_tagged_packet_header_t *taghdr);
+
+/** Closes a tagged record file and frees the writer.
+ *
+ *  @param writer       The writer to be destroyed.
+ */
+void corsaro_destroy_tagrecord_writer(corsaro_tagrecord_writer_t *writer);
+
+/** Opens an existing tagged record file for reading.
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param filename     The path of the file to read.
+ *
+ *  @return a pointer to a new tagged record reader, or NULL if the file
+ *          could not be opened or is not a tagged record file.
+ */
+corsaro_tagrecord_reader_t *corsaro_create_tagrecord_reader(
+        corsaro_logger_t *logger, char *filename);
+
+/** Reads the next tagged record from a tagged record file.
+ *
+ *  @param logger       A corsaro logger instance to use for logging errors.
+ *  @param reader       The reader to read the record from.
+ *  @param hashbin      Updated to contain the hashbin for the record.
+ *  @param taghdr       Updated to point to the tagged packet header for the
+ *                      record, which is immediately followed by the packet
+ *                      contents. Only valid until the next read.
+ *
+ *  @return 1 if a record was read, 0 if the end of the file has been
+ *          reached, -1 if an error occurred.
+ */
+int corsaro_read_tagrecord(corsaro_logger_t *logger,
+        corsaro_tagrecord_reader_t *reader, uint16_t *hashbin,
+        corsaro_tagged_packet_header_t **taghdr);
+
+/** Closes a tagged record file and frees the reader.
+ *
+ *  @param reader       The reader to be destroyed.
+ */
+void corsaro_destroy_tagrecord_reader(corsaro_tagrecord_reader_t *reader);
+
+#endif
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -309,6 +309,8 @@ struct corsaro_dos_state_t {
 typedef struct corsaro_dos_merge_state {
     corsaro_avro_writer_t *mainwriter;
     FILE *summarywriter;
+    /** Summary output file, if it is being written by the file writer */
+    corsaro_filewriter_file_t *summaryfile;
     struct corsaro_dos_state_t *combined;
 } corsaro_dos_merge_state_t;
 
@@ -667,6 +669,7 @@ int corsaro_dos_finalise_config(corsaro_plugin_t *p,
 
     conf->basic.template = stdopts->template;
     conf->basic.monitorid = stdopts->monitorid;
+    conf->basic.filewriter = stdopts->filewriter;
 
     if (conf->ppm_window_size <= 0) {
         corsaro_log(p->logger,
@@ -1369,6 +1372,8 @@ void *corsaro_dos_init_merging(corsaro_plugin_t *p, int sources) {
             free(m);
             return NULL;
         }
+        corsaro_set_avro_writer_filewriter(m->mainwriter,
+                config->basic.filewriter);
     }
 
     m->combined = calloc(1, sizeof(struct corsaro_dos_state_t));
@@ -1397,6 +1402,10 @@ int corsaro_dos_halt_merging(corsaro_plugin_t *p, void *local) {
         fclose(m->summarywriter);
     }
 
+    if (m->summaryfile) {
+        corsaro_filewriter_close(m->summaryfile, 0);
+    }
+
     if (m->combined) {
         kh_free(av, m->combined->attack_hash_tcp, &attack_vector_free);
         kh_free(av, m->combined->attack_hash_udp, &attack_vector_free);
@@ -1715,21 +1724,30 @@ int corsaro_dos_merge_interval_results(corsaro_plugin_t *p, void *local,
         if (outname == NULL) {
             return -1;
         }
-        if (corsaro_start_avro_writer(m->mainwriter, outname, 0) == -1) {
+        if (corsaro_start_avro_block_writer(m->mainwriter, outname,
+                    CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) == -1) {
             free(outname);
             return -1;
         }
         free(outname);
     }
 
-    if (config->write_summary && m->summarywriter == NULL) {
+    if (config->write_summary && m->summarywriter == NULL &&
+            m->summaryfile == NULL) {
         outname = p->derive_output_name(p, local, fin->timestamp, -1);
         if (outname == NULL) {
             return -1;
         }
         // replace the "avro" suffix with "summ"
         strcpy(outname + strlen(outname) - 4, "summ");
-        if ((m->summarywriter = fopen(outname, "w")) == NULL) {
+        if (config->basic.filewriter) {
+            m->summaryfile = corsaro_filewriter_open(config->basic.filewriter,
+                    outname);
+            if (m->summaryfile == NULL) {
+                free(outname);
+                return -1;
+            }
+        } else if ((m->summarywriter = fopen(outname, "w")) == NULL) {
             free(outname);
             return -1;
         }
@@ -1777,7 +1795,17 @@ int corsaro_dos_merge_interval_results(corsaro_plugin_t *p, void *local,
     if (config->write_summary) {
         printf("%u %ld\n", fin->timestamp, active_count);
 
-        if (fprintf(m->summarywriter, "%u %ld\n", fin->timestamp, active_count) < 0) {
+        if (m->summaryfile) {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "%u %ld\n",
+                    fin->timestamp, active_count);
+
+            if (corsaro_filewriter_write(m->summaryfile, line, len) < 0) {
+                corsaro_log(p->logger, "could not write to summary file");
+                ret = -1;
+                goto endmerge;
+            }
+        } else if (fprintf(m->summarywriter, "%u %ld\n", fin->timestamp, active_count) < 0) {
             corsaro_log(p->logger, "could not write to summary file");
             ret = -1;
             goto endmerge;
@@ -1809,7 +1837,13 @@ int corsaro_dos_rotate_output(corsaro_plugin_t *p, void *local) {
     if (config->write_summary) {
         printf("closing summary file for rotation\n");
         /* TODO write a done file? */
-        if (m->summarywriter == NULL || fclose(m->summarywriter) != 0) {
+        if (m->summaryfile) {
+            if (corsaro_filewriter_close(m->summaryfile, 0) < 0) {
+                ret = -1;
+            }
+            m->summaryfile = NULL;
+        } else if (m->summarywriter == NULL ||
+                fclose(m->summarywriter) != 0) {
             ret = -1;
         }
         m->summarywriter = NULL;
@@ -1818,5 +1852,22 @@ int corsaro_dos_rotate_output(corsaro_plugin_t *p, void *local) {
     return ret;
 }
 
+void corsaro_dos_release_interval_result(corsaro_plugin_t *p, void *result) {
+
+    struct corsaro_dos_state_t *state = (struct corsaro_dos_state_t *)result;
+
+    if (state == NULL) {
+        return;
+    }
+
+    kh_free(av, state->attack_hash_tcp, &attack_vector_free);
+    kh_free(av, state->attack_hash_udp, &attack_vector_free);
+    kh_free(av, state->attack_hash_icmp, &attack_vector_free);
+    kh_destroy(av, state->attack_hash_tcp);
+    kh_destroy(av, state->attack_hash_udp);
+    kh_destroy(av, state->attack_hash_icmp);
+    free(state);
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
 
@@ -59,6 +59,7 @@
 #include <errno.h>
 #include <yaml.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 #include <Judy.h>
 #include <zmq.h>
 
@@ -71,6 +72,9 @@
 #include "libcorsaro_avro.h"
 #include "libcorsaro_filtering.h"
 #include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+#include "corsaro_flowtuple_spill.h"
+#include "corsaro_flowtuple_kway.h"
 #include "utils.h"
 
 /* This magic number is a legacy number from when we used to call it the
@@ -93,7 +97,24 @@ typedef enum corsaro_flowtuple_sort {
 
 /** Holds the state for an instance of this plugin */
 struct corsaro_flowtuple_state_t {
-    Pvoid_t  st_hash;
+    /** Flowtuples seen so far in the current interval */
+    corsaro_ft_table_t *table;
+
+    /** Reusable tables for this thread -- a table is handed to the merging
+     *  threads at the end of each interval and comes back to this pool
+     *  once it has been written.
+     */
+    corsaro_ft_table_pool_t *tablepool;
+
+    /** Number of flowtuples that fit in this thread's memory budget, or
+     *  zero if there is no budget.
+     */
+    uint32_t entrylimit;
+
+    /** Flowtuples that have been spilled to disk during the current
+     *  interval because the table reached the memory budget.
+     */
+    corsaro_ft_spill_t *spill;
 
     /** Timestamp of the start of the current interval */
     uint32_t last_interval_start;
@@ -108,8 +129,6 @@ struct corsaro_flowtuple_state_t {
 
     uint32_t pkt_cnt;
 
-    Pvoid_t keysort_levelone;
-
 };
 
 enum {
@@ -117,6 +136,7 @@ enum {
     CORSARO_FT_MSG_ROTATE,
     CORSARO_FT_MSG_MERGE_SORTED,
     CORSARO_FT_MSG_MERGE_UNSORTED,
+    CORSARO_FT_MSG_MERGE_KWAY,
 };
 
 /** Enum describing the different compression methods we support for avro
@@ -125,7 +145,8 @@ enum {
 enum {
     CORSARO_AVRO_OUTPUT_NONE,       /**<< Do not write avro output */
     CORSARO_AVRO_OUTPUT_DEFLATE,    /**<< Write gzipped avro output */
-    CORSARO_AVRO_OUTPUT_SNAPPY      /**<< Write snappy-compressed avro output */
+    CORSARO_AVRO_OUTPUT_SNAPPY,     /**<< Write snappy-compressed avro output */
+    CORSARO_AVRO_OUTPUT_ZSTD        /**<< Write zstd-compressed avro output */
 };
 
 typedef struct corsaro_ft_merge_msg {
@@ -138,31 +159,65 @@ typedef struct corsaro_ft_merge_msg {
 } PACKED corsaro_ft_write_msg_t;
 
 typedef struct corsaro_flowtuple_interim {
-    Pvoid_t hmap;
+    corsaro_ft_table_t *table;
     uint64_t hsize;
-    Pvoid_t sorted_keys;
     corsaro_logger_t *logger;
     pthread_mutex_t mutex;
-    pthread_t tid;
     int usable;
+
+    /** The processing thread that produced this interim result */
+    int threadid;
+    /** The timestamp of the interval that this result belongs to */
+    uint32_t interval_ts;
+    /** Flowtuples from this interval that were spilled to disk, to be
+     *  merged with the table by the merging thread.
+     */
+    corsaro_ft_spill_t *spill;
 } corsaro_flowtuple_interim_t;
 
+/** A fixed set of threads, shared by all processing threads, that sort
+ *  each interval's flowtuples so the processing threads can move on to
+ *  the next interval straight away.
+ */
+typedef struct corsaro_ft_sort_pool {
+    corsaro_logger_t *logger;
+
+    /** The sorting threads */
+    pthread_t *threads;
+    uint8_t threadcount;
+
+    /** Bounded ring of interim results that are waiting to be sorted */
+    corsaro_flowtuple_interim_t **queue;
+    uint32_t queuesize;
+    uint32_t queuehead;
+    uint32_t queuecount;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+
+    /** Set when the sorting threads should exit once the queue is empty */
+    uint8_t halted;
+} corsaro_ft_sort_pool_t;
+
 typedef struct corsaro_flowtuple_iterator {
     corsaro_memhandler_t *handler;
-    int sortiter;
     uint64_t hsize;
-    Pvoid_t hmap;
+    corsaro_ft_table_t *table;
     struct corsaro_flowtuple *nextft;
-    Word_t sortindex_top;
-    Word_t sortindex_bot;
     corsaro_result_type_t state;
 
-    Pvoid_t sorted_keys;
-    Pvoid_t current_subkeys;
-
     corsaro_flowtuple_interim_t *parent;
 } corsaro_flowtuple_iterator_t;
 
+/** The results from every processing thread for a single interval, to be
+ *  merged into a single output file by one merging thread.
+ */
+typedef struct corsaro_flowtuple_kway_job {
+    corsaro_flowtuple_iterator_t **inputs;
+    int inputcount;
+} corsaro_flowtuple_kway_job_t;
+
 /** Configuration options for publishing via kafka */
 typedef struct corsaro_ft_kafka_options {
     /** The broker(s) to connect to */
@@ -190,6 +245,84 @@ typedef struct corsaro_ft_kafka_partkey {
     uint32_t hash_val;  /**<< The hash value of the flow */
 } corsaro_ft_kafka_partkey_t;
 
+/** Number of bytes of flowtuple records that are collected into a single
+ *  kafka message. 512 KB seems to be good number for message sizes with
+ *  kafka; larger messages require extra configuration on the broker.
+ */
+#define CORSARO_FT_KAFKA_MSG_SIZE (1024 * 512)
+
+/** Maximum number of messages that may be waiting for the kafka producer
+ *  thread before the merging threads have to wait for it.
+ */
+#define CORSARO_FT_KAFKA_QUEUE_SIZE 64
+
+/** Maximum number of messages passed to rd_kafka_produce_batch() at once */
+#define CORSARO_FT_KAFKA_MAX_BATCH 16
+
+/** How often (in seconds) the kafka producer thread logs its statistics */
+#define CORSARO_FT_KAFKA_REPORT_FREQ 60
+
+/** How long (in milliseconds) the kafka producer thread may keep trying to
+ *  hand over and deliver its remaining messages once it has been halted.
+ */
+#define CORSARO_FT_KAFKA_FLUSH_TIMEOUT (30 * 1000)
+
+/** A kafka message that is waiting to be produced */
+typedef struct corsaro_ft_kafka_msg {
+    uint8_t *buf;
+    size_t len;
+    corsaro_ft_kafka_partkey_t partkey;
+} corsaro_ft_kafka_msg_t;
+
+/** A single kafka producer, shared by all of the merging threads. The
+ *  merging threads fill messages with flowtuple records and queue them;
+ *  the producer thread hands them to librdkafka in batches and collects
+ *  the delivery reports.
+ */
+typedef struct corsaro_ft_kafka_producer {
+    corsaro_logger_t *logger;
+    corsaro_ft_kafka_options_t *opts;
+
+    /** A kafka instance for publishing flowtuple records */
+    rd_kafka_t *rdk;
+    /** A kafka topic that flowtuple records can be published to */
+    rd_kafka_topic_t *rdktopic;
+
+    pthread_t tid;
+
+    /** Bounded ring of messages waiting to be produced */
+    corsaro_ft_kafka_msg_t queue[CORSARO_FT_KAFKA_QUEUE_SIZE];
+    uint32_t queuehead;
+    uint32_t queuecount;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+
+    /** Set when the producer thread should exit once the queue is empty */
+    uint8_t halted;
+    /** Time (in milliseconds) after which a halted producer gives up on
+     *  any messages that it has not yet managed to produce or deliver */
+    uint64_t flushdeadline;
+
+    /** Messages accepted by librdkafka */
+    uint64_t produced;
+    /** Bytes in the messages accepted by librdkafka */
+    uint64_t producedbytes;
+    /** Messages that librdkafka refused to accept */
+    uint64_t producefailures;
+    /** Messages that the broker has acknowledged */
+    uint64_t delivered;
+    /** Messages that could not be delivered to the broker */
+    uint64_t deliveryfailures;
+    /** The most recent delivery error */
+    rd_kafka_resp_err_t lasterr;
+    /** Number of times a merging thread had to wait for queue space */
+    uint64_t stalls;
+    /** Time (in seconds) that statistics were last logged */
+    uint32_t lastreport;
+} corsaro_ft_kafka_producer_t;
+
 
 /** State for a single flowtuple merging worker thread */
 typedef struct corsaro_flowtuple_merger {
@@ -207,10 +340,8 @@ typedef struct corsaro_flowtuple_merger {
      */
     Pvoid_t writers;
 
-    /** A kafka instance for publishing flowtuple records */
-    rd_kafka_t *rdk;
-    /** A kafka topic that flowtuple records can be published to */
-    rd_kafka_topic_t *rdktopic;
+    /** The producer to hand kafka messages to, if publishing to kafka */
+    corsaro_ft_kafka_producer_t *producer;
 
     /** A zeromq socket for receiving flowtuple records from the processing
      *  threads.
@@ -226,6 +357,12 @@ typedef struct corsaro_flowtuple_merger {
     uint8_t maxmergeworkers;
     /** The compression method to use when writing avro output */
     uint8_t avrooutput;
+    /** The compression level to use when writing avro output */
+    int compresslevel;
+    /** Threads shared by all merging threads for compressing avro blocks */
+    corsaro_avro_compress_pool_t *compresspool;
+    /** Whether to write a block index alongside each avro output file */
+    uint8_t writeindex;
     /** The kafka configuration options for this plugin */
     corsaro_ft_kafka_options_t *kafkaopts;
 
@@ -246,14 +383,25 @@ struct corsaro_flowtuple_merge_state_t {
     uint8_t maxworkers;
     uint32_t last_rotate;
     void *pubqueue;
+    corsaro_ft_kafka_producer_t *producer;
 };
 
 typedef struct corsaro_flowtuple_config {
     corsaro_plugin_proc_options_t basic;
     corsaro_flowtuple_sort_t sort_enabled;
+    uint8_t mergeoutput;
     void *zmq_ctxt;
     uint8_t maxmergeworkers;
+    uint8_t sortthreads;
+    uint32_t sortqueuesize;
+    corsaro_ft_sort_pool_t *sortpool;
     uint8_t avrooutput;
+    int compresslevel;
+    uint8_t compressthreads;
+    corsaro_avro_compress_pool_t *compresspool;
+    uint8_t writeindex;
+    uint32_t memorybudget;
+    char *spilldir;
     corsaro_ft_kafka_options_t kafkaopts;
 } corsaro_flowtuple_config_t;
 
@@ -295,8 +443,18 @@ int corsaro_flowtuple_parse_config(corsaro_plugin_t *p, yaml_document_t *doc,
     /* Default config settings: avro using deflate, no kafka output */
     CORSARO_INIT_PLUGIN_PROC_OPTS(conf->basic);
     conf->sort_enabled = CORSARO_FLOWTUPLE_SORT_DEFAULT;
+    conf->mergeoutput = 0;
     conf->maxmergeworkers = 4;
+    conf->sortthreads = 2;
+    conf->sortqueuesize = 32;
+    conf->sortpool = NULL;
     conf->avrooutput = CORSARO_AVRO_OUTPUT_DEFLATE;
+    conf->compresslevel = 0;
+    conf->compressthreads = 2;
+    conf->compresspool = NULL;
+    conf->writeindex = 0;
+    conf->memorybudget = 0;
+    conf->spilldir = NULL;
     conf->kafkaopts.brokeruri = NULL;
     conf->kafkaopts.topicprefix = NULL;
     conf->kafkaopts.lingerms = 500;
@@ -336,6 +494,22 @@ int corsaro_flowtuple_parse_config(corsaro_plugin_t *p, yaml_document_t *doc,
             }
         }
 
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value, "mergeoutput") == 0) {
+            if (parse_onoff_option(p->logger, (char *)value->data.scalar.value,
+                    &(conf->mergeoutput), "mergeoutput") < 0) {
+                conf->mergeoutput = 0;
+            }
+        }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value, "writeindex") == 0) {
+            if (parse_onoff_option(p->logger, (char *)value->data.scalar.value,
+                    &(conf->writeindex), "writeindex") < 0) {
+                conf->writeindex = 0;
+            }
+        }
+
         if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                 && strcmp((char *)key->data.scalar.value, "avrooutput") == 0) {
 
@@ -347,9 +521,26 @@ int corsaro_flowtuple_parse_config(corsaro_plugin_t *p, yaml_document_t *doc,
             } else if (strcasecmp((char *)value->data.scalar.value, "snappy")
                     == 0) {
                 conf->avrooutput = CORSARO_AVRO_OUTPUT_SNAPPY;
+            } else if (strcasecmp((char *)value->data.scalar.value, "zstd")
+                    == 0) {
+                conf->avrooutput = CORSARO_AVRO_OUTPUT_ZSTD;
             }
         }
 
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "avrocompresslevel") == 0) {
+            conf->compresslevel = strtol((char *)value->data.scalar.value,
+                    NULL, 10);
+        }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "compressthreads") == 0) {
+            conf->compressthreads = strtoul((char *)value->data.scalar.value,
+                    NULL, 10);
+        }
+
         if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                 && strcmp((char *)key->data.scalar.value,
                         "mergethreads") == 0) {
@@ -357,6 +548,36 @@ int corsaro_flowtuple_parse_config(corsaro_plugin_t *p, yaml_document_t *doc,
                     NULL, 10);
         }
 
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "sortthreads") == 0) {
+            conf->sortthreads = strtoul((char *)value->data.scalar.value,
+                    NULL, 10);
+        }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "sortqueuesize") == 0) {
+            conf->sortqueuesize = strtoul((char *)value->data.scalar.value,
+                    NULL, 10);
+        }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "memorybudget") == 0) {
+            conf->memorybudget = strtoul((char *)value->data.scalar.value,
+                    NULL, 10);
+        }
+
+        if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
+                && strcmp((char *)key->data.scalar.value,
+                        "spilldir") == 0) {
+            if (conf->spilldir) {
+                free(conf->spilldir);
+            }
+            conf->spilldir = strdup((char *)value->data.scalar.value);
+        }
+
         if (key->type == YAML_SCALAR_NODE && value->type == YAML_SCALAR_NODE
                 && strcmp((char *)key->data.scalar.value,
                         "kafkabatchsize") == 0) {
@@ -396,13 +617,170 @@ int corsaro_flowtuple_parse_config(corsaro_plugin_t *p, yaml_document_t *doc,
 
 }
 
+static void *start_ft_sort_worker(void *tdata) {
+
+    corsaro_ft_sort_pool_t *pool = (corsaro_ft_sort_pool_t *)tdata;
+    corsaro_flowtuple_interim_t *interim;
+    struct timeval start, end;
+    uint32_t depth, flows, interval_ts;
+    int threadid, ret;
+
+    while (1) {
+        pthread_mutex_lock(&(pool->mutex));
+        while (pool->queuecount == 0 && !pool->halted) {
+            pthread_cond_wait(&(pool->notempty), &(pool->mutex));
+        }
+        if (pool->queuecount == 0) {
+            pthread_mutex_unlock(&(pool->mutex));
+            break;
+        }
+        interim = pool->queue[pool->queuehead];
+        pool->queuehead = (pool->queuehead + 1) % pool->queuesize;
+        pool->queuecount --;
+        depth = pool->queuecount;
+        pthread_cond_signal(&(pool->notfull));
+        pthread_mutex_unlock(&(pool->mutex));
+
+        /* The merging thread polls 'usable' with a trylock, so holding
+         * the mutex for the duration of the sort keeps it waiting.
+         */
+        gettimeofday(&start, NULL);
+        pthread_mutex_lock(&(interim->mutex));
+        ret = corsaro_ft_table_sort(interim->table);
+        flows = interim->table->count;
+        threadid = interim->threadid;
+        interval_ts = interim->interval_ts;
+        if (ret < 0) {
+            interim->usable = -1;
+        } else {
+            interim->usable = 1;
+        }
+        pthread_mutex_unlock(&(interim->mutex));
+        gettimeofday(&end, NULL);
+
+        if (ret < 0) {
+            corsaro_log(pool->logger,
+                    "flowtuple plugin: unable to allocate memory to sort %u flowtuples from thread %d",
+                    flows, threadid);
+        }
+
+        corsaro_log(pool->logger,
+                "flowtuple plugin: sorted %u flows from thread %d for interval %u in %.3f ms, sort queue depth %u",
+                flows, threadid, interval_ts,
+                ((end.tv_sec - start.tv_sec) * 1000.0) +
+                ((end.tv_usec - start.tv_usec) / 1000.0), depth);
+    }
+    pthread_exit(NULL);
+}
+
+static corsaro_ft_sort_pool_t *create_sort_pool(corsaro_logger_t *logger,
+        uint8_t threadcount, uint32_t queuesize) {
+
+    corsaro_ft_sort_pool_t *pool;
+    int i;
+
+    pool = (corsaro_ft_sort_pool_t *)calloc(1, sizeof(corsaro_ft_sort_pool_t));
+    if (pool == NULL) {
+        corsaro_log(logger, "unable to allocate flowtuple sort pool");
+        return NULL;
+    }
+
+    pool->logger = logger;
+    pool->queuesize = queuesize;
+    pool->queue = calloc(queuesize, sizeof(corsaro_flowtuple_interim_t *));
+    pool->threads = calloc(threadcount, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->threads == NULL) {
+        corsaro_log(logger, "unable to allocate flowtuple sort pool");
+        free(pool->queue);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->notempty), NULL);
+    pthread_cond_init(&(pool->notfull), NULL);
+
+    for (i = 0; i < threadcount; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL, start_ft_sort_worker,
+                    pool) != 0) {
+            corsaro_log(logger, "unable to start flowtuple sort thread %d",
+                    i);
+            break;
+        }
+        pool->threadcount ++;
+    }
+    return pool;
+}
+
+static void destroy_sort_pool(corsaro_ft_sort_pool_t *pool) {
+
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    /* The sort threads will finish anything left in the queue first */
+    pthread_mutex_lock(&(pool->mutex));
+    pool->halted = 1;
+    pthread_cond_broadcast(&(pool->notempty));
+    pthread_mutex_unlock(&(pool->mutex));
+
+    for (i = 0; i < pool->threadcount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&(pool->mutex));
+    pthread_cond_destroy(&(pool->notempty));
+    pthread_cond_destroy(&(pool->notfull));
+    free(pool->queue);
+    free(pool->threads);
+    free(pool);
+}
+
+/* Adds an interim result to the sort queue. If the queue is full, the
+ * calling processing thread blocks until a sort thread frees up a spot,
+ * which limits the number of unsorted intervals held in memory.
+ */
+static int enqueue_sort_job(corsaro_ft_sort_pool_t *pool,
+        corsaro_flowtuple_interim_t *interim) {
+
+    uint32_t depth;
+
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->threadcount == 0) {
+        pthread_mutex_unlock(&(pool->mutex));
+        return -1;
+    }
+    if (pool->queuecount == pool->queuesize) {
+        corsaro_log(pool->logger,
+                "flowtuple plugin: sort queue is full, thread %d is waiting",
+                interim->threadid);
+    }
+    while (pool->queuecount == pool->queuesize) {
+        pthread_cond_wait(&(pool->notfull), &(pool->mutex));
+    }
+    pool->queue[(pool->queuehead + pool->queuecount) % pool->queuesize] =
+            interim;
+    pool->queuecount ++;
+    depth = pool->queuecount;
+    pthread_cond_signal(&(pool->notempty));
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (depth > pool->threadcount) {
+        corsaro_log(pool->logger,
+                "flowtuple plugin: %u intervals are waiting to be sorted",
+                depth);
+    }
+    return 0;
+}
+
 int corsaro_flowtuple_finalise_config(corsaro_plugin_t *p,
         corsaro_plugin_proc_options_t *stdopts, void *zmq_ctxt) {
 
     corsaro_flowtuple_config_t *conf;
 
-    srand(time(0));
-
     /* Configure standard 'global' options for any options that
      * were not overridden by plugin-specific config.
      */
@@ -410,6 +788,7 @@ int corsaro_flowtuple_finalise_config(corsaro_plugin_t *p,
 
     conf->basic.template = stdopts->template;
     conf->basic.monitorid = stdopts->monitorid;
+    conf->basic.filewriter = stdopts->filewriter;
     conf->zmq_ctxt = zmq_ctxt;
 
     if (conf->maxmergeworkers < stdopts->procthreads) {
@@ -423,24 +802,79 @@ int corsaro_flowtuple_finalise_config(corsaro_plugin_t *p,
     corsaro_log(p->logger, "flowtuple plugin: using %u merging threads",
             conf->maxmergeworkers);
     if (conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED) {
+        if (conf->sortthreads == 0) {
+            conf->sortthreads = 1;
+        }
+        if (conf->sortqueuesize == 0) {
+            conf->sortqueuesize = 1;
+        }
         corsaro_log(p->logger,
-                "flowtuple plugin: sorting flowtuples before output");
+                "flowtuple plugin: sorting flowtuples before output, using %u sort threads with a queue of %u intervals",
+                conf->sortthreads, conf->sortqueuesize);
+        conf->sortpool = create_sort_pool(p->logger, conf->sortthreads,
+                conf->sortqueuesize);
     } else {
         corsaro_log(p->logger,
                 "flowtuple plugin: NOT sorting flowtuples before output");
     }
 
+    if (conf->mergeoutput &&
+            conf->sort_enabled != CORSARO_FLOWTUPLE_SORT_ENABLED) {
+        corsaro_log(p->logger,
+                "flowtuple plugin: mergeoutput requires sorttuples, writing one file per processing thread instead");
+        conf->mergeoutput = 0;
+    }
+    if (conf->mergeoutput) {
+        corsaro_log(p->logger,
+                "flowtuple plugin: merging the flowtuples from all processing threads into a single output file");
+    }
+
     if (conf->avrooutput == CORSARO_AVRO_OUTPUT_SNAPPY) {
         corsaro_log(p->logger,
                 "flowtuple plugin: using snappy compression for avro output");
     } else if (conf->avrooutput == CORSARO_AVRO_OUTPUT_DEFLATE) {
         corsaro_log(p->logger,
-                "flowtuple plugin: using deflate compression for avro output");
+                "flowtuple plugin: using deflate compression (level %d) for avro output",
+                conf->compresslevel);
+    } else if (conf->avrooutput == CORSARO_AVRO_OUTPUT_ZSTD) {
+#ifdef HAVE_ZSTD
+        corsaro_log(p->logger,
+                "flowtuple plugin: using zstd compression (level %d) for avro output",
+                conf->compresslevel);
+#else
+        corsaro_log(p->logger,
+                "flowtuple plugin: zstd is not available, using deflate compression for avro output instead");
+#endif
     } else {
         corsaro_log(p->logger,
                 "flowtuple plugin: not writing any avro output");
     }
 
+    if (conf->avrooutput != CORSARO_AVRO_OUTPUT_NONE &&
+            conf->compressthreads > 0) {
+        corsaro_log(p->logger,
+                "flowtuple plugin: using %u threads to compress avro blocks",
+                conf->compressthreads);
+        conf->compresspool = corsaro_create_avro_compress_pool(p->logger,
+                conf->compressthreads);
+        if (conf->compresspool == NULL) {
+            corsaro_log(p->logger,
+                    "flowtuple plugin: unable to start avro compression threads, compressing on the merging threads instead");
+        }
+    }
+
+    if (conf->spilldir == NULL) {
+        conf->spilldir = strdup("/tmp");
+    }
+    if (conf->memorybudget > 0) {
+        corsaro_log(p->logger,
+                "flowtuple plugin: limiting each processing thread to %u MB of flowtuples, spilling to %s",
+                conf->memorybudget, conf->spilldir);
+    } else {
+        corsaro_log(p->logger,
+                "flowtuple plugin: no memory budget for flowtuples");
+    }
+
     if (conf->kafkaopts.brokeruri != NULL) {
         corsaro_log(p->logger,
                 "flowtuple plugin: writing flowtuples to kafka broker: %s, using topic prefix '%s'",
@@ -461,6 +895,18 @@ void corsaro_flowtuple_destroy_self(corsaro_plugin_t *p) {
 
     conf = (corsaro_flowtuple_config_t *)(p->config);
 
+    if (conf && conf->sortpool) {
+        destroy_sort_pool(conf->sortpool);
+    }
+
+    if (conf && conf->compresspool) {
+        corsaro_destroy_avro_compress_pool(conf->compresspool);
+    }
+
+    if (conf && conf->spilldir) {
+        free(conf->spilldir);
+    }
+
     if (conf && conf->kafkaopts.brokeruri) {
         free(conf->kafkaopts.brokeruri);
     }
@@ -478,6 +924,9 @@ void corsaro_flowtuple_destroy_self(corsaro_plugin_t *p) {
 void *corsaro_flowtuple_init_processing(corsaro_plugin_t *p, int threadid) {
 
     struct corsaro_flowtuple_state_t *state;
+    corsaro_flowtuple_config_t *conf;
+
+    conf = (corsaro_flowtuple_config_t *)(p->config);
 
     state = (struct corsaro_flowtuple_state_t *)calloc(1,
             sizeof(struct corsaro_flowtuple_state_t));
@@ -499,8 +948,38 @@ void *corsaro_flowtuple_init_processing(corsaro_plugin_t *p, int threadid) {
             sizeof(struct corsaro_flowtuple), 1000000);
 #endif
 
-    state->st_hash = NULL;
-    state->keysort_levelone = NULL;
+    state->table = NULL;
+    state->spill = NULL;
+    state->entrylimit = 0;
+
+    /* Once the table holds as many flowtuples as the memory budget
+     * allows, it is spilled to disk and emptied.
+     */
+    if (conf->memorybudget > 0) {
+        uint64_t limit = ((uint64_t)conf->memorybudget * 1024 * 1024) /
+                corsaro_ft_table_entry_cost();
+
+        if (limit < 1024) {
+            limit = 1024;
+        } else if (limit > UINT32_MAX / 2) {
+            limit = UINT32_MAX / 2;
+        }
+        state->entrylimit = (uint32_t)limit;
+    }
+
+    /* When sorting, flowtuples with the same sort key must be combined
+     * just as they would be if the sort key itself was the hash key.
+     */
+    state->tablepool = corsaro_ft_create_table_pool(p->logger,
+            conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED);
+    if (state->tablepool) {
+        state->table = corsaro_ft_get_table(state->tablepool);
+    }
+    if (state->table == NULL) {
+        corsaro_flowtuple_halt_processing(p, state);
+        return NULL;
+    }
+    state->table->entrylimit = state->entrylimit;
 
     return state;
 }
@@ -517,6 +996,18 @@ int corsaro_flowtuple_halt_processing(corsaro_plugin_t *p, void *local) {
     if (state->fthandler) {
         destroy_corsaro_memhandler(state->fthandler);
     }
+
+    if (state->spill) {
+        corsaro_ft_destroy_spill(state->spill);
+    }
+
+    /* Any tables still being written by the merging threads will be
+     * freed once they are released.
+     */
+    if (state->table) {
+        corsaro_ft_release_table(state->table);
+    }
+    corsaro_ft_close_table_pool(state->tablepool);
     free(state);
 
     return 0;
@@ -567,7 +1058,6 @@ void *corsaro_flowtuple_end_interval(corsaro_plugin_t *p, void *local,
     corsaro_flowtuple_config_t *conf;
     struct corsaro_flowtuple_state_t *state;
     corsaro_flowtuple_interim_t *interim = NULL;
-    Word_t hashsize;
 
     FLOWTUPLE_PROC_FUNC_START("corsaro_flowtuple_end_interval", NULL);
 
@@ -576,64 +1066,117 @@ void *corsaro_flowtuple_end_interval(corsaro_plugin_t *p, void *local,
     if (state->fthandler) {
         add_corsaro_memhandler_user(state->fthandler);
     }
-    interim->hmap = state->st_hash;
-    JLC(hashsize, state->st_hash, 0, -1);
-    interim->hsize = hashsize;
+    interim->table = state->table;
+    interim->hsize = 0;
     interim->usable = 0;
-    interim->sorted_keys = NULL;
     interim->logger = p->logger;
+    interim->threadid = state->threadid;
+    interim->interval_ts = int_end->time;
+    interim->spill = state->spill;
+    state->spill = NULL;
 
     pthread_mutex_init(&(interim->mutex), NULL);
 
-    if (conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED) {
-        interim->sorted_keys = state->keysort_levelone;
-        interim->usable = 1;
-    } else {
-        interim->usable = 1;
+    if (state->table) {
+        uint64_t used, uncompacted;
+
+        corsaro_log(p->logger,
+                "flowtuple thread %d: %u flows in interval %u, table load factor %.2f, mean probe length %.2f groups (max %u)",
+                state->threadid, state->table->count, int_end->time,
+                corsaro_ft_table_load_factor(state->table),
+                corsaro_ft_table_mean_probe(state->table),
+                state->table->maxprobe);
+
+        corsaro_ft_table_memory(state->table, &used, &uncompacted);
+        if (used > 0 && uncompacted > 0) {
+            corsaro_log(p->logger,
+                    "flowtuple thread %d: %u distinct flow attribute sets, %lu bytes of flows (%lu without compaction), %.0f flows per GB (%.0f without compaction)",
+                    state->threadid, state->table->attrcount, used,
+                    uncompacted,
+                    state->table->count * (1073741824.0 / used),
+                    state->table->count * (1073741824.0 / uncompacted));
+        }
+        interim->hsize = state->table->count;
+    }
+
+    if (interim->spill) {
+        corsaro_log(p->logger,
+                "flowtuple thread %d: spilled %lu flows (%lu bytes) in %u runs during interval %u",
+                state->threadid, interim->spill->records,
+                interim->spill->bytes, interim->spill->runcount,
+                int_end->time);
     }
 
-    /* Replace the hash map with an empty one -- the merging process
-     * will free up everything associated with the old hash map. */
-    state->st_hash = NULL;
-    state->keysort_levelone = NULL;
+    interim->usable = 1;
+    if (conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED && state->table) {
+        /* Order only matters once the interval is over, so the whole
+         * lot is sorted now by the sort pool rather than paying for a
+         * sorted insert on every packet. The merging thread will wait
+         * until the sort has finished.
+         */
+        interim->usable = 0;
+        if (conf->sortpool == NULL ||
+                enqueue_sort_job(conf->sortpool, interim) < 0) {
+            if (corsaro_ft_table_sort(state->table) < 0) {
+                corsaro_log(p->logger,
+                        "unable to allocate memory to sort %u flowtuples",
+                        state->table->count);
+                interim->usable = -1;
+            } else {
+                interim->usable = 1;
+            }
+        }
+    }
+
+    /* Start the next interval with an empty table -- the merging process
+     * will return the old table to our pool once it has been written. */
+    state->table = corsaro_ft_get_table(state->tablepool);
+    if (state->table) {
+        state->table->entrylimit = state->entrylimit;
+    }
     return interim;
 }
 
-static struct corsaro_flowtuple *insert_sorted_key(Pvoid_t *topmap,
-        struct corsaro_flowtuple *ft, corsaro_logger_t *logger) {
-
-    PWord_t tval, bval;
-    Pvoid_t botmap = NULL;
-    struct corsaro_flowtuple *newft;
-    uint64_t sk_top, sk_bot;
+/** Writes the contents of the current table to a spill run on disk and
+ *  empties the table, so that the thread stays within its memory budget.
+ */
+static void corsaro_flowtuple_spill_table(corsaro_logger_t *logger,
+        struct corsaro_flowtuple_state_t *state,
+        corsaro_flowtuple_config_t *conf) {
 
-    sk_top = FT_CALC_SORT_KEY_TOP(ft);
-    sk_bot = FT_CALC_SORT_KEY_BOTTOM(ft);
+    struct timeval start, end;
+    uint32_t flows = state->table->count;
+    uint64_t bytes;
 
-    JLI(tval, (*topmap), sk_top);
-    botmap = (Pvoid_t) *tval;
+    if (state->spill == NULL) {
+        state->spill = corsaro_ft_create_spill(logger, conf->spilldir,
+                state->threadid, state->last_interval_start);
+    }
 
-    JLI(bval, botmap, sk_bot);
-    if (*bval == 0) {
-        newft = calloc(1, sizeof(struct corsaro_flowtuple));
+    bytes = state->spill ? state->spill->bytes : 0;
+    gettimeofday(&start, NULL);
+    if (state->spill == NULL ||
+            corsaro_ft_spill_table(state->spill, state->table) < 0) {
+        /* Keep counting in memory for the rest of the interval rather
+         * than dropping flows.
+         */
+        corsaro_log(logger,
+                "flowtuple thread %d: unable to spill flowtuples to %s, ignoring the memory budget until the end of the interval",
+                state->threadid, conf->spilldir);
+        state->table->entrylimit = 0;
+        return;
+    }
+    gettimeofday(&end, NULL);
 
-        if (newft == NULL) {
-          corsaro_log(logger, "malloc of flowtuple failed");
-          return NULL;
-        }
+    corsaro_log(logger,
+            "flowtuple thread %d: spilled %u flows (%lu bytes) to %s in %.3f ms",
+            state->threadid, flows,
+            state->spill->bytes - bytes,
+            state->spill->runs[state->spill->runcount - 1].filename,
+            ((end.tv_sec - start.tv_sec) * 1000.0) +
+                    ((end.tv_usec - start.tv_usec) / 1000.0));
 
-        /* fill it */
-        memcpy(newft, ft, sizeof(struct corsaro_flowtuple));
-        newft->memsrc = NULL;
-        newft->ftdata.packet_cnt = 0;
-        newft->sort_key_top = sk_top;
-        newft->sort_key_bot = sk_bot;
-        *bval = (Word_t)newft;
-    } else {
-        newft =(struct corsaro_flowtuple *)(*bval);
-    }
-    *tval = (Word_t)botmap;
-    return newft;
+    corsaro_ft_table_reset(state->table);
 }
 
 /** Either add the given flowtuple to the hash, or increment the current count
@@ -641,42 +1184,30 @@ static struct corsaro_flowtuple *insert_sorted_key(Pvoid_t *topmap,
 static int corsaro_flowtuple_add_inc(corsaro_logger_t *logger,
         struct corsaro_flowtuple_state_t *state, struct corsaro_flowtuple *t,
         uint32_t increment, corsaro_flowtuple_config_t *conf) {
-  struct corsaro_flowtuple *new_6t = NULL;
-  PWord_t pval;
+  corsaro_ft_entry_t *new_6t = NULL;
 
-  if (conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED) {
-    new_6t = insert_sorted_key(&(state->keysort_levelone), t, logger);
+  if (state->table == NULL) {
+    corsaro_log(logger, "no flowtuple table available for this interval");
+    return -1;
+  }
 
-    if (new_6t == NULL) {
-        return -1;
-    }
-  } else {
-    JLI(pval, state->st_hash, t->ftdata.hash_val);
-    if (*pval == 0) {
-      new_6t = calloc(1, sizeof(struct corsaro_flowtuple));
-      if (new_6t == NULL) {
-          corsaro_log(logger, "malloc of flowtuple failed");
-          return -1;
-      }
-
-      /* fill it */
-      memcpy(new_6t, t, sizeof(struct corsaro_flowtuple));
-      new_6t->memsrc = NULL;
-      new_6t->ftdata.packet_cnt = 0;
-      new_6t->sort_key_top = 0;
-      new_6t->sort_key_bot = 0;
-      *pval = (Word_t)new_6t;
-    } else {
-      new_6t =(struct corsaro_flowtuple *)(*pval);
-    }
+  if (state->table->entrylimit > 0 &&
+        state->table->count >= state->table->entrylimit) {
+    corsaro_flowtuple_spill_table(logger, state, conf);
+  }
+
+  new_6t = corsaro_ft_table_find_or_insert(state->table, t);
+  if (new_6t == NULL) {
+    corsaro_log(logger, "unable to grow flowtuple table");
+    return -1;
   }
 
   assert(new_6t != NULL);
 
   /* will this cause a wrap? */
-  assert((UINT32_MAX - new_6t->ftdata.packet_cnt) > increment);
+  assert((UINT32_MAX - new_6t->packet_cnt) > increment);
 
-  new_6t->ftdata.packet_cnt = (new_6t->ftdata.packet_cnt) + increment;
+  new_6t->packet_cnt = (new_6t->packet_cnt) + increment;
   return 0;
 }
 
@@ -780,6 +1311,79 @@ int corsaro_flowtuple_process_packet(corsaro_plugin_t *p, void *local,
     return 0;
 }
 
+/** Hashes the fields that identify a flow, for deciding whether the flow
+ *  is sampled for publishing to kafka. The interval is deliberately left
+ *  out, so that the same flows are selected in every interval, by every
+ *  merging thread and in every run.
+ */
+static inline uint32_t kafka_sample_hash(struct corsaro_flowtuple *ft) {
+    uint64_t h;
+
+    h = (((uint64_t)ft->ftdata.src_ip) << 32) | ft->ftdata.dst_ip;
+    h ^= ((((uint64_t)ft->ftdata.src_port) << 48) |
+            (((uint64_t)ft->ftdata.dst_port) << 32) |
+            (((uint64_t)ft->ftdata.protocol) << 24) |
+            (((uint64_t)ft->ftdata.ttl) << 16) |
+            (((uint64_t)ft->ftdata.tcp_flags) << 8)) * 0x9e3779b97f4a7c15ULL;
+    h ^= ft->ftdata.ip_len;
+
+    /* splitmix64 finalizer */
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (uint32_t)h;
+}
+
+/** Hands the current kafka message for a merging thread to the producer
+ *  thread, waiting if the producer has too many messages queued already.
+ *
+ *  @param m        The merging thread whose message is to be sent
+ */
+static void kafka_send_message(corsaro_flowtuple_merger_t *m) {
+
+    corsaro_ft_kafka_producer_t *prod = m->producer;
+    corsaro_ft_kafka_msg_t *msg;
+
+    if (m->buf == NULL || m->writeptr == m->buf) {
+        return;
+    }
+
+    pthread_mutex_lock(&(prod->mutex));
+    if (prod->queuecount == CORSARO_FT_KAFKA_QUEUE_SIZE) {
+        prod->stalls ++;
+    }
+    while (prod->queuecount == CORSARO_FT_KAFKA_QUEUE_SIZE &&
+            !prod->halted) {
+        pthread_cond_wait(&(prod->notfull), &(prod->mutex));
+    }
+    if (prod->halted) {
+        pthread_mutex_unlock(&(prod->mutex));
+        m->writeptr = m->buf;
+        return;
+    }
+
+    msg = &(prod->queue[(prod->queuehead + prod->queuecount) %
+            CORSARO_FT_KAFKA_QUEUE_SIZE]);
+    msg->buf = m->buf;
+    msg->len = m->writeptr - m->buf;
+    msg->partkey = m->partkey;
+    prod->queuecount ++;
+    pthread_cond_signal(&(prod->notempty));
+    pthread_mutex_unlock(&(prod->mutex));
+
+    /* The producer now owns the old buffer, so start a new one */
+    m->buf = malloc(CORSARO_FT_KAFKA_MSG_SIZE +
+            sizeof(corsaro_flowtuple_kafka_record_t));
+    if (m->buf == NULL) {
+        corsaro_log(m->logger,
+                "unable to allocate kafka message buffer for flowtuple merging thread %d",
+                m->thread_num);
+    }
+    m->writeptr = m->buf;
+}
+
 /** Push a single flowtuple record onto a kafka topic
  *
  *  @param m        The merging thread that has received the flowtuple
@@ -789,22 +1393,28 @@ static void kafka_publish_flowtuple(corsaro_flowtuple_merger_t *m,
         struct corsaro_flowtuple *ft) {
 
     corsaro_flowtuple_kafka_record_t rec;
-    uint32_t roll;
 
     /* If we are only publishing a sample of the flowtuples, check to
      * see if this one is selected for publication.
      */
     if (m->kafkaopts->sampling < 10000) {
-        roll = rand() % 10000;
-        if (roll >= m->kafkaopts->sampling) {
+        if (kafka_sample_hash(ft) % 10000 >= m->kafkaopts->sampling) {
             return;
         }
     }
 
-    if (m->partkey.ts == 0) {
-        m->partkey.ts = ft->ftdata.interval_ts;
+    /* Flush the message whenever we switch interval to avoid mixing
+     * intervals in the same message.
+     */
+    if (m->writeptr != m->buf && ft->ftdata.interval_ts != m->partkey.ts) {
+        kafka_send_message(m);
     }
 
+    if (m->buf == NULL) {
+        return;
+    }
+
+    m->partkey.ts = ft->ftdata.interval_ts;
     m->partkey.hash_val = ft->ftdata.hash_val;
 
     /* We use a specific struct here because:
@@ -840,109 +1450,283 @@ static void kafka_publish_flowtuple(corsaro_flowtuple_merger_t *m,
     memcpy(m->writeptr, &rec, sizeof(rec));
     m->writeptr += sizeof(rec);
 
-    /* 512 KB seems to be good number for message sizes with kafka. Larger
-     * messages require extra configuration on the broker.
-     *
-     * Also, we flush the message whenever we switch interval to avoid
-     * mixing intervals in the same message.
-     */
-    if (m->writeptr - m->buf > (1024 * 512) || ft->ftdata.interval_ts !=
-            m->partkey.ts) {
+    if (m->writeptr - m->buf >= CORSARO_FT_KAFKA_MSG_SIZE) {
+        kafka_send_message(m);
+    }
+}
 
-        while (rd_kafka_produce(m->rdktopic, RD_KAFKA_PARTITION_UA,
-                    RD_KAFKA_MSG_F_COPY, m->buf, m->writeptr - m->buf,
-                    &(m->partkey),
-                    sizeof(m->partkey), &(m->maxmergeworkers)) == -1) {
+static void write_spilled_interim_flowtuples(corsaro_flowtuple_merger_t *m,
+        corsaro_avro_writer_t *writer, corsaro_flowtuple_iterator_t *input,
+        uint8_t mustsort);
 
-            if (rd_kafka_last_error() == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
-                usleep(50);
-                continue;
-            }
+/** Discards one thread's flowtuples for an interval that could not be
+ *  written in sorted order, as an output file that claims to be sorted
+ *  must never contain records out of order.
+ */
+static void drop_unsortable_flowtuples(corsaro_flowtuple_merger_t *m,
+        corsaro_flowtuple_iterator_t *input, uint64_t count) {
 
-            corsaro_log(m->logger, "Error while publishing flowtuple to kafka topic %s: %s",
-                    rd_kafka_topic_name(m->rdktopic),
-                    rd_kafka_err2str(rd_kafka_last_error()));
+    corsaro_log(m->logger,
+            "merging thread %d: not writing %lu flowtuples from thread %d for interval %u, as they could not be sorted",
+            m->thread_num, count, input->parent->threadid,
+            input->parent->interval_ts);
 
-            break;
-        }
+    corsaro_ft_release_table(input->table);
+    input->table = NULL;
+}
 
-        /* Doing this occasionally allows librdkafka to trigger any extra
-         * callbacks (e.g. errors).
-         */
-        rd_kafka_poll(m->rdk, 0);
-        m->writeptr = m->buf;
-        m->partkey.ts = ft->ftdata.interval_ts;
+static void write_unsorted_interim_flowtuples(corsaro_flowtuple_merger_t *m,
+        corsaro_avro_writer_t *writer, corsaro_flowtuple_iterator_t *input) {
+
+    struct corsaro_flowtuple nextft;
+    uint32_t i;
+
+    if (input->parent->spill) {
+        write_spilled_interim_flowtuples(m, writer, input, 0);
+        return;
+    }
+
+    if (input->table == NULL) {
+        return;
     }
+
+    for (i = 0; i < input->table->count; i++) {
+        corsaro_ft_table_expand(input->table, i, &nextft);
+
+        if (writer) {
+            encode_flowtuple_as_avro(&(nextft.ftdata), writer, m->logger);
+            if (corsaro_append_avro_writer(writer, NULL) < 0) {
+                /* shall we do something? */
+            }
+        }
+        if (m->producer) {
+            kafka_publish_flowtuple(m, &nextft);
+        }
+    }
+
+    /* Hand the table back to the processing thread for reuse */
+    corsaro_ft_release_table(input->table);
+    input->table = NULL;
 }
 
 static void write_sorted_interim_flowtuples(corsaro_flowtuple_merger_t *m,
         corsaro_avro_writer_t *writer, corsaro_flowtuple_iterator_t *input) {
 
-    PWord_t pval;
-    Word_t ret;
-    struct corsaro_flowtuple *nextft;
-    uint64_t count = 0;
+    struct corsaro_flowtuple nextft;
+    uint32_t i;
 
-    input->sortindex_top = 0;
+    if (input->parent->spill) {
+        write_spilled_interim_flowtuples(m, writer, input, 1);
+        return;
+    }
 
-    JLF(pval, input->sorted_keys, input->sortindex_top);
+    if (input->table == NULL) {
+        return;
+    }
 
-    while (pval) {
-        input->current_subkeys = (Pvoid_t) (*pval);
-        input->sortindex_bot = 0;
+    /* If the sort pool could not sort the table, have one more go now
+     * that some memory may have been freed */
+    if (input->table->sorted == NULL && input->table->count > 0 &&
+            corsaro_ft_table_sort(input->table) < 0) {
+        drop_unsortable_flowtuples(m, input, input->table->count);
+        return;
+    }
 
-        JLF(pval, input->current_subkeys, input->sortindex_bot);
-        while (pval) {
-            nextft = (struct corsaro_flowtuple *)(*pval);
+    for (i = 0; i < input->table->count; i++) {
+        corsaro_ft_table_expand(input->table, input->table->sorted[i].index,
+                &nextft);
 
-            if (writer) {
-                encode_flowtuple_as_avro(&(nextft->ftdata), writer, m->logger);
-                if (corsaro_append_avro_writer(writer, NULL) < 0) {
-                    /* what shall we do? */
-                }
+        if (writer) {
+            encode_flowtuple_as_avro(&(nextft.ftdata), writer, m->logger);
+            if (corsaro_append_avro_writer(writer, NULL) < 0) {
+                /* what shall we do? */
             }
+        }
 
-            if (m->rdk) {
-                kafka_publish_flowtuple(m, nextft);
-            }
+        if (m->producer) {
+            kafka_publish_flowtuple(m, &nextft);
+        }
+    }
 
-            free(nextft);
-            count ++;
+    /* Hand the table back to the processing thread for reuse */
+    corsaro_ft_release_table(input->table);
+    input->table = NULL;
+}
+
+/** Writes the flowtuples for an interval where the processing thread
+ *  spilled part of its table to disk, by merging the spill runs with
+ *  whatever was left in the table at the end of the interval.
+ *
+ *  If the merge cannot be started, the table is written on its own --
+ *  unless 'mustsort' is set and the table cannot be sorted, in which case
+ *  nothing is written.
+ */
+static void write_spilled_interim_flowtuples(corsaro_flowtuple_merger_t *m,
+        corsaro_avro_writer_t *writer, corsaro_flowtuple_iterator_t *input,
+        uint8_t mustsort) {
 
-            JLN(pval, input->current_subkeys, input->sortindex_bot);
+    corsaro_ft_spill_t *spill = input->parent->spill;
+    corsaro_ft_spill_merger_t *merger;
+    struct corsaro_flowtuple *nextft;
+    uint64_t merged;
+
+    input->parent->spill = NULL;
+
+    merger = corsaro_ft_start_spill_merge(spill, input->table);
+    if (merger == NULL) {
+        corsaro_log(m->logger,
+                "unable to merge %u flowtuple spill runs from thread %d for interval %u, %lu spilled flows will be missing",
+                spill->runcount, spill->threadid, spill->interval_ts,
+                spill->records);
+        corsaro_ft_destroy_spill(spill);
+        if (mustsort) {
+            write_sorted_interim_flowtuples(m, writer, input);
+        } else {
+            write_unsorted_interim_flowtuples(m, writer, input);
         }
-        JLFA(ret, input->current_subkeys);
-        JLN(pval, input->sorted_keys, input->sortindex_top);
+        return;
+    }
+
+    while ((nextft = corsaro_ft_spill_merge_next(merger)) != NULL) {
+        if (writer) {
+            encode_flowtuple_as_avro(&(nextft->ftdata), writer, m->logger);
+            if (corsaro_append_avro_writer(writer, NULL) < 0) {
+                /* what shall we do? */
+            }
+        }
+
+        if (m->producer) {
+            kafka_publish_flowtuple(m, nextft);
+        }
+    }
+
+    merged = corsaro_ft_finish_spill_merge(merger);
+    corsaro_log(m->logger,
+            "merging thread %d: merged %u spill runs (%lu flows) and %u in-memory flows from thread %d into %lu flows",
+            m->thread_num, spill->runcount, spill->records,
+            input->table ? input->table->count : 0, spill->threadid, merged);
+
+    corsaro_ft_destroy_spill(spill);
+    if (input->table) {
+        corsaro_ft_release_table(input->table);
+        input->table = NULL;
     }
 }
 
-static void write_unsorted_interim_flowtuples(corsaro_flowtuple_merger_t *m,
-        corsaro_avro_writer_t *writer, corsaro_flowtuple_iterator_t *input) {
+/** Writes the flowtuples from every processing thread for an interval as
+ *  a single sorted stream, using a k-way merge over each thread's sorted
+ *  table (or the merge of its spill runs and table, if it spilled).
+ *
+ *  If the merge cannot be set up, or any thread's flowtuples cannot be
+ *  sorted, nothing is written for the interval -- readers rely on the
+ *  output being in sorted order.
+ */
+static void write_kway_interim_flowtuples(corsaro_flowtuple_merger_t *m,
+        corsaro_avro_writer_t *writer, corsaro_flowtuple_kway_job_t *job,
+        uint32_t interval_ts) {
 
+    corsaro_ft_kway_t *kway;
+    corsaro_ft_spill_merger_t **spillmerges;
     struct corsaro_flowtuple *nextft;
-    PWord_t pval;
-    Word_t index = 0;
+    uint64_t dropped = 0;
+    int i, failed = 0;
 
-    uint64_t count = 0;
+    kway = corsaro_ft_create_kway(m->logger, job->inputcount);
+    spillmerges = calloc(job->inputcount, sizeof(corsaro_ft_spill_merger_t *));
 
-    JLF(pval, input->hmap, index);
-    while (pval) {
-        nextft = (struct corsaro_flowtuple *)(*pval);
+    if (kway == NULL || spillmerges == NULL) {
+        corsaro_log(m->logger,
+                "unable to allocate memory to merge the flowtuples for interval %u",
+                interval_ts);
+        failed = 1;
+        goto kwayfinish;
+    }
+
+    for (i = 0; i < job->inputcount; i++) {
+        corsaro_flowtuple_iterator_t *input = job->inputs[i];
+        corsaro_ft_spill_t *spill = input->parent->spill;
+
+        if (spill) {
+            spillmerges[i] = corsaro_ft_start_spill_merge(spill, input->table);
+            if (spillmerges[i]) {
+                corsaro_ft_kway_add_spill(kway, spillmerges[i]);
+                continue;
+            }
+            corsaro_log(m->logger,
+                    "unable to merge %u flowtuple spill runs from thread %d for interval %u, %lu spilled flows will be missing",
+                    spill->runcount, spill->threadid, spill->interval_ts,
+                    spill->records);
+            corsaro_ft_destroy_spill(spill);
+            input->parent->spill = NULL;
+        }
+
+        if (input->table == NULL) {
+            continue;
+        }
+        if (input->table->sorted == NULL && input->table->count > 0 &&
+                corsaro_ft_table_sort(input->table) < 0) {
+            corsaro_log(m->logger,
+                    "unable to allocate memory to sort %u flowtuples from input %d for interval %u",
+                    input->table->count, i, interval_ts);
+            failed = 1;
+            goto kwayfinish;
+        }
+        corsaro_ft_kway_add_table(kway, input->table);
+    }
 
+    while ((nextft = corsaro_ft_kway_next(kway)) != NULL) {
         if (writer) {
             encode_flowtuple_as_avro(&(nextft->ftdata), writer, m->logger);
             if (corsaro_append_avro_writer(writer, NULL) < 0) {
-                /* shall we do something? */
+                /* what shall we do? */
             }
         }
-        if (m->rdk) {
+
+        if (m->producer) {
             kafka_publish_flowtuple(m, nextft);
         }
-        free(nextft);
-        count ++;
+    }
+
+    corsaro_log(m->logger,
+            "merging thread %d: merged %lu flows from %d processing threads into %lu flows for interval %u",
+            m->thread_num, corsaro_ft_kway_input_count(kway),
+            job->inputcount, corsaro_ft_kway_output_count(kway),
+            interval_ts);
 
-        JLN(pval, input->hmap, index);
+kwayfinish:
+    for (i = 0; i < job->inputcount; i++) {
+        corsaro_flowtuple_iterator_t *input = job->inputs[i];
+
+        if (failed) {
+            if (input->parent->spill) {
+                dropped += input->parent->spill->records;
+            }
+            if (input->table) {
+                dropped += input->table->count;
+            }
+        }
+
+        if (spillmerges && spillmerges[i]) {
+            corsaro_ft_finish_spill_merge(spillmerges[i]);
+        }
+        if (input->parent->spill) {
+            corsaro_ft_destroy_spill(input->parent->spill);
+            input->parent->spill = NULL;
+        }
+        if (input->table) {
+            corsaro_ft_release_table(input->table);
+            input->table = NULL;
+        }
+    }
+
+    if (failed) {
+        corsaro_log(m->logger,
+                "merging thread %d: not writing interval %u, as its %lu flowtuples could not be merged in sorted order",
+                m->thread_num, interval_ts, dropped);
     }
+
+    corsaro_ft_destroy_kway(kway);
+    free(spillmerges);
 }
 
 /** Assigns a given flowtuple record to a kafka partition
@@ -956,8 +1740,7 @@ static void write_unsorted_interim_flowtuples(corsaro_flowtuple_merger_t *m,
  *  @param partition_cnt    The number of partitions supported by the kafka
  *                          cluster
  *  @param opaque   Unused
- *  @param msg_opaque   Contains the total number of interim writer worker
- *                      threads for this flowtuple plugin instance.
+ *  @param msg_opaque   Unused
  *
  *  @return the index of the partition that should receive this flowtuple record
  *
@@ -979,16 +1762,36 @@ static int32_t assign_kafka_partition(const rd_kafka_topic_t *rkt,
     return pkey->hash_val % partition_cnt;
 }
 
+/** Counts the delivery reports for the messages that have been produced.
+ *
+ *  Function prototype cannot be changed as this is a specific callback
+ *  method defined in librdkafka. Delivery reports are only served by
+ *  rd_kafka_poll() and rd_kafka_flush(), which are only called by the
+ *  producer thread.
+ */
+static void kafka_delivery_report(rd_kafka_t *rk,
+        const rd_kafka_message_t *rkmessage, void *opaque) {
+
+    corsaro_ft_kafka_producer_t *prod = (corsaro_ft_kafka_producer_t *)opaque;
+
+    if (rkmessage->err) {
+        prod->deliveryfailures ++;
+        prod->lasterr = rkmessage->err;
+    } else {
+        prod->delivered ++;
+    }
+}
+
 /** Creates and configures a kafka producer instance for publishing
  *  flowtuple records.
  *
- *  @param m        The flowtuple "merger" thread that this producer is
- *                  being created for.
+ *  @param m        The kafka producer that this instance is being
+ *                  created for.
  *
  *  @return 1 if the producer is created successfully, -1 if an error
  *          occurs.
  */
-static int init_kafka_producer(corsaro_flowtuple_merger_t *m) {
+static int init_kafka_producer(corsaro_ft_kafka_producer_t *m) {
 
     rd_kafka_conf_t *conf;
     rd_kafka_topic_conf_t *tconf;
@@ -1008,37 +1811,40 @@ static int init_kafka_producer(corsaro_flowtuple_merger_t *m) {
         goto initkafkafail;
     }
 
-    snprintf(intstr, 100, "%d", m->kafkaopts->batchsize);
+    snprintf(intstr, 100, "%d", m->opts->batchsize);
     res = rd_kafka_conf_set(conf, "batch.num.messages", intstr,
             errstr, sizeof(errstr));
     if (res != RD_KAFKA_CONF_OK) {
         goto initkafkafail;
     }
 
-    snprintf(intstr, 100, "%d", m->kafkaopts->lingerms);
+    snprintf(intstr, 100, "%d", m->opts->lingerms);
     res = rd_kafka_conf_set(conf, "linger.ms", intstr,
             errstr, sizeof(errstr));
     if (res != RD_KAFKA_CONF_OK) {
         goto initkafkafail;
     }
 
+    rd_kafka_conf_set_dr_msg_cb(conf, kafka_delivery_report);
+    rd_kafka_conf_set_opaque(conf, m);
+
     m->rdk = rd_kafka_new(RD_KAFKA_PRODUCER, conf, errstr, sizeof(errstr));
     if (!m->rdk) {
         goto initkafkafail;
     }
 
     /* Add the broker so kafka can connect to it */
-    if (rd_kafka_brokers_add(m->rdk, m->kafkaopts->brokeruri) == 0) {
+    if (rd_kafka_brokers_add(m->rdk, m->opts->brokeruri) == 0) {
         corsaro_log(m->logger, "Kafka error connecting to broker: %s",
-                m->kafkaopts->brokeruri);
+                m->opts->brokeruri);
         errstr[0] = '\0';
         goto initkafkafail;
     }
 
     /* Configure and create the flowtuple topic */
-    if (m->kafkaopts->topicprefix != NULL) {
+    if (m->opts->topicprefix != NULL) {
         snprintf(topicname, 1024, "%s.corsaroflowtuple",
-                m->kafkaopts->topicprefix);
+                m->opts->topicprefix);
     } else {
         snprintf(topicname, 1024, "corsaroflowtuple");
     }
@@ -1063,6 +1869,7 @@ initkafkafail:
 
     if (m->rdk) {
         rd_kafka_destroy(m->rdk);
+        m->rdk = NULL;
     } else {
         rd_kafka_conf_destroy(conf);
     }
@@ -1071,24 +1878,271 @@ initkafkafail:
     return -1;
 }
 
+static void report_kafka_stats(corsaro_ft_kafka_producer_t *prod,
+        uint32_t now) {
+
+    corsaro_log(prod->logger,
+            "flowtuple kafka producer: %lu messages (%lu bytes) produced, %lu delivered, %lu delivery failures, %lu messages rejected by librdkafka, merging threads waited for the producer %lu times",
+            prod->produced, prod->producedbytes, prod->delivered,
+            prod->deliveryfailures, prod->producefailures, prod->stalls);
+    if (prod->deliveryfailures > 0) {
+        corsaro_log(prod->logger,
+                "flowtuple kafka producer: most recent delivery error was: %s",
+                rd_kafka_err2str(prod->lasterr));
+    }
+    prod->lastreport = now;
+}
+
+static inline uint64_t kafka_now_ms(void) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return ((uint64_t)now.tv_sec) * 1000 + (now.tv_usec / 1000);
+}
+
+/** Checks whether a halted producer has run out of time to produce the
+ *  messages that it still has.
+ */
+static int kafka_flush_expired(corsaro_ft_kafka_producer_t *prod) {
+    int expired;
+
+    pthread_mutex_lock(&(prod->mutex));
+    expired = (prod->halted && kafka_now_ms() >= prod->flushdeadline);
+    pthread_mutex_unlock(&(prod->mutex));
+    return expired;
+}
+
+/** Hands a set of queued messages to librdkafka. Messages that are
+ *  rejected because librdkafka's own queue is full are retried once it
+ *  has had a chance to send some -- if the producer is halting, only
+ *  until the flush timeout expires. Any other failure is counted and the
+ *  message is dropped.
+ */
+static void produce_kafka_batch(corsaro_ft_kafka_producer_t *prod,
+        corsaro_ft_kafka_msg_t *msgs, int count) {
+
+    rd_kafka_message_t batch[CORSARO_FT_KAFKA_MAX_BATCH];
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    int i, retry, failed = 0;
+
+    memset(batch, 0, sizeof(batch));
+    for (i = 0; i < count; i++) {
+        batch[i].payload = msgs[i].buf;
+        batch[i].len = msgs[i].len;
+        batch[i].key = &(msgs[i].partkey);
+        batch[i].key_len = sizeof(corsaro_ft_kafka_partkey_t);
+    }
+
+    while (count > 0) {
+        /* With RD_KAFKA_MSG_F_FREE, librdkafka frees the payload of
+         * every message that it accepts.
+         */
+        rd_kafka_produce_batch(prod->rdktopic, RD_KAFKA_PARTITION_UA,
+                RD_KAFKA_MSG_F_FREE, batch, count);
+
+        retry = 0;
+        for (i = 0; i < count; i++) {
+            if (batch[i].err == RD_KAFKA_RESP_ERR_NO_ERROR) {
+                prod->produced ++;
+                prod->producedbytes += batch[i].len;
+                continue;
+            }
+
+            if (batch[i].err == RD_KAFKA_RESP_ERR__QUEUE_FULL &&
+                    !kafka_flush_expired(prod)) {
+                batch[retry] = batch[i];
+                batch[retry].err = RD_KAFKA_RESP_ERR_NO_ERROR;
+                retry ++;
+                continue;
+            }
+
+            err = batch[i].err;
+            failed ++;
+            free(batch[i].payload);
+        }
+
+        count = retry;
+        if (count > 0) {
+            rd_kafka_poll(prod->rdk, 50);
+        }
+    }
+
+    if (failed > 0) {
+        prod->producefailures += failed;
+        corsaro_log(prod->logger,
+                "Error while publishing %d flowtuple messages to kafka topic %s: %s",
+                failed, rd_kafka_topic_name(prod->rdktopic),
+                rd_kafka_err2str(err));
+    }
+}
+
+static void *start_kafka_producer(void *tdata) {
+
+    corsaro_ft_kafka_producer_t *prod = (corsaro_ft_kafka_producer_t *)tdata;
+    corsaro_ft_kafka_msg_t msgs[CORSARO_FT_KAFKA_MAX_BATCH];
+    struct timeval now;
+    struct timespec ts;
+    int count, flushms;
+    uint64_t nowms;
+
+    while (1) {
+        pthread_mutex_lock(&(prod->mutex));
+        if (prod->queuecount == 0 && !prod->halted) {
+            /* Wake up regularly so that delivery reports are served
+             * even when there is nothing new to send.
+             */
+            gettimeofday(&now, NULL);
+            now.tv_usec += 100000;
+            if (now.tv_usec >= 1000000) {
+                now.tv_sec ++;
+                now.tv_usec -= 1000000;
+            }
+            ts.tv_sec = now.tv_sec;
+            ts.tv_nsec = now.tv_usec * 1000;
+            pthread_cond_timedwait(&(prod->notempty), &(prod->mutex), &ts);
+        }
+
+        /* Only stop once everything that was queued has been produced */
+        if (prod->queuecount == 0 && prod->halted) {
+            pthread_mutex_unlock(&(prod->mutex));
+            break;
+        }
+
+        count = 0;
+        while (prod->queuecount > 0 && count < CORSARO_FT_KAFKA_MAX_BATCH) {
+            msgs[count] = prod->queue[prod->queuehead];
+            prod->queuehead = (prod->queuehead + 1) %
+                    CORSARO_FT_KAFKA_QUEUE_SIZE;
+            prod->queuecount --;
+            count ++;
+        }
+        if (count > 0) {
+            pthread_cond_broadcast(&(prod->notfull));
+        }
+        pthread_mutex_unlock(&(prod->mutex));
+
+        if (count > 0) {
+            produce_kafka_batch(prod, msgs, count);
+        }
+
+        /* Serve any delivery reports (or errors) that are waiting */
+        rd_kafka_poll(prod->rdk, 0);
+
+        gettimeofday(&now, NULL);
+        if (now.tv_sec - prod->lastreport >= CORSARO_FT_KAFKA_REPORT_FREQ) {
+            report_kafka_stats(prod, now.tv_sec);
+        }
+    }
+
+    /* Make sure we wind kafka down nicely, with whatever is left of the
+     * flush timeout */
+    nowms = kafka_now_ms();
+    flushms = 0;
+    if (nowms < prod->flushdeadline) {
+        flushms = prod->flushdeadline - nowms;
+    }
+    if (rd_kafka_flush(prod->rdk, flushms) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+        corsaro_log(prod->logger,
+                "flowtuple kafka producer: %d messages were still undelivered after %d ms",
+                rd_kafka_outq_len(prod->rdk), flushms);
+    }
+    gettimeofday(&now, NULL);
+    report_kafka_stats(prod, now.tv_sec);
+    pthread_exit(NULL);
+}
+
+/** Creates the kafka producer thread that publishes flowtuple records on
+ *  behalf of all of the merging threads.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param opts         The kafka configuration options for this plugin
+ *  @return a pointer to the new producer, or NULL if an error occurs.
+ */
+static corsaro_ft_kafka_producer_t *create_kafka_producer(
+        corsaro_logger_t *logger, corsaro_ft_kafka_options_t *opts) {
+
+    corsaro_ft_kafka_producer_t *prod;
+    struct timeval now;
+
+    prod = (corsaro_ft_kafka_producer_t *)calloc(1,
+            sizeof(corsaro_ft_kafka_producer_t));
+    if (prod == NULL) {
+        corsaro_log(logger, "unable to allocate memory for kafka producer");
+        return NULL;
+    }
+
+    prod->logger = logger;
+    prod->opts = opts;
+    gettimeofday(&now, NULL);
+    prod->lastreport = now.tv_sec;
+
+    if (init_kafka_producer(prod) < 0) {
+        free(prod);
+        return NULL;
+    }
+
+    pthread_mutex_init(&(prod->mutex), NULL);
+    pthread_cond_init(&(prod->notempty), NULL);
+    pthread_cond_init(&(prod->notfull), NULL);
+
+    if (pthread_create(&(prod->tid), NULL, start_kafka_producer,
+                prod) != 0) {
+        corsaro_log(logger, "unable to start kafka producer thread");
+        pthread_mutex_destroy(&(prod->mutex));
+        pthread_cond_destroy(&(prod->notempty));
+        pthread_cond_destroy(&(prod->notfull));
+        rd_kafka_topic_destroy(prod->rdktopic);
+        rd_kafka_destroy(prod->rdk);
+        free(prod);
+        return NULL;
+    }
+    return prod;
+}
+
+/** Stops a kafka producer thread, once it has produced every message that
+ *  was queued, and frees the producer.
+ *
+ *  @param prod         The producer to destroy
+ */
+static void destroy_kafka_producer(corsaro_ft_kafka_producer_t *prod) {
+
+    pthread_mutex_lock(&(prod->mutex));
+    prod->flushdeadline = kafka_now_ms() + CORSARO_FT_KAFKA_FLUSH_TIMEOUT;
+    prod->halted = 1;
+    pthread_cond_broadcast(&(prod->notempty));
+    pthread_cond_broadcast(&(prod->notfull));
+    pthread_mutex_unlock(&(prod->mutex));
+
+    pthread_join(prod->tid, NULL);
+
+    rd_kafka_topic_destroy(prod->rdktopic);
+    rd_kafka_destroy(prod->rdk);
+    pthread_mutex_destroy(&(prod->mutex));
+    pthread_cond_destroy(&(prod->notempty));
+    pthread_cond_destroy(&(prod->notfull));
+    free(prod);
+}
+
+static inline uint8_t flowtuple_avro_codec(uint8_t avrooutput) {
+    if (avrooutput == CORSARO_AVRO_OUTPUT_SNAPPY) {
+        return CORSARO_AVRO_CODEC_SNAPPY;
+    }
+    if (avrooutput == CORSARO_AVRO_OUTPUT_ZSTD) {
+        return CORSARO_AVRO_CODEC_ZSTD;
+    }
+    return CORSARO_AVRO_CODEC_DEFLATE;
+}
+
 static void *start_ftmerge_worker(void *tdata) {
     corsaro_flowtuple_merger_t *m = (corsaro_flowtuple_merger_t *)tdata;
     corsaro_ft_write_msg_t msg;
     corsaro_flowtuple_iterator_t *input;
     corsaro_avro_writer_t *w = NULL;
+    corsaro_avro_writer_stats_t wstats;
+    struct timeval start, end;
     PWord_t pval;
     Word_t rc, index;
 
-    /* Create a kafka producer for this thread if we are doing kafka output */
-    /*  XXX would we be better off having a single producer shared by all
-    *       threads? docs imply that would be ok, but is contention an issue?
-    */
-    if (m->kafkaopts->brokeruri) {
-        if (init_kafka_producer(m) < 0) {
-            corsaro_log(m->logger, "error creating kafka producer for flowtuple interim writer thread %d", m->thread_num);
-        }
-    }
-
     while (1) {
         if (zmq_recv(m->inqueue, &(msg), sizeof(msg), ZMQ_DONTWAIT) < 0) {
 
@@ -1130,6 +2184,12 @@ static void *start_ftmerge_worker(void *tdata) {
             if (!pval) {
                 w = corsaro_create_avro_writer(m->logger,
                         FLOWTUPLE_RESULT_SCHEMA);
+                if (w == NULL) {
+                    continue;
+                }
+                corsaro_set_avro_writer_filewriter(w,
+                        m->baseconf->filewriter);
+                corsaro_enable_avro_writer_index(w, m->writeindex);
                 JLI(pval, m->writers, msg.input_source);
                 *pval = (Word_t)w;
             } else {
@@ -1138,15 +2198,19 @@ static void *start_ftmerge_worker(void *tdata) {
 
 
             if (!corsaro_is_avro_writer_active(w)) {
+                /* A merged output file has no thread ID in its name, just
+                 * like the output of corsaroftmerge.
+                 */
                 char *outname = _flowtuple_derive_output_name(
                         m->logger, m->baseconf, msg.rotate_ts,
-                        m->thread_num);
+                        msg.type == CORSARO_FT_MSG_MERGE_KWAY ? -1 :
+                                m->thread_num);
                 if (outname == NULL) {
                     continue;
                 }
-                if (corsaro_start_avro_writer(w, outname,
-                            (m->avrooutput == CORSARO_AVRO_OUTPUT_SNAPPY)
-                            ) == -1) {
+                if (corsaro_start_avro_block_writer(w, outname,
+                            flowtuple_avro_codec(m->avrooutput),
+                            m->compresslevel, m->compresspool) == -1) {
                     free(outname);
                     continue;
                 }
@@ -1154,32 +2218,61 @@ static void *start_ftmerge_worker(void *tdata) {
             }
         }
 
-        input = (corsaro_flowtuple_iterator_t *)msg.content;
+        gettimeofday(&start, NULL);
+        if (msg.type == CORSARO_FT_MSG_MERGE_KWAY) {
+            corsaro_flowtuple_kway_job_t *job;
+            int i;
+
+            job = (corsaro_flowtuple_kway_job_t *)msg.content;
+            write_kway_interim_flowtuples(m, w, job, msg.interval_ts);
+            for (i = 0; i < job->inputcount; i++) {
+                input = job->inputs[i];
+                pthread_mutex_destroy(&(input->parent->mutex));
+                free(input->parent);
+                free(input);
+            }
+            free(job->inputs);
+            free(job);
+        } else {
+            input = (corsaro_flowtuple_iterator_t *)msg.content;
+            if (msg.type == CORSARO_FT_MSG_MERGE_UNSORTED) {
+                write_unsorted_interim_flowtuples(m, w, input);
+            } else if (msg.type == CORSARO_FT_MSG_MERGE_SORTED) {
+                write_sorted_interim_flowtuples(m, w, input);
+            }
+            pthread_mutex_destroy(&(input->parent->mutex));
+            free(input->parent);
+            free(input);
+        }
 
-        if (msg.type == CORSARO_FT_MSG_MERGE_UNSORTED) {
-            write_unsorted_interim_flowtuples(m, w, input);
-        } else if (msg.type == CORSARO_FT_MSG_MERGE_SORTED) {
-            write_sorted_interim_flowtuples(m, w, input);
+        /* Don't leave the end of this interval waiting for the next one */
+        if (m->producer) {
+            kafka_send_message(m);
         }
 
-        JLFA(rc, input->hmap);
-        JLFA(rc, input->sorted_keys);
-        pthread_mutex_destroy(&(input->parent->mutex));
-        free(input->parent);
-        free(input);
+        if (m->avrooutput == CORSARO_AVRO_OUTPUT_NONE || w == NULL) {
+            corsaro_log(m->logger,
+                    "merging thread %d has completed the merge job for %u",
+                    m->thread_num, msg.interval_ts);
+            continue;
+        }
 
-        corsaro_log(m->logger,
-                "merging thread %d has completed the merge job for %u",
-                m->thread_num, msg.interval_ts);
-    }
+        /* Wait for this interval's blocks to be written so that the
+         * statistics (and the time taken) cover the whole interval.
+         */
+        corsaro_drain_avro_writer(w);
+        gettimeofday(&end, NULL);
+        corsaro_get_avro_writer_stats(w, &wstats, 1);
 
-    /* If we were publishing to kafka, make sure we wind that down nicely */
-    if (m->rdk) {
-        rd_kafka_flush(m->rdk, 30 * 1000);
-        if (m->rdktopic) {
-            rd_kafka_topic_destroy(m->rdktopic);
-        }
-        rd_kafka_destroy(m->rdk);
+        corsaro_log(m->logger,
+                "merging thread %d has completed the merge job for %u: wrote %lu bytes in %lu blocks (%lu bytes before compression, ratio %.2f) in %.3f ms, %.3f ms spent compressing, %.3f ms waiting for compression",
+                m->thread_num, msg.interval_ts, wstats.writtenbytes,
+                wstats.blocks, wstats.rawbytes,
+                wstats.writtenbytes == 0 ? 0.0 :
+                        ((double)wstats.rawbytes) / wstats.writtenbytes,
+                ((end.tv_sec - start.tv_sec) * 1000.0) +
+                        ((end.tv_usec - start.tv_usec) / 1000.0),
+                wstats.compressusec / 1000.0, wstats.stallusec / 1000.0);
     }
 
     if (m->buf) {
@@ -1241,6 +2334,15 @@ void *corsaro_flowtuple_init_merging(corsaro_plugin_t *p, int sources) {
         goto initfail;
     }
 
+    /* A single producer is shared by all of the merging threads */
+    if (conf->kafkaopts.brokeruri) {
+        m->producer = create_kafka_producer(p->logger, &(conf->kafkaopts));
+        if (m->producer == NULL) {
+            corsaro_log(p->logger,
+                    "error creating kafka producer for flowtuple merging threads");
+        }
+    }
+
     for (i = 0; i < m->maxworkers; i++) {
         m->writerthreads[i].logger = p->logger;
         m->writerthreads[i].baseconf = &(conf->basic);
@@ -1249,11 +2351,17 @@ void *corsaro_flowtuple_init_merging(corsaro_plugin_t *p, int sources) {
         m->writerthreads[i].thread_num = i;
         m->writerthreads[i].inqueue = zmq_socket(conf->zmq_ctxt, ZMQ_SUB);
         m->writerthreads[i].avrooutput = conf->avrooutput;
+        m->writerthreads[i].compresslevel = conf->compresslevel;
+        m->writerthreads[i].compresspool = conf->compresspool;
+        m->writerthreads[i].writeindex = conf->writeindex;
         m->writerthreads[i].maxmergeworkers = conf->maxmergeworkers;
-        m->writerthreads[i].rdk = NULL;
-        m->writerthreads[i].rdktopic = NULL;
+        m->writerthreads[i].producer = m->producer;
         m->writerthreads[i].kafkaopts = &(conf->kafkaopts);
-        m->writerthreads[i].buf = calloc(1024 * 1024 * 2, sizeof(uint8_t));
+        m->writerthreads[i].buf = NULL;
+        if (m->producer) {
+            m->writerthreads[i].buf = malloc(CORSARO_FT_KAFKA_MSG_SIZE +
+                    sizeof(corsaro_flowtuple_kafka_record_t));
+        }
         m->writerthreads[i].writeptr = m->writerthreads[i].buf;
         m->writerthreads[i].partkey.ts = 0;
         m->writerthreads[i].partkey.hash_val = 0;
@@ -1315,6 +2423,13 @@ int corsaro_flowtuple_halt_merging(corsaro_plugin_t *p, void *local) {
         zmq_close(m->pubqueue);
     }
 
+    /* Only stop the producer once the merging threads have queued their
+     * last messages.
+     */
+    if (m->producer) {
+        destroy_kafka_producer(m->producer);
+    }
+
     free(m->writerthreads);
     free(m);
     return 0;
@@ -1325,7 +2440,8 @@ int corsaro_flowtuple_merge_interval_results(corsaro_plugin_t *p, void *local,
     struct corsaro_flowtuple_merge_state_t *m;
     corsaro_flowtuple_config_t *conf;
     corsaro_ft_write_msg_t msg;
-    int i, inputsready;
+    corsaro_flowtuple_kway_job_t *job = NULL;
+    int i, inputsready, failed = 0;
     uint8_t *donethreads;
 
     conf = (corsaro_flowtuple_config_t *)(p->config);
@@ -1335,6 +2451,29 @@ int corsaro_flowtuple_merge_interval_results(corsaro_plugin_t *p, void *local,
     }
 
     donethreads = calloc(fin->threads_ended, sizeof(uint8_t));
+    if (donethreads == NULL) {
+        corsaro_log(p->logger,
+                "unable to allocate memory to merge flowtuple results for interval %u",
+                fin->timestamp);
+        goto mergefail;
+    }
+
+    /* When merging the output, every thread's results for this interval
+     * are collected into a single job for one merging thread.
+     */
+    if (conf->mergeoutput) {
+        job = calloc(1, sizeof(corsaro_flowtuple_kway_job_t));
+        if (job == NULL || (job->inputs = calloc(fin->threads_ended,
+                sizeof(corsaro_flowtuple_iterator_t *))) == NULL) {
+            corsaro_log(p->logger,
+                    "unable to allocate memory for a k-way flowtuple merge of interval %u",
+                    fin->timestamp);
+            free(job);
+            free(donethreads);
+            goto mergefail;
+        }
+        job->inputcount = 0;
+    }
 
     inputsready = 0;
     while (inputsready < fin->threads_ended) {
@@ -1355,12 +2494,23 @@ int corsaro_flowtuple_merge_interval_results(corsaro_plugin_t *p, void *local,
                 }
                 if (interim->usable < 0) {
                     corsaro_log(p->logger,
-                            "flowtuple sort failed for input %d\n", i);
+                            "flowtuple sort failed for input %d in interval %u, the merging thread will try again",
+                            i, fin->timestamp);
                 }
                 inputsready ++;
                 input = calloc(1, sizeof(corsaro_flowtuple_iterator_t));
+                if (input == NULL) {
+                    pthread_mutex_unlock(&(interim->mutex));
+                    corsaro_log(p->logger,
+                            "unable to allocate memory to merge flowtuple results from thread %d for interval %u",
+                            i, fin->timestamp);
+                    corsaro_flowtuple_release_interval_result(p, interim);
+                    donethreads[i] = 1;
+                    failed = 1;
+                    continue;
+                }
 
-                input->hmap = interim->hmap;
+                input->table = interim->table;
                 input->hsize = interim->hsize;
                 input->nextft = NULL;
 
@@ -1369,25 +2519,15 @@ int corsaro_flowtuple_merge_interval_results(corsaro_plugin_t *p, void *local,
                 } else {
                     input->state = CORSARO_RESULT_TYPE_EOF;
                 }
-                if (conf->sort_enabled == CORSARO_FLOWTUPLE_SORT_ENABLED) {
-                    input->sorted_keys = interim->sorted_keys;
-                    input->current_subkeys = NULL;
-                    input->sortindex_top = 0;
-                    input->sortindex_bot = 0;
-                    input->sortiter = 0;
-                } else {
-                    input->sorted_keys = NULL;
-                    input->current_subkeys = NULL;
-                    input->sortindex_top = 0;
-                    input->sortindex_bot = 0;
-                    input->sortiter = -1;
-                }
                 input->parent = interim;
-                pthread_join(interim->tid, NULL);
                 pthread_mutex_unlock(&(interim->mutex));
             }
 
-            if (input) {
+            if (input && job) {
+                job->inputs[job->inputcount] = input;
+                job->inputcount ++;
+                donethreads[i] = 1;
+            } else if (input) {
                 msg.dest = m->nextworker;
 
                 if (m->last_rotate == 0) {
@@ -1417,8 +2557,46 @@ int corsaro_flowtuple_merge_interval_results(corsaro_plugin_t *p, void *local,
         }
     }
 
+    if (job && failed) {
+        /* Don't write an interval that is missing some of its flowtuples */
+        for (i = 0; i < job->inputcount; i++) {
+            corsaro_flowtuple_release_interval_result(p,
+                    job->inputs[i]->parent);
+            free(job->inputs[i]);
+        }
+        free(job->inputs);
+        free(job);
+        job = NULL;
+    }
 
+    if (job) {
+        /* Always use the same merging thread, as every interval in a
+         * rotation period goes into the same file.
+         */
+        if (m->last_rotate == 0) {
+            m->last_rotate = fin->timestamp;
+        }
+        msg.dest = 0;
+        msg.type = CORSARO_FT_MSG_MERGE_KWAY;
+        msg.content = job;
+        msg.rotate_ts = m->last_rotate;
+        msg.interval_ts = fin->timestamp;
+        msg.input_source = 0;
+        zmq_send(m->pubqueue, &(msg), sizeof(msg), 0);
+    }
+
+    free(donethreads);
+
+    if (failed) {
+        return -1;
+    }
     return 0;
+
+mergefail:
+    for (i = 0; i < fin->threads_ended; i++) {
+        corsaro_flowtuple_release_interval_result(p, tomerge[i]);
+    }
+    return -1;
 }
 
 int corsaro_flowtuple_rotate_output(corsaro_plugin_t *p, void *local) {
@@ -1448,6 +2626,38 @@ int corsaro_flowtuple_rotate_output(corsaro_plugin_t *p, void *local) {
     return 0;
 }
 
+void corsaro_flowtuple_release_interval_result(corsaro_plugin_t *p,
+        void *result) {
+
+    corsaro_flowtuple_interim_t *interim;
+    int usable;
+
+    interim = (corsaro_flowtuple_interim_t *)result;
+    if (interim == NULL) {
+        return;
+    }
+
+    /* The sort pool may still be working on this table */
+    while (1) {
+        pthread_mutex_lock(&(interim->mutex));
+        usable = interim->usable;
+        pthread_mutex_unlock(&(interim->mutex));
+        if (usable != 0) {
+            break;
+        }
+        usleep(100);
+    }
+
+    if (interim->spill) {
+        corsaro_ft_destroy_spill(interim->spill);
+    }
+    if (interim->table) {
+        corsaro_ft_release_table(interim->table);
+    }
+    pthread_mutex_destroy(&(interim->mutex));
+    free(interim);
+}
+
 /*
  * Hashes the flowtuple based on the following table
  *
@@ -0,0 +1,359 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+#include "corsaro_flowtuple_spill.h"
+#include "corsaro_flowtuple_kway.h"
+
+/** A single input to a k-way merge */
+typedef struct corsaro_ft_kway_input {
+    /** The input, if it is a sorted table */
+    corsaro_ft_table_t *table;
+    /** Position in table->sorted of the next flowtuple */
+    uint32_t tableind;
+    /** The most recent flowtuple from the table, expanded */
+    struct corsaro_flowtuple expanded;
+
+    /** The input, if it is a spill merge */
+    corsaro_ft_spill_merger_t *spillmerge;
+
+    /** The next flowtuple from this input */
+    struct corsaro_flowtuple *current;
+} corsaro_ft_kway_input_t;
+
+struct corsaro_ft_kway {
+    corsaro_logger_t *logger;
+
+    corsaro_ft_kway_input_t *inputs;
+    uint32_t inputcount;
+    uint32_t maxinputs;
+
+    /** Binary min-heap of inputs that still have flowtuples, ordered on
+     *  the sort key of their current flowtuple.
+     */
+    uint32_t *heap;
+    uint32_t heapsize;
+    /** Set once the heap has been built from the initial inputs */
+    uint8_t started;
+
+    /** Flowtuples that share a sort key, waiting to be returned */
+    struct corsaro_flowtuple *group;
+    uint32_t groupcount;
+    uint32_t groupalloc;
+    uint32_t groupind;
+
+    uint64_t inputflows;
+    uint64_t outputflows;
+};
+
+/* Tests if two flowtuples describe the same flow, in the same way that
+ * corsaroftmerge does.
+ */
+#define KWAY_SAME_FLOW(a, b) \
+    (corsaro_flowtuple_hash_equal(a, b) && \
+     (a)->ftdata.tcp_synlen == (b)->ftdata.tcp_synlen && \
+     (a)->ftdata.tcp_synwinlen == (b)->ftdata.tcp_synwinlen)
+
+/* Orders flowtuples that share a sort key, using the fields that are not
+ * part of the sort key so that the output does not depend on the order
+ * in which the inputs were added.
+ */
+static inline int kway_group_lt(struct corsaro_flowtuple *a,
+        struct corsaro_flowtuple *b) {
+
+    if (a->ftdata.dst_ip != b->ftdata.dst_ip) {
+        return a->ftdata.dst_ip < b->ftdata.dst_ip;
+    }
+    if (a->ftdata.tcp_synlen != b->ftdata.tcp_synlen) {
+        return a->ftdata.tcp_synlen < b->ftdata.tcp_synlen;
+    }
+    return a->ftdata.tcp_synwinlen < b->ftdata.tcp_synwinlen;
+}
+
+corsaro_ft_kway_t *corsaro_ft_create_kway(corsaro_logger_t *logger,
+        uint32_t maxinputs) {
+
+    corsaro_ft_kway_t *kway;
+
+    kway = (corsaro_ft_kway_t *)calloc(1, sizeof(corsaro_ft_kway_t));
+    if (kway == NULL) {
+        goto kwayfail;
+    }
+    kway->logger = logger;
+    kway->maxinputs = maxinputs;
+    kway->inputs = (corsaro_ft_kway_input_t *)calloc(maxinputs,
+            sizeof(corsaro_ft_kway_input_t));
+    kway->heap = (uint32_t *)calloc(maxinputs, sizeof(uint32_t));
+    if (kway->inputs == NULL || kway->heap == NULL) {
+        goto kwayfail;
+    }
+    return kway;
+
+kwayfail:
+    corsaro_log(logger, "unable to allocate memory for flowtuple k-way merge");
+    corsaro_ft_destroy_kway(kway);
+    return NULL;
+}
+
+int corsaro_ft_kway_add_table(corsaro_ft_kway_t *kway,
+        corsaro_ft_table_t *table) {
+
+    if (kway->inputcount == kway->maxinputs || kway->started) {
+        return -1;
+    }
+    if (table->sorted == NULL && table->count > 0) {
+        corsaro_log(kway->logger,
+                "cannot add an unsorted flowtuple table to a k-way merge");
+        return -1;
+    }
+    kway->inputs[kway->inputcount].table = table;
+    kway->inputcount ++;
+    return 0;
+}
+
+int corsaro_ft_kway_add_spill(corsaro_ft_kway_t *kway,
+        corsaro_ft_spill_merger_t *spillmerge) {
+
+    if (kway->inputcount == kway->maxinputs || kway->started) {
+        return -1;
+    }
+    kway->inputs[kway->inputcount].spillmerge = spillmerge;
+    kway->inputcount ++;
+    return 0;
+}
+
+/* Moves an input on to its next flowtuple. Returns 1 if there was one,
+ * 0 if the input is exhausted.
+ */
+static int advance_kway_input(corsaro_ft_kway_t *kway, uint32_t ind) {
+
+    corsaro_ft_kway_input_t *in = &(kway->inputs[ind]);
+
+    if (in->spillmerge) {
+        in->current = corsaro_ft_spill_merge_next(in->spillmerge);
+    } else if (in->tableind < in->table->count) {
+        corsaro_ft_table_expand(in->table,
+                in->table->sorted[in->tableind].index, &(in->expanded));
+        in->current = &(in->expanded);
+        in->tableind ++;
+    } else {
+        in->current = NULL;
+    }
+
+    if (in->current == NULL) {
+        return 0;
+    }
+    kway->inputflows ++;
+    return 1;
+}
+
+static inline int kway_input_lt(corsaro_ft_kway_t *kway, uint32_t a,
+        uint32_t b) {
+
+    struct corsaro_flowtuple *fa = kway->inputs[a].current;
+    struct corsaro_flowtuple *fb = kway->inputs[b].current;
+
+    if (fa->sort_key_top != fb->sort_key_top) {
+        return fa->sort_key_top < fb->sort_key_top;
+    }
+    return fa->sort_key_bot < fb->sort_key_bot;
+}
+
+static void sift_kway_heap(corsaro_ft_kway_t *kway, uint32_t i) {
+
+    uint32_t *heap = kway->heap;
+    uint32_t smallest, l, r, tmp;
+
+    while (1) {
+        l = (i * 2) + 1;
+        r = l + 1;
+        smallest = i;
+
+        if (l < kway->heapsize && kway_input_lt(kway, heap[l],
+                    heap[smallest])) {
+            smallest = l;
+        }
+        if (r < kway->heapsize && kway_input_lt(kway, heap[r],
+                    heap[smallest])) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+/* Adds a flowtuple to the current group, either combining it with an
+ * earlier flowtuple for the same flow or inserting it in order.
+ */
+static int add_to_kway_group(corsaro_ft_kway_t *kway,
+        struct corsaro_flowtuple *ft) {
+
+    uint32_t i;
+
+    for (i = 0; i < kway->groupcount; i++) {
+        if (KWAY_SAME_FLOW(&(kway->group[i]), ft)) {
+            kway->group[i].ftdata.packet_cnt += ft->ftdata.packet_cnt;
+            return 0;
+        }
+    }
+
+    if (kway->groupcount == kway->groupalloc) {
+        struct corsaro_flowtuple *newgroup;
+
+        newgroup = realloc(kway->group, (kway->groupalloc + 16) *
+                sizeof(struct corsaro_flowtuple));
+        if (newgroup == NULL) {
+            corsaro_log(kway->logger,
+                    "unable to allocate memory for flowtuple k-way merge");
+            return -1;
+        }
+        kway->group = newgroup;
+        kway->groupalloc += 16;
+    }
+
+    i = kway->groupcount;
+    while (i > 0 && kway_group_lt(ft, &(kway->group[i - 1]))) {
+        kway->group[i] = kway->group[i - 1];
+        i --;
+    }
+    kway->group[i] = *ft;
+    kway->groupcount ++;
+    return 0;
+}
+
+struct corsaro_flowtuple *corsaro_ft_kway_next(corsaro_ft_kway_t *kway) {
+
+    struct corsaro_flowtuple *ft;
+    uint64_t top, bot;
+    uint32_t i;
+
+    if (!kway->started) {
+        for (i = 0; i < kway->inputcount; i++) {
+            if (advance_kway_input(kway, i) > 0) {
+                kway->heap[kway->heapsize] = i;
+                kway->heapsize ++;
+            }
+        }
+        for (i = kway->heapsize / 2; i > 0; i--) {
+            sift_kway_heap(kway, i - 1);
+        }
+        kway->started = 1;
+    }
+
+    if (kway->groupind < kway->groupcount) {
+        kway->outputflows ++;
+        return &(kway->group[kway->groupind ++]);
+    }
+
+    kway->groupcount = 0;
+    kway->groupind = 0;
+
+    if (kway->heapsize == 0) {
+        return NULL;
+    }
+
+    /* Gather every flowtuple that shares the smallest sort key */
+    ft = kway->inputs[kway->heap[0]].current;
+    top = ft->sort_key_top;
+    bot = ft->sort_key_bot;
+
+    while (kway->heapsize > 0) {
+        ft = kway->inputs[kway->heap[0]].current;
+        if (ft->sort_key_top != top || ft->sort_key_bot != bot) {
+            break;
+        }
+
+        if (add_to_kway_group(kway, ft) < 0) {
+            return NULL;
+        }
+
+        if (advance_kway_input(kway, kway->heap[0]) == 0) {
+            kway->heapsize --;
+            kway->heap[0] = kway->heap[kway->heapsize];
+        }
+        if (kway->heapsize > 0) {
+            sift_kway_heap(kway, 0);
+        }
+    }
+
+    kway->outputflows ++;
+    return &(kway->group[kway->groupind ++]);
+}
+
+uint64_t corsaro_ft_kway_input_count(corsaro_ft_kway_t *kway) {
+    return kway->inputflows;
+}
+
+uint64_t corsaro_ft_kway_output_count(corsaro_ft_kway_t *kway) {
+    return kway->outputflows;
+}
+
+void corsaro_ft_destroy_kway(corsaro_ft_kway_t *kway) {
+    if (kway == NULL) {
+        return;
+    }
+    free(kway->inputs);
+    free(kway->heap);
+    free(kway->group);
+    free(kway);
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
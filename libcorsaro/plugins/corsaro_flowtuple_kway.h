@@ -0,0 +1,125 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef CORSARO_FLOWTUPLE_KWAY_H_
+#define CORSARO_FLOWTUPLE_KWAY_H_
+
+#include <stdint.h>
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+#include "corsaro_flowtuple_spill.h"
+
+typedef struct corsaro_ft_kway corsaro_ft_kway_t;
+
+/** Creates a k-way merge that combines the sorted flowtuples produced by
+ *  several processing threads for the same interval into a single sorted
+ *  stream.
+ *
+ *  Flowtuples are returned in sort key order. Flowtuples from different
+ *  inputs that describe the same flow (using the same test as
+ *  corsaroftmerge) are combined into a single flowtuple with the packet
+ *  counts summed, so the output is the same as running corsaroftmerge
+ *  over the per-thread interim files.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param maxinputs    The maximum number of inputs that will be added
+ *  @return a pointer to the new merge, or NULL if an error occurs.
+ */
+corsaro_ft_kway_t *corsaro_ft_create_kway(corsaro_logger_t *logger,
+        uint32_t maxinputs);
+
+/** Adds a sorted flowtuple table as an input to a k-way merge.
+ *
+ *  @param kway         The merge to add the input to
+ *  @param table        The table to add, which must have been sorted
+ *                      using corsaro_ft_table_sort().
+ *  @return 0 if successful, -1 if the merge already has its maximum
+ *          number of inputs.
+ */
+int corsaro_ft_kway_add_table(corsaro_ft_kway_t *kway,
+        corsaro_ft_table_t *table);
+
+/** Adds the output of a spill merge as an input to a k-way merge.
+ *
+ *  @param kway         The merge to add the input to
+ *  @param spillmerge   The spill merge to add. The caller must not finish
+ *                      the spill merge until the k-way merge is destroyed.
+ *  @return 0 if successful, -1 if the merge already has its maximum
+ *          number of inputs.
+ */
+int corsaro_ft_kway_add_spill(corsaro_ft_kway_t *kway,
+        corsaro_ft_spill_merger_t *spillmerge);
+
+/** Returns the next flowtuple from a k-way merge.
+ *
+ *  @param kway         The merge to read from
+ *  @return the next flowtuple, or NULL once every input has been consumed.
+ *          The flowtuple is only valid until the next call.
+ */
+struct corsaro_flowtuple *corsaro_ft_kway_next(corsaro_ft_kway_t *kway);
+
+/** Returns the number of flowtuples that have been read from the inputs
+ *  of a k-way merge so far.
+ */
+uint64_t corsaro_ft_kway_input_count(corsaro_ft_kway_t *kway);
+
+/** Returns the number of flowtuples that a k-way merge has produced so
+ *  far.
+ */
+uint64_t corsaro_ft_kway_output_count(corsaro_ft_kway_t *kway);
+
+/** Frees a k-way merge. Inputs are not freed.
+ *
+ *  @param kway         The merge to destroy
+ */
+void corsaro_ft_destroy_kway(corsaro_ft_kway_t *kway);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,546 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+#include "corsaro_flowtuple_spill.h"
+
+/** Number of flowtuples that are read or written in one go */
+#define SPILL_BATCH 4096
+
+/** Size of the stdio buffer used for each spill run file */
+#define SPILL_IOBUF (1024 * 1024)
+
+/** The form in which a flowtuple is written to a spill run. Only the
+ *  flowtuple data and the sort key are needed to merge runs back together.
+ */
+typedef struct corsaro_ft_spill_rec {
+    struct corsaro_flowtuple_data ftdata;
+    uint64_t sort_key_top;
+    uint64_t sort_key_bot;
+} PACKED corsaro_ft_spill_rec_t;
+
+/** A single input to a k-way merge -- either a spill run that is being
+ *  read back in, or the sorted contents of the flowtuple table.
+ */
+typedef struct corsaro_ft_merge_source {
+    FILE *f;
+    char *iobuf;
+    corsaro_ft_spill_rec_t *recs;
+    uint32_t reccount;
+    uint32_t recind;
+
+    /** Position in table->sorted, if this source is the table */
+    uint32_t tableind;
+
+    /** The next flowtuple from this source */
+    struct corsaro_flowtuple current;
+} corsaro_ft_merge_source_t;
+
+struct corsaro_ft_spill_merger {
+    corsaro_ft_spill_t *spill;
+    corsaro_ft_table_t *table;
+
+    corsaro_ft_merge_source_t *sources;
+    uint32_t sourcecount;
+
+    /** Binary min-heap of sources that still have flowtuples, ordered on
+     *  the sort key of their current flowtuple.
+     */
+    uint32_t *heap;
+    uint32_t heapsize;
+
+    /** Flowtuples that share a sort key, waiting to be returned */
+    struct corsaro_flowtuple *group;
+    uint32_t groupcount;
+    uint32_t groupalloc;
+    uint32_t groupind;
+
+    uint64_t produced;
+};
+
+corsaro_ft_spill_t *corsaro_ft_create_spill(corsaro_logger_t *logger,
+        const char *spilldir, int threadid, uint32_t interval_ts) {
+
+    corsaro_ft_spill_t *spill;
+
+    spill = (corsaro_ft_spill_t *)calloc(1, sizeof(corsaro_ft_spill_t));
+    if (spill == NULL) {
+        corsaro_log(logger, "unable to allocate memory for flowtuple spill");
+        return NULL;
+    }
+
+    spill->logger = logger;
+    spill->spilldir = spilldir;
+    spill->threadid = threadid;
+    spill->interval_ts = interval_ts;
+    return spill;
+}
+
+void corsaro_ft_destroy_spill(corsaro_ft_spill_t *spill) {
+    uint32_t i;
+
+    if (spill == NULL) {
+        return;
+    }
+
+    for (i = 0; i < spill->runcount; i++) {
+        if (unlink(spill->runs[i].filename) < 0 && errno != ENOENT) {
+            corsaro_log(spill->logger,
+                    "unable to remove flowtuple spill file %s: %s",
+                    spill->runs[i].filename, strerror(errno));
+        }
+        free(spill->runs[i].filename);
+    }
+    free(spill->runs);
+    free(spill);
+}
+
+int corsaro_ft_spill_table(corsaro_ft_spill_t *spill,
+        corsaro_ft_table_t *table) {
+
+    corsaro_ft_spill_run_t *run;
+    corsaro_ft_spill_rec_t *recs = NULL;
+    char *iobuf = NULL;
+    char fname[1024];
+    FILE *f = NULL;
+    uint32_t i, n = 0;
+
+    if (table->sorted == NULL && table->count > 0 &&
+            corsaro_ft_table_sort(table) < 0) {
+        corsaro_log(spill->logger,
+                "unable to allocate memory to sort %u flowtuples for spilling",
+                table->count);
+        return -1;
+    }
+
+    if (spill->runcount == spill->runalloc) {
+        corsaro_ft_spill_run_t *newruns;
+
+        newruns = realloc(spill->runs, (spill->runalloc + 8) *
+                sizeof(corsaro_ft_spill_run_t));
+        if (newruns == NULL) {
+            corsaro_log(spill->logger,
+                    "unable to allocate memory for flowtuple spill run");
+            return -1;
+        }
+        spill->runs = newruns;
+        spill->runalloc += 8;
+    }
+
+    snprintf(fname, 1024, "%s/corsaro-ft-spill-%d-%d-%u-%u", spill->spilldir,
+            (int)getpid(), spill->threadid, spill->interval_ts,
+            spill->runcount);
+
+    recs = (corsaro_ft_spill_rec_t *)malloc(SPILL_BATCH *
+            sizeof(corsaro_ft_spill_rec_t));
+    iobuf = (char *)malloc(SPILL_IOBUF);
+    if (recs == NULL || iobuf == NULL) {
+        corsaro_log(spill->logger,
+                "unable to allocate memory for flowtuple spill buffers");
+        goto spillfail;
+    }
+
+    f = fopen(fname, "w");
+    if (f == NULL) {
+        corsaro_log(spill->logger,
+                "unable to create flowtuple spill file %s: %s", fname,
+                strerror(errno));
+        goto spillfail;
+    }
+    setvbuf(f, iobuf, _IOFBF, SPILL_IOBUF);
+
+    for (i = 0; i < table->count; i++) {
+        struct corsaro_flowtuple ft;
+
+        corsaro_ft_table_expand(table, table->sorted[i].index, &ft);
+        recs[n].ftdata = ft.ftdata;
+        recs[n].sort_key_top = table->sorted[i].top;
+        recs[n].sort_key_bot = table->sorted[i].bot;
+        n ++;
+
+        if (n == SPILL_BATCH || i == table->count - 1) {
+            if (fwrite(recs, sizeof(corsaro_ft_spill_rec_t), n, f) != n) {
+                corsaro_log(spill->logger,
+                        "error while writing flowtuple spill file %s: %s",
+                        fname, strerror(errno));
+                goto spillfail;
+            }
+            n = 0;
+        }
+    }
+
+    if (fclose(f) != 0) {
+        f = NULL;
+        corsaro_log(spill->logger,
+                "error while writing flowtuple spill file %s: %s",
+                fname, strerror(errno));
+        goto spillfail;
+    }
+    f = NULL;
+
+    run = &(spill->runs[spill->runcount]);
+    run->filename = strdup(fname);
+    run->records = table->count;
+    spill->runcount ++;
+    spill->records += table->count;
+    spill->bytes += ((uint64_t)table->count) * sizeof(corsaro_ft_spill_rec_t);
+
+    free(recs);
+    free(iobuf);
+    return 0;
+
+spillfail:
+    if (f) {
+        fclose(f);
+    }
+    if (recs) {
+        unlink(fname);
+    }
+    free(recs);
+    free(iobuf);
+    return -1;
+}
+
+/* Loads the next flowtuple from a merge source into source->current.
+ * Returns 1 if there was a flowtuple, 0 if the source is exhausted and
+ * -1 if an error occurred reading a spill run.
+ */
+static int advance_merge_source(corsaro_ft_spill_merger_t *merger,
+        uint32_t sind) {
+
+    corsaro_ft_merge_source_t *src = &(merger->sources[sind]);
+    corsaro_ft_spill_rec_t *rec;
+
+    if (src->f == NULL) {
+        corsaro_ft_sortrec_t *sr;
+
+        /* This source is the table */
+        if (merger->table == NULL ||
+                src->tableind >= merger->table->count) {
+            return 0;
+        }
+        sr = &(merger->table->sorted[src->tableind]);
+        corsaro_ft_table_expand(merger->table, sr->index, &(src->current));
+        src->tableind ++;
+        return 1;
+    }
+
+    if (src->recind == src->reccount) {
+        src->reccount = fread(src->recs, sizeof(corsaro_ft_spill_rec_t),
+                SPILL_BATCH, src->f);
+        src->recind = 0;
+        if (src->reccount == 0) {
+            if (ferror(src->f)) {
+                corsaro_log(merger->spill->logger,
+                        "error while reading flowtuple spill run %u: %s",
+                        sind, strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    rec = &(src->recs[src->recind]);
+    memset(&(src->current), 0, sizeof(struct corsaro_flowtuple));
+    src->current.ftdata = rec->ftdata;
+    src->current.sort_key_top = rec->sort_key_top;
+    src->current.sort_key_bot = rec->sort_key_bot;
+    src->recind ++;
+    return 1;
+}
+
+static inline int merge_source_lt(corsaro_ft_spill_merger_t *merger,
+        uint32_t a, uint32_t b) {
+
+    struct corsaro_flowtuple *fa = &(merger->sources[a].current);
+    struct corsaro_flowtuple *fb = &(merger->sources[b].current);
+
+    if (fa->sort_key_top != fb->sort_key_top) {
+        return fa->sort_key_top < fb->sort_key_top;
+    }
+    return fa->sort_key_bot < fb->sort_key_bot;
+}
+
+static void sift_merge_heap(corsaro_ft_spill_merger_t *merger, uint32_t i) {
+
+    uint32_t *heap = merger->heap;
+    uint32_t smallest, l, r, tmp;
+
+    while (1) {
+        l = (i * 2) + 1;
+        r = l + 1;
+        smallest = i;
+
+        if (l < merger->heapsize &&
+                merge_source_lt(merger, heap[l], heap[smallest])) {
+            smallest = l;
+        }
+        if (r < merger->heapsize &&
+                merge_source_lt(merger, heap[r], heap[smallest])) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            break;
+        }
+        tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+corsaro_ft_spill_merger_t *corsaro_ft_start_spill_merge(
+        corsaro_ft_spill_t *spill, corsaro_ft_table_t *table) {
+
+    corsaro_ft_spill_merger_t *merger;
+    uint32_t i;
+    int ret;
+
+    if (table && table->sorted == NULL && table->count > 0 &&
+            corsaro_ft_table_sort(table) < 0) {
+        corsaro_log(spill->logger,
+                "unable to allocate memory to sort %u flowtuples for merging",
+                table->count);
+        return NULL;
+    }
+
+    merger = (corsaro_ft_spill_merger_t *)calloc(1,
+            sizeof(corsaro_ft_spill_merger_t));
+    if (merger == NULL) {
+        goto mergefail;
+    }
+    merger->spill = spill;
+    merger->table = table;
+
+    /* One source per spill run, plus the table */
+    merger->sources = (corsaro_ft_merge_source_t *)calloc(
+            spill->runcount + 1, sizeof(corsaro_ft_merge_source_t));
+    merger->heap = (uint32_t *)calloc(spill->runcount + 1, sizeof(uint32_t));
+    if (merger->sources == NULL || merger->heap == NULL) {
+        goto mergefail;
+    }
+    merger->sourcecount = spill->runcount + 1;
+
+    for (i = 0; i < spill->runcount; i++) {
+        corsaro_ft_merge_source_t *src = &(merger->sources[i]);
+
+        src->recs = (corsaro_ft_spill_rec_t *)malloc(SPILL_BATCH *
+                sizeof(corsaro_ft_spill_rec_t));
+        src->iobuf = (char *)malloc(SPILL_IOBUF);
+        if (src->recs == NULL || src->iobuf == NULL) {
+            goto mergefail;
+        }
+        src->f = fopen(spill->runs[i].filename, "r");
+        if (src->f == NULL) {
+            corsaro_log(spill->logger,
+                    "unable to open flowtuple spill file %s: %s",
+                    spill->runs[i].filename, strerror(errno));
+            corsaro_ft_finish_spill_merge(merger);
+            return NULL;
+        }
+        setvbuf(src->f, src->iobuf, _IOFBF, SPILL_IOBUF);
+    }
+
+    for (i = 0; i < merger->sourcecount; i++) {
+        ret = advance_merge_source(merger, i);
+        if (ret < 0) {
+            corsaro_ft_finish_spill_merge(merger);
+            return NULL;
+        }
+        if (ret > 0) {
+            merger->heap[merger->heapsize] = i;
+            merger->heapsize ++;
+        }
+    }
+
+    for (i = merger->heapsize / 2; i > 0; i--) {
+        sift_merge_heap(merger, i - 1);
+    }
+    return merger;
+
+mergefail:
+    corsaro_log(spill->logger,
+            "unable to allocate memory to merge flowtuple spill runs");
+    if (merger) {
+        corsaro_ft_finish_spill_merge(merger);
+    }
+    return NULL;
+}
+
+/* Adds a flowtuple to the current group, combining it with an earlier
+ * flowtuple from the group if they represent the same flow.
+ */
+static int add_to_merge_group(corsaro_ft_spill_merger_t *merger,
+        struct corsaro_flowtuple *ft) {
+
+    uint32_t i;
+    uint8_t sortkeyed = merger->table ? merger->table->sortkeyed : 0;
+
+    for (i = 0; i < merger->groupcount; i++) {
+        struct corsaro_flowtuple *existing = &(merger->group[i]);
+
+        /* Tables that are keyed on the sort key treat any flowtuples with
+         * the same key as the same flow, so do the same here.
+         */
+        if (sortkeyed || corsaro_flowtuple_hash_equal(existing, ft)) {
+            existing->ftdata.packet_cnt += ft->ftdata.packet_cnt;
+            return 0;
+        }
+    }
+
+    if (merger->groupcount == merger->groupalloc) {
+        struct corsaro_flowtuple *newgroup;
+
+        newgroup = realloc(merger->group, (merger->groupalloc + 16) *
+                sizeof(struct corsaro_flowtuple));
+        if (newgroup == NULL) {
+            corsaro_log(merger->spill->logger,
+                    "unable to allocate memory to merge flowtuple spill runs");
+            return -1;
+        }
+        merger->group = newgroup;
+        merger->groupalloc += 16;
+    }
+
+    merger->group[merger->groupcount] = *ft;
+    merger->groupcount ++;
+    return 0;
+}
+
+struct corsaro_flowtuple *corsaro_ft_spill_merge_next(
+        corsaro_ft_spill_merger_t *merger) {
+
+    corsaro_ft_merge_source_t *src;
+    uint64_t top, bot;
+    int ret;
+
+    if (merger->groupind < merger->groupcount) {
+        merger->produced ++;
+        return &(merger->group[merger->groupind ++]);
+    }
+
+    merger->groupcount = 0;
+    merger->groupind = 0;
+
+    if (merger->heapsize == 0) {
+        return NULL;
+    }
+
+    /* Gather every flowtuple that shares the smallest sort key. Each
+     * source holds each flow at most once, so groups stay small.
+     */
+    src = &(merger->sources[merger->heap[0]]);
+    top = src->current.sort_key_top;
+    bot = src->current.sort_key_bot;
+
+    while (merger->heapsize > 0) {
+        src = &(merger->sources[merger->heap[0]]);
+        if (src->current.sort_key_top != top ||
+                src->current.sort_key_bot != bot) {
+            break;
+        }
+
+        if (add_to_merge_group(merger, &(src->current)) < 0) {
+            return NULL;
+        }
+
+        ret = advance_merge_source(merger, merger->heap[0]);
+        if (ret < 0) {
+            return NULL;
+        }
+        if (ret == 0) {
+            merger->heapsize --;
+            merger->heap[0] = merger->heap[merger->heapsize];
+        }
+        if (merger->heapsize > 0) {
+            sift_merge_heap(merger, 0);
+        }
+    }
+
+    merger->produced ++;
+    return &(merger->group[merger->groupind ++]);
+}
+
+uint64_t corsaro_ft_finish_spill_merge(corsaro_ft_spill_merger_t *merger) {
+    uint64_t produced;
+    uint32_t i;
+
+    if (merger == NULL) {
+        return 0;
+    }
+
+    if (merger->sources) {
+        for (i = 0; i < merger->sourcecount; i++) {
+            if (merger->sources[i].f) {
+                fclose(merger->sources[i].f);
+            }
+            free(merger->sources[i].recs);
+            free(merger->sources[i].iobuf);
+        }
+        free(merger->sources);
+    }
+    free(merger->heap);
+    free(merger->group);
+
+    produced = merger->produced;
+    free(merger);
+    return produced;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,153 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef CORSARO_FLOWTUPLE_SPILL_H_
+#define CORSARO_FLOWTUPLE_SPILL_H_
+
+#include <stdint.h>
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+
+/** A sorted run of flowtuples that has been written to a local file */
+typedef struct corsaro_ft_spill_run {
+    /** The name of the file containing the run */
+    char *filename;
+    /** The number of flowtuples in the run */
+    uint64_t records;
+} corsaro_ft_spill_run_t;
+
+/** The spill runs that a processing thread has written for one interval.
+ *
+ *  When a processing thread's flowtuple table reaches its memory budget,
+ *  the table is sorted and written to a spill run and the thread carries
+ *  on with an empty table. At the end of the interval, the runs and the
+ *  final contents of the table are merged back together.
+ */
+typedef struct corsaro_ft_spill {
+    corsaro_logger_t *logger;
+    /** The directory that spill runs are written to */
+    const char *spilldir;
+    /** The processing thread that wrote the runs */
+    int threadid;
+    /** The interval that the runs belong to */
+    uint32_t interval_ts;
+
+    corsaro_ft_spill_run_t *runs;
+    uint32_t runcount;
+    uint32_t runalloc;
+
+    /** Total number of flowtuples and bytes written to spill runs */
+    uint64_t records;
+    uint64_t bytes;
+} corsaro_ft_spill_t;
+
+typedef struct corsaro_ft_spill_merger corsaro_ft_spill_merger_t;
+
+/** Creates an empty set of spill runs for an interval.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param spilldir     The directory to write spill runs into
+ *  @param threadid     The processing thread that will write the runs
+ *  @param interval_ts  The interval that the runs will belong to
+ *  @return a pointer to the new spill set, or NULL if an error occurs.
+ */
+corsaro_ft_spill_t *corsaro_ft_create_spill(corsaro_logger_t *logger,
+        const char *spilldir, int threadid, uint32_t interval_ts);
+
+/** Removes any spill run files and frees a spill set.
+ *
+ *  @param spill        The spill set to destroy
+ */
+void corsaro_ft_destroy_spill(corsaro_ft_spill_t *spill);
+
+/** Sorts the contents of a flowtuple table and writes them to a new spill
+ *  run. The table is left sorted but otherwise unchanged; it is up to the
+ *  caller to reset it.
+ *
+ *  @param spill        The spill set to add the run to
+ *  @param table        The table to spill
+ *  @return 0 if successful, -1 if the run could not be written.
+ */
+int corsaro_ft_spill_table(corsaro_ft_spill_t *spill,
+        corsaro_ft_table_t *table);
+
+/** Starts a k-way merge of the spill runs in a spill set and the final
+ *  contents of a flowtuple table. Flowtuples are returned in sort key
+ *  order, with duplicates from different runs combined into a single
+ *  flowtuple.
+ *
+ *  @param spill        The spill set to merge
+ *  @param table        The table holding the rest of the interval's
+ *                      flowtuples. It will be sorted if it has not been
+ *                      already.
+ *  @return a merger to pass to corsaro_ft_spill_merge_next(), or NULL if
+ *          an error occurs.
+ */
+corsaro_ft_spill_merger_t *corsaro_ft_start_spill_merge(
+        corsaro_ft_spill_t *spill, corsaro_ft_table_t *table);
+
+/** Returns the next flowtuple from a k-way merge.
+ *
+ *  @param merger       The merger to read from
+ *  @return the next flowtuple, or NULL once every run has been consumed.
+ *          The flowtuple is only valid until the next call.
+ */
+struct corsaro_flowtuple *corsaro_ft_spill_merge_next(
+        corsaro_ft_spill_merger_t *merger);
+
+/** Finishes a k-way merge and frees the merger.
+ *
+ *  @param merger       The merger to finish
+ *  @return the number of flowtuples that the merge produced.
+ */
+uint64_t corsaro_ft_finish_spill_merge(corsaro_ft_spill_merger_t *merger);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -0,0 +1,793 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+#include "corsaro_flowtuple_table.h"
+
+/** Control byte value for a slot that is not in use */
+#define CTRL_EMPTY 0x80
+
+/** Number of slots in a newly created table */
+#define INITIAL_CAPACITY (1 << 16)
+
+/** Number of attribute slots in a newly created table */
+#define INITIAL_ATTR_CAPACITY (1 << 12)
+
+/* The same sort key as FT_CALC_SORT_KEY_TOP and FT_CALC_SORT_KEY_BOTTOM,
+ * calculated from a compact table entry.
+ */
+#define ENTRY_SORT_KEY_TOP(e) \
+    ( \
+        (((uint64_t)((e)->protocol)) << 56) | \
+        (((uint64_t)((e)->ttl)) << 48) | \
+        (((uint64_t)((e)->tcp_flags)) << 40) | \
+        (((uint64_t)((e)->src_ip)) << 8) | \
+        (((uint64_t)((e)->dst_ip & 0x00FFFFFF)) >> 16) \
+    )
+
+#define ENTRY_SORT_KEY_BOTTOM(e) \
+    ( \
+        (((uint64_t)((e)->dst_ip)) << 48) | \
+        (((uint64_t)((e)->src_port)) << 32) | \
+        (((uint64_t)((e)->dst_port)) << 16) | \
+        (((uint64_t)((e)->ip_len))) \
+    )
+
+/* Tests two entries for equality, using the same fields as
+ * corsaro_flowtuple_hash_equal(). The interval is the same for every
+ * entry in a table.
+ */
+static inline int entry_equal(corsaro_ft_entry_t *a, corsaro_ft_entry_t *b) {
+    return a->src_ip == b->src_ip && a->dst_ip == b->dst_ip &&
+            a->src_port == b->src_port && a->dst_port == b->dst_port &&
+            a->protocol == b->protocol && a->ttl == b->ttl &&
+            a->tcp_flags == b->tcp_flags && a->ip_len == b->ip_len;
+}
+
+/* Hashes all of the fields that make up a flowtuple key. We can't just
+ * use the hash_val provided by the tagger, as that is only 32 bits and
+ * is not guaranteed to be unique for each flow.
+ */
+static inline uint64_t hash_flowtuple_key(corsaro_ft_entry_t *e) {
+
+    uint64_t a, b, c, h;
+
+    a = (((uint64_t)e->src_ip) << 32) | e->dst_ip;
+    b = (((uint64_t)e->src_port) << 48) |
+            (((uint64_t)e->dst_port) << 32) |
+            (((uint64_t)e->ip_len) << 16) |
+            (((uint64_t)e->protocol) << 8) |
+            ((uint64_t)e->ttl);
+    c = e->tcp_flags;
+
+    h = a * 0x9E3779B97F4A7C15ULL;
+    h ^= (b * 0xC2B2AE3D27D4EB4FULL);
+    h = (h << 31) | (h >> 33);
+    h ^= (c * 0x165667B19E3779F9ULL);
+
+    /* final avalanche, from MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_sort_key(uint64_t top, uint64_t bot) {
+
+    uint64_t h;
+
+    h = top * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    h ^= (bot * 0xC2B2AE3D27D4EB4FULL);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline uint64_t hash_entry(corsaro_ft_table_t *table,
+        corsaro_ft_entry_t *e) {
+
+    if (table->sortkeyed) {
+        return hash_sort_key(ENTRY_SORT_KEY_TOP(e), ENTRY_SORT_KEY_BOTTOM(e));
+    }
+    return hash_flowtuple_key(e);
+}
+
+static inline uint32_t hash_attrs(corsaro_ft_attrs_t *a) {
+
+    uint64_t h;
+
+    h = (((uint64_t)a->prefixasn) << 32) |
+            (((uint64_t)a->maxmind_country) << 16) | a->netacq_country;
+    h ^= ((((uint64_t)a->maxmind_continent) << 48) |
+            (((uint64_t)a->netacq_continent) << 32) |
+            (((uint64_t)a->tagproviders) << 16) |
+            (((uint64_t)a->is_spoofed) << 8) | a->is_masscan) *
+            0x9E3779B97F4A7C15ULL;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/* Returns a bitmask with a bit set for each control byte in the group
+ * that is equal to 'val'.
+ */
+static inline uint32_t match_group(const uint8_t *ctrl, uint8_t val) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group,
+            _mm_set1_epi8((char)val)));
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < CORSARO_FT_TABLE_GROUP; i++) {
+        if (ctrl[i] == val) {
+            mask |= (1 << i);
+        }
+    }
+    return mask;
+#endif
+}
+
+/* Returns a bitmask with a bit set for each empty slot in the group.
+ * Only empty slots have the top bit of their control byte set.
+ */
+static inline uint32_t match_empty(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(group);
+#else
+    return match_group(ctrl, CTRL_EMPTY);
+#endif
+}
+
+static int allocate_slots(corsaro_ft_table_t *table, uint32_t capacity) {
+
+    uint8_t *ctrl;
+    uint32_t *slots;
+
+    ctrl = malloc(capacity);
+    slots = malloc(capacity * sizeof(uint32_t));
+
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return -1;
+    }
+
+    memset(ctrl, CTRL_EMPTY, capacity);
+    free(table->ctrl);
+    free(table->slots);
+    table->ctrl = ctrl;
+    table->slots = slots;
+    table->capacity = capacity;
+    return 0;
+}
+
+/* Places an arena index into the first free slot in its probe sequence.
+ * Only used when rebuilding the table, so we already know the key is not
+ * present.
+ */
+static inline void place_entry(corsaro_ft_table_t *table, uint64_t h,
+        uint32_t index) {
+
+    uint32_t ngroups = table->capacity / CORSARO_FT_TABLE_GROUP;
+    uint32_t group = (uint32_t)(h >> 7) & (ngroups - 1);
+    uint32_t empties, pos;
+
+    while (1) {
+        pos = group * CORSARO_FT_TABLE_GROUP;
+        empties = match_empty(table->ctrl + pos);
+        if (empties) {
+            pos += __builtin_ctz(empties);
+            table->ctrl[pos] = (uint8_t)(h & 0x7f);
+            table->slots[pos] = index;
+            return;
+        }
+        group = (group + 1) & (ngroups - 1);
+    }
+}
+
+static int grow_slots(corsaro_ft_table_t *table) {
+
+    uint32_t i;
+
+    if (allocate_slots(table, table->capacity * 2) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < table->count; i++) {
+        place_entry(table, hash_entry(table, &(table->entries[i])), i);
+    }
+    return 0;
+}
+
+static int grow_attr_slots(corsaro_ft_table_t *table) {
+
+    uint32_t *newslots;
+    uint32_t newcap = table->attrslotcap * 2;
+    uint32_t i, pos;
+
+    newslots = calloc(newcap, sizeof(uint32_t));
+    if (newslots == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < table->attrcount; i++) {
+        pos = hash_attrs(&(table->attrs[i])) & (newcap - 1);
+        while (newslots[pos] != 0) {
+            pos = (pos + 1) & (newcap - 1);
+        }
+        newslots[pos] = i + 1;
+    }
+
+    free(table->attrslots);
+    table->attrslots = newslots;
+    table->attrslotcap = newcap;
+    return 0;
+}
+
+/* Returns the index of the given attributes in the table, adding them if
+ * no flowtuple in the table has used them yet. Returns UINT32_MAX if
+ * memory could not be allocated.
+ */
+static uint32_t find_or_insert_attrs(corsaro_ft_table_t *table,
+        corsaro_ft_attrs_t *a) {
+
+    uint32_t pos;
+
+    /* Keep the attribute index no more than half full */
+    if (table->attrcount >= table->attrslotcap / 2) {
+        if (grow_attr_slots(table) < 0) {
+            return UINT32_MAX;
+        }
+    }
+
+    pos = hash_attrs(a) & (table->attrslotcap - 1);
+    while (table->attrslots[pos] != 0) {
+        if (memcmp(&(table->attrs[table->attrslots[pos] - 1]), a,
+                    sizeof(corsaro_ft_attrs_t)) == 0) {
+            return table->attrslots[pos] - 1;
+        }
+        pos = (pos + 1) & (table->attrslotcap - 1);
+    }
+
+    if (table->attrcount == table->attrcap) {
+        corsaro_ft_attrs_t *newattrs;
+
+        newattrs = realloc(table->attrs, table->attrcap * 2 *
+                sizeof(corsaro_ft_attrs_t));
+        if (newattrs == NULL) {
+            return UINT32_MAX;
+        }
+        table->attrs = newattrs;
+        table->attrcap *= 2;
+    }
+
+    table->attrs[table->attrcount] = *a;
+    table->attrslots[pos] = table->attrcount + 1;
+    table->attrcount ++;
+    return table->attrcount - 1;
+}
+
+static int grow_arena(corsaro_ft_table_t *table) {
+
+    corsaro_ft_entry_t *newentries;
+    uint32_t newcap = table->entrycap * 2;
+
+    if (table->entrylimit > table->entrycap && newcap > table->entrylimit) {
+        newcap = table->entrylimit;
+    }
+
+    newentries = realloc(table->entries, newcap * sizeof(corsaro_ft_entry_t));
+    if (newentries == NULL) {
+        return -1;
+    }
+    table->entries = newentries;
+    table->entrycap = newcap;
+    return 0;
+}
+
+static corsaro_ft_table_t *create_table(corsaro_ft_table_pool_t *pool) {
+
+    corsaro_ft_table_t *table;
+
+    table = calloc(1, sizeof(corsaro_ft_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    if (allocate_slots(table, INITIAL_CAPACITY) < 0) {
+        free(table);
+        return NULL;
+    }
+
+    table->entrycap = INITIAL_CAPACITY / 2;
+    table->entries = malloc(table->entrycap * sizeof(corsaro_ft_entry_t));
+    table->attrcap = INITIAL_ATTR_CAPACITY / 2;
+    table->attrs = malloc(table->attrcap * sizeof(corsaro_ft_attrs_t));
+    table->attrslotcap = INITIAL_ATTR_CAPACITY;
+    table->attrslots = calloc(table->attrslotcap, sizeof(uint32_t));
+    if (table->entries == NULL || table->attrs == NULL ||
+            table->attrslots == NULL) {
+        free(table->entries);
+        free(table->attrs);
+        free(table->attrslots);
+        free(table->ctrl);
+        free(table->slots);
+        free(table);
+        return NULL;
+    }
+
+    table->pool = pool;
+    table->sortkeyed = pool->sortkeyed;
+    return table;
+}
+
+static void destroy_table(corsaro_ft_table_t *table) {
+    free(table->sortbufs[0]);
+    free(table->sortbufs[1]);
+    free(table->ctrl);
+    free(table->slots);
+    free(table->entries);
+    free(table->attrs);
+    free(table->attrslots);
+    free(table);
+}
+
+static void destroy_table_pool(corsaro_ft_table_pool_t *pool) {
+
+    corsaro_ft_table_t *table;
+
+    while (pool->freelist) {
+        table = pool->freelist;
+        pool->freelist = table->nextfree;
+        destroy_table(table);
+    }
+    pthread_mutex_destroy(&(pool->mutex));
+    free(pool);
+}
+
+corsaro_ft_table_pool_t *corsaro_ft_create_table_pool(
+        corsaro_logger_t *logger, uint8_t sortkeyed) {
+
+    corsaro_ft_table_pool_t *pool;
+
+    pool = calloc(1, sizeof(corsaro_ft_table_pool_t));
+    if (pool == NULL) {
+        corsaro_log(logger, "unable to allocate flowtuple table pool");
+        return NULL;
+    }
+
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pool->logger = logger;
+    pool->freelist = NULL;
+    pool->outstanding = 0;
+    pool->closed = 0;
+    pool->sortkeyed = sortkeyed;
+    return pool;
+}
+
+void corsaro_ft_close_table_pool(corsaro_ft_table_pool_t *pool) {
+
+    uint8_t destroy = 0;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->closed = 1;
+    if (pool->outstanding == 0) {
+        destroy = 1;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (destroy) {
+        destroy_table_pool(pool);
+    }
+}
+
+corsaro_ft_table_t *corsaro_ft_get_table(corsaro_ft_table_pool_t *pool) {
+
+    corsaro_ft_table_t *table = NULL;
+
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->freelist) {
+        table = pool->freelist;
+        pool->freelist = table->nextfree;
+    }
+    pool->outstanding ++;
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (table == NULL) {
+        table = create_table(pool);
+        if (table == NULL) {
+            corsaro_log(pool->logger,
+                    "unable to allocate new flowtuple table");
+            pthread_mutex_lock(&(pool->mutex));
+            pool->outstanding --;
+            pthread_mutex_unlock(&(pool->mutex));
+            return NULL;
+        }
+    }
+
+    table->nextfree = NULL;
+    return table;
+}
+
+void corsaro_ft_release_table(corsaro_ft_table_t *table) {
+
+    corsaro_ft_table_pool_t *pool;
+    uint8_t destroy = 0;
+
+    if (table == NULL) {
+        return;
+    }
+
+    /* Reset, rather than free, so the slots and arena can be reused by
+     * a later interval without going back to the allocator.
+     */
+    corsaro_ft_table_reset(table);
+    table->entrylimit = 0;
+
+    pool = table->pool;
+    pthread_mutex_lock(&(pool->mutex));
+    if (pool->closed) {
+        destroy_table(table);
+    } else {
+        table->nextfree = pool->freelist;
+        pool->freelist = table;
+    }
+    pool->outstanding --;
+    if (pool->closed && pool->outstanding == 0) {
+        destroy = 1;
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    if (destroy) {
+        destroy_table_pool(pool);
+    }
+}
+
+corsaro_ft_entry_t *corsaro_ft_table_find_or_insert(
+        corsaro_ft_table_t *table, struct corsaro_flowtuple *ft) {
+
+    uint64_t h, top = 0, bot = 0;
+    uint32_t ngroups, group, pos, matches, empties, probe;
+    uint8_t h2;
+    corsaro_ft_entry_t key, *found;
+    corsaro_ft_attrs_t attrs;
+
+    /* Keep the load factor below 7/8 so that every probe sequence is
+     * guaranteed to reach an empty slot reasonably quickly.
+     */
+    if (table->count >= (table->capacity / 8) * 7) {
+        if (grow_slots(table) < 0) {
+            return NULL;
+        }
+    }
+
+    key.src_ip = ft->ftdata.src_ip;
+    key.dst_ip = ft->ftdata.dst_ip;
+    key.src_port = ft->ftdata.src_port;
+    key.dst_port = ft->ftdata.dst_port;
+    key.ip_len = ft->ftdata.ip_len;
+    key.protocol = ft->ftdata.protocol;
+    key.ttl = ft->ftdata.ttl;
+    key.tcp_flags = ft->ftdata.tcp_flags;
+
+    if (table->sortkeyed) {
+        top = ENTRY_SORT_KEY_TOP(&key);
+        bot = ENTRY_SORT_KEY_BOTTOM(&key);
+        h = hash_sort_key(top, bot);
+    } else {
+        h = hash_flowtuple_key(&key);
+    }
+    h2 = (uint8_t)(h & 0x7f);
+    ngroups = table->capacity / CORSARO_FT_TABLE_GROUP;
+    group = (uint32_t)(h >> 7) & (ngroups - 1);
+
+    table->lookups ++;
+    for (probe = 1; ; probe ++) {
+        pos = group * CORSARO_FT_TABLE_GROUP;
+
+        matches = match_group(table->ctrl + pos, h2);
+        while (matches) {
+            found = &(table->entries[table->slots[pos +
+                    __builtin_ctz(matches)]]);
+            if (table->sortkeyed) {
+                if (ENTRY_SORT_KEY_TOP(found) == top &&
+                        ENTRY_SORT_KEY_BOTTOM(found) == bot) {
+                    goto probedone;
+                }
+            } else if (entry_equal(found, &key)) {
+                goto probedone;
+            }
+            matches &= (matches - 1);
+        }
+
+        empties = match_empty(table->ctrl + pos);
+        if (empties) {
+            break;
+        }
+        group = (group + 1) & (ngroups - 1);
+    }
+
+    /* Not present, so add it to the arena and claim the first empty
+     * slot that we found. The tag-derived attributes are kept once per
+     * distinct set rather than once per flowtuple.
+     */
+    if (table->count == table->entrycap) {
+        if (grow_arena(table) < 0) {
+            return NULL;
+        }
+    }
+
+    attrs.prefixasn = ft->ftdata.prefixasn;
+    attrs.maxmind_country = ft->ftdata.maxmind_country;
+    attrs.maxmind_continent = ft->ftdata.maxmind_continent;
+    attrs.netacq_country = ft->ftdata.netacq_country;
+    attrs.netacq_continent = ft->ftdata.netacq_continent;
+    attrs.tagproviders = ft->ftdata.tagproviders;
+    attrs.is_spoofed = ft->ftdata.is_spoofed;
+    attrs.is_masscan = ft->ftdata.is_masscan;
+
+    key.attrs = find_or_insert_attrs(table, &attrs);
+    if (key.attrs == UINT32_MAX) {
+        return NULL;
+    }
+    key.tcp_synlen = ft->ftdata.tcp_synlen;
+    key.tcp_synwinlen = ft->ftdata.tcp_synwinlen;
+    key.hash_val = ft->ftdata.hash_val;
+    key.packet_cnt = 0;
+
+    if (table->count == 0) {
+        table->interval_ts = ft->ftdata.interval_ts;
+    }
+
+    pos += __builtin_ctz(empties);
+    found = &(table->entries[table->count]);
+    *found = key;
+
+    table->ctrl[pos] = h2;
+    table->slots[pos] = table->count;
+    table->count ++;
+
+probedone:
+    table->probes += probe;
+    if (probe > table->maxprobe) {
+        table->maxprobe = probe;
+    }
+    return found;
+}
+
+void corsaro_ft_table_expand(corsaro_ft_table_t *table, uint32_t index,
+        struct corsaro_flowtuple *ft) {
+
+    corsaro_ft_entry_t *e = &(table->entries[index]);
+    corsaro_ft_attrs_t *a = &(table->attrs[e->attrs]);
+
+    memset(ft, 0, sizeof(struct corsaro_flowtuple));
+    ft->ftdata.interval_ts = table->interval_ts;
+    ft->ftdata.src_ip = e->src_ip;
+    ft->ftdata.dst_ip = e->dst_ip;
+    ft->ftdata.src_port = e->src_port;
+    ft->ftdata.dst_port = e->dst_port;
+    ft->ftdata.protocol = e->protocol;
+    ft->ftdata.ttl = e->ttl;
+    ft->ftdata.tcp_flags = e->tcp_flags;
+    ft->ftdata.ip_len = e->ip_len;
+    ft->ftdata.tcp_synlen = e->tcp_synlen;
+    ft->ftdata.tcp_synwinlen = e->tcp_synwinlen;
+    ft->ftdata.packet_cnt = e->packet_cnt;
+    ft->ftdata.hash_val = e->hash_val;
+
+    ft->ftdata.is_spoofed = a->is_spoofed;
+    ft->ftdata.is_masscan = a->is_masscan;
+    ft->ftdata.maxmind_country = a->maxmind_country;
+    ft->ftdata.maxmind_continent = a->maxmind_continent;
+    ft->ftdata.netacq_country = a->netacq_country;
+    ft->ftdata.netacq_continent = a->netacq_continent;
+    ft->ftdata.prefixasn = a->prefixasn;
+    ft->ftdata.tagproviders = a->tagproviders;
+
+    ft->sort_key_top = ENTRY_SORT_KEY_TOP(e);
+    ft->sort_key_bot = ENTRY_SORT_KEY_BOTTOM(e);
+}
+
+/* Returns byte 'pass' of the 128-bit sort key, counting from the least
+ * significant byte of the bottom half.
+ */
+static inline uint8_t sort_key_byte(corsaro_ft_sortrec_t *rec, int pass) {
+    if (pass < 8) {
+        return (uint8_t)(rec->bot >> (pass * 8));
+    }
+    return (uint8_t)(rec->top >> ((pass - 8) * 8));
+}
+
+int corsaro_ft_table_sort(corsaro_ft_table_t *table) {
+
+    uint32_t counts[16][256];
+    uint32_t offsets[256];
+    corsaro_ft_sortrec_t *src, *dst, *tmp;
+    uint32_t i, n, total;
+    int pass, b;
+
+    n = table->count;
+    if (n > table->sortcap) {
+        for (b = 0; b < 2; b++) {
+            tmp = realloc(table->sortbufs[b],
+                    n * sizeof(corsaro_ft_sortrec_t));
+            if (tmp == NULL) {
+                return -1;
+            }
+            table->sortbufs[b] = tmp;
+        }
+        table->sortcap = n;
+    }
+
+    src = table->sortbufs[0];
+    dst = table->sortbufs[1];
+
+    /* Gather the keys and build the histograms for every pass at once,
+     * so we only need to read the arena a single time.
+     */
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < n; i++) {
+        src[i].top = ENTRY_SORT_KEY_TOP(&(table->entries[i]));
+        src[i].bot = ENTRY_SORT_KEY_BOTTOM(&(table->entries[i]));
+        src[i].index = i;
+        for (pass = 0; pass < 16; pass++) {
+            counts[pass][sort_key_byte(&(src[i]), pass)] ++;
+        }
+    }
+
+    for (pass = 0; pass < 16 && n > 0; pass++) {
+        /* Every key has the same value for this byte (e.g. the constant
+         * parts of the destination address), so this pass would not
+         * change the order.
+         */
+        if (counts[pass][sort_key_byte(&(src[0]), pass)] == n) {
+            continue;
+        }
+
+        total = 0;
+        for (b = 0; b < 256; b++) {
+            offsets[b] = total;
+            total += counts[pass][b];
+        }
+
+        for (i = 0; i < n; i++) {
+            dst[offsets[sort_key_byte(&(src[i]), pass)] ++] = src[i];
+        }
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    table->sorted = src;
+    return 0;
+}
+
+void corsaro_ft_table_reset(corsaro_ft_table_t *table) {
+    memset(table->ctrl, CTRL_EMPTY, table->capacity);
+    memset(table->attrslots, 0, table->attrslotcap * sizeof(uint32_t));
+    table->count = 0;
+    table->attrcount = 0;
+    table->lookups = 0;
+    table->probes = 0;
+    table->maxprobe = 0;
+    table->sorted = NULL;
+}
+
+uint32_t corsaro_ft_table_entry_cost(void) {
+    /* The slot arrays are kept between 7/16 and 7/8 full, so allow for
+     * twice the control byte and index per flowtuple. Sorting needs two
+     * sort records per flowtuple. In the worst case, every flowtuple has
+     * its own attributes (and two attribute slots).
+     */
+    return sizeof(corsaro_ft_entry_t) +
+            2 * (sizeof(uint8_t) + sizeof(uint32_t)) +
+            2 * sizeof(corsaro_ft_sortrec_t) +
+            sizeof(corsaro_ft_attrs_t) + 2 * sizeof(uint32_t);
+}
+
+void corsaro_ft_table_memory(corsaro_ft_table_t *table, uint64_t *used,
+        uint64_t *uncompacted) {
+
+    uint64_t slotbytes;
+
+    slotbytes = ((uint64_t)table->capacity) *
+            (sizeof(uint8_t) + sizeof(uint32_t));
+
+    *used = slotbytes +
+            ((uint64_t)table->count) * sizeof(corsaro_ft_entry_t) +
+            ((uint64_t)table->attrcount) * sizeof(corsaro_ft_attrs_t) +
+            ((uint64_t)table->attrslotcap) * sizeof(uint32_t);
+    *uncompacted = slotbytes +
+            ((uint64_t)table->count) * sizeof(struct corsaro_flowtuple);
+}
+
+double corsaro_ft_table_load_factor(corsaro_ft_table_t *table) {
+    if (table->capacity == 0) {
+        return 0.0;
+    }
+    return ((double)table->count) / table->capacity;
+}
+
+double corsaro_ft_table_mean_probe(corsaro_ft_table_t *table) {
+    if (table->lookups == 0) {
+        return 0.0;
+    }
+    return ((double)table->probes) / table->lookups;
+}
+
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
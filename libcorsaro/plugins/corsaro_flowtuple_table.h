@@ -0,0 +1,310 @@
+/*
+ * corsaro
+ *
+ * Alistair King, CAIDA, UC San Diego
+ * Shane Alcock, WAND, University of Waikato
+ *
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2012-2019 The Regents of the University of California.
+ * All Rights Reserved.
+ *
+ * This file is part of corsaro.
+ *
+ * Permission to copy, modify, and distribute this software and its
+ * documentation for academic research and education purposes, without fee, and
+ * without a written agreement is hereby granted, provided that
+ * the above copyright notice, this paragraph and the following paragraphs
+ * appear in all copies.
+ *
+ * Permission to make use of this software for other than academic research and
+ * education purposes may be obtained by contacting:
+ *
+ * Office of Innovation and Commercialization
+ * 9500 Gilman Drive, Mail Code 0910
+ * University of California
+ * La Jolla, CA 92093-0910
+ * (858) 534-5815
+ * invent@ucsd.edu
+ *
+ * This software program and documentation are copyrighted by The Regents of the
+ * University of California. The software program and documentation are supplied
+ * “as is”, without any accompanying services from The Regents. The Regents does
+ * not warrant that the operation of the program will be uninterrupted or
+ * error-free. The end-user understands that the program was developed for
+ * research purposes and is advised not to rely exclusively on the program for
+ * any reason.
+ *
+ * IN NO EVENT SHALL THE UNIVERSITY OF CALIFORNIA BE LIABLE TO ANY PARTY FOR
+ * DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING
+ * LOST PROFITS, ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION,
+ * EVEN IF THE UNIVERSITY OF CALIFORNIA HAS BEEN ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE. THE UNIVERSITY OF CALIFORNIA SPECIFICALLY DISCLAIMS ANY
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE. THE SOFTWARE PROVIDED
+ * HEREUNDER IS ON AN “AS IS” BASIS, AND THE UNIVERSITY OF CALIFORNIA HAS NO
+ * OBLIGATIONS TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS, OR
+ * MODIFICATIONS.
+ */
+
+#ifndef CORSARO_FLOWTUPLE_TABLE_H_
+#define CORSARO_FLOWTUPLE_TABLE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libcorsaro_log.h"
+#include "corsaro_flowtuple.h"
+
+/** Number of control bytes that are examined together when probing */
+#define CORSARO_FT_TABLE_GROUP 16
+
+typedef struct corsaro_ft_table_pool corsaro_ft_table_pool_t;
+
+/** A flowtuple's sort key, along with its position in the table arena */
+typedef struct corsaro_ft_sortrec {
+    uint64_t top;
+    uint64_t bot;
+    uint32_t index;
+} corsaro_ft_sortrec_t;
+
+/** The attributes of a flowtuple that come from the packet tags rather
+ *  than the flow key. These mostly depend on just the source address, so
+ *  a table stores each distinct set of attributes once and its flowtuples
+ *  refer to them by index.
+ */
+typedef struct corsaro_ft_attrs {
+    uint32_t prefixasn;
+    uint16_t maxmind_country;
+    uint16_t maxmind_continent;
+    uint16_t netacq_country;
+    uint16_t netacq_continent;
+    uint16_t tagproviders;
+    uint8_t is_spoofed;
+    uint8_t is_masscan;
+} corsaro_ft_attrs_t;
+
+/** A flowtuple as it is stored in a table: the flow key, the packet count
+ *  and the index of the flowtuple's attributes. The interval is the same
+ *  for every flowtuple in a table, so it is stored in the table instead.
+ *
+ *  Use corsaro_ft_table_expand() to turn an entry back into a complete
+ *  flowtuple.
+ */
+typedef struct corsaro_ft_entry {
+    uint32_t src_ip;
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t ip_len;
+    uint16_t tcp_synlen;
+    uint16_t tcp_synwinlen;
+    uint8_t protocol;
+    uint8_t ttl;
+    uint8_t tcp_flags;
+    uint32_t packet_cnt;
+    uint32_t hash_val;
+    /** Index into the table's attribute array */
+    uint32_t attrs;
+} PACKED corsaro_ft_entry_t;
+
+/** Open-addressing hash table of flowtuples, keyed on the full tuple.
+ *
+ *  The flowtuples themselves are stored contiguously (in their compact
+ *  form) in an arena in the order they were first seen; the hash table
+ *  proper is just an array of
+ *  one-byte control values (empty, or 7 bits of the hash) and a parallel
+ *  array of indexes into the arena. Control bytes are probed a group at a
+ *  time so that a single vector comparison can rule out most slots.
+ *
+ *  Tables are never freed at the end of an interval -- instead they are
+ *  reset and returned to the pool that they came from, so the memory is
+ *  reused for a later interval.
+ */
+typedef struct corsaro_ft_table {
+    /** Control byte for each slot: 0x80 if empty, otherwise the low
+     *  7 bits of the hash of the flowtuple in that slot.
+     */
+    uint8_t *ctrl;
+    /** Index into 'entries' for each occupied slot */
+    uint32_t *slots;
+    /** Number of slots, always a power of two */
+    uint32_t capacity;
+
+    /** Arena of flowtuples that have been added to the table */
+    corsaro_ft_entry_t *entries;
+    /** Number of flowtuples in the arena */
+    uint32_t count;
+    /** Number of flowtuples that the arena can hold before growing */
+    uint32_t entrycap;
+    /** If non-zero, the arena is never grown beyond this many flowtuples.
+     *  The owner is expected to empty the table once it is full.
+     */
+    uint32_t entrylimit;
+
+    /** The interval that every flowtuple in the table belongs to */
+    uint32_t interval_ts;
+
+    /** Distinct sets of attributes used by the flowtuples in the table */
+    corsaro_ft_attrs_t *attrs;
+    uint32_t attrcount;
+    uint32_t attrcap;
+    /** Open-addressing index into 'attrs', holding index + 1 for each
+     *  occupied slot and zero for empty slots.
+     */
+    uint32_t *attrslots;
+    /** Number of slots in 'attrslots', always a power of two */
+    uint32_t attrslotcap;
+
+    /** Number of lookups performed since the table was last reset */
+    uint64_t lookups;
+    /** Total number of groups examined by those lookups */
+    uint64_t probes;
+    /** Largest number of groups examined by a single lookup */
+    uint32_t maxprobe;
+
+    /** If set, flowtuples are keyed on their sort key
+     *  (as calculated by FT_CALC_SORT_KEY_TOP and FT_CALC_SORT_KEY_BOTTOM)
+     *  rather than the full tuple, so that duplicates are combined in
+     *  exactly the same way as the original sorted output.
+     */
+    uint8_t sortkeyed;
+
+    /** Sort keys for every flowtuple in the arena, in ascending order.
+     *  Only valid after corsaro_ft_table_sort() has been called.
+     */
+    corsaro_ft_sortrec_t *sorted;
+    /** Buffers used by the radix sort, reused between intervals */
+    corsaro_ft_sortrec_t *sortbufs[2];
+    uint32_t sortcap;
+
+    /** The pool that this table will be returned to once released */
+    corsaro_ft_table_pool_t *pool;
+    /** Next table in the pool's free list */
+    struct corsaro_ft_table *nextfree;
+} corsaro_ft_table_t;
+
+/** A set of reusable flowtuple tables belonging to a single processing
+ *  thread. Tables are handed to merging threads at the end of each
+ *  interval and are returned to the pool once the merging thread has
+ *  written their contents.
+ */
+struct corsaro_ft_table_pool {
+    pthread_mutex_t mutex;
+    corsaro_logger_t *logger;
+    corsaro_ft_table_t *freelist;
+    /** Number of tables that have been taken from the pool and not yet
+     *  released.
+     */
+    uint32_t outstanding;
+    /** Set once the owning processing thread has finished */
+    uint8_t closed;
+    /** Whether tables from this pool are keyed on the sort key */
+    uint8_t sortkeyed;
+};
+
+/** Creates a new, empty, pool of flowtuple tables.
+ *
+ *  @param logger       The logger to use for reporting errors
+ *  @param sortkeyed    If non-zero, tables from this pool identify
+ *                      flowtuples by their sort key instead of the full
+ *                      tuple.
+ *  @return a pointer to the new pool, or NULL if an error occurs.
+ */
+corsaro_ft_table_pool_t *corsaro_ft_create_table_pool(
+        corsaro_logger_t *logger, uint8_t sortkeyed);
+
+/** Marks a pool as closed. The pool (and any tables in it) will be freed
+ *  once every table that has been taken from the pool has been released.
+ *
+ *  @param pool         The pool to close
+ */
+void corsaro_ft_close_table_pool(corsaro_ft_table_pool_t *pool);
+
+/** Takes an empty table from a pool, creating a new table if there are
+ *  no spare tables available.
+ *
+ *  @param pool         The pool to take the table from
+ *  @return an empty flowtuple table, or NULL if an error occurs.
+ */
+corsaro_ft_table_t *corsaro_ft_get_table(corsaro_ft_table_pool_t *pool);
+
+/** Resets a table and returns it to the pool that it was taken from.
+ *
+ *  @param table        The table to release
+ */
+void corsaro_ft_release_table(corsaro_ft_table_t *table);
+
+/** Finds the flowtuple in the table that matches the given tuple. If there
+ *  is no matching flowtuple, the given tuple is added to the table with a
+ *  packet count of zero.
+ *
+ *  @param table        The table to search
+ *  @param ft           The flowtuple to look for
+ *  @return a pointer to the matching entry in the table, or NULL if
+ *          the table needed to grow and memory could not be allocated.
+ *
+ *  @note The returned pointer is only valid until the next call to this
+ *        function, as adding a flowtuple may move the arena.
+ */
+corsaro_ft_entry_t *corsaro_ft_table_find_or_insert(
+        corsaro_ft_table_t *table, struct corsaro_flowtuple *ft);
+
+/** Expands a flowtuple stored in a table back into a complete flowtuple,
+ *  including its attributes and sort key.
+ *
+ *  @param table        The table containing the flowtuple
+ *  @param index        The position of the flowtuple in the arena
+ *  @param ft           The flowtuple to fill in
+ */
+void corsaro_ft_table_expand(corsaro_ft_table_t *table, uint32_t index,
+        struct corsaro_flowtuple *ft);
+
+/** Sorts the flowtuples in a table into ascending order by sort key,
+ *  using an LSD radix sort. The resulting order is the same as iterating
+ *  over a two-level Judy array keyed on FT_CALC_SORT_KEY_TOP and then
+ *  FT_CALC_SORT_KEY_BOTTOM.
+ *
+ *  The sorted order is available in table->sorted once this function
+ *  returns. If the table was not created with 'sortkeyed' set, flowtuples
+ *  that differ but share a sort key will be next to each other in no
+ *  particular order.
+ *
+ *  @param table        The table to sort
+ *  @return 0 if the sort succeeds, -1 if memory could not be allocated.
+ */
+int corsaro_ft_table_sort(corsaro_ft_table_t *table);
+
+/** Empties a table without giving it back to its pool, keeping the memory
+ *  that it has already allocated.
+ *
+ *  @param table        The table to empty
+ */
+void corsaro_ft_table_reset(corsaro_ft_table_t *table);
+
+/** Returns the approximate number of bytes of memory that each flowtuple
+ *  in a table costs, including the hash slots and sort buffers.
+ */
+uint32_t corsaro_ft_table_entry_cost(void);
+
+/** Returns the number of bytes that a table is using to store its
+ *  flowtuples, and the number of bytes that the same flowtuples would
+ *  need if each was stored as a complete struct corsaro_flowtuple.
+ *
+ *  @param table        The table to measure
+ *  @param used         Set to the number of bytes used by the table
+ *  @param uncompacted  Set to the number of bytes needed without the
+ *                      compact representation
+ */
+void corsaro_ft_table_memory(corsaro_ft_table_t *table, uint64_t *used,
+        uint64_t *uncompacted);
+
+/** Returns the proportion of slots in the table that are occupied */
+double corsaro_ft_table_load_factor(corsaro_ft_table_t *table);
+
+/** Returns the mean number of groups examined per lookup since the table
+ *  was last reset.
+ */
+double corsaro_ft_table_mean_probe(corsaro_ft_table_t *table);
+
+#endif
+// vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -121,4 +121,9 @@ int corsaro_null_rotate_output(corsaro_plugin_t *p, void *local) {
     return 0;
 }
 
+void corsaro_null_release_interval_result(corsaro_plugin_t *p, void *result) {
+
+    return;
+}
+
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
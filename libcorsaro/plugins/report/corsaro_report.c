@@ -582,7 +582,9 @@ int corsaro_report_finalise_config(corsaro_plugin_t *p,
     conf = (corsaro_report_config_t *)(p->config);
     conf->basic.template = stdopts->template;
     conf->basic.monitorid = stdopts->monitorid;
+    conf->basic.filewriter = stdopts->filewriter;
     conf->basic.procthreads = stdopts->procthreads;
+    conf->basic.stragglertimeout = stdopts->stragglertimeout;
     conf->basic.libtsascii = stdopts->libtsascii;
     conf->basic.libtskafka = stdopts->libtskafka;
     conf->basic.libtsdbats = stdopts->libtsdbats;
@@ -729,6 +731,7 @@ int corsaro_report_finalise_config(corsaro_plugin_t *p,
 
         pthread_mutex_init(&(conf->iptrackers[i].mutex), NULL);
         conf->iptrackers[i].lastresultts = 0;
+        conf->iptrackers[i].lastclosedts = 0;
         conf->iptrackers[i].conf = conf;
         conf->iptrackers[i].srcip_sample_index = 0;
         conf->iptrackers[i].dstip_sample_index = 0;
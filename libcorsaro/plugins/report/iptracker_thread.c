@@ -361,11 +361,12 @@ static inline int sender_in_outstanding(libtrace_list_t *outl, uint8_t sender) {
  *  @param limit        The total number of packet processing threads.
  *  @param sender       The thread ID of the packet processing thread that
  *                      has just sent us an interval message.
+ *  @param msgtype      The type of the interval message.
  *  @return the timestamp of the interval if this was the last thread that
  *          we were waiting on, 0 otherwise.
  */
 static uint32_t update_outstanding(libtrace_list_t *outl, uint32_t ts,
-        uint8_t limit, uint8_t sender) {
+        uint8_t limit, uint8_t sender, uint8_t msgtype) {
 
     libtrace_list_node_t *n;
     corsaro_report_out_interval_t *o, newentry;
@@ -381,6 +382,7 @@ static uint32_t update_outstanding(libtrace_list_t *outl, uint32_t ts,
                 o->reports_recvd[sender] = 1;
                 o->reports_total ++;
             }
+            o->msgtype = msgtype;
             if (o->reports_total == limit) {
                 /* All threads have ended for this interval */
                 toret = ts;
@@ -425,56 +427,27 @@ static uint32_t update_outstanding(libtrace_list_t *outl, uint32_t ts,
     newentry.reports_recvd[sender] = 1;
     newentry.reports_total = 1;
     newentry.interval_ts = ts;
+    newentry.msgtype = msgtype;
+    newentry.firstseen = time(NULL);
     libtrace_list_push_back(outl, (void *)(&newentry));
     return 0;
 
 }
 
 
-/** Processes and acts upon an "Interval" or "Reset" message received
- *  by an IP tracker thread.
+/** Takes the final tally for an interval that every processing thread has
+ *  ended (or that we have given up waiting on), and makes it available to
+ *  the merging thread.
  *
- *  @param track        The IP tracker thread that received the message
- *  @param msg          The message that was received.
+ *  @param track        The IP tracker thread that is ending the interval
+ *  @param complete     The timestamp of the interval being ended
+ *  @param msgtype      Whether the interval is to be tallied or reset
  */
-static void process_interval_reset_message(corsaro_report_iptracker_t *track,
-        corsaro_report_ipmsg_header_t *msg) {
+static void end_tracker_interval(corsaro_report_iptracker_t *track,
+        uint32_t complete, uint8_t msgtype) {
 
-    uint32_t complete;
     uint64_t totallost = 0;
     int i;
-	int more;
-    size_t moresize;
-
-	ZEROMQ_CHECK_MORE
-	if (more != 0) {
-		corsaro_log(track->logger, "Interval end messages are not expected to be multi-part");
-		/* XXX should try to do more than just return if this happens */
-		return;
-	}
-
-    pthread_mutex_lock(&(track->mutex));
-    if (msg->timestamp == 0) {
-        pthread_mutex_unlock(&(track->mutex));
-        return;
-    }
-
-    if (msg->timestamp <= track->lastresultts) {
-        pthread_mutex_unlock(&(track->mutex));
-        return;
-    }
-
-    /* update our record of which processing threads have
-     * completed intervals. */
-    complete = update_outstanding(track->outstanding, msg->timestamp,
-            track->sourcethreads, msg->sender);
-    if (complete == 0) {
-        /* still waiting on at least one more thread */
-        pthread_mutex_unlock(&(track->mutex));
-        return;
-    }
-
- 	pthread_mutex_unlock(&(track->mutex));
 
     /* End of interval, take final tally and update lastresults */
 
@@ -491,7 +464,8 @@ static void process_interval_reset_message(corsaro_report_iptracker_t *track,
         sleep(1);
     } while (1);
 
-    if (msg->msgtype == CORSARO_IP_MESSAGE_INTERVAL) {
+    track->lastclosedts = complete;
+    if (msgtype == CORSARO_IP_MESSAGE_INTERVAL) {
         track->prev_maps = track->curr_maps;
         track->lastresultts = complete;
         track->srcip_sample_index ++;
@@ -529,6 +503,94 @@ static void process_interval_reset_message(corsaro_report_iptracker_t *track,
      */
     track->curr_maps = track->next_maps;
     track->next_maps = create_new_map_set();
+}
+
+/** Closes any intervals that have been waiting on at least one processing
+ *  thread for longer than the straggler timeout, so that the merging thread
+ *  is not left waiting on a result that may never arrive.
+ *
+ *  Any updates that the missing threads later send for a closed interval
+ *  are counted towards the next interval instead.
+ *
+ *  @param track        The IP tracker thread to check for stragglers
+ */
+static void close_straggling_tracker_intervals(
+        corsaro_report_iptracker_t *track) {
+
+    corsaro_report_out_interval_t *o, popped;
+    uint32_t timeout = track->conf->basic.stragglertimeout;
+    time_t now;
+
+    if (timeout == 0) {
+        return;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock(&(track->mutex));
+    while (track->outstanding->head) {
+        o = (corsaro_report_out_interval_t *)(track->outstanding->head->data);
+        if (now - o->firstseen < timeout) {
+            break;
+        }
+
+        corsaro_log(track->logger,
+                "IP tracker has only heard from %u of %u processing threads about interval %u after %u seconds, closing it without them",
+                o->reports_total, track->sourcethreads, o->interval_ts,
+                timeout);
+        libtrace_list_pop_front(track->outstanding, (void *)(&popped));
+        pthread_mutex_unlock(&(track->mutex));
+
+        end_tracker_interval(track, popped.interval_ts, popped.msgtype);
+        pthread_mutex_lock(&(track->mutex));
+    }
+    pthread_mutex_unlock(&(track->mutex));
+}
+
+/** Processes and acts upon an "Interval" or "Reset" message received
+ *  by an IP tracker thread.
+ *
+ *  @param track        The IP tracker thread that received the message
+ *  @param msg          The message that was received.
+ */
+static void process_interval_reset_message(corsaro_report_iptracker_t *track,
+        corsaro_report_ipmsg_header_t *msg) {
+
+    uint32_t complete;
+	int more;
+    size_t moresize;
+
+	ZEROMQ_CHECK_MORE
+	if (more != 0) {
+		corsaro_log(track->logger, "Interval end messages are not expected to be multi-part");
+		/* XXX should try to do more than just return if this happens */
+		return;
+	}
+
+    pthread_mutex_lock(&(track->mutex));
+    if (msg->timestamp == 0) {
+        pthread_mutex_unlock(&(track->mutex));
+        return;
+    }
+
+    if (msg->timestamp <= track->lastresultts ||
+            msg->timestamp <= track->lastclosedts) {
+        pthread_mutex_unlock(&(track->mutex));
+        return;
+    }
+
+    /* update our record of which processing threads have
+     * completed intervals. */
+    complete = update_outstanding(track->outstanding, msg->timestamp,
+            track->sourcethreads, msg->sender, msg->msgtype);
+    if (complete == 0) {
+        /* still waiting on at least one more thread */
+        pthread_mutex_unlock(&(track->mutex));
+        return;
+    }
+
+ 	pthread_mutex_unlock(&(track->mutex));
+
+    end_tracker_interval(track, complete, msg->msgtype);
 trackerover:
 	return;
 }
@@ -664,6 +726,8 @@ void *start_iptracker(void *tdata) {
      */
 
     while (track->haltphase != 2) {
+        close_straggling_tracker_intervals(track);
+
         if (zmq_recv(track->incoming, &msg, sizeof(msg), 0) < 0) {
             if (errno == EAGAIN || errno == EINTR) {
                 continue;
@@ -653,7 +653,8 @@ static int report_write_avro_output(corsaro_plugin_t *p,
         if (outname == NULL) {
             return -1;
         }
-        if (corsaro_start_avro_writer(m->writer, outname, 0) == -1) {
+        if (corsaro_start_avro_block_writer(m->writer, outname,
+                    CORSARO_AVRO_CODEC_DEFLATE, 0, NULL) == -1) {
             free(outname);
             return -1;
         }
@@ -996,6 +997,7 @@ void *corsaro_report_init_merging(corsaro_plugin_t *p, int sources) {
             free(m);
             return NULL;
         }
+        corsaro_set_avro_writer_filewriter(m->writer, conf->basic.filewriter);
     } else {
         m->writer = NULL;
     }
@@ -1419,5 +1421,18 @@ int corsaro_report_rotate_output(corsaro_plugin_t *p, void *local) {
     return 0;
 }
 
+/** Frees an interim result from the report plugin that will never be
+ *  merged, e.g. because the merger has already given up on waiting for
+ *  this processing thread to finish the interval.
+ *
+ *  @param p            A reference to the running instance of the report plugin
+ *  @param result       The interim result to free
+ */
+void corsaro_report_release_interval_result(corsaro_plugin_t *p,
+        void *result) {
+
+    free(result);
+}
+
 
 // vim: set sw=4 tabstop=4 softtabstop=4 expandtab :
@@ -56,6 +56,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <libipmeta.h>
@@ -202,6 +203,13 @@ typedef struct corsaro_report_outstanding_interval {
 
     /** Total number of interval end messages received for this interval */
     uint8_t reports_total;
+
+    /** The type of the most recent interval end message (i.e. whether
+     *  the interval is to be tallied or reset) */
+    uint8_t msgtype;
+
+    /** The time at which the first interval end message arrived */
+    time_t firstseen;
 } corsaro_report_out_interval_t;
 
 typedef struct corsaro_report_iptracker_maps {
@@ -243,6 +251,12 @@ typedef struct corsaro_report_iptracker {
      */
     uint32_t lastresultts;
 
+    /** The timestamp of the most recent interval that we have stopped
+     *  waiting on, including intervals that were reset or closed before
+     *  every processing thread had ended them.
+     */
+    uint32_t lastclosedts;
+
     /** The number of processing threads that are able to send messages to this
      *  IP tracker thread.
      */
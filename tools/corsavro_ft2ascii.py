@@ -13,6 +13,10 @@ continue to do so with the new avro files without having to re-develop any
 code / scripts.
 
 Usage: python3 corsavro_ft2ascii.py <flowtuple avro file>
+
+The corsaroavro2ascii tool produces the same output (see
+docs/corsaroavro2ascii-README.md) and is much faster, so it should be
+preferred wherever it is installed.
 """
 
 from fastavro import reader